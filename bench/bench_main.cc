@@ -0,0 +1,34 @@
+#include <benchmark/benchmark.h>
+
+#include <string.h>
+#include <vector>
+
+#include "kernel_peer.h"
+
+// Same as BENCHMARK_MAIN(), except the console output defaults to JSON so
+// runs can be stored and compared. --benchmark_format still overrides it.
+int main(int argc, char* argv[]) {
+  static char json_format[] = "--benchmark_format=json";
+  std::vector<char*> args(argv, argv + argc);
+  bool has_format = false;
+  for (int i = 1; i < argc; ++i) {
+    if (::strncmp(argv[i], "--benchmark_format", 18) == 0) {
+      has_format = true;
+    }
+  }
+  if (!has_format) {
+    args.push_back(json_format);
+  }
+  args.push_back(NULL);
+  int args_count = static_cast<int>(args.size()) - 1;
+  benchmark::Initialize(&args_count, args.data());
+  if (benchmark::ReportUnrecognizedArguments(args_count, args.data())) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  // the lookup benchmarks leave dummy entries behind, Kernel must not try
+  // to close them at exit
+  tcpmany::KernelPeer::ClearConnections();
+  benchmark::Shutdown();
+  return 0;
+}
@@ -0,0 +1,36 @@
+#include <benchmark/benchmark.h>
+
+#include <memory>
+
+#include "blocking_queue.h"
+#include "packet.h"
+
+using tcpmany::BlockingQueue;
+using tcpmany::PacketPtr;
+
+namespace {
+
+// Every benchmark thread pushes and then pops, so with more threads they
+// all fight over the one mutex the way the send path does.
+void BM_BlockingQueuePushPop(benchmark::State& state) {
+  static BlockingQueue<PacketPtr> queue;
+  static const PacketPtr packet = std::make_shared<tcpmany::Packet>();
+  PacketPtr out;
+  for (auto _ : state) {
+    queue.Push(packet);
+    queue.Pop(out);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_BlockingQueuePushPop)->ThreadRange(1, 8)->UseRealTime();
+
+void BM_BlockingQueueTryPopEmpty(benchmark::State& state) {
+  static BlockingQueue<PacketPtr> queue;
+  PacketPtr out;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(queue.TryPop(out));
+  }
+}
+BENCHMARK(BM_BlockingQueueTryPopEmpty)->ThreadRange(1, 8)->UseRealTime();
+
+}  // namespace
@@ -0,0 +1,88 @@
+#include <benchmark/benchmark.h>
+
+#include "kernel_peer.h"
+
+using tcpmany::Connection;
+using tcpmany::InetAddress;
+using tcpmany::KernelPeer;
+using tcpmany::PacketPtr;
+
+namespace {
+
+// kept clear of the addresses kernel_bench fills the table with, in case
+// loopback_bench has the kernel threads running and a reply gets demuxed
+const InetAddress kServer("192.168.0.1", 5223);
+const InetAddress kClient("192.168.100.1", 13579);
+
+// The server side of one connection lifetime, built against the client's
+// current sequence number.
+PacketPtr SynAck(const Connection& conn) {
+  auto packet = tcpmany::SynPacket(1000, kClient, kServer);
+  packet->SetAck();
+  packet->SetAckSeq(KernelPeer::Seq(conn));
+  return packet;
+}
+
+void BM_ProcessPacketHandshake(benchmark::State& state) {
+  for (auto _ : state) {
+    state.PauseTiming();
+    Connection* conn = KernelPeer::NewConnection(kServer, kClient);
+    conn->Connect();
+    PacketPtr syn_ack = SynAck(*conn);
+    state.ResumeTiming();
+
+    KernelPeer::ProcessPacket(conn, *syn_ack);
+
+    state.PauseTiming();
+    KernelPeer::DrainSendQueue();
+    KernelPeer::DeleteConnection(conn);
+    state.ResumeTiming();
+  }
+}
+BENCHMARK(BM_ProcessPacketHandshake);
+
+void BM_ProcessPacketData(benchmark::State& state) {
+  Connection* conn = KernelPeer::NewConnection(kServer, kClient);
+  conn->Connect();
+  KernelPeer::ProcessPacket(conn, *SynAck(*conn));
+  auto data = tcpmany::DataPacket(1001, KernelPeer::Seq(*conn),
+                                  kClient, kServer,
+                                  std::string(state.range(0), 'x'));
+  int64 received = 0;
+  conn->SetMessageCallback([&received](Connection&, const char*, int len) {
+    received += len;
+  });
+  int count = 0;
+  for (auto _ : state) {
+    KernelPeer::ProcessPacket(conn, *data);
+    if (++count == 1024) {
+      state.PauseTiming();
+      KernelPeer::DrainSendQueue();
+      count = 0;
+      state.ResumeTiming();
+    }
+  }
+  KernelPeer::DrainSendQueue();
+  KernelPeer::DeleteConnection(conn);
+  state.SetBytesProcessed(received);
+}
+BENCHMARK(BM_ProcessPacketData)->Arg(16)->Arg(1400);
+
+// SYN_SENT -> ESTABLISHED -> FIN_WAIT_1 -> CLOSED
+void BM_ProcessPacketLifecycle(benchmark::State& state) {
+  for (auto _ : state) {
+    Connection* conn = KernelPeer::NewConnection(kServer, kClient);
+    conn->Connect();
+    KernelPeer::ProcessPacket(conn, *SynAck(*conn));
+    conn->Close();
+    auto fin_ack = tcpmany::FinPacket(1001, KernelPeer::Seq(*conn),
+                                      kClient, kServer);
+    KernelPeer::ProcessPacket(conn, *fin_ack);
+    benchmark::DoNotOptimize(conn->IsClosed());
+    KernelPeer::DeleteConnection(conn);
+    KernelPeer::DrainSendQueue();
+  }
+}
+BENCHMARK(BM_ProcessPacketLifecycle);
+
+}  // namespace
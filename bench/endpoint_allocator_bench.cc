@@ -0,0 +1,47 @@
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+#include "endpoint_allocator.h"
+
+using tcpmany::EndpointAllocator;
+using tcpmany::SourceRange;
+
+namespace {
+
+// Allocate plus Free of one endpoint with range(0) of the /16 x 64512
+// ports already taken, the allocator at steady state with churn.
+void BM_EndpointAllocateFree(benchmark::State& state) {
+  SourceRange range;
+  CHECK(tcpmany::ParseSourceRange("10.64.0.0/16", &range));
+  EndpointAllocator allocator(std::vector<SourceRange>(1, range),
+                              std::chrono::milliseconds(0));
+  tcpmany::InetAddress addr(0u, 0);
+  for (int64 i = 0; i < state.range(0); ++i) {
+    allocator.Allocate(&addr);
+  }
+  for (auto _ : state) {
+    allocator.Allocate(&addr);
+    allocator.Free(addr);
+  }
+  state.counters["ips_in_use"] = allocator.IpsInUse();
+}
+BENCHMARK(BM_EndpointAllocateFree)->Arg(1000)->Arg(1000000)->Arg(10000000);
+
+// Freed endpoints go through the quarantine queue before being reused.
+void BM_EndpointAllocateQuarantined(benchmark::State& state) {
+  SourceRange range;
+  CHECK(tcpmany::ParseSourceRange("10.64.0.0/16", &range));
+  EndpointAllocator allocator(std::vector<SourceRange>(1, range),
+                              std::chrono::milliseconds(1));
+  tcpmany::InetAddress addr(0u, 0);
+  for (auto _ : state) {
+    if (allocator.Allocate(&addr)) {
+      allocator.Free(addr);
+    }
+  }
+  state.counters["quarantined"] = allocator.Quarantined();
+}
+BENCHMARK(BM_EndpointAllocateQuarantined);
+
+}  // namespace
@@ -0,0 +1,31 @@
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <vector>
+
+#include "event_dispatcher.h"
+
+using tcpmany::EventDispatcher;
+
+namespace {
+
+// What the receive thread pays per callback it hands off, spread over
+// 1024 connections so every worker gets its share.
+void BM_EventDispatcherDispatch(benchmark::State& state) {
+  std::atomic<uint64> done(0);
+  std::vector<int> keys(1024);
+  uint64 dispatched = 0;
+  {
+    EventDispatcher dispatcher(state.range(0), 4096);
+    for (auto _ : state) {
+      dispatcher.Dispatch(&keys[dispatched++ % keys.size()], [&done] {
+        done.fetch_add(1, std::memory_order_relaxed);
+      });
+    }
+    state.counters["queue_waits"] = dispatcher.Waits();
+  }
+  state.SetItemsProcessed(done);
+}
+BENCHMARK(BM_EventDispatcherDispatch)->Arg(1)->Arg(2)->Arg(4)->UseRealTime();
+
+}  // namespace
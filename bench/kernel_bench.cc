@@ -0,0 +1,82 @@
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+#include "kernel_peer.h"
+
+using tcpmany::Connection;
+using tcpmany::InetAddress;
+using tcpmany::KernelPeer;
+
+namespace {
+
+const uint16 kClientPort = 13579;
+const uint32 kFirstClientIp = 0x0a000001;  // 10.0.0.1
+
+// Fills the connection table with |count| entries keyed the way
+// DoNewConnection keys them. Lookups never dereference the value, so a
+// dummy pointer keeps 10M entries affordable.
+void FillConnections(int64 count) {
+  static int64 filled = 0;
+  if (filled == count) {
+    return;
+  }
+  KernelPeer::ClearConnections();
+  Connection* dummy = reinterpret_cast<Connection*>(1);
+  for (int64 i = 0; i < count; ++i) {
+    InetAddress addr(kFirstClientIp + i, kClientPort);
+    KernelPeer::InsertConnection(addr.Key(), dummy);
+  }
+  filled = count;
+}
+
+std::vector<uint64> LookupKeys(int64 count, bool hit) {
+  std::vector<uint64> keys;
+  uint32 state = 12345;
+  for (int i = 0; i < 4096; ++i) {
+    state = state * 1103515245 + 12345;
+    uint32 index = state % count;
+    InetAddress addr(kFirstClientIp + index, hit ? kClientPort : 1);
+    keys.push_back(addr.Key());
+  }
+  return keys;
+}
+
+void BM_FindConnectionHit(benchmark::State& state) {
+  FillConnections(state.range(0));
+  const std::vector<uint64> keys = LookupKeys(state.range(0), true);
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        KernelPeer::FindConnection(keys[i++ & (keys.size() - 1)]));
+  }
+}
+BENCHMARK(BM_FindConnectionHit)->Arg(1000)->Arg(1000000)->Arg(10000000);
+
+void BM_FindConnectionMiss(benchmark::State& state) {
+  FillConnections(state.range(0));
+  const std::vector<uint64> keys = LookupKeys(state.range(0), false);
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        KernelPeer::FindConnection(keys[i++ & (keys.size() - 1)]));
+  }
+}
+BENCHMARK(BM_FindConnectionMiss)->Arg(1000)->Arg(1000000)->Arg(10000000);
+
+// What ReceiveThread does per packet: build the key, then look it up.
+void BM_DemuxPacket(benchmark::State& state) {
+  FillConnections(state.range(0));
+  auto packet = tcpmany::AckPacket(1,
+                                   tcpmany::Packet(),
+                                   InetAddress(kFirstClientIp + 7,
+                                               kClientPort),
+                                   InetAddress("10.255.0.1", 5223));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        KernelPeer::FindConnection(packet->DstKey()));
+  }
+}
+BENCHMARK(BM_DemuxPacket)->Arg(1000)->Arg(1000000)->Arg(10000000);
+
+}  // namespace
@@ -0,0 +1,59 @@
+#ifndef TCPMANY_BENCH_KERNEL_PEER_H_
+#define TCPMANY_BENCH_KERNEL_PEER_H_
+
+#include "connection.h"
+#include "kernel.h"
+#include "packet.h"
+#include "singleton.h"
+
+namespace tcpmany {
+
+// Reaches into Kernel and Connection internals so the hot paths can be
+// driven without starting the kernel threads.
+class KernelPeer {
+ public:
+  static Kernel& Instance() {
+    return Singleton<Kernel>::Instance();
+  }
+
+  static Connection* FindConnection(uint64 key) {
+    return Instance().FindConnection(key);
+  }
+  static void InsertConnection(uint64 key, Connection* conn) {
+    Instance().InsertConnection(key, conn);
+  }
+  // only drops the table entries, the caller owns what it inserted
+  static void ClearConnections() {
+    std::unique_lock<std::mutex> lock(Instance().conn_mutex_);
+    ConnectionMap().swap(Instance().connections_);
+  }
+
+  static Connection* NewConnection(const InetAddress& dst_addr,
+                                   const InetAddress& src_addr) {
+    return new Connection(dst_addr, src_addr);
+  }
+  static void DeleteConnection(Connection* conn) {
+    delete conn;
+  }
+  static void ProcessPacket(Connection* conn, const Packet& packet) {
+    conn->ProcessPacket(packet);
+  }
+  static uint32 Seq(const Connection& conn) {
+    return conn.seq_;
+  }
+
+  // Packets queued by Kernel::Send pile up while the send thread is not
+  // running, drop them.
+  static size_t DrainSendQueue() {
+    size_t count = 0;
+    PacketPtr packet;
+    while (Instance().packets_.TryPop(packet)) {
+      ++count;
+    }
+    return count;
+  }
+};
+
+}  // namespace tcpmany
+
+#endif  // TCPMANY_BENCH_KERNEL_PEER_H_
@@ -0,0 +1,38 @@
+#include <benchmark/benchmark.h>
+
+#include "logging.h"
+
+namespace {
+
+// What the receive thread pays for a line: formatting into the thread's
+// buffer, the write to stderr happens on the logger's own thread. Run with
+// stderr redirected, lines the writer can't keep up with are dropped.
+void BM_LogInfo(benchmark::State& state) {
+  int64 i = 0;
+  for (auto _ : state) {
+    LOG(INFO) << "connection " << ++i << " state changed";
+  }
+  tcpmany::FlushLogs();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LogInfo)->ThreadRange(1, 4)->UseRealTime();
+
+void BM_VlogDisabled(benchmark::State& state) {
+  int64 i = 0;
+  for (auto _ : state) {
+    VLOG(4) << "connection " << ++i << " state changed";
+  }
+  benchmark::DoNotOptimize(i);
+}
+BENCHMARK(BM_VlogDisabled);
+
+void BM_LogEveryNSecSuppressed(benchmark::State& state) {
+  int64 i = 0;
+  for (auto _ : state) {
+    LOG_EVERY_N_SEC(INFO, 3600) << "connection " << ++i << " state changed";
+  }
+  benchmark::DoNotOptimize(i);
+}
+BENCHMARK(BM_LogEveryNSecSuppressed);
+
+}  // namespace
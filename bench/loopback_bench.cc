@@ -0,0 +1,71 @@
+#include <benchmark/benchmark.h>
+
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+
+#include "connection.h"
+#include "kernel.h"
+#include "memory_backend.h"
+
+using tcpmany::Connection;
+using tcpmany::InetAddress;
+using tcpmany::Kernel;
+using tcpmany::KernelOptions;
+using tcpmany::MemoryBackend;
+
+namespace {
+
+const InetAddress kServer("192.168.1.1", 5223);
+const uint32 kFirstClientIp = 0xac100001;  // 172.16.0.1
+const uint16 kClientPort = 13579;
+
+std::shared_ptr<MemoryBackend> StartKernel() {
+  static std::shared_ptr<MemoryBackend> backend;
+  if (!backend) {
+    backend = std::make_shared<MemoryBackend>();
+    KernelOptions options;
+    options.backend = backend;
+    Kernel::Start(options);
+  }
+  return backend;
+}
+
+// Full lifetime of |range(0)| connections through the real kernel threads
+// against the in-memory server: handshake, one request echoed back, close.
+void BM_MemoryBackendSessions(benchmark::State& state) {
+  auto backend = StartKernel();
+  const int count = state.range(0);
+  std::atomic<int> closed(0);
+  uint64 packets_before = backend->GetStats().bytes_received;
+  for (auto _ : state) {
+    closed = 0;
+    for (int i = 0; i < count; ++i) {
+      Connection* conn = Kernel::NewConnection(
+          kServer, InetAddress(kFirstClientIp + i, kClientPort));
+      conn->SetConnectedCallback([](Connection& c) {
+        c.Send("ping");
+      });
+      conn->SetMessageCallback([](Connection& c, const char*, int) {
+        c.Close();
+      });
+      conn->SetClosedCallback([&closed](Connection& c) {
+        // Release destroys this callback along with its captures
+        std::atomic<int>& counter = closed;
+        Kernel::Release(c);
+        ++counter;
+      });
+      conn->Connect();
+    }
+    while (closed < count) {
+      ::usleep(100);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+  state.counters["bytes_echoed"] =
+      backend->GetStats().bytes_received - packets_before;
+}
+BENCHMARK(BM_MemoryBackendSessions)
+    ->Arg(1000)->Arg(100000)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+}  // namespace
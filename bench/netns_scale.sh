@@ -0,0 +1,87 @@
+#!/bin/bash
+# End-to-end scale run on one machine, no lab needed. Builds this topology
+# (needs root and iproute2):
+#
+#   netns tm_cli                          netns tm_srv
+#   scaleload  [$CLIENT_IP] veth <-> veth [$SERVER_IP]  fakeserver
+#                                                       redirect
+#
+# The server routes the fake client range back over the veth, redirect
+# captures those replies on the server side and sends them on to the
+# client. Prints one json object with the scaleload numbers plus the veth
+# drop counters.
+#
+# usage: netns_scale.sh <count> <rate> [hold_s]
+#   BIN        directory holding the built binaries (default ../build/bin)
+#   REDIRECT   redirect command, run as "$REDIRECT <client_ip> <port> <if>",
+#              e.g. "$BIN/redirect --bpf" for the in-kernel rewrite
+#   FAKESERVER_ARGS  extra fakeserver options, e.g. "-m push -i 1000"
+#   CAPTURE=1  no redirect, scaleload captures the replies on its veth
+#   SCALELOAD_ARGS  extra scaleload options, e.g. "-t 2 -w 200"
+
+set -e
+
+COUNT=${1:?usage: $0 <count> <rate> [hold_s]}
+RATE=${2:?usage: $0 <count> <rate> [hold_s]}
+HOLD=${3:-0}
+
+BIN=${BIN:-$(cd "$(dirname "$0")/../build/bin" 2>/dev/null && pwd)}
+REDIRECT=${REDIRECT:-$BIN/redirect}
+CLI_NS=tm_cli
+SRV_NS=tm_srv
+CLIENT_IP=10.200.0.1
+SERVER_IP=10.200.0.2
+SERVER_PORT=5223
+FAKE_NET=10.64.0.0/10
+FAKE_FIRST_IP=10.64.0.1
+
+cleanup() {
+  if [ -n "$SERVER_PID" ]; then kill "$SERVER_PID" 2>/dev/null || true; fi
+  if [ -n "$REDIRECT_PID" ]; then kill "$REDIRECT_PID" 2>/dev/null || true; fi
+  ip netns del $CLI_NS 2>/dev/null || true
+  ip netns del $SRV_NS 2>/dev/null || true
+}
+trap cleanup EXIT
+cleanup
+
+ip netns add $CLI_NS
+ip netns add $SRV_NS
+ip link add tm_veth_c netns $CLI_NS type veth peer name tm_veth_s netns $SRV_NS
+ip -n $CLI_NS addr add $CLIENT_IP/24 dev tm_veth_c
+ip -n $SRV_NS addr add $SERVER_IP/24 dev tm_veth_s
+for ns in $CLI_NS $SRV_NS; do
+  ip -n $ns link set lo up
+done
+ip -n $CLI_NS link set tm_veth_c up
+ip -n $SRV_NS link set tm_veth_s up
+ip -n $SRV_NS route add $FAKE_NET via $CLIENT_IP
+# a million half-open handshakes need deeper queues than the defaults
+ip netns exec $SRV_NS sysctl -qw net.core.somaxconn=65535 \
+    net.ipv4.tcp_max_syn_backlog=1048576 net.ipv4.tcp_syncookies=0 || true
+
+ip netns exec $SRV_NS "$BIN/fakeserver" -p $SERVER_PORT $FAKESERVER_ARGS \
+    >/dev/null 2>&1 &
+SERVER_PID=$!
+SCALELOAD_ARGS=${SCALELOAD_ARGS:-}
+if [ "$CAPTURE" = 1 ]; then
+  SCALELOAD_ARGS="$SCALELOAD_ARGS -c tm_veth_c"
+else
+  # only the network namespace, "ip netns exec" would also hide the host's
+  # /sys/fs/bpf where redirect --bpf pins its maps for redirectctl
+  nsenter --net=/var/run/netns/$SRV_NS $REDIRECT $CLIENT_IP $SERVER_PORT \
+      tm_veth_s >/dev/null 2>&1 &
+  REDIRECT_PID=$!
+fi
+sleep 1
+
+RESULT=$(ip netns exec $CLI_NS "$BIN/scaleload" $SCALELOAD_ARGS \
+    $SERVER_IP $SERVER_PORT \
+    $COUNT $RATE $FAKE_FIRST_IP $HOLD 2>/dev/null)
+
+drops() {
+  ip netns exec "$1" cat "/sys/class/net/$2/statistics/$3"
+}
+echo "${RESULT%\}}",\
+"\"client_veth_rx_dropped\":$(drops $CLI_NS tm_veth_c rx_dropped)",\
+"\"server_veth_rx_dropped\":$(drops $SRV_NS tm_veth_s rx_dropped)",\
+"\"server_veth_tx_dropped\":$(drops $SRV_NS tm_veth_s tx_dropped)}"
@@ -0,0 +1,150 @@
+#include <benchmark/benchmark.h>
+
+#include <string.h>
+#include <memory>
+#include <string>
+
+#include "packet.h"
+
+using tcpmany::InetAddress;
+using tcpmany::Packet;
+
+namespace {
+
+const InetAddress kServer("10.0.0.1", 5223);
+const InetAddress kClient("10.1.0.1", 13579);
+
+void BM_PacketConstruct(benchmark::State& state) {
+  for (auto _ : state) {
+    Packet packet;
+    benchmark::DoNotOptimize(packet.Buffer());
+  }
+}
+BENCHMARK(BM_PacketConstruct);
+
+void BM_PacketMakeShared(benchmark::State& state) {
+  for (auto _ : state) {
+    auto packet = std::make_shared<Packet>();
+    benchmark::DoNotOptimize(packet.get());
+  }
+}
+BENCHMARK(BM_PacketMakeShared);
+
+void BM_CalculateChecksum(benchmark::State& state) {
+  auto packet = tcpmany::DataPacket(1, 1, kServer, kClient,
+                                    std::string(state.range(0), 'x'));
+  for (auto _ : state) {
+    packet->CalculateChecksum();
+    benchmark::DoNotOptimize(packet->pkt.tcp.check);
+  }
+  state.SetBytesProcessed(state.iterations() * packet->Size());
+}
+BENCHMARK(BM_CalculateChecksum)->Arg(0)->Arg(64)->Arg(512)->Arg(1400);
+
+// A server segment carrying 12 bytes of timestamp options, checksummed.
+tcpmany::PacketPtr OptionsPacket(int data_len) {
+  auto packet = std::make_shared<Packet>();
+  packet->SetAddress(kClient, kServer);
+  packet->SetAck();
+  packet->pkt.tcp.doff = 8;
+  const uint8 options[12] = {1, 1, 8, 10, 0, 1, 2, 3, 4, 5, 6, 7};
+  ::memcpy(packet->pkt.data, options, sizeof(options));
+  for (int i = 0; i < data_len; ++i) {
+    packet->pkt.data[sizeof(options) + i] = static_cast<uint8>(i * 7);
+  }
+  packet->pkt.ip.tot_len =
+      ::htons(Packet::HEADER_LEN + sizeof(options) + data_len);
+  packet->CalculateChecksum();
+  return packet;
+}
+
+// The redirect rewrite: incremental adjustment, checked against a full
+// recompute of the same packet before timing it.
+void BM_RewriteAddress(benchmark::State& state) {
+  auto packet = OptionsPacket(state.range(0));
+  const uint32 client = kServer.SockAddr().sin_addr.s_addr;
+  const uint32 fake = packet->DstIpNet();
+
+  Packet expected = *packet;
+  expected.SetSrcIpNet(fake);
+  expected.SetDstIpNet(client);
+  expected.CalculateChecksum();
+  Packet rewritten = *packet;
+  rewritten.RewriteAddressNet(fake, client);
+  if (::memcmp(rewritten.Buffer(), expected.Buffer(), expected.Size()) != 0) {
+    state.SkipWithError("incremental checksum differs from full recompute");
+    return;
+  }
+
+  for (auto _ : state) {
+    // swap back and forth so every iteration changes both addresses
+    packet->RewriteAddressNet(packet->DstIpNet(), packet->SrcIpNet());
+    benchmark::DoNotOptimize(packet->pkt.tcp.check);
+  }
+  state.SetBytesProcessed(state.iterations() * packet->Size());
+}
+BENCHMARK(BM_RewriteAddress)->Arg(0)->Arg(64)->Arg(512)->Arg(1400);
+
+void BM_RewriteAddressFullChecksum(benchmark::State& state) {
+  auto packet = OptionsPacket(state.range(0));
+  for (auto _ : state) {
+    uint32 dst = packet->DstIpNet();
+    packet->SetDstIpNet(packet->SrcIpNet());
+    packet->SetSrcIpNet(dst);
+    packet->CalculateChecksum();
+    benchmark::DoNotOptimize(packet->pkt.tcp.check);
+  }
+  state.SetBytesProcessed(state.iterations() * packet->Size());
+}
+BENCHMARK(BM_RewriteAddressFullChecksum)->Arg(0)->Arg(64)->Arg(512)->Arg(1400);
+
+void BM_SynPacket(benchmark::State& state) {
+  uint32 seq = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tcpmany::SynPacket(seq++, kServer, kClient));
+  }
+}
+BENCHMARK(BM_SynPacket);
+
+void BM_FinPacket(benchmark::State& state) {
+  uint32 seq = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        tcpmany::FinPacket(seq, seq, kServer, kClient));
+    ++seq;
+  }
+}
+BENCHMARK(BM_FinPacket);
+
+void BM_AckPacket(benchmark::State& state) {
+  auto received = tcpmany::DataPacket(1, 1, kClient, kServer, "pong");
+  uint32 seq = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        tcpmany::AckPacket(seq++, *received, kServer, kClient));
+  }
+}
+BENCHMARK(BM_AckPacket);
+
+void BM_FinAckPacket(benchmark::State& state) {
+  auto received = tcpmany::FinPacket(1, 1, kClient, kServer);
+  uint32 seq = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        tcpmany::FinAckPacket(seq++, *received, kServer, kClient));
+  }
+}
+BENCHMARK(BM_FinAckPacket);
+
+void BM_DataPacket(benchmark::State& state) {
+  const std::string message(state.range(0), 'x');
+  uint32 seq = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        tcpmany::DataPacket(seq, seq, kServer, kClient, message));
+    ++seq;
+  }
+}
+BENCHMARK(BM_DataPacket)->Arg(16)->Arg(512)->Arg(1400);
+
+}  // namespace
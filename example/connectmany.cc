@@ -36,23 +36,37 @@ void OnMessage(int id, Connection& conn, const char* msg, int msg_len) {
 }
 
 int main(int argc, char* argv[]) {
-  if (argc != 5) {
-    cerr << "usage: " << argv[0] << " <ip> <port> <count> <local_ip>" << endl;
+  if (argc != 5 && argc != 6) {
+    cerr << "usage: " << argv[0]
+         << " <ip> <port> <count> <source_range> [callback_threads]" << endl
+         << "  source_range: <ip>[/<prefix>][:<port>[-<port>]],"
+         << " e.g. 10.64.0.1, 10.64.0.0/24:2000-2999"
+         << " or [fd00:64::]/64:2000-2999" << endl;
     return -1;
   }
-  Kernel::Start();
+  // the printing callbacks are slow, keep them off the receive thread
+  tcpmany::KernelOptions options;
+  options.callback_threads = argc > 5 ? atoi(argv[5]) : 0;
+  tcpmany::SourceRange sources;
+  if (!tcpmany::ParseSourceRange(argv[4], &sources)) {
+    cerr << "invalid source_range: " << argv[4] << endl;
+    return -1;
+  }
+  options.source_ranges.push_back(sources);
+  Kernel::Start(options);
 
   const char* SERVER_IP = argv[1];
   const uint16 SERVER_PORT = atoi(argv[2]);
   const int COUNT = atoi(argv[3]);
-  const uint16 LOCAL_PORT = 13579;
 
   InetAddress server_addr(SERVER_IP, SERVER_PORT);
 
-  uint32 ip = ::ntohl(::inet_addr(argv[4]));
   for (int i = 0; i < COUNT; ++i) {
-    InetAddress client_addr(ip++, LOCAL_PORT);
-    Connection* conn = Kernel::NewConnection(server_addr, client_addr);
+    Connection* conn = Kernel::NewConnection(server_addr);
+    if (conn == nullptr) {
+      cerr << "source_range used up after " << i << " connections" << endl;
+      break;
+    }
     conn->SetConnectedCallback(std::bind(&OnConnected, i, _1));
     conn->SetMessageCallback(std::bind(&OnMessage, i, _1, _2, _3));
     conn->Connect();
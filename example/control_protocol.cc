@@ -0,0 +1,247 @@
+#include "control_protocol.h"
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace {
+
+// nothing the protocol sends comes close, a larger length is garbage
+const uint32 kMaxFrame = 1 << 16;
+
+bool WriteAll(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = ::write(fd, data, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool ReadAll(int fd, char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = ::read(fd, data, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+}  // namespace
+
+void ControlMessage::PutU8(uint8 value) {
+  fields_.push_back(static_cast<char>(value));
+}
+
+void ControlMessage::PutU16(uint16 value) {
+  value = ::htons(value);
+  fields_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void ControlMessage::PutU32(uint32 value) {
+  value = ::htonl(value);
+  fields_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void ControlMessage::PutU64(uint64 value) {
+  value = ::htobe64(value);
+  fields_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void ControlMessage::PutString(const std::string& value) {
+  PutU16(value.size());
+  fields_.append(value, 0, static_cast<uint16>(value.size()));
+}
+
+bool ControlMessage::Get(void* value, size_t size) {
+  if (fields_.size() - read_offset_ < size) {
+    return false;
+  }
+  ::memcpy(value, fields_.data() + read_offset_, size);
+  read_offset_ += size;
+  return true;
+}
+
+bool ControlMessage::GetU8(uint8* value) {
+  return Get(value, sizeof(*value));
+}
+
+bool ControlMessage::GetU16(uint16* value) {
+  if (!Get(value, sizeof(*value))) {
+    return false;
+  }
+  *value = ::ntohs(*value);
+  return true;
+}
+
+bool ControlMessage::GetU32(uint32* value) {
+  if (!Get(value, sizeof(*value))) {
+    return false;
+  }
+  *value = ::ntohl(*value);
+  return true;
+}
+
+bool ControlMessage::GetU64(uint64* value) {
+  if (!Get(value, sizeof(*value))) {
+    return false;
+  }
+  *value = ::be64toh(*value);
+  return true;
+}
+
+bool ControlMessage::GetString(std::string* value) {
+  uint16 size;
+  if (!GetU16(&size) || fields_.size() - read_offset_ < size) {
+    return false;
+  }
+  value->assign(fields_, read_offset_, size);
+  read_offset_ += size;
+  return true;
+}
+
+bool ControlMessage::Send(int fd) const {
+  std::string frame(5, '\0');
+  uint32 length = ::htonl(fields_.size() + 1);
+  ::memcpy(&frame[0], &length, sizeof(length));
+  frame[4] = static_cast<char>(type_);
+  frame += fields_;
+  return WriteAll(fd, frame.data(), frame.size());
+}
+
+bool ControlMessage::Receive(int fd) {
+  uint32 length;
+  if (!ReadAll(fd, reinterpret_cast<char*>(&length), sizeof(length))) {
+    return false;
+  }
+  length = ::ntohl(length);
+  if (length < 1 || length > kMaxFrame) {
+    return false;
+  }
+  std::string frame(length, '\0');
+  if (!ReadAll(fd, &frame[0], length)) {
+    return false;
+  }
+  type_ = static_cast<uint8>(frame[0]);
+  fields_.assign(frame, 1, std::string::npos);
+  read_offset_ = 0;
+  return true;
+}
+
+void Encode(const AgentRegistration& registration, ControlMessage* message) {
+  message->PutU32(registration.version);
+  message->PutString(registration.name);
+}
+
+void Encode(const Assignment& assignment, ControlMessage* message) {
+  message->PutU32(assignment.agent_id);
+  message->PutU32(assignment.agents);
+  message->PutU32(assignment.sources.ips.first);
+  message->PutU32(assignment.sources.ips.last);
+  message->PutU16(assignment.sources.first_port);
+  message->PutU16(assignment.sources.last_port);
+  message->PutU32(assignment.server_ip);
+  message->PutU16(assignment.server_port);
+  message->PutU64(assignment.connections);
+  // in thousandths, no floating point on the wire
+  message->PutU64(static_cast<uint64>(assignment.rate * 1000));
+  message->PutU32(assignment.hold_ms);
+  message->PutU32(assignment.settle_ms);
+  message->PutU8(assignment.teardown.mode);
+  message->PutU32(assignment.teardown.rate);
+  message->PutU32(assignment.teardown.deadline_ms);
+}
+
+void Encode(const StartOrder& start, ControlMessage* message) {
+  message->PutU64(start.start_ns);
+}
+
+void Encode(const AgentMetrics& metrics, ControlMessage* message) {
+  message->PutU32(metrics.elapsed_ms);
+  message->PutU64(metrics.connections_opened);
+  message->PutU64(metrics.established);
+  message->PutU64(metrics.peak_established);
+  message->PutU32(metrics.peak_ms);
+  message->PutU64(metrics.packets_received);
+  message->PutU64(metrics.packets_sent);
+  message->PutU64(metrics.packets_unmatched);
+  message->PutU64(metrics.receive_drops);
+  message->PutU64(metrics.rss_bytes);
+  message->PutU64(metrics.cpu_us);
+  message->PutU32(metrics.teardown_ms);
+}
+
+bool Decode(ControlMessage* message, AgentRegistration* registration) {
+  return message->GetU32(&registration->version) &&
+         message->GetString(&registration->name);
+}
+
+bool Decode(ControlMessage* message, Assignment* assignment) {
+  uint64 rate;
+  uint8 teardown_mode;
+  uint32 deadline_ms;
+  if (!message->GetU32(&assignment->agent_id) ||
+      !message->GetU32(&assignment->agents) ||
+      !message->GetU32(&assignment->sources.ips.first) ||
+      !message->GetU32(&assignment->sources.ips.last) ||
+      !message->GetU16(&assignment->sources.first_port) ||
+      !message->GetU16(&assignment->sources.last_port) ||
+      !message->GetU32(&assignment->server_ip) ||
+      !message->GetU16(&assignment->server_port) ||
+      !message->GetU64(&assignment->connections) ||
+      !message->GetU64(&rate) ||
+      !message->GetU32(&assignment->hold_ms) ||
+      !message->GetU32(&assignment->settle_ms) ||
+      !message->GetU8(&teardown_mode) ||
+      teardown_mode > tcpmany::TEARDOWN_FORGET ||
+      !message->GetU32(&assignment->teardown.rate) ||
+      !message->GetU32(&deadline_ms)) {
+    return false;
+  }
+  assignment->teardown.mode = static_cast<tcpmany::TeardownMode>(teardown_mode);
+  assignment->teardown.deadline_ms = deadline_ms;
+  assignment->rate = rate / 1000.0;
+  // the protocol carries ipv4 ranges only
+  assignment->sources.ipv6 = false;
+  ::memset(&assignment->sources.prefix6, 0,
+           sizeof(assignment->sources.prefix6));
+  return true;
+}
+
+bool Decode(ControlMessage* message, StartOrder* start) {
+  uint64 start_ns;
+  if (!message->GetU64(&start_ns)) {
+    return false;
+  }
+  start->start_ns = start_ns;
+  return true;
+}
+
+bool Decode(ControlMessage* message, AgentMetrics* metrics) {
+  return message->GetU32(&metrics->elapsed_ms) &&
+         message->GetU64(&metrics->connections_opened) &&
+         message->GetU64(&metrics->established) &&
+         message->GetU64(&metrics->peak_established) &&
+         message->GetU32(&metrics->peak_ms) &&
+         message->GetU64(&metrics->packets_received) &&
+         message->GetU64(&metrics->packets_sent) &&
+         message->GetU64(&metrics->packets_unmatched) &&
+         message->GetU64(&metrics->receive_drops) &&
+         message->GetU64(&metrics->rss_bytes) &&
+         message->GetU64(&metrics->cpu_us) &&
+         message->GetU32(&metrics->teardown_ms);
+}
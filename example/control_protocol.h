@@ -0,0 +1,127 @@
+#ifndef TCPMANY_EXAMPLE_CONTROL_PROTOCOL_H_
+#define TCPMANY_EXAMPLE_CONTROL_PROTOCOL_H_
+
+#include <string>
+
+#include "base.h"
+#include "endpoint_allocator.h"
+#include "kernel.h"
+
+// What loadctl and its loadagents say to each other over one tcp
+// connection per agent:
+//
+//   agent                       loadctl
+//   REGISTER           ->
+//                      <-       ASSIGN   its share of the sources and load
+//   READY              ->                once its Kernel is up
+//                      <-       START    when every agent is ready
+//   METRICS            ->                every second while running
+//   DONE               ->                with the final numbers, once its
+//                                        connections are torn down
+//
+// Every message is one frame: a 4 byte length of what follows, a 1 byte
+// type and the fields, integers in network order.
+
+const uint32 CONTROL_VERSION = 2;
+
+enum ControlType {
+  CT_REGISTER = 1,
+  CT_ASSIGN = 2,
+  CT_READY = 3,
+  CT_START = 4,
+  CT_METRICS = 5,
+  CT_DONE = 6,
+};
+
+struct AgentRegistration {
+  uint32 version;
+  // host:pid, for the report
+  std::string name;
+};
+
+struct Assignment {
+  uint32 agent_id;
+  uint32 agents;
+  // disjoint from those of every other agent
+  tcpmany::SourceRange sources;
+  // host order
+  uint32 server_ip;
+  uint16 server_port;
+  uint64 connections;
+  // connections per second, of this agent
+  double rate;
+  uint32 hold_ms;
+  uint32 settle_ms;
+  // how the agent's Kernel::Stop ends the connections at the end
+  tcpmany::TeardownOptions teardown;
+};
+
+struct StartOrder {
+  // CLOCK_REALTIME, every agent starts its ramp at this moment, so hosts
+  // need synchronized clocks
+  int64 start_ns;
+};
+
+struct AgentMetrics {
+  // since the start
+  uint32 elapsed_ms;
+  uint64 connections_opened;
+  uint64 established;
+  uint64 peak_established;
+  // when the peak was first reached
+  uint32 peak_ms;
+  uint64 packets_received;
+  uint64 packets_sent;
+  uint64 packets_unmatched;
+  uint64 receive_drops;
+  uint64 rss_bytes;
+  uint64 cpu_us;
+  // how long Kernel::Stop took, 0 before DONE
+  uint32 teardown_ms;
+};
+
+// One frame, built up with the Put functions and sent, or received and
+// taken apart with the Get functions, which fail once the fields run out.
+class ControlMessage {
+ public:
+  explicit ControlMessage(uint8 type = 0) : type_(type), read_offset_(0) {}
+
+  uint8 type() const {
+    return type_;
+  }
+
+  void PutU8(uint8 value);
+  void PutU16(uint16 value);
+  void PutU32(uint32 value);
+  void PutU64(uint64 value);
+  void PutString(const std::string& value);
+
+  bool GetU8(uint8* value);
+  bool GetU16(uint16* value);
+  bool GetU32(uint32* value);
+  bool GetU64(uint64* value);
+  bool GetString(std::string* value);
+
+  // blocking, false when the connection fails or is closed
+  bool Send(int fd) const;
+  bool Receive(int fd);
+
+ private:
+  bool Get(void* value, size_t size);
+
+  uint8 type_;
+  std::string fields_;
+  size_t read_offset_;
+};
+
+void Encode(const AgentRegistration& registration, ControlMessage* message);
+void Encode(const Assignment& assignment, ControlMessage* message);
+void Encode(const StartOrder& start, ControlMessage* message);
+void Encode(const AgentMetrics& metrics, ControlMessage* message);
+// false if the message is too short
+bool Decode(ControlMessage* message, AgentRegistration* registration);
+bool Decode(ControlMessage* message, Assignment* assignment);
+bool Decode(ControlMessage* message, StartOrder* start);
+bool Decode(ControlMessage* message, AgentMetrics* metrics);
+
+#endif  // TCPMANY_EXAMPLE_CONTROL_PROTOCOL_H_
@@ -1,63 +1,441 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <strings.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <unistd.h>
-#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/types.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "websocket.h"
 
-int main(int argc, char* argv[]) {
-  int fd = socket(AF_INET, SOCK_STREAM, 0);
+// A target server that can hold millions of idle or chatty connections.
+// Every worker thread owns a SO_REUSEPORT listener and an edge triggered
+// epoll set, so accepts and reads spread over the cores with no shared
+// state besides the counters.
+
+enum Mode {
+  MODE_ECHO,  // write back whatever is received
+  MODE_PUSH,  // send a message to every connection each interval
+  MODE_IDLE,  // read and drop, only hold the connection
+  MODE_WS,    // websocket: upgrade, echo data frames, answer pings and closes
+};
+
+struct Options {
+  uint16_t port;
+  int threads;
+  int backlog;
+  Mode mode;
+  int push_interval_ms;
+  int push_size;
+};
+
+static std::atomic<uint64_t> g_accepts(0);
+static std::atomic<uint64_t> g_messages_in(0);
+static std::atomic<uint64_t> g_messages_out(0);
+static std::atomic<uint64_t> g_closes(0);
+
+static const int MAX_EVENTS = 1024;
+static const int READ_BUFFER_SIZE = 4096;
+
+// Dual stack: an ipv6 socket that also takes ipv4 connections, as mapped
+// addresses. Plain ipv4 where the host has no ipv6.
+static int Listen(const Options& options) {
+  int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  const bool ipv6 = fd != -1;
+  if (!ipv6) {
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  }
   if (fd == -1) {
-    printf("create socket failed\n");
+    printf("create socket failed: %s\n", strerror(errno));
     exit(1);
   }
-
   int opt = 1;
   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-  
-  struct sockaddr_in server_addr;
-  bzero(&server_addr, sizeof(struct sockaddr_in));
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_addr.s_addr = inet_addr("0.0.0.0");
-  server_addr.sin_port = htons(5223);
-  if (bind(fd, (struct sockaddr*)&server_addr, sizeof(server_addr))) {
-    printf("bind failed\n");
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+    printf("set SO_REUSEPORT failed: %s\n", strerror(errno));
     exit(1);
   }
 
-  if (listen(fd, 100)) {
-    printf("listen failed\n");
+  int ret;
+  if (ipv6) {
+    int v6only = 0;
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    struct sockaddr_in6 server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin6_family = AF_INET6;
+    server_addr.sin6_addr = in6addr_any;
+    server_addr.sin6_port = htons(options.port);
+    ret = bind(fd, (struct sockaddr*)&server_addr, sizeof(server_addr));
+  } else {
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    server_addr.sin_port = htons(options.port);
+    ret = bind(fd, (struct sockaddr*)&server_addr, sizeof(server_addr));
+  }
+  if (ret) {
+    printf("bind failed: %s\n", strerror(errno));
+    exit(1);
+  }
+  if (listen(fd, options.backlog)) {
+    printf("listen failed: %s\n", strerror(errno));
     exit(1);
   }
-  while (1) {
-    struct sockaddr_in client_addr;
-    int length = sizeof(client_addr);
+  return fd;
+}
 
-    printf("ready to accept\n");
-    int client_socket = accept(fd, (struct sockaddr*)&client_addr, (socklen_t*)&length);
-    if (client_socket < 0) {
-      printf("accept failed\n");
-    } else {
-      printf("accept success\n");
+// The connections of one worker, kept in a dense array so the periodic push
+// is a linear walk, with an fd -> slot index for O(1) removal.
+class ConnectionSet {
+ public:
+  void Add(int fd) {
+    if (fd >= static_cast<int>(slots_.size())) {
+      slots_.resize(fd + 1, -1);
+    }
+    slots_[fd] = fds_.size();
+    fds_.push_back(fd);
+  }
+  void Remove(int fd) {
+    int slot = slots_[fd];
+    int last = fds_.back();
+    fds_[slot] = last;
+    slots_[last] = slot;
+    fds_.pop_back();
+    slots_[fd] = -1;
+    if (fd < static_cast<int>(pending_.size())) {
+      std::string().swap(pending_[fd]);
+    }
+  }
+  const std::vector<int>& fds() const { return fds_; }
+  // what has been read but not used yet, websocket mode only
+  std::string* Pending(int fd) {
+    if (fd >= static_cast<int>(pending_.size())) {
+      pending_.resize(fd + 1);
+    }
+    return &pending_[fd];
+  }
+
+ private:
+  std::vector<int> fds_;
+  std::vector<int> slots_;
+  std::vector<std::string> pending_;
+};
+
+static void CloseConnection(int epfd, int fd, ConnectionSet* conns) {
+  epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+  conns->Remove(fd);
+  close(fd);
+  ++g_closes;
+}
+
+static void AcceptAll(int listen_fd, int epfd, ConnectionSet* conns) {
+  while (true) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        printf("accept failed: %s\n", strerror(errno));
+      }
+      return;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    event.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event)) {
+      printf("epoll_ctl failed: %s\n", strerror(errno));
+      close(fd);
+      continue;
+    }
+    conns->Add(fd);
+    ++g_accepts;
+  }
+}
+
+// The value of header |name| in an http request, empty if it has none.
+static std::string HeaderValue(const char* data, size_t len,
+                               const char* name) {
+  const std::string request(data, len);
+  const size_t name_len = strlen(name);
+  size_t line = request.find("\r\n");
+  while (line != std::string::npos) {
+    const size_t start = line + 2;
+    const size_t end = request.find("\r\n", start);
+    if (end == std::string::npos) {
+      break;
+    }
+    if (end - start > name_len && request[start + name_len] == ':' &&
+        !strncasecmp(request.data() + start, name, name_len)) {
+      size_t first = request.find_first_not_of(" \t", start + name_len + 1);
+      size_t last = request.find_last_not_of(" \t", end - 1);
+      if (first == std::string::npos || first > last) {
+        return std::string();
+      }
+      return request.substr(first, last - first + 1);
+    }
+    line = end;
+  }
+  return std::string();
+}
+
+// Answers the upgrade request and the whole frames at the start of
+// |input| and leaves the rest there for the next read. Returns false once
+// the connection is to be closed.
+static bool ServeWebSocket(int fd, std::string* input) {
+  std::string reply;
+  size_t offset = 0;
+  bool close = false;
+  if (input->compare(0, 4, "GET ") == 0) {
+    const size_t end = input->find("\r\n\r\n");
+    if (end == std::string::npos) {
+      return input->size() < READ_BUFFER_SIZE;
+    }
+    offset = end + 4;
+    std::string key =
+        HeaderValue(input->data(), offset, "Sec-WebSocket-Key");
+    if (key.empty()) {
+      return false;
+    }
+    reply = "HTTP/1.1 101 Switching Protocols\r\n"
+            "Upgrade: websocket\r\n"
+            "Connection: Upgrade\r\n"
+            "Sec-WebSocket-Accept: " + tcpmany::WebSocketAccept(key) +
+            "\r\n\r\n";
+  }
+  const size_t len = input->size();
+  std::string payload;
+  while (offset + 2 <= len && !close) {
+    const uint8_t* frame =
+        reinterpret_cast<const uint8_t*>(input->data() + offset);
+    const uint8_t opcode = frame[0] & 0x0f;
+    uint64_t size = frame[1] & 0x7f;
+    size_t header = 2;
+    if (size == 126 && offset + 4 <= len) {
+      size = frame[2] << 8 | frame[3];
+      header = 4;
+    } else if (size == 127 && offset + 10 <= len) {
+      size = 0;
+      for (int i = 2; i < 10; ++i) {
+        size = size << 8 | frame[i];
+      }
+      header = 10;
+    } else if (size >= 126) {
+      break;
+    }
+    const bool masked = frame[1] & 0x80;
+    if (masked) {
+      header += 4;
     }
+    if (offset + header + size > len) {
+      break;
+    }
+    payload.assign(input->data() + offset + header, size);
+    if (masked) {
+      tcpmany::MaskWebSocketPayload(&payload[0], size, frame + header - 4);
+    }
+    offset += header + size;
+    if (opcode == tcpmany::WS_PING) {
+      tcpmany::EncodeWebSocketFrame(tcpmany::WS_PONG, payload.data(),
+                                    payload.size(), NULL, &reply);
+    } else if (opcode == tcpmany::WS_CLOSE) {
+      tcpmany::EncodeWebSocketFrame(tcpmany::WS_CLOSE, payload.data(),
+                                    std::min<size_t>(payload.size(), 2),
+                                    NULL, &reply);
+      close = true;
+    } else if (opcode == tcpmany::WS_TEXT || opcode == tcpmany::WS_BINARY) {
+      tcpmany::EncodeWebSocketFrame(
+          static_cast<tcpmany::WebSocketOpcode>(opcode), payload.data(),
+          payload.size(), NULL, &reply);
+    }
+  }
+  input->erase(0, offset);
+  if (!reply.empty() &&
+      send(fd, reply.data(), reply.size(), MSG_NOSIGNAL) > 0) {
+    ++g_messages_out;
+  }
+  return !close;
+}
 
-#if 1
-    char buffer[1024];
-    bzero(buffer, sizeof(buffer));
-    length = recv(client_socket, buffer, sizeof(buffer), 0);
-    if (length < 0 || length == sizeof(buffer)) {
-      printf("receive failed\n");
+// Drains the socket as edge triggering requires. Returns false when the
+// peer has gone away.
+static bool ReadAll(int fd, Mode mode, ConnectionSet* conns) {
+  char buffer[READ_BUFFER_SIZE];
+  while (true) {
+    ssize_t length = recv(fd, buffer, sizeof(buffer), 0);
+    if (length > 0) {
+      ++g_messages_in;
+      if (mode == MODE_WS) {
+        std::string* pending = conns->Pending(fd);
+        pending->append(buffer, length);
+        if (!ServeWebSocket(fd, pending)) {
+          return false;
+        }
+        continue;
+      }
+      // best effort, a client that does not read its echoes loses them
+      if (mode == MODE_ECHO && send(fd, buffer, length, MSG_NOSIGNAL) > 0) {
+        ++g_messages_out;
+      }
       continue;
     }
-    printf("receive:%s\n", buffer);
-    send(client_socket, buffer, strlen(buffer), 0);
-    if (length < 0) {
-      printf("send failed\n");
+    if (length == 0) {
+      return false;
+    }
+    if (errno == EINTR) {
       continue;
     }
-#endif
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+  }
+}
+
+static void Push(const ConnectionSet& conns, const std::string& message) {
+  for (int fd : conns.fds()) {
+    if (send(fd, message.data(), message.size(),
+             MSG_NOSIGNAL | MSG_DONTWAIT) > 0) {
+      ++g_messages_out;
+    }
+  }
+}
+
+static void Worker(const Options& options) {
+  int listen_fd = Listen(options);
+  int epfd = epoll_create1(0);
+  if (epfd == -1) {
+    printf("epoll_create failed: %s\n", strerror(errno));
+    exit(1);
+  }
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLET;
+  event.data.fd = listen_fd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &event);
+
+  ConnectionSet conns;
+  std::string message(options.push_size, 'x');
+  message.back() = '\n';
+  typedef std::chrono::steady_clock Clock;
+  const Clock::duration interval =
+      std::chrono::milliseconds(options.push_interval_ms);
+  Clock::time_point next_push = Clock::now() + interval;
+
+  struct epoll_event events[MAX_EVENTS];
+  while (true) {
+    int timeout = -1;
+    if (options.mode == MODE_PUSH) {
+      timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+          next_push - Clock::now()).count();
+      timeout = timeout < 0 ? 0 : timeout;
+    }
+    int count = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+    if (count < 0 && errno != EINTR) {
+      printf("epoll_wait failed: %s\n", strerror(errno));
+      exit(1);
+    }
+    for (int i = 0; i < count; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == listen_fd) {
+        AcceptAll(listen_fd, epfd, &conns);
+      } else if ((events[i].events & (EPOLLERR | EPOLLHUP)) ||
+                 !ReadAll(fd, options.mode, &conns) ||
+                 (events[i].events & EPOLLRDHUP)) {
+        CloseConnection(epfd, fd, &conns);
+      }
+    }
+    if (options.mode == MODE_PUSH && Clock::now() >= next_push) {
+      Push(conns, message);
+      next_push += interval;
+    }
+  }
+}
+
+static void RaiseFileLimit() {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+static void Usage(const char* name) {
+  printf("usage: %s [-p port] [-t threads] [-b backlog]"
+         " [-m echo|push|idle|ws] [-i push_interval_ms] [-s push_size]\n",
+         name);
+}
+
+int main(int argc, char* argv[]) {
+  Options options;
+  options.port = 5223;
+  options.threads = std::thread::hardware_concurrency();
+  options.backlog = 65535;
+  options.mode = MODE_ECHO;
+  options.push_interval_ms = 1000;
+  options.push_size = 64;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "p:t:b:m:i:s:h")) != -1) {
+    switch (opt) {
+      case 'p': options.port = atoi(optarg); break;
+      case 't': options.threads = atoi(optarg); break;
+      case 'b': options.backlog = atoi(optarg); break;
+      case 'i': options.push_interval_ms = atoi(optarg); break;
+      case 's': options.push_size = atoi(optarg); break;
+      case 'm':
+        if (!strcmp(optarg, "echo")) {
+          options.mode = MODE_ECHO;
+        } else if (!strcmp(optarg, "push")) {
+          options.mode = MODE_PUSH;
+        } else if (!strcmp(optarg, "idle")) {
+          options.mode = MODE_IDLE;
+        } else if (!strcmp(optarg, "ws")) {
+          options.mode = MODE_WS;
+        } else {
+          Usage(argv[0]);
+          exit(1);
+        }
+        break;
+      default:
+        Usage(argv[0]);
+        exit(1);
+    }
+  }
+  if (options.threads <= 0 || options.push_size <= 0 ||
+      options.push_interval_ms <= 0) {
+    Usage(argv[0]);
+    exit(1);
+  }
+
+  RaiseFileLimit();
+  std::vector<std::thread> workers;
+  for (int i = 0; i < options.threads; ++i) {
+    workers.push_back(std::thread(Worker, options));
+  }
+
+  uint64_t accepts = 0, messages_in = 0, messages_out = 0, closes = 0;
+  while (true) {
+    sleep(1);
+    uint64_t a = g_accepts, in = g_messages_in;
+    uint64_t out = g_messages_out, c = g_closes;
+    printf("accept/s: %lu, in/s: %lu, out/s: %lu, close/s: %lu,"
+           " connections: %lu\n",
+           a - accepts, in - messages_in, out - messages_out, c - closes,
+           a - c);
+    fflush(stdout);
+    accepts = a;
+    messages_in = in;
+    messages_out = out;
+    closes = c;
   }
 }
@@ -0,0 +1,254 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "connection.h"
+#include "control_protocol.h"
+#include "kernel.h"
+#include "memory_backend.h"
+
+using std::cerr;
+using std::endl;
+using std::string;
+
+using tcpmany::Connection;
+using tcpmany::InetAddress;
+using tcpmany::Kernel;
+using tcpmany::KernelStats;
+
+typedef std::chrono::steady_clock Clock;
+
+namespace {
+
+double SecondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+int64 RssBytes() {
+  std::ifstream status("/proc/self/status");
+  string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmRSS:") == 0) {
+      return atoll(line.c_str() + 6) * 1024;
+    }
+  }
+  return 0;
+}
+
+uint64 CpuMicroseconds() {
+  struct rusage usage;
+  ::getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ull +
+         usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+int64 RealtimeNanoseconds() {
+  struct timespec ts;
+  ::clock_gettime(CLOCK_REALTIME, &ts);
+  return static_cast<int64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+int ConnectController(const InetAddress& controller) {
+  int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 ||
+      ::connect(fd,
+                reinterpret_cast<const struct sockaddr*>(
+                    &controller.SockAddr()),
+                sizeof(struct sockaddr_in)) != 0) {
+    cerr << "connect " << controller.ToIpPort() << " error: "
+         << ::strerror(errno) << endl;
+    return -1;
+  }
+  return fd;
+}
+
+bool Expect(int fd, ControlType type, ControlMessage* message) {
+  if (!message->Receive(fd)) {
+    cerr << "lost the controller" << endl;
+    return false;
+  }
+  if (message->type() != type) {
+    cerr << "unexpected message " << static_cast<int>(message->type())
+         << ", wanted " << type << endl;
+    return false;
+  }
+  return true;
+}
+
+// What the sampler keeps track of while the load runs.
+struct Progress {
+  Progress() : opened(0), peak_established(0), peak_ms(0) {}
+
+  std::atomic<uint64> opened;
+  std::atomic<uint64> peak_established;
+  std::atomic<uint32> peak_ms;
+};
+
+AgentMetrics Measure(const Progress& progress,
+                     Clock::time_point start,
+                     int64 base_rss,
+                     uint64 base_cpu) {
+  const KernelStats stats = Kernel::GetStats();
+  AgentMetrics metrics;
+  metrics.elapsed_ms = SecondsSince(start) * 1000;
+  metrics.connections_opened = progress.opened;
+  metrics.established = stats.established;
+  metrics.peak_established = progress.peak_established;
+  metrics.peak_ms = progress.peak_ms;
+  metrics.packets_received = stats.packets_received;
+  metrics.packets_sent = stats.packets_sent;
+  metrics.packets_unmatched = stats.packets_unmatched;
+  metrics.receive_drops = stats.receive_drops;
+  int64 rss = RssBytes() - base_rss;
+  metrics.rss_bytes = rss > 0 ? rss : 0;
+  metrics.cpu_us = CpuMicroseconds() - base_cpu;
+  metrics.teardown_ms = 0;
+  return metrics;
+}
+
+}  // namespace
+
+// Runs one share of a distributed load for loadctl: registers with the
+// controller at <controller_ip:port>, gets its own source range and load,
+// opens the connections from the agreed start on and reports back every
+// second. At the end it tears its connections down as loadctl says before
+// reporting for the last time. -M runs against the in-process
+// MemoryBackend, so several agents can be tried on one machine without
+// root; -c and -t are the same as for scaleload.
+int main(int argc, char* argv[]) {
+  tcpmany::KernelOptions options;
+  bool memory = false;
+  int opt;
+  while ((opt = ::getopt(argc, argv, "c:t:M")) != -1) {
+    if (opt == 'c') {
+      options.capture_interface = optarg;
+    } else if (opt == 't') {
+      options.callback_threads = atoi(optarg);
+    } else if (opt == 'M') {
+      memory = true;
+    } else {
+      return -1;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (argc != 2) {
+    cerr << "usage: " << argv[0] << " [-M] [-c capture_interface]"
+         << " [-t callback_threads] <controller_ip:port>" << endl;
+    return -1;
+  }
+  int fd = ConnectController(InetAddress(string(argv[1])));
+  if (fd < 0) {
+    return -1;
+  }
+
+  char host[256] = {0};
+  ::gethostname(host, sizeof(host) - 1);
+  AgentRegistration registration;
+  registration.version = CONTROL_VERSION;
+  registration.name = string(host) + ":" + std::to_string(::getpid());
+  ControlMessage message(CT_REGISTER);
+  Encode(registration, &message);
+  Assignment assignment;
+  if (!message.Send(fd) || !Expect(fd, CT_ASSIGN, &message) ||
+      !Decode(&message, &assignment)) {
+    return -1;
+  }
+
+  const InetAddress server_addr(assignment.server_ip,
+                                assignment.server_port);
+  if (memory) {
+    options.backend = std::make_shared<tcpmany::MemoryBackend>();
+  }
+  options.servers.push_back(server_addr);
+  options.source_ranges.push_back(assignment.sources);
+  options.teardown = assignment.teardown;
+  Kernel::Start(options);
+  const int64 base_rss = RssBytes();
+  const uint64 base_cpu = CpuMicroseconds();
+
+  StartOrder start_order;
+  if (!ControlMessage(CT_READY).Send(fd) || !Expect(fd, CT_START, &message) ||
+      !Decode(&message, &start_order)) {
+    return -1;
+  }
+  int64 wait_ns = start_order.start_ns - RealtimeNanoseconds();
+  if (wait_ns > 0) {
+    std::this_thread::sleep_for(std::chrono::nanoseconds(wait_ns));
+  }
+
+  // samples the established count, and reports every second
+  Progress progress;
+  std::atomic<bool> sampling(true);
+  const Clock::time_point start = Clock::now();
+  std::thread sampler([&] {
+    Clock::time_point next_report = start + std::chrono::seconds(1);
+    while (sampling) {
+      uint64 established = Kernel::GetStats().established;
+      if (established > progress.peak_established) {
+        progress.peak_established = established;
+        progress.peak_ms = SecondsSince(start) * 1000;
+      }
+      if (Clock::now() >= next_report) {
+        next_report += std::chrono::seconds(1);
+        ControlMessage report(CT_METRICS);
+        Encode(Measure(progress, start, base_rss, base_cpu), &report);
+        report.Send(fd);
+      }
+      ::usleep(10 * 1000);
+    }
+  });
+
+  for (uint64 i = 0; i < assignment.connections; ++i) {
+    double due = i / assignment.rate;
+    double now = SecondsSince(start);
+    if (due > now + 0.001) {
+      ::usleep(static_cast<useconds_t>((due - now) * 1e6));
+    }
+    Connection* conn = Kernel::NewConnection(server_addr);
+    if (conn == nullptr) {
+      cerr << "sources used up after " << i << " connections" << endl;
+      break;
+    }
+    conn->Connect();
+    ++progress.opened;
+  }
+
+  double last_progress = SecondsSince(start);
+  uint64 last_peak = 0;
+  while (progress.peak_established < progress.opened &&
+         SecondsSince(start) - last_progress < assignment.settle_ms / 1000.0) {
+    if (progress.peak_established != last_peak) {
+      last_peak = progress.peak_established;
+      last_progress = SecondsSince(start);
+    }
+    ::usleep(10 * 1000);
+  }
+  // hold_ms * 1000 would wrap 32 bits, as would usleep's argument
+  std::this_thread::sleep_for(std::chrono::milliseconds(assignment.hold_ms));
+  sampling = false;
+  sampler.join();
+
+  // the numbers of the run itself, then the teardown, like scaleload
+  AgentMetrics metrics = Measure(progress, start, base_rss, base_cpu);
+  const Clock::time_point stop_start = Clock::now();
+  Kernel::Stop();
+  metrics.teardown_ms = SecondsSince(stop_start) * 1000;
+  ControlMessage done(CT_DONE);
+  Encode(metrics, &done);
+  done.Send(fd);
+  ::close(fd);
+  tcpmany::FlushLogs();
+  return 0;
+}
@@ -0,0 +1,390 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "control_protocol.h"
+#include "inet_address.h"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+
+using tcpmany::InetAddress;
+
+namespace {
+
+// how long the agents have to start their Kernels, those not ready by
+// then are left out of the run
+const int kReadyTimeoutMs = 30 * 1000;
+// a frame that started arriving has to be complete by then
+const int kReceiveTimeoutMs = 5 * 1000;
+
+struct Agent {
+  Agent() : fd(-1), done(false), lost(false) {
+    ::memset(&metrics, 0, sizeof(metrics));
+  }
+
+  int fd;
+  string name;
+  Assignment assignment;
+  // the latest report, the final one once done
+  AgentMetrics metrics;
+  bool done;
+  bool lost;
+};
+
+int64 RealtimeNanoseconds() {
+  struct timespec ts;
+  ::clock_gettime(CLOCK_REALTIME, &ts);
+  return static_cast<int64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+int Listen(const InetAddress& addr) {
+  int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  if (fd < 0 ||
+      ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+      ::bind(fd, reinterpret_cast<const struct sockaddr*>(&addr.SockAddr()),
+             sizeof(struct sockaddr_in)) != 0 ||
+      ::listen(fd, 128) != 0) {
+    cerr << "listen on " << addr.ToIpPort() << " error: "
+         << ::strerror(errno) << endl;
+    return -1;
+  }
+  return fd;
+}
+
+// Bounds every read, so ControlMessage::Receive fails instead of blocking
+// on an agent that stops halfway through a frame.
+bool SetReceiveTimeout(int fd, int ms) {
+  struct timeval tv;
+  tv.tv_sec = ms / 1000;
+  tv.tv_usec = ms % 1000 * 1000;
+  return ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0;
+}
+
+void LoseAgent(Agent* agent) {
+  cerr << "lost agent " << agent->name << endl;
+  agent->lost = true;
+  // an agent still waiting for START finds out and exits
+  ::close(agent->fd);
+  agent->fd = -1;
+}
+
+// Cuts |sources| into one block of whole addresses per agent, each with
+// room for its share of |count|. False if the range is too small.
+bool Split(const tcpmany::SourceRange& sources,
+           uint64 count,
+           std::vector<Agent>* agents) {
+  const uint64 ports = sources.last_port - sources.first_port + 1;
+  uint64 next_ip = sources.ips.first;
+  for (size_t i = 0; i < agents->size(); ++i) {
+    Assignment& assignment = (*agents)[i].assignment;
+    assignment.agent_id = i;
+    assignment.agents = agents->size();
+    assignment.connections =
+        count / agents->size() + (i < count % agents->size() ? 1 : 0);
+    uint64 ips = (assignment.connections + ports - 1) / ports;
+    if (ips == 0) {
+      ips = 1;
+    }
+    if (next_ip + ips - 1 > sources.ips.last) {
+      return false;
+    }
+    assignment.sources = sources;
+    assignment.sources.ips.first = next_ip;
+    assignment.sources.ips.last = next_ip + ips - 1;
+    next_ip += ips;
+  }
+  return true;
+}
+
+AgentMetrics Sum(const std::vector<Agent>& agents) {
+  AgentMetrics sum;
+  ::memset(&sum, 0, sizeof(sum));
+  for (const Agent& agent : agents) {
+    const AgentMetrics& m = agent.metrics;
+    sum.elapsed_ms = std::max(sum.elapsed_ms, m.elapsed_ms);
+    sum.connections_opened += m.connections_opened;
+    sum.established += m.established;
+    sum.peak_established += m.peak_established;
+    sum.peak_ms = std::max(sum.peak_ms, m.peak_ms);
+    sum.packets_received += m.packets_received;
+    sum.packets_sent += m.packets_sent;
+    sum.packets_unmatched += m.packets_unmatched;
+    sum.receive_drops += m.receive_drops;
+    sum.rss_bytes += m.rss_bytes;
+    sum.cpu_us += m.cpu_us;
+    sum.teardown_ms = std::max(sum.teardown_ms, m.teardown_ms);
+  }
+  return sum;
+}
+
+}  // namespace
+
+// Spreads one load over <agents> loadagents, on this host or others: waits
+// for them to register, gives each a disjoint block of <source_range> and
+// its share of <count> and <rate>, starts them all at the same moment,
+// prints a line per second with the sums of their reports and, once every
+// agent is done, one json object for the whole run. -l sets where agents
+// connect to, 0.0.0.0:7070 by default. -T fin|rst|forget[:rate] is how the
+// agents end their connections before their last report, as for
+// scaleload, rst by default.
+int main(int argc, char* argv[]) {
+  string listen_addr = "0.0.0.0:7070";
+  tcpmany::TeardownOptions teardown;
+  teardown.mode = tcpmany::TEARDOWN_RST;
+  int opt;
+  while ((opt = ::getopt(argc, argv, "l:T:")) != -1) {
+    if (opt == 'l') {
+      listen_addr = optarg;
+    } else if (opt == 'T') {
+      char* rate = ::strchr(optarg, ':');
+      if (rate != NULL) {
+        *rate = '\0';
+        teardown.rate = atoi(rate + 1);
+      }
+      if (::strcmp(optarg, "fin") == 0) {
+        teardown.mode = tcpmany::TEARDOWN_FIN;
+      } else if (::strcmp(optarg, "rst") == 0) {
+        teardown.mode = tcpmany::TEARDOWN_RST;
+      } else if (::strcmp(optarg, "forget") == 0) {
+        teardown.mode = tcpmany::TEARDOWN_FORGET;
+      } else {
+        cerr << "unknown teardown: " << optarg << endl;
+        return -1;
+      }
+    } else {
+      return -1;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (argc < 7 || argc > 9) {
+    cerr << "usage: " << argv[0] << " [-l listen_ip:port]"
+         << " [-T fin|rst|forget[:rate]]"
+         << " <agents> <server_ip> <port> <count> <rate> <source_range>"
+         << " [hold_s] [settle_s]" << endl;
+    return -1;
+  }
+  std::vector<Agent> agents(atoi(argv[1]));
+  const InetAddress server_addr(argv[2], atoi(argv[3]));
+  const uint64 COUNT = atoll(argv[4]);
+  const double RATE = atof(argv[5]);
+  const double HOLD_SECONDS = argc > 7 ? atof(argv[7]) : 0;
+  const double SETTLE_SECONDS = argc > 8 ? atof(argv[8]) : 3;
+  tcpmany::SourceRange sources;
+  if (agents.empty() || !tcpmany::ParseSourceRange(argv[6], &sources)) {
+    cerr << "invalid agents or source_range" << endl;
+    return -1;
+  }
+  if (sources.ipv6 || server_addr.IsIpv6()) {
+    cerr << "distributed runs are ipv4 only" << endl;
+    return -1;
+  }
+  if (!Split(sources, COUNT, &agents)) {
+    cerr << argv[6] << " is too small for " << COUNT << " connections"
+         << endl;
+    return -1;
+  }
+  for (Agent& agent : agents) {
+    agent.assignment.server_ip = server_addr.IpHost();
+    agent.assignment.server_port = server_addr.PortHost();
+    agent.assignment.rate = RATE * agent.assignment.connections / COUNT;
+    agent.assignment.hold_ms = HOLD_SECONDS * 1000;
+    agent.assignment.settle_ms = SETTLE_SECONDS * 1000;
+    agent.assignment.teardown = teardown;
+  }
+
+  int listen_fd = Listen(InetAddress(listen_addr));
+  if (listen_fd < 0) {
+    return -1;
+  }
+  cerr << "waiting for " << agents.size() << " agents on " << listen_addr
+       << endl;
+  ControlMessage message;
+  for (size_t i = 0; i < agents.size();) {
+    Agent& agent = agents[i];
+    agent.fd = ::accept(listen_fd, NULL, NULL);
+    if (agent.fd < 0) {
+      continue;
+    }
+    if (!SetReceiveTimeout(agent.fd, kReceiveTimeoutMs)) {
+      ::close(agent.fd);
+      continue;
+    }
+    AgentRegistration registration;
+    if (!message.Receive(agent.fd) || message.type() != CT_REGISTER ||
+        !Decode(&message, &registration) ||
+        registration.version != CONTROL_VERSION) {
+      cerr << "dropped an agent that didn't register properly" << endl;
+      ::close(agent.fd);
+      continue;
+    }
+    agent.name = registration.name;
+    ControlMessage assign(CT_ASSIGN);
+    Encode(agent.assignment, &assign);
+    if (!assign.Send(agent.fd)) {
+      ::close(agent.fd);
+      continue;
+    }
+    cerr << "agent " << i << " " << agent.name << ": "
+         << agent.assignment.connections << " connections from "
+         << InetAddress(agent.assignment.sources.ips.first, 0).ToIpPort()
+         << " on" << endl;
+    ++i;
+  }
+  ::close(listen_fd);
+  std::vector<Agent*> waiting;
+  for (Agent& agent : agents) {
+    waiting.push_back(&agent);
+  }
+  const int64 ready_deadline =
+      RealtimeNanoseconds() + kReadyTimeoutMs * 1000000ll;
+  while (!waiting.empty()) {
+    int64 timeout_ms = (ready_deadline - RealtimeNanoseconds()) / 1000000;
+    if (timeout_ms <= 0) {
+      break;
+    }
+    std::vector<struct pollfd> fds;
+    for (Agent* agent : waiting) {
+      struct pollfd pfd = {agent->fd, POLLIN, 0};
+      fds.push_back(pfd);
+    }
+    ::poll(&fds[0], fds.size(), timeout_ms);
+    std::vector<Agent*> still_waiting;
+    for (size_t i = 0; i < fds.size(); ++i) {
+      Agent* agent = waiting[i];
+      if (fds[i].revents == 0) {
+        still_waiting.push_back(agent);
+      } else if (!message.Receive(agent->fd) ||
+                 message.type() != CT_READY) {
+        cerr << "agent " << agent->name << " failed to get ready" << endl;
+        LoseAgent(agent);
+      }
+    }
+    waiting.swap(still_waiting);
+  }
+  for (Agent* agent : waiting) {
+    cerr << "agent " << agent->name << " not ready in "
+         << kReadyTimeoutMs / 1000 << "s" << endl;
+    LoseAgent(agent);
+  }
+
+  // far enough ahead for the order to reach every agent
+  StartOrder start_order;
+  start_order.start_ns = RealtimeNanoseconds() + 500 * 1000 * 1000;
+  ControlMessage start(CT_START);
+  Encode(start_order, &start);
+  size_t running = 0;
+  for (Agent& agent : agents) {
+    if (agent.lost) {
+      continue;
+    }
+    if (!start.Send(agent.fd)) {
+      LoseAgent(&agent);
+      continue;
+    }
+    ++running;
+  }
+
+  // half a second after the agents' reports, so each line has them
+  int64 next_print = start_order.start_ns + 1500000000;
+  while (running > 0) {
+    std::vector<struct pollfd> fds;
+    std::vector<Agent*> polled;
+    for (Agent& agent : agents) {
+      if (!agent.done && !agent.lost) {
+        struct pollfd pfd = {agent.fd, POLLIN, 0};
+        fds.push_back(pfd);
+        polled.push_back(&agent);
+      }
+    }
+    int64 timeout_ms = (next_print - RealtimeNanoseconds()) / 1000000;
+    ::poll(&fds[0], fds.size(), timeout_ms > 0 ? timeout_ms : 0);
+    for (size_t i = 0; i < fds.size(); ++i) {
+      if (fds[i].revents == 0) {
+        continue;
+      }
+      Agent* agent = polled[i];
+      if (!message.Receive(agent->fd) ||
+          (message.type() != CT_METRICS && message.type() != CT_DONE) ||
+          !Decode(&message, &agent->metrics)) {
+        LoseAgent(agent);
+        --running;
+      } else if (message.type() == CT_DONE) {
+        agent->done = true;
+        --running;
+      }
+    }
+    if (RealtimeNanoseconds() >= next_print) {
+      next_print += 1000000000;
+      const AgentMetrics sum = Sum(agents);
+      cerr << "elapsed: " << sum.elapsed_ms / 1000.0 << "s"
+           << ", opened: " << sum.connections_opened
+           << ", established: " << sum.established
+           << ", received: " << sum.packets_received
+           << ", sent: " << sum.packets_sent
+           << ", agents running: " << running << endl;
+    }
+  }
+
+  const AgentMetrics sum = Sum(agents);
+  size_t lost = 0;
+  for (const Agent& agent : agents) {
+    lost += agent.lost ? 1 : 0;
+  }
+  const double connect_seconds = sum.peak_ms / 1000.0;
+  cout << "{"
+       << "\"agents\":" << agents.size() << ","
+       << "\"agents_lost\":" << lost << ","
+       << "\"connections_requested\":" << COUNT << ","
+       << "\"target_rate\":" << RATE << ","
+       << "\"connections_opened\":" << sum.connections_opened << ","
+       << "\"connections_per_second\":"
+       << (connect_seconds > 0 ? sum.peak_established / connect_seconds : 0)
+       << ","
+       << "\"peak_established\":" << sum.peak_established << ","
+       << "\"established\":" << sum.established << ","
+       << "\"rss_bytes\":" << sum.rss_bytes << ","
+       << "\"rss_bytes_per_connection\":"
+       << (sum.peak_established > 0 ?
+           sum.rss_bytes / static_cast<double>(sum.peak_established) : 0)
+       << ","
+       << "\"cpu_seconds\":" << sum.cpu_us / 1e6 << ","
+       << "\"packets_received\":" << sum.packets_received << ","
+       << "\"packets_sent\":" << sum.packets_sent << ","
+       << "\"packets_unmatched\":" << sum.packets_unmatched << ","
+       << "\"receive_drops\":" << sum.receive_drops << ","
+       << "\"teardown_seconds\":" << sum.teardown_ms / 1000.0 << ","
+       << "\"per_agent\":[";
+  for (size_t i = 0; i < agents.size(); ++i) {
+    const Agent& agent = agents[i];
+    cout << (i > 0 ? "," : "") << "{"
+         << "\"name\":\"" << agent.name << "\","
+         << "\"first_ip\":\""
+         << InetAddress(agent.assignment.sources.ips.first, 0).ToIpPort()
+         << "\","
+         << "\"connections\":" << agent.assignment.connections << ","
+         << "\"peak_established\":" << agent.metrics.peak_established << ","
+         << "\"established\":" << agent.metrics.established << ","
+         << "\"connect_seconds\":" << agent.metrics.peak_ms / 1000.0 << ","
+         << "\"teardown_seconds\":" << agent.metrics.teardown_ms / 1000.0
+         << ","
+         << "\"done\":" << (agent.done ? "true" : "false")
+         << "}";
+  }
+  cout << "]}" << endl;
+  return lost > 0 ? 1 : 0;
+}
@@ -1,100 +1,419 @@
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
-#include <linux/if_ether.h>
-#include <pcap.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 #include "logging.h"
 #include "packet.h"
+#include "packet_ring.h"
+#include "route_table.h"
+#include "tc_redirect.h"
 
 using std::cerr;
 using std::endl;
-using std::make_shared;
+using tcpmany::BpfFilter;
+using tcpmany::Packet;
+using tcpmany::PacketRing;
 
-uint32 g_client_ip_net;
+// fake client address -> client host
+RouteTable g_routes;
+// 0 for any server address
+uint32 g_server_ip_net;
 uint16 g_server_port;
-int g_sockfd;
-
-void ProcessPacket(u_char *args,
-                   const struct pcap_pkthdr *header,
-                   const u_char *packet_data) {
-  static const int SIZE_ETHERNET = 14;
-  tcpmany::Packet packet;
-  ::memcpy(packet.Buffer(),
-           packet_data+SIZE_ETHERNET,
-           tcpmany::Packet::MAX_SIZE);
-  if (packet.SrcPort() == g_server_port &&
-      packet.DstIpNet() != g_client_ip_net) {
-    uint32 dst_ip_net = packet.DstIpNet();
-    packet.SetDstIpNet(g_client_ip_net);
-    packet.SetSrcIpNet(dst_ip_net);
-    packet.CalculateChecksum();
-    VLOG(3) << "redirect pakcet: " << packet;
-
-    struct sockaddr_in dst_addr = packet.DstSockAddr();
-    CHECK(g_sockfd > 0);
-    int ret = sendto(g_sockfd,
-                     packet.Buffer(),
-                     packet.Size(),
-                     0,
-                     (struct sockaddr*)&dst_addr,
-                     sizeof(struct sockaddr));
-    if (ret == -1) {
-      LOG(ERROR) << "sendto error: " << ::strerror(errno);
+// ipv6 mode: a single client host, the server address is any when it is
+// all zeros
+bool g_ipv6;
+struct in6_addr g_client_ip6;
+struct in6_addr g_server_ip6;
+
+// Rewritten packets waiting to go out together in one sendmmsg.
+class SendBatch {
+ public:
+  static const int kMaxSize = 64;
+
+  explicit SendBatch(int sockfd)
+      : sockfd_(sockfd), size_(0), packets_(0), bytes_(0), errors_(0) {
+    ::memset(msgs_, 0, sizeof(msgs_));
+    for (int i = 0; i < kMaxSize; ++i) {
+      msgs_[i].msg_hdr.msg_iov = &iovs_[i];
+      msgs_[i].msg_hdr.msg_iovlen = 1;
+      msgs_[i].msg_hdr.msg_name = &addrs_[i];
+    }
+  }
+
+  // The slot the next packet is written to, it only becomes part of the
+  // batch with Commit.
+  Packet* Next() {
+    if (size_ == kMaxSize) {
+      Flush();
+    }
+    return &slots_[size_];
+  }
+
+  void Commit() {
+    Packet& packet = slots_[size_];
+    iovs_[size_].iov_base = packet.Buffer();
+    iovs_[size_].iov_len = packet.Size();
+    if (packet.IsIpv6()) {
+      addrs_[size_].v6 = packet.DstSockAddr6();
+      msgs_[size_].msg_hdr.msg_namelen = sizeof(addrs_[size_].v6);
+    } else {
+      addrs_[size_].v4 = packet.DstSockAddr();
+      msgs_[size_].msg_hdr.msg_namelen = sizeof(addrs_[size_].v4);
+    }
+    ++size_;
+  }
+
+  void Flush() {
+    int offset = 0;
+    while (offset < size_) {
+      int ret = sendmmsg(sockfd_, msgs_ + offset, size_ - offset, 0);
+      if (ret < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        LOG(ERROR) << "sendmmsg error: " << ::strerror(errno);
+        ++errors_;
+        ++offset;
+        continue;
+      }
+      uint64 bytes = 0;
+      for (int i = offset; i < offset + ret; ++i) {
+        bytes += iovs_[i].iov_len;
+      }
+      bytes_ += bytes;
+      packets_ += ret;
+      offset += ret;
     }
+    size_ = 0;
   }
+
+  // read by the reporting thread
+  uint64 packets() const { return packets_; }
+  uint64 bytes() const { return bytes_; }
+  uint64 errors() const { return errors_; }
+
+ private:
+  int sockfd_;
+  int size_;
+  Packet slots_[kMaxSize];
+  struct mmsghdr msgs_[kMaxSize];
+  struct iovec iovs_[kMaxSize];
+  union {
+    struct sockaddr_in v4;
+    struct sockaddr_in6 v6;
+  } addrs_[kMaxSize];
+  std::atomic<uint64> packets_;
+  std::atomic<uint64> bytes_;
+  std::atomic<uint64> errors_;
+};
+
+// checksum_ready is false for locally sent packets captured before the NIC
+// filled in the TCP checksum (TP_STATUS_CSUMNOTREADY), their checksum field
+// only holds the pseudo header sum so it can't be adjusted incrementally.
+static void ProcessPacket6(const uint8* data,
+                           uint32 len,
+                           bool checksum_ready,
+                           SendBatch* batch) {
+  if (len < Packet::HEADER6_LEN || len > Packet::MAX_SIZE) {
+    return;
+  }
+  const struct ip6_hdr* ip6 = reinterpret_cast<const struct ip6_hdr*>(data);
+  const struct tcphdr* tcp =
+      reinterpret_cast<const struct tcphdr*>(data + sizeof(struct ip6_hdr));
+  const uint32 size = sizeof(struct ip6_hdr) + ::ntohs(ip6->ip6_plen);
+  if ((data[0] >> 4) != 6 || ip6->ip6_nxt != IPPROTO_TCP ||
+      ::ntohs(tcp->source) != g_server_port ||
+      (!IN6_IS_ADDR_UNSPECIFIED(&g_server_ip6) &&
+       !IN6_ARE_ADDR_EQUAL(&ip6->ip6_src, &g_server_ip6)) ||
+      IN6_ARE_ADDR_EQUAL(&ip6->ip6_dst, &g_client_ip6) || size > len) {
+    return;
+  }
+  Packet* packet = batch->Next();
+  ::memcpy(packet->Buffer(), data, size);
+  const struct in6_addr fake_ip = packet->DstIp6();
+  if (checksum_ready) {
+    packet->RewriteAddress6(fake_ip, g_client_ip6);
+  } else {
+    packet->SetSrcAddress(tcpmany::InetAddress(fake_ip, packet->SrcPort()));
+    packet->SetDstAddress(tcpmany::InetAddress(g_client_ip6,
+                                               packet->DstPort()));
+    packet->CalculateChecksum();
+  }
+  VLOG(3) << "redirect pakcet: " << *packet;
+  batch->Commit();
+}
+
+void ProcessPacket(const uint8* data,
+                   uint32 len,
+                   bool checksum_ready,
+                   SendBatch* batch) {
+  if (g_ipv6) {
+    ProcessPacket6(data, len, checksum_ready, batch);
+    return;
+  }
+  if (len < Packet::HEADER_LEN || len > Packet::MAX_SIZE) {
+    return;
+  }
+  // the filter already did this, but it is cheap and saves the copy if an
+  // unfiltered packet slipped in
+  const struct iphdr* ip = reinterpret_cast<const struct iphdr*>(data);
+  if (ip->ihl < 5 || ip->ihl * 4 + sizeof(struct tcphdr) > len) {
+    return;
+  }
+  const struct tcphdr* tcp =
+      reinterpret_cast<const struct tcphdr*>(data + ip->ihl * 4);
+  if (ip->protocol != IPPROTO_TCP ||
+      ::ntohs(tcp->source) != g_server_port ||
+      (g_server_ip_net != 0 && ip->saddr != g_server_ip_net) ||
+      ::ntohs(ip->tot_len) > len) {
+    return;
+  }
+  // no route, or already rewritten
+  uint32 client_ip_net = g_routes.Lookup(ip->daddr);
+  if (client_ip_net == 0 || client_ip_net == ip->daddr) {
+    return;
+  }
+  Packet* packet = batch->Next();
+  ::memcpy(packet->Buffer(), data, ::ntohs(ip->tot_len));
+  if (checksum_ready) {
+    packet->RewriteAddressNet(packet->DstIpNet(), client_ip_net);
+  } else {
+    packet->SetSrcIpNet(packet->DstIpNet());
+    packet->SetDstIpNet(client_ip_net);
+    packet->CalculateChecksum();
+  }
+  VLOG(3) << "redirect pakcet: " << *packet;
+  batch->Commit();
+}
+
+static int ReinjectionSocket() {
+  int sockfd = socket(g_ipv6 ? AF_INET6 : AF_INET, SOCK_RAW, IPPROTO_TCP);
+  CHECK(sockfd >= 0) << "socket error: " << strerror(errno);
+  int flag = 1;
+  if (g_ipv6) {
+    CHECK(setsockopt(sockfd, IPPROTO_IPV6, IPV6_HDRINCL, &flag,
+                     sizeof(flag)) >= 0)
+        << "setsockopt error: " << strerror(errno);
+  } else {
+    CHECK(setsockopt(sockfd, IPPROTO_IP, IP_HDRINCL, &flag,
+                     sizeof(flag)) >= 0)
+        << "setsockopt error: " << strerror(errno);
+  }
+  // only used for sending, don't let it queue a copy of every tcp packet
+  // the host receives
+  CHECK(BpfFilter::AttachDropAll(sockfd))
+      << "setsockopt error: " << strerror(errno);
+  return sockfd;
+}
+
+static BpfFilter CaptureFilter() {
+  // server responses only, and not the ones we have already rewritten
+  if (g_ipv6) {
+    BpfFilter filter(AF_INET6);
+    filter.RequireSourcePort(g_server_port);
+    if (!IN6_IS_ADDR_UNSPECIFIED(&g_server_ip6)) {
+      filter.RequireSourceIp6(g_server_ip6);
+    }
+    filter.ExcludeDestinationIp6(g_client_ip6);
+    return filter;
+  }
+  BpfFilter filter;
+  filter.RequireSourcePort(g_server_port);
+  if (g_server_ip_net != 0) {
+    filter.RequireSourceIp(g_server_ip_net);
+  }
+  for (uint32 client_ip_net : g_routes.Clients()) {
+    filter.ExcludeDestinationIp(client_ip_net);
+  }
+  return filter;
+}
+
+// One capture and reinjection pipeline. Workers share the interface through
+// a PACKET_FANOUT hash group, which keeps each flow on one worker, and
+// share nothing else.
+class Worker {
+ public:
+  Worker(const char* interface, uint16 fanout_group, uint32 block_count)
+      : sockfd_(ReinjectionSocket()),
+        ring_(interface, CaptureFilter(), true, 1 << 22, block_count),
+        batch_(sockfd_) {
+    ring_.JoinFanout(fanout_group);
+  }
+  ~Worker() {
+    ::close(sockfd_);
+  }
+
+  void Start() {
+    thread_ = std::thread(&Worker::Run, this);
+  }
+
+  const SendBatch& batch() const {
+    return batch_;
+  }
+  PacketRing::Stats GetRingStats() {
+    return ring_.GetStats();
+  }
+
+ private:
+  void Run() {
+    SendBatch* batch = &batch_;
+    while (true) {
+      struct tpacket_block_desc* block = ring_.NextBlock(100);
+      if (block == NULL) {
+        continue;
+      }
+      PacketRing::ForEachFrame(block,
+          [batch](const uint8* data, uint32 len, struct tpacket3_hdr* hdr) {
+        ProcessPacket(data, len,
+                      !(hdr->tp_status & TP_STATUS_CSUMNOTREADY), batch);
+      });
+      batch->Flush();
+      ring_.ReleaseBlock(block);
+    }
+  }
+
+  int sockfd_;
+  PacketRing ring_;
+  SendBatch batch_;
+  std::thread thread_;
+};
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void OnStopSignal(int) {
+  g_stop = 1;
+}
+
+// --bpf mode: the rewrite runs in the kernel on tc egress of the interface,
+// this process only keeps it attached and reports its counters.
+static int RunTcRedirect(const char* interface) {
+  TcRedirectConfig config;
+  ::memset(&config, 0, sizeof(config));
+  config.server_ip = g_server_ip_net;
+  config.server_port = ::htons(g_server_port);
+  TcRedirect redirect(interface);
+  redirect.Attach(config, g_routes);
+  // stop cleanly so the pinned maps go away with the program
+  ::signal(SIGINT, OnStopSignal);
+  ::signal(SIGTERM, OnStopSignal);
+  LOG(INFO) << "tc redirect attached to " << interface
+            << ", maps in " << redirect.PinDirectory();
+
+  TcRedirectCounters last = redirect.GetCounters();
+  while (!g_stop) {
+    ::sleep(1);
+    TcRedirectCounters counters = redirect.GetCounters();
+    LOG(INFO) << "forwarded " << counters.packets - last.packets
+              << " pkt/s, "
+              << (counters.bytes - last.bytes) * 8 / 1e6 << " Mbit/s, "
+              << "passed " << counters.passed - last.passed << " pkt/s";
+    last = counters;
+  }
+  return 0;
 }
 
 int main(int argc, char* argv[]) {
-  if (argc != 4) {
-    cerr << "usage: " << argv[0]
-         << " <client_ip> <server_port> <interface>" << endl;
+  const bool BPF_MODE = argc > 1 && ::strcmp(argv[1], "--bpf") == 0;
+  if (BPF_MODE) {
+    --argc;
+    ++argv;
+  }
+  if (argc != 4 && (BPF_MODE || argc != 5)) {
+    cerr << "usage: " << argv[0] << " [--bpf] <client_ip|route_file> "
+         << "<[server_ip:]server_port> <interface> [workers]" << endl
+         << "       " << argv[0] << " <client_ip6> "
+         << "<[[server_ip6]:]server_port> <interface> [workers]" << endl;
     return -1;
   }
 
-  struct sockaddr_in addr;
-  CHECK(::inet_pton(AF_INET, argv[1], &addr.sin_addr) != 0);
-  g_client_ip_net = addr.sin_addr.s_addr;
-  g_server_port = atoi(argv[2]);
+  // a single client host takes every fake address
+  struct in_addr addr;
+  if (::inet_pton(AF_INET6, argv[1], &g_client_ip6) == 1) {
+    if (BPF_MODE) {
+      cerr << "--bpf is ipv4 only" << endl;
+      return -1;
+    }
+    g_ipv6 = true;
+  } else if (::inet_pton(AF_INET, argv[1], &addr) == 1) {
+    g_routes.Add("0.0.0.0/0", argv[1]);
+  } else if (!g_routes.LoadFile(argv[1]) || g_routes.Empty()) {
+    cerr << "bad route file " << argv[1] << endl;
+    return -1;
+  }
+  std::string server = argv[2];
+  size_t colon = server.rfind(':');
+  if (g_ipv6 && colon != std::string::npos) {
+    if (colon < 2 || server[0] != '[' || server[colon - 1] != ']' ||
+        ::inet_pton(AF_INET6, server.substr(1, colon - 2).c_str(),
+                    &g_server_ip6) != 1) {
+      cerr << "bad server address " << server << endl;
+      return -1;
+    }
+    server = server.substr(colon + 1);
+  } else if (colon != std::string::npos) {
+    if (::inet_pton(AF_INET, server.substr(0, colon).c_str(), &addr) != 1) {
+      cerr << "bad server address " << server << endl;
+      return -1;
+    }
+    g_server_ip_net = addr.s_addr;
+    server = server.substr(colon + 1);
+  }
+  g_server_port = atoi(server.c_str());
   const char* interface = argv[3];
+  if (BPF_MODE) {
+    return RunTcRedirect(interface);
+  }
+  const int WORKERS = argc > 4 ? atoi(argv[4]) : 1;
+  CHECK(WORKERS > 0) << "workers must be positive";
 
-  g_sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
-  CHECK(g_sockfd >= 0) << "socket error: " << strerror(errno);
-  int flag = 1;
-  CHECK(setsockopt(g_sockfd, IPPROTO_IP, IP_HDRINCL, &flag, sizeof(flag)) >= 0)
-      << "setsockopt error: " << strerror(errno);
+  // keep the total ring memory about the same whatever the worker count
+  const uint32 BLOCKS_PER_WORKER = std::max(8, 64 / WORKERS);
+  const uint16 FANOUT_GROUP = ::getpid() & 0xffff;
+  std::vector<std::unique_ptr<Worker>> workers;
+  for (int i = 0; i < WORKERS; ++i) {
+    workers.emplace_back(new Worker(interface, FANOUT_GROUP,
+                                    BLOCKS_PER_WORKER));
+  }
+  for (auto& worker : workers) {
+    worker->Start();
+  }
 
-  char err[PCAP_ERRBUF_SIZE];
-  bpf_u_int32 mask;
-  bpf_u_int32 net;
-  CHECK(pcap_lookupnet(interface, &net, &mask, err) == 0)
-      << "get interface info failed: " << err;
-
-  const int SNAP_LEN = 1518;
-  const int PROMISC_MODe = 1;
-  const int TIMEOUT_MS = 1000;
-  pcap_t* handle = pcap_open_live(interface,
-                                  SNAP_LEN,
-                                  PROMISC_MODe,
-                                  TIMEOUT_MS,
-                                  err);
-  CHECK(handle != NULL) << "open interface failed: " << err;
-  CHECK(pcap_datalink(handle) == DLT_EN10MB) << "not an ethernet interface";
-
-  char filter_exp[50] = {0};
-  snprintf(filter_exp, sizeof(filter_exp), "tcp port %d", g_server_port);
-  struct bpf_program fp;
-  CHECK(pcap_compile(handle, &fp, filter_exp, 0, net) == 0)
-      << "compile filter expression failed: " << pcap_geterr(handle);
-  CHECK(pcap_setfilter(handle, &fp) == 0)
-      << "set filter failed: " << pcap_geterr(handle);
-
-  pcap_loop(handle, -1, ProcessPacket, NULL);
-
-  LOG(INFO) << "redirect loop exited";
-  ::close(g_sockfd);
-  pcap_freecode(&fp);
-  pcap_close(handle);
+  std::vector<uint64> last_packets(WORKERS, 0);
+  uint64 last_bytes = 0;
+  while (true) {
+    ::sleep(1);
+    uint64 packets = 0, bytes = 0, captured = 0, drops = 0, errors = 0;
+    std::ostringstream per_worker;
+    for (int i = 0; i < WORKERS; ++i) {
+      const SendBatch& batch = workers[i]->batch();
+      PacketRing::Stats stats = workers[i]->GetRingStats();
+      uint64 worker_packets = batch.packets();
+      per_worker << (i ? " " : "") << worker_packets - last_packets[i];
+      packets += worker_packets - last_packets[i];
+      last_packets[i] = worker_packets;
+      bytes += batch.bytes();
+      errors += batch.errors();
+      captured += stats.packets;
+      drops += stats.drops;
+    }
+    LOG(INFO) << "forwarded " << packets << " pkt/s, "
+              << (bytes - last_bytes) * 8 / 1e6 << " Mbit/s, captured "
+              << captured << ", ring drops " << drops
+              << ", send errors " << errors
+              << ", per worker pkt/s [" << per_worker.str() << "]";
+    last_bytes = bytes;
+  }
 }
@@ -0,0 +1,113 @@
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "route_table.h"
+#include "tc_redirect.h"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+
+// Inspects and reconfigures the in-kernel program of a running
+// "redirect --bpf" through its pinned maps.
+
+static void Usage(const char* name) {
+  cerr << "usage: " << name << " <interface> stats" << endl
+       << "       " << name << " <interface> config" << endl
+       << "       " << name << " <interface> server <[server_ip:]port>"
+       << endl
+       << "       " << name
+       << " <interface> route add <fake_network> <client_ip>" << endl
+       << "       " << name << " <interface> route del <fake_network>"
+       << endl;
+}
+
+static std::string IpString(uint32 ip_net) {
+  char buf[INET_ADDRSTRLEN] = {0};
+  ::inet_ntop(AF_INET, &ip_net, buf, sizeof(buf));
+  return buf;
+}
+
+static int PrefixLength(uint32 mask_net) {
+  return __builtin_popcount(mask_net);
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    Usage(argv[0]);
+    return -1;
+  }
+  TcRedirect redirect(argv[1]);
+  if (!redirect.Open()) {
+    cerr << "no redirect running on " << argv[1] << " (nothing pinned in "
+         << redirect.PinDirectory() << ")" << endl;
+    return 1;
+  }
+
+  const std::string command = argv[2];
+  if (command == "stats" && argc == 3) {
+    std::vector<TcRedirectCounters> per_cpu;
+    TcRedirectCounters total = redirect.GetCounters(&per_cpu);
+    cout << "{\"packets\":" << total.packets
+         << ",\"bytes\":" << total.bytes
+         << ",\"passed\":" << total.passed
+         << ",\"per_cpu\":[";
+    for (size_t i = 0; i < per_cpu.size(); ++i) {
+      cout << (i ? "," : "") << "{\"packets\":" << per_cpu[i].packets
+           << ",\"bytes\":" << per_cpu[i].bytes
+           << ",\"passed\":" << per_cpu[i].passed << "}";
+    }
+    cout << "]}" << endl;
+  } else if (command == "config" && argc == 3) {
+    TcRedirectConfig config = redirect.GetConfig();
+    cout << "server " << IpString(config.server_ip) << ":"
+         << ::ntohs(config.server_port) << endl;
+    for (const RouteTable::Route& route : redirect.GetRoutes()) {
+      cout << "route " << IpString(route.net) << "/"
+           << PrefixLength(route.mask) << " " << IpString(route.client_ip)
+           << endl;
+    }
+  } else if (command == "server" && argc == 4) {
+    TcRedirectConfig config;
+    ::memset(&config, 0, sizeof(config));
+    std::string server = argv[3];
+    size_t colon = server.find(':');
+    if (colon != std::string::npos) {
+      if (::inet_pton(AF_INET, server.substr(0, colon).c_str(),
+                      &config.server_ip) != 1) {
+        cerr << "bad server address " << server << endl;
+        return -1;
+      }
+      server = server.substr(colon + 1);
+    }
+    config.server_port = ::htons(::atoi(server.c_str()));
+    redirect.SetConfig(config);
+  } else if (command == "route" && argc == 6 &&
+             ::strcmp(argv[3], "add") == 0) {
+    RouteTable table;
+    if (!table.Add(argv[4], argv[5])) {
+      cerr << "bad route " << argv[4] << " " << argv[5] << endl;
+      return -1;
+    }
+    redirect.AddRoute(table.routes()[0]);
+  } else if (command == "route" && argc == 5 &&
+             ::strcmp(argv[3], "del") == 0) {
+    uint32 net, mask;
+    if (!ParseNetwork(argv[4], &net, &mask)) {
+      cerr << "bad network " << argv[4] << endl;
+      return -1;
+    }
+    if (!redirect.DeleteRoute(net, mask)) {
+      cerr << "no route for " << argv[4] << endl;
+      return 1;
+    }
+  } else {
+    Usage(argv[0]);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "connection.h"
+#include "kernel.h"
+#include "packet.h"
+#include "pcap_replay_backend.h"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::string;
+
+using tcpmany::InetAddress;
+using tcpmany::Kernel;
+using tcpmany::KernelStats;
+using tcpmany::Packet;
+using tcpmany::PcapReplayBackend;
+using tcpmany::ReplayOptions;
+
+typedef std::chrono::steady_clock Clock;
+
+static double CpuSeconds() {
+  struct rusage usage;
+  ::getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static bool SameIp(const InetAddress& a, const InetAddress& b) {
+  if (a.IsIpv6() != b.IsIpv6()) {
+    return false;
+  }
+  if (a.IsIpv6()) {
+    return ::memcmp(&a.SockAddr6().sin6_addr, &b.SockAddr6().sin6_addr,
+                    sizeof(struct in6_addr)) == 0;
+  }
+  return a.IpHost() == b.IpHost();
+}
+
+// The fake client endpoint a server packet is for. Captured on the
+// server's side it is the destination; after a redirect the fake address
+// has moved to the source.
+static InetAddress ClientOf(const Packet& packet, const InetAddress& server) {
+  const InetAddress src = packet.SrcAddress();
+  const InetAddress dst = packet.DstAddress();
+  if (SameIp(src, server)) {
+    return dst;
+  }
+  if (src.IsIpv6()) {
+    return InetAddress(src.SockAddr6().sin6_addr, dst.PortHost());
+  }
+  return InetAddress(src.IpHost(), dst.PortHost());
+}
+
+// The connections of <pcap> whose first packet from <server> is the
+// SYN-ACK, in the order they show up.
+static std::vector<InetAddress> FindConnections(const string& path,
+                                                const InetAddress& server) {
+  ReplayOptions options;
+  options.server_ports.push_back(server.PortHost());
+  PcapReplayBackend scan(path, options);
+  scan.Play();
+  std::unordered_set<string> seen;
+  std::vector<InetAddress> clients;
+  Packet packet;
+  while (!scan.Done()) {
+    if (scan.Receive(&packet) <= 0) {
+      continue;
+    }
+    const InetAddress client = ClientOf(packet, server);
+    if (seen.insert(client.ToIpPort()).second &&
+        packet.IsSyn() && packet.IsAck()) {
+      clients.push_back(client);
+    }
+  }
+  return clients;
+}
+
+// Replays the packets <server> sent in <pcap> into the receive path, with
+// no network: the connections whose SYN-ACK is in the file are set up
+// first, waiting for it, then the file is fed through the demultiplexing
+// and the state machine, as fast as they go or with -s <speed> at the
+// recorded pace times <speed>, -l <loops> times. Prints one json object
+// with the packet rate. -t <threads> runs the callbacks on that many
+// threads. The packets of other connections count as unmatched.
+int main(int argc, char* argv[]) {
+  ReplayOptions replay;
+  tcpmany::KernelOptions options;
+  int opt;
+  while ((opt = ::getopt(argc, argv, "l:s:t:")) != -1) {
+    if (opt == 'l') {
+      replay.loops = atoi(optarg);
+    } else if (opt == 's') {
+      replay.speed = atof(optarg);
+    } else if (opt == 't') {
+      options.callback_threads = atoi(optarg);
+    } else {
+      return -1;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (argc != 3) {
+    cerr << "usage: " << argv[0] << " [-s speed] [-l loops]"
+         << " [-t callback_threads] <pcap> <server_ip:port>" << endl;
+    return -1;
+  }
+  const string PATH = argv[1];
+  const InetAddress server_addr(argv[2]);
+
+  const std::vector<InetAddress> clients = FindConnections(PATH, server_addr);
+  replay.server_ports.push_back(server_addr.PortHost());
+  auto backend = std::make_shared<PcapReplayBackend>(PATH, replay);
+  options.backend = backend;
+  Kernel::Start(options);
+  for (const InetAddress& client : clients) {
+    if (client.family() != server_addr.family()) {
+      continue;
+    }
+    Kernel::NewConnection(server_addr, client)->Connect();
+  }
+
+  const double base_cpu = CpuSeconds();
+  const Clock::time_point start = Clock::now();
+  backend->Play();
+  while (!backend->Done()) {
+    ::usleep(1000);
+  }
+  const double seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  const double cpu = CpuSeconds() - base_cpu;
+
+  const KernelStats stats = Kernel::GetStats();
+  const uint64 replayed = backend->Replayed();
+  cout << "{"
+       << "\"connections\":" << clients.size() << ","
+       << "\"loops\":" << replay.loops << ","
+       << "\"speed\":" << replay.speed << ","
+       << "\"packets_replayed\":" << replayed << ","
+       << "\"packets_skipped\":" << stats.packets_filtered << ","
+       << "\"seconds\":" << seconds << ","
+       << "\"packets_per_second\":" << (seconds > 0 ? replayed / seconds : 0)
+       << ","
+       << "\"cpu_seconds\":" << cpu << ","
+       << "\"cpu_ns_per_packet\":"
+       << (replayed > 0 ? cpu * 1e9 / replayed : 0) << ","
+       << "\"established\":" << stats.established << ","
+       << "\"packets_unmatched\":" << stats.packets_unmatched << ","
+       << "\"packets_sent\":" << stats.packets_sent
+       << "}" << endl;
+  // nothing answers the FINs of a graceful Stop
+  tcpmany::FlushLogs();
+  ::_exit(0);
+}
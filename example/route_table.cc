@@ -0,0 +1,126 @@
+#include "route_table.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+bool ParseNetwork(const std::string& cidr, uint32* net, uint32* mask) {
+  std::string address = cidr;
+  int prefix = 32;
+  size_t slash = cidr.find('/');
+  if (slash != std::string::npos) {
+    address = cidr.substr(0, slash);
+    char* end = NULL;
+    prefix = ::strtol(cidr.c_str() + slash + 1, &end, 10);
+    if (*end != '\0' || end == cidr.c_str() + slash + 1 ||
+        prefix < 0 || prefix > 32) {
+      return false;
+    }
+  }
+  struct in_addr addr;
+  if (::inet_pton(AF_INET, address.c_str(), &addr) != 1) {
+    return false;
+  }
+  *mask = prefix == 0 ? 0 : ::htonl(~0u << (32 - prefix));
+  *net = addr.s_addr & *mask;
+  return true;
+}
+
+bool RouteTable::Add(const std::string& fake_network,
+                     const std::string& client_ip) {
+  Route route;
+  struct in_addr addr;
+  if (!ParseNetwork(fake_network, &route.net, &route.mask) ||
+      ::inet_pton(AF_INET, client_ip.c_str(), &addr) != 1) {
+    return false;
+  }
+  route.client_ip = addr.s_addr;
+  Add(route);
+  return true;
+}
+
+void RouteTable::Add(const Route& route) {
+  // a second route for the same network replaces the first
+  for (Route& existing : routes_) {
+    if (existing.net == route.net && existing.mask == route.mask) {
+      existing.client_ip = route.client_ip;
+      Build();
+      return;
+    }
+  }
+  routes_.push_back(route);
+  Build();
+}
+
+bool RouteTable::LoadFile(const std::string& path) {
+  std::ifstream file(path.c_str());
+  if (!file) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(file, line)) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream fields(line);
+    std::string network, client;
+    if (!(fields >> network)) {
+      continue;
+    }
+    if (!(fields >> client) || !Add(network, client)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::vector<uint32> RouteTable::Clients() const {
+  std::vector<uint32> clients;
+  for (const Route& route : routes_) {
+    if (std::find(clients.begin(), clients.end(), route.client_ip) ==
+        clients.end()) {
+      clients.push_back(route.client_ip);
+    }
+  }
+  return clients;
+}
+
+// Every route boundary starts a range, within a range the longest prefix
+// covering its first address covers all of it. Tables are a handful of
+// routes, so the quadratic build doesn't matter.
+void RouteTable::Build() {
+  std::vector<uint32> boundaries(1, 0);
+  for (const Route& route : routes_) {
+    uint32 first = ::ntohl(route.net);
+    uint32 last = first | ~::ntohl(route.mask);
+    boundaries.push_back(first);
+    if (last != 0xffffffff) {
+      boundaries.push_back(last + 1);
+    }
+  }
+  std::sort(boundaries.begin(), boundaries.end());
+  boundaries.erase(std::unique(boundaries.begin(), boundaries.end()),
+                   boundaries.end());
+
+  starts_.clear();
+  clients_.clear();
+  for (uint32 start : boundaries) {
+    uint32 client = 0;
+    uint32 longest = 0;
+    bool found = false;
+    for (const Route& route : routes_) {
+      uint32 mask = ::ntohl(route.mask);
+      if ((start & mask) == ::ntohl(route.net) &&
+          (!found || mask > longest)) {
+        client = route.client_ip;
+        longest = mask;
+        found = true;
+      }
+    }
+    if (!clients_.empty() && clients_.back() == client) {
+      continue;
+    }
+    starts_.push_back(start);
+    clients_.push_back(client);
+  }
+}
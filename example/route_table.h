@@ -0,0 +1,68 @@
+#ifndef TCPMANY_EXAMPLE_ROUTE_TABLE_H_
+#define TCPMANY_EXAMPLE_ROUTE_TABLE_H_
+
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+
+#include "base.h"
+
+// Parses "a.b.c.d/prefix" (a bare address is a /32) into a network and a
+// mask, both in network order.
+bool ParseNetwork(const std::string& cidr, uint32* net, uint32* mask);
+
+// Maps fake client addresses to the real client host that owns them, so
+// several load generators can share one redirect. Routes are CIDR
+// networks, the longest matching prefix wins. Lookups go through a sorted
+// list of disjoint address ranges flattened from the routes, one binary
+// search whatever the nesting.
+class RouteTable {
+ public:
+  // everything in network order
+  struct Route {
+    uint32 net;
+    uint32 mask;
+    uint32 client_ip;
+  };
+
+  // false if either address doesn't parse
+  bool Add(const std::string& fake_network, const std::string& client_ip);
+  void Add(const Route& route);
+  // "<fake_network> <client_ip>" per line, '#' starts a comment
+  bool LoadFile(const std::string& path);
+
+  // the client host for |ip_net| (network order), 0 if no route matches
+  uint32 Lookup(uint32 ip_net) const {
+    uint32 ip = ::ntohl(ip_net);
+    size_t low = 0, high = starts_.size();
+    // last range starting at or below ip, starts_[0] is always 0
+    while (high - low > 1) {
+      size_t middle = (low + high) / 2;
+      if (starts_[middle] <= ip) {
+        low = middle;
+      } else {
+        high = middle;
+      }
+    }
+    return clients_.empty() ? 0 : clients_[low];
+  }
+
+  const std::vector<Route>& routes() const {
+    return routes_;
+  }
+  // distinct client hosts, network order
+  std::vector<uint32> Clients() const;
+  bool Empty() const {
+    return routes_.empty();
+  }
+
+ private:
+  void Build();
+
+  std::vector<Route> routes_;
+  // range i covers [starts_[i], starts_[i + 1]) in host order
+  std::vector<uint32> starts_;
+  std::vector<uint32> clients_;
+};
+
+#endif  // TCPMANY_EXAMPLE_ROUTE_TABLE_H_
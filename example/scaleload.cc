@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include "connection.h"
+#include "kernel.h"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::string;
+
+using tcpmany::Connection;
+using tcpmany::InetAddress;
+using tcpmany::IpRange;
+using tcpmany::Kernel;
+using tcpmany::KernelStats;
+
+typedef std::chrono::steady_clock Clock;
+
+static double SecondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static int64 RssBytes() {
+  std::ifstream status("/proc/self/status");
+  string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmRSS:") == 0) {
+      return atoll(line.c_str() + 6) * 1024;
+    }
+  }
+  return 0;
+}
+
+static double CpuSeconds() {
+  struct rusage usage;
+  ::getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// "<n>[k|m|g]", in bytes
+static uint64 ParseBytes(const char* text) {
+  char* end = NULL;
+  double bytes = ::strtod(text, &end);
+  if (*end == 'k' || *end == 'K') {
+    bytes *= 1 << 10;
+  } else if (*end == 'm' || *end == 'M') {
+    bytes *= 1 << 20;
+  } else if (*end == 'g' || *end == 'G') {
+    bytes *= 1 << 30;
+  }
+  return static_cast<uint64>(bytes);
+}
+
+// stands in for application logic in the callbacks
+static void Spin(int64 microseconds) {
+  const Clock::time_point end =
+      Clock::now() + std::chrono::microseconds(microseconds);
+  while (Clock::now() < end) {
+  }
+}
+
+// Opens <count> connections at <rate> per second, waits until they are all
+// established (or progress stops for <settle> seconds), holds them for
+// <hold> seconds and prints what it measured as one json object. With
+// -c <interface> the replies are captured there instead of coming back
+// through a redirect. -w <us> busies every connected and message callback
+// for that long, -t <threads> runs the callbacks on that many threads
+// instead of the receive thread. -p <first>-<last> gives every fake address
+// that many ports, so <count> connections need <count>/ports addresses
+// starting at <local_ip> instead of one address each, ipv6 needs it. -o
+// <file> saves the
+// established connections there before exiting, -r <file> picks them up
+// again at start, only the rest of <count> is opened anew. -P <file>
+// records the headers of every packet sent and received there, as pcap.
+// -T fin|rst|forget[:rate] is how the connections are ended at exit, with
+// that many FINs or RSTs per second at most, rst by default: a graceful
+// close can take longer than the whole run. With -o
+// they are forgotten, the server has to keep them for the restore.
+// -I <spec>, once per group, impairs the packets of a share of the
+// clients, e.g. -I share=0.1,drop=0.02,delay=50,jitter=20 (see
+// ParseImpairmentGroup). -M <bytes>[k|m|g] is the kernel's memory budget,
+// the ramp ends early once a connection is refused.
+int main(int argc, char* argv[]) {
+  tcpmany::KernelOptions options;
+  options.teardown.mode = tcpmany::TEARDOWN_RST;
+  int64 callback_work_us = 0;
+  const char* ports = NULL;
+  const char* save_path = NULL;
+  const char* restore_path = NULL;
+  int opt;
+  while ((opt = ::getopt(argc, argv, "c:o:p:r:t:w:I:M:P:T:")) != -1) {
+    if (opt == 'c') {
+      options.capture_interface = optarg;
+    } else if (opt == 't') {
+      options.callback_threads = atoi(optarg);
+    } else if (opt == 'o') {
+      save_path = optarg;
+    } else if (opt == 'p') {
+      ports = optarg;
+    } else if (opt == 'r') {
+      restore_path = optarg;
+    } else if (opt == 'w') {
+      callback_work_us = atoll(optarg);
+    } else if (opt == 'I') {
+      tcpmany::ImpairmentGroup group;
+      if (!tcpmany::ParseImpairmentGroup(optarg, &group)) {
+        cerr << "invalid impairment: " << optarg << endl;
+        return -1;
+      }
+      options.impairment.groups.push_back(group);
+    } else if (opt == 'M') {
+      options.memory_budget = ParseBytes(optarg);
+    } else if (opt == 'P') {
+      options.record.path = optarg;
+      options.record.headers_only = true;
+    } else if (opt == 'T') {
+      char* rate = ::strchr(optarg, ':');
+      if (rate != NULL) {
+        *rate = '\0';
+        options.teardown.rate = atoi(rate + 1);
+      }
+      if (::strcmp(optarg, "fin") == 0) {
+        options.teardown.mode = tcpmany::TEARDOWN_FIN;
+      } else if (::strcmp(optarg, "rst") == 0) {
+        options.teardown.mode = tcpmany::TEARDOWN_RST;
+      } else if (::strcmp(optarg, "forget") == 0) {
+        options.teardown.mode = tcpmany::TEARDOWN_FORGET;
+      } else {
+        cerr << "unknown teardown: " << optarg << endl;
+        return -1;
+      }
+    } else {
+      return -1;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (argc < 6 || argc > 8) {
+    cerr << "usage: " << argv[0] << " [-c capture_interface]"
+         << " [-p first_port-last_port] [-o save_snapshot]"
+         << " [-r restore_snapshot] [-P record_pcap] [-T fin|rst|forget[:rate]]"
+         << " [-I impairment]... [-M memory_budget]"
+         << " [-t callback_threads] [-w callback_work_us]"
+         << " <ip> <port> <count> <rate> <local_ip> [hold_s] [settle_s]"
+         << endl;
+    return -1;
+  }
+  const InetAddress server_addr(argv[1], atoi(argv[2]));
+  const int COUNT = atoi(argv[3]);
+  const double RATE = atof(argv[4]);
+  const uint32 FIRST_IP = ::ntohl(::inet_addr(argv[5]));
+  const double HOLD_SECONDS = argc > 6 ? atof(argv[6]) : 0;
+  const double SETTLE_SECONDS = argc > 7 ? atof(argv[7]) : 3;
+  const uint16 LOCAL_PORT = 13579;
+
+  if (save_path != NULL) {
+    options.teardown.mode = tcpmany::TEARDOWN_FORGET;
+  }
+
+  const bool IPV6 = ::strchr(argv[5], ':') != NULL;
+  if (IPV6 && ports == NULL) {
+    cerr << "an ipv6 local_ip needs -p" << endl;
+    return -1;
+  }
+
+  options.servers.push_back(server_addr);
+  if (ports != NULL) {
+    tcpmany::SourceRange sources;
+    const string local_ip = IPV6 ? "[" + string(argv[5]) + "]" : argv[5];
+    if (!tcpmany::ParseSourceRange(local_ip + ":" + ports, &sources)) {
+      cerr << "invalid port range: " << ports << endl;
+      return -1;
+    }
+    uint32 port_count = sources.last_port - sources.first_port + 1;
+    sources.ips.last = sources.ips.first + (COUNT - 1) / port_count;
+    options.source_ranges.push_back(sources);
+  } else {
+    IpRange clients = {FIRST_IP, FIRST_IP + COUNT - 1};
+    options.client_ranges.push_back(clients);
+  }
+  Kernel::Start(options);
+  const int64 base_rss = RssBytes();
+  const double base_cpu = CpuSeconds();
+
+  // samples the established count while the ramp is running
+  std::atomic<bool> sampling(true);
+  std::atomic<uint64> peak_established(0);
+  std::atomic<double> peak_time(0);
+  const Clock::time_point start = Clock::now();
+  std::thread sampler([&] {
+    while (sampling) {
+      uint64 established = Kernel::GetStats().established;
+      if (established > peak_established) {
+        peak_established = established;
+        peak_time = SecondsSince(start);
+      }
+      ::usleep(10 * 1000);
+    }
+  });
+
+  auto simulate_work = [callback_work_us](Connection* conn) {
+    if (callback_work_us > 0) {
+      conn->SetConnectedCallback([callback_work_us](Connection&) {
+        Spin(callback_work_us);
+      });
+      conn->SetMessageCallback(
+          [callback_work_us](Connection&, const char*, int) {
+            Spin(callback_work_us);
+          });
+    }
+  };
+
+  int64 restored = 0;
+  double restore_seconds = 0;
+  if (restore_path != NULL) {
+    restored = Kernel::RestoreSnapshot(restore_path, [&](Connection& conn) {
+      simulate_work(&conn);
+    });
+    if (restored < 0) {
+      return -1;
+    }
+    restore_seconds = SecondsSince(start);
+  }
+
+  // without -p the restored connections are taken to be the first ones
+  int opened = restored;
+  for (int i = restored; i < COUNT; ++i) {
+    double due = (i - restored) / RATE + restore_seconds;
+    double now = SecondsSince(start);
+    if (due > now + 0.001) {
+      ::usleep(static_cast<useconds_t>((due - now) * 1e6));
+    }
+    Connection* conn;
+    if (ports != NULL) {
+      conn = Kernel::NewConnection(server_addr);
+    } else {
+      InetAddress client_addr(FIRST_IP + i, LOCAL_PORT);
+      conn = Kernel::NewConnection(server_addr, client_addr);
+    }
+    if (conn == NULL) {
+      // out of source endpoints or over the memory budget
+      break;
+    }
+    simulate_work(conn);
+    conn->Connect();
+    ++opened;
+  }
+  const double ramp_seconds = SecondsSince(start);
+
+  double last_progress = SecondsSince(start);
+  uint64 last_peak = 0;
+  while (peak_established < static_cast<uint64>(opened) &&
+         SecondsSince(start) - last_progress < SETTLE_SECONDS) {
+    if (peak_established != last_peak) {
+      last_peak = peak_established;
+      last_progress = SecondsSince(start);
+    }
+    ::usleep(10 * 1000);
+  }
+  // usleep takes 32 bits of microseconds, not much more than an hour
+  std::this_thread::sleep_for(
+      std::chrono::duration<double>(HOLD_SECONDS));
+  sampling = false;
+  sampler.join();
+  int64 saved = 0;
+  if (save_path != NULL) {
+    saved = Kernel::SaveSnapshot(save_path);
+  }
+  if (!options.record.path.empty()) {
+    Kernel::SaveRecording();
+  }
+
+  const KernelStats stats = Kernel::GetStats();
+  const uint64 peak = peak_established;
+  const int64 rss = RssBytes();
+  const double cpu = CpuSeconds() - base_cpu;
+  const double connect_seconds =
+      peak_time > 0 ? peak_time.load() : ramp_seconds;
+  cout << "{"
+       << "\"connections_requested\":" << COUNT << ","
+       << "\"connections_opened\":" << opened << ","
+       << "\"target_rate\":" << RATE << ","
+       << "\"ramp_seconds\":" << ramp_seconds << ","
+       << "\"restored\":" << restored << ","
+       << "\"restore_seconds\":" << restore_seconds << ","
+       << "\"saved\":" << saved << ","
+       << "\"connections_per_second\":"
+       << (connect_seconds > 0 ? peak / connect_seconds : 0) << ","
+       << "\"peak_established\":" << peak << ","
+       << "\"established\":" << stats.established << ","
+       << "\"syn_sent\":" << stats.syn_sent << ","
+       << "\"rss_bytes\":" << rss << ","
+       << "\"rss_bytes_per_connection\":"
+       << (peak > 0 ? (rss - base_rss) / static_cast<double>(peak) : 0) << ","
+       << "\"cpu_seconds\":" << cpu << ","
+       << "\"cpu_ms_per_1k_connections\":"
+       << (peak > 0 ? cpu * 1e3 * 1000 / peak : 0) << ","
+       << "\"packets_received\":" << stats.packets_received << ","
+       << "\"packets_sent\":" << stats.packets_sent << ","
+       << "\"packets_unmatched\":" << stats.packets_unmatched << ","
+       << "\"receive_drops\":" << stats.receive_drops << ","
+       << "\"packets_filtered\":" << stats.packets_filtered << ","
+       << "\"source_ips_in_use\":" << stats.source_ips_in_use << ","
+       << "\"callbacks_dispatched\":" << stats.callbacks_dispatched << ","
+       << "\"callbacks_queued\":" << stats.callbacks_queued << ","
+       << "\"callback_queue_waits\":" << stats.callback_queue_waits << ","
+       << "\"packets_recorded\":" << stats.packets_recorded << ","
+       << "\"record_drops\":" << stats.record_drops << ","
+       << "\"impaired_drops\":" << stats.impaired_drops << ","
+       << "\"impaired_duplicates\":" << stats.impaired_duplicates << ","
+       << "\"impaired_reorders\":" << stats.impaired_reorders << ","
+       << "\"memory_connections\":" << stats.memory_connections << ","
+       << "\"memory_tables\":" << stats.memory_tables << ","
+       << "\"memory_packets\":" << stats.memory_packets << ","
+       << "\"memory_callbacks\":" << stats.memory_callbacks << ","
+       << "\"memory_sources\":" << stats.memory_sources << ","
+       << "\"memory_recorder\":" << stats.memory_recorder << ","
+       << "\"memory_total\":" << stats.memory_total << ","
+       << "\"memory_per_connection\":" << stats.memory_per_connection << ","
+       << "\"memory_refused_connections\":"
+       << stats.memory_refused_connections << ","
+       << "\"memory_refused_sends\":" << stats.memory_refused_sends << ",";
+  const Clock::time_point stop_start = Clock::now();
+  Kernel::Stop();
+  cout << "\"teardown_seconds\":" << SecondsSince(stop_start)
+       << "}" << endl;
+  tcpmany::FlushLogs();
+  return 0;
+}
@@ -0,0 +1,202 @@
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "connection.h"
+#include "kernel.h"
+#include "memory_backend.h"
+#include "session.h"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+
+using tcpmany::AsyncConnection;
+using tcpmany::Connection;
+using tcpmany::InetAddress;
+using tcpmany::Kernel;
+using tcpmany::KernelStats;
+using tcpmany::Session;
+using tcpmany::SessionStats;
+
+typedef std::chrono::steady_clock Clock;
+
+namespace {
+
+struct Script {
+  int heartbeats;
+  std::chrono::milliseconds interval;
+};
+
+std::atomic<uint64> g_completed(0);
+std::atomic<uint64> g_failed(0);
+
+// nothing is retransmitted, a lost SYN or reply fails the session after
+// this instead of leaving it waiting
+const std::chrono::seconds kTimeout(3);
+
+// A chat-like client against an echo server: log in, wait for the answer,
+// then a heartbeat every interval, each one answered. The parameters are
+// taken by value so the frame keeps its own copies.
+Session Run(Connection* c, int id, Script script) {
+  AsyncConnection conn(c);
+  if (!co_await conn.Connect(kTimeout)) {
+    ++g_failed;
+    co_return;
+  }
+  const string login = "LOGIN " + std::to_string(id) + "\n";
+  co_await conn.Send(login);
+  if (co_await conn.Read(login.size(), kTimeout) != login) {
+    ++g_failed;
+    co_return;
+  }
+  for (int i = 0; i < script.heartbeats; ++i) {
+    co_await tcpmany::Sleep(script.interval);
+    co_await conn.Send("PING\n");
+    if ((co_await conn.Read(5, kTimeout)).size() != 5) {
+      ++g_failed;
+      co_return;
+    }
+  }
+  ++g_completed;
+}
+
+double SecondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+int64 RssBytes() {
+  std::ifstream status("/proc/self/status");
+  string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmRSS:") == 0) {
+      return atoll(line.c_str() + 6) * 1024;
+    }
+  }
+  return 0;
+}
+
+double CpuSeconds() {
+  struct rusage usage;
+  ::getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+}  // namespace
+
+// Starts <count> scripted sessions at <rate> per second against an echo
+// server (fakeserver's default mode), each sending <heartbeats> heartbeats
+// <interval_ms> apart, waits for all of them to end and prints one json
+// object. -M runs against the in-process MemoryBackend instead, no root or
+// network needed; -c and -t are the same as for scaleload.
+int main(int argc, char* argv[]) {
+  tcpmany::KernelOptions options;
+  bool memory = false;
+  int opt;
+  while ((opt = ::getopt(argc, argv, "c:t:M")) != -1) {
+    if (opt == 'c') {
+      options.capture_interface = optarg;
+    } else if (opt == 't') {
+      options.callback_threads = atoi(optarg);
+    } else if (opt == 'M') {
+      memory = true;
+    } else {
+      return -1;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (argc != 8) {
+    cerr << "usage: " << argv[0] << " [-M] [-c capture_interface]"
+         << " [-t callback_threads] <ip> <port> <count> <rate> <local_ip>"
+         << " <heartbeats> <interval_ms>" << endl;
+    return -1;
+  }
+  const InetAddress server_addr(argv[1], atoi(argv[2]));
+  const int COUNT = atoi(argv[3]);
+  const double RATE = atof(argv[4]);
+  const uint32 FIRST_IP = ::ntohl(::inet_addr(argv[5]));
+  const uint16 LOCAL_PORT = 13579;
+  Script script;
+  script.heartbeats = atoi(argv[6]);
+  script.interval = std::chrono::milliseconds(atoi(argv[7]));
+
+  if (memory) {
+    options.backend = std::make_shared<tcpmany::MemoryBackend>();
+  }
+  options.servers.push_back(server_addr);
+  tcpmany::IpRange clients = {FIRST_IP, FIRST_IP + COUNT - 1};
+  options.client_ranges.push_back(clients);
+  Kernel::Start(options);
+  const int64 base_rss = RssBytes();
+  const double base_cpu = CpuSeconds();
+
+  const Clock::time_point start = Clock::now();
+  uint64 peak_running = 0;
+  int64 peak_rss = 0;
+  for (int i = 0; i < COUNT; ++i) {
+    double due = i / RATE;
+    double now = SecondsSince(start);
+    if (due > now + 0.001) {
+      ::usleep(static_cast<useconds_t>((due - now) * 1e6));
+    }
+    InetAddress client_addr(FIRST_IP + i, LOCAL_PORT);
+    Run(Kernel::NewConnection(server_addr, client_addr), i, script);
+    if (i % 1024 == 0) {
+      peak_running = std::max(peak_running,
+                               tcpmany::GetSessionStats().running);
+    }
+  }
+  const double ramp_seconds = SecondsSince(start);
+
+  // ends when every session is done or nothing has happened for 3s
+  uint64 last_done = 0;
+  double last_progress = SecondsSince(start);
+  while (g_completed + g_failed < static_cast<uint64>(COUNT) &&
+         SecondsSince(start) - last_progress < 3 + script.interval.count() /
+                                                   1000.0) {
+    uint64 done = g_completed + g_failed;
+    if (done != last_done) {
+      last_done = done;
+      last_progress = SecondsSince(start);
+    }
+    peak_running = std::max(peak_running, tcpmany::GetSessionStats().running);
+    peak_rss = std::max(peak_rss, RssBytes());
+    ::usleep(10 * 1000);
+  }
+
+  const SessionStats sessions = tcpmany::GetSessionStats();
+  const KernelStats stats = Kernel::GetStats();
+  const double cpu = CpuSeconds() - base_cpu;
+  cout << "{"
+       << "\"sessions_requested\":" << COUNT << ","
+       << "\"ramp_seconds\":" << ramp_seconds << ","
+       << "\"seconds\":" << SecondsSince(start) << ","
+       << "\"completed\":" << g_completed << ","
+       << "\"failed\":" << g_failed << ","
+       << "\"still_running\":" << sessions.running << ","
+       << "\"peak_running\":" << peak_running << ","
+       << "\"frame_bytes\":" << sessions.frame_bytes << ","
+       << "\"large_frames\":" << sessions.large_frames << ","
+       << "\"peak_rss_bytes_per_session\":"
+       << (peak_running > 0 ?
+           (peak_rss - base_rss) / static_cast<double>(peak_running) : 0)
+       << ","
+       << "\"cpu_seconds\":" << cpu << ","
+       << "\"packets_received\":" << stats.packets_received << ","
+       << "\"packets_sent\":" << stats.packets_sent << ","
+       << "\"receive_drops\":" << stats.receive_drops
+       << "}" << endl;
+  tcpmany::FlushLogs();
+  ::_exit(0);
+}
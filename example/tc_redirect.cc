@@ -0,0 +1,422 @@
+#include "tc_redirect.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/magic.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "ebpf.h"
+#include "logging.h"
+
+using tcpmany::BpfSyscall;
+using tcpmany::CreateBpfMap;
+using tcpmany::EbpfAssembler;
+using tcpmany::LoadBpfProgram;
+using tcpmany::PossibleCpus;
+
+// Not in older uapi headers, the value is fixed by the kernel abi.
+static const uint32 kTcxEgress = 47;
+// tcx return code to hand the packet on to the next program, or the stack
+static const int32 kTcxNext = -1;
+static const char kPinRoot[] = "/sys/fs/bpf/tcpmany";
+static const char* const kPinNames[] = {"config", "routes", "counters"};
+static const uint32 kMaxRoutes = 1024;
+
+// key of the lpm trie route map
+struct RouteKey {
+  uint32 prefix_length;
+  uint32 net;
+};
+
+// offsets into the frame, the program only handles ethernet
+static const int16 kEthProto = 12;
+static const int16 kIpStart = ETH_HLEN;
+static const int16 kIpFragment = kIpStart + 6;
+static const int16 kIpProtocol = kIpStart + 9;
+static const int16 kIpCheck = kIpStart + 10;
+static const int16 kIpSrc = kIpStart + 12;
+static const int16 kIpDst = kIpStart + 16;
+static const int16 kIpMinEnd = kIpStart + 20;
+// offsets into the tcp header
+static const int16 kTcpSrcPort = 0;
+static const int16 kTcpCheck = 16;
+// stack slots
+static const int16 kStackKey = -4;
+static const int16 kStackTcpOffset = -16;
+static const int16 kStackPort = -24;
+static const int16 kStackOldSrc = -32;
+static const int16 kStackNewAddrs = -40;
+// struct bpf_lpm_trie_key with a 4 byte address
+static const int16 kStackRouteKey = -48;
+
+// r6 skb, r7 old destination, r8 config and later the client, r9 counters
+static std::vector<struct bpf_insn> RedirectProgram(int config_fd,
+                                                    int routes_fd,
+                                                    int counters_fd) {
+  EbpfAssembler a;
+  a.MovReg(BPF_REG_6, BPF_REG_1);
+  a.StoreImm(BPF_W, BPF_REG_10, kStackKey, 0);
+
+  a.LoadMap(BPF_REG_1, counters_fd);
+  a.MovReg(BPF_REG_2, BPF_REG_10);
+  a.AluImm(BPF_ADD, BPF_REG_2, kStackKey);
+  a.Call(BPF_FUNC_map_lookup_elem);
+  a.JumpImm(BPF_JEQ, BPF_REG_0, 0, "out");
+  a.MovReg(BPF_REG_9, BPF_REG_0);
+
+  a.LoadMap(BPF_REG_1, config_fd);
+  a.MovReg(BPF_REG_2, BPF_REG_10);
+  a.AluImm(BPF_ADD, BPF_REG_2, kStackKey);
+  a.Call(BPF_FUNC_map_lookup_elem);
+  a.JumpImm(BPF_JEQ, BPF_REG_0, 0, "out");
+  a.MovReg(BPF_REG_8, BPF_REG_0);
+
+  a.Load(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct __sk_buff, data));
+  a.Load(BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct __sk_buff, data_end));
+  a.MovReg(BPF_REG_4, BPF_REG_2);
+  a.AluImm(BPF_ADD, BPF_REG_4, kIpMinEnd);
+  a.JumpReg(BPF_JGT, BPF_REG_4, BPF_REG_3, "out");
+  a.Load(BPF_H, BPF_REG_4, BPF_REG_2, kEthProto);
+  a.JumpImm(BPF_JNE, BPF_REG_4, ::htons(ETH_P_IP), "out");
+
+  // from here on every non matching packet counts as passed
+  a.Load(BPF_B, BPF_REG_4, BPF_REG_2, kIpProtocol);
+  a.JumpImm(BPF_JNE, BPF_REG_4, IPPROTO_TCP, "pass");
+  // later fragments carry no tcp header
+  a.Load(BPF_H, BPF_REG_4, BPF_REG_2, kIpFragment);
+  a.AluImm(BPF_AND, BPF_REG_4, ::htons(0x1fff));
+  a.JumpImm(BPF_JNE, BPF_REG_4, 0, "pass");
+  a.Load(BPF_W, BPF_REG_4, BPF_REG_2, kIpSrc);
+  a.Store(BPF_W, BPF_REG_10, kStackOldSrc, BPF_REG_4);
+  a.Load(BPF_W, BPF_REG_5, BPF_REG_8,
+         offsetof(TcRedirectConfig, server_ip));
+  a.JumpImm(BPF_JEQ, BPF_REG_5, 0, "any_server");
+  a.JumpReg(BPF_JNE, BPF_REG_4, BPF_REG_5, "pass");
+  a.Label("any_server");
+  a.Load(BPF_W, BPF_REG_7, BPF_REG_2, kIpDst);
+
+  // the tcp header follows the ip options, read the port with a helper
+  // rather than proving a variable packet offset to the verifier
+  a.Load(BPF_B, BPF_REG_4, BPF_REG_2, kIpStart);
+  a.AluImm(BPF_AND, BPF_REG_4, 0x0f);
+  a.AluImm(BPF_LSH, BPF_REG_4, 2);
+  a.JumpImm(BPF_JLT, BPF_REG_4, 20, "pass");
+  a.AluImm(BPF_ADD, BPF_REG_4, kIpStart);
+  a.Store(BPF_DW, BPF_REG_10, kStackTcpOffset, BPF_REG_4);
+  a.MovReg(BPF_REG_1, BPF_REG_6);
+  a.MovReg(BPF_REG_2, BPF_REG_4);
+  a.AluImm(BPF_ADD, BPF_REG_2, kTcpSrcPort);
+  a.MovReg(BPF_REG_3, BPF_REG_10);
+  a.AluImm(BPF_ADD, BPF_REG_3, kStackPort);
+  a.MovImm(BPF_REG_4, sizeof(uint16));
+  a.Call(BPF_FUNC_skb_load_bytes);
+  a.JumpImm(BPF_JNE, BPF_REG_0, 0, "pass");
+  a.Load(BPF_H, BPF_REG_4, BPF_REG_10, kStackPort);
+  a.Load(BPF_H, BPF_REG_5, BPF_REG_8,
+         offsetof(TcRedirectConfig, server_port));
+  a.JumpReg(BPF_JNE, BPF_REG_4, BPF_REG_5, "pass");
+
+  // the client host owning the destination, from here on r8 holds it
+  a.StoreImm(BPF_W, BPF_REG_10, kStackRouteKey, 32);
+  a.Store(BPF_W, BPF_REG_10, kStackRouteKey + 4, BPF_REG_7);
+  a.LoadMap(BPF_REG_1, routes_fd);
+  a.MovReg(BPF_REG_2, BPF_REG_10);
+  a.AluImm(BPF_ADD, BPF_REG_2, kStackRouteKey);
+  a.Call(BPF_FUNC_map_lookup_elem);
+  a.JumpImm(BPF_JEQ, BPF_REG_0, 0, "pass");
+  a.Load(BPF_W, BPF_REG_8, BPF_REG_0, 0);
+  // already rewritten, or a route pointing into a client's own range
+  a.JumpReg(BPF_JEQ, BPF_REG_7, BPF_REG_8, "pass");
+
+  // source: old source -> old destination
+  // destination: old destination -> client
+  // the tcp checksum covers both through the pseudo header
+  a.MovReg(BPF_REG_1, BPF_REG_6);
+  a.Load(BPF_DW, BPF_REG_2, BPF_REG_10, kStackTcpOffset);
+  a.AluImm(BPF_ADD, BPF_REG_2, kTcpCheck);
+  a.Load(BPF_W, BPF_REG_3, BPF_REG_10, kStackOldSrc);
+  a.MovReg(BPF_REG_4, BPF_REG_7);
+  a.MovImm(BPF_REG_5, BPF_F_PSEUDO_HDR | sizeof(uint32));
+  a.Call(BPF_FUNC_l4_csum_replace);
+  a.JumpImm(BPF_JNE, BPF_REG_0, 0, "pass");
+  a.MovReg(BPF_REG_1, BPF_REG_6);
+  a.Load(BPF_DW, BPF_REG_2, BPF_REG_10, kStackTcpOffset);
+  a.AluImm(BPF_ADD, BPF_REG_2, kTcpCheck);
+  a.MovReg(BPF_REG_3, BPF_REG_7);
+  a.MovReg(BPF_REG_4, BPF_REG_8);
+  a.MovImm(BPF_REG_5, BPF_F_PSEUDO_HDR | sizeof(uint32));
+  a.Call(BPF_FUNC_l4_csum_replace);
+  a.JumpImm(BPF_JNE, BPF_REG_0, 0, "pass");
+  a.MovReg(BPF_REG_1, BPF_REG_6);
+  a.MovImm(BPF_REG_2, kIpCheck);
+  a.Load(BPF_W, BPF_REG_3, BPF_REG_10, kStackOldSrc);
+  a.MovReg(BPF_REG_4, BPF_REG_7);
+  a.MovImm(BPF_REG_5, sizeof(uint32));
+  a.Call(BPF_FUNC_l3_csum_replace);
+  a.JumpImm(BPF_JNE, BPF_REG_0, 0, "pass");
+  a.MovReg(BPF_REG_1, BPF_REG_6);
+  a.MovImm(BPF_REG_2, kIpCheck);
+  a.MovReg(BPF_REG_3, BPF_REG_7);
+  a.MovReg(BPF_REG_4, BPF_REG_8);
+  a.MovImm(BPF_REG_5, sizeof(uint32));
+  a.Call(BPF_FUNC_l3_csum_replace);
+  a.JumpImm(BPF_JNE, BPF_REG_0, 0, "pass");
+
+  // saddr and daddr are adjacent, write both at once
+  a.Store(BPF_W, BPF_REG_10, kStackNewAddrs, BPF_REG_7);
+  a.Store(BPF_W, BPF_REG_10, kStackNewAddrs + 4, BPF_REG_8);
+  a.MovReg(BPF_REG_1, BPF_REG_6);
+  a.MovImm(BPF_REG_2, kIpSrc);
+  a.MovReg(BPF_REG_3, BPF_REG_10);
+  a.AluImm(BPF_ADD, BPF_REG_3, kStackNewAddrs);
+  a.MovImm(BPF_REG_4, 2 * sizeof(uint32));
+  a.MovImm(BPF_REG_5, 0);
+  a.Call(BPF_FUNC_skb_store_bytes);
+  a.JumpImm(BPF_JNE, BPF_REG_0, 0, "pass");
+
+  // counters are per cpu, no atomics needed
+  a.Load(BPF_DW, BPF_REG_1, BPF_REG_9, offsetof(TcRedirectCounters, packets));
+  a.AluImm(BPF_ADD, BPF_REG_1, 1);
+  a.Store(BPF_DW, BPF_REG_9, offsetof(TcRedirectCounters, packets), BPF_REG_1);
+  a.Load(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct __sk_buff, len));
+  a.Load(BPF_DW, BPF_REG_1, BPF_REG_9, offsetof(TcRedirectCounters, bytes));
+  a.AluReg(BPF_ADD, BPF_REG_1, BPF_REG_2);
+  a.Store(BPF_DW, BPF_REG_9, offsetof(TcRedirectCounters, bytes), BPF_REG_1);
+  a.MovImm(BPF_REG_0, kTcxNext);
+  a.Exit();
+
+  a.Label("pass");
+  a.Load(BPF_DW, BPF_REG_1, BPF_REG_9, offsetof(TcRedirectCounters, passed));
+  a.AluImm(BPF_ADD, BPF_REG_1, 1);
+  a.Store(BPF_DW, BPF_REG_9, offsetof(TcRedirectCounters, passed), BPF_REG_1);
+  a.Label("out");
+  a.MovImm(BPF_REG_0, kTcxNext);
+  a.Exit();
+  return a.Program();
+}
+
+TcRedirect::TcRedirect(const std::string& interface)
+    : interface_(interface),
+      config_fd_(-1),
+      routes_fd_(-1),
+      counters_fd_(-1),
+      prog_fd_(-1),
+      link_fd_(-1),
+      pinned_(false) {
+}
+
+TcRedirect::~TcRedirect() {
+  if (pinned_) {
+    Unpin();
+    ::rmdir(PinDirectory().c_str());
+  }
+  int fds[] = {link_fd_, prog_fd_, counters_fd_, routes_fd_, config_fd_};
+  for (int fd : fds) {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+}
+
+std::string TcRedirect::PinDirectory() const {
+  return std::string(kPinRoot) + "/" + interface_;
+}
+
+void TcRedirect::Attach(const TcRedirectConfig& config,
+                        const RouteTable& routes) {
+  CHECK(prog_fd_ < 0) << "already attached";
+  uint32 ifindex = ::if_nametoindex(interface_.c_str());
+  CHECK(ifindex != 0) << "unknown interface " << interface_;
+
+  config_fd_ = CreateBpfMap(BPF_MAP_TYPE_ARRAY, sizeof(uint32),
+                            sizeof(TcRedirectConfig), 1, "tm_config");
+  routes_fd_ = CreateBpfMap(BPF_MAP_TYPE_LPM_TRIE, sizeof(RouteKey),
+                            sizeof(uint32), kMaxRoutes, "tm_routes");
+  counters_fd_ = CreateBpfMap(BPF_MAP_TYPE_PERCPU_ARRAY, sizeof(uint32),
+                              sizeof(TcRedirectCounters), 1, "tm_counters");
+  CHECK(config_fd_ >= 0 && routes_fd_ >= 0 && counters_fd_ >= 0)
+      << "bpf map create error: " << strerror(errno);
+  SetConfig(config);
+  for (const RouteTable::Route& route : routes.routes()) {
+    AddRoute(route);
+  }
+
+  std::vector<struct bpf_insn> program =
+      RedirectProgram(config_fd_, routes_fd_, counters_fd_);
+  std::string log;
+  prog_fd_ = LoadBpfProgram(BPF_PROG_TYPE_SCHED_CLS, program, "tm_redirect",
+                            &log);
+  CHECK(prog_fd_ >= 0) << "bpf prog load error: " << strerror(errno)
+                       << "\n" << log;
+
+  union bpf_attr attr;
+  ::memset(&attr, 0, sizeof(attr));
+  attr.link_create.prog_fd = prog_fd_;
+  attr.link_create.target_ifindex = ifindex;
+  attr.link_create.attach_type = kTcxEgress;
+  link_fd_ = BpfSyscall(BPF_LINK_CREATE, &attr);
+  CHECK(link_fd_ >= 0) << "tcx attach to " << interface_ << " error: "
+                       << strerror(errno);
+  Pin();
+}
+
+void TcRedirect::Pin() {
+  struct statfs fs;
+  if (::statfs("/sys/fs/bpf", &fs) != 0 || fs.f_type != BPF_FS_MAGIC) {
+    LOG(WARNING) << "no bpf filesystem, redirectctl won't find the maps";
+    return;
+  }
+  ::mkdir(kPinRoot, 0700);
+  ::mkdir(PinDirectory().c_str(), 0700);
+  // left over by a redirect that was killed
+  Unpin();
+  int fds[] = {config_fd_, routes_fd_, counters_fd_};
+  for (int i = 0; i < 3; ++i) {
+    std::string path = PinDirectory() + "/" + kPinNames[i];
+    union bpf_attr attr;
+    ::memset(&attr, 0, sizeof(attr));
+    attr.pathname = reinterpret_cast<uint64>(path.c_str());
+    attr.bpf_fd = fds[i];
+    if (BpfSyscall(BPF_OBJ_PIN, &attr) != 0) {
+      LOG(WARNING) << "pin " << path << " error: " << strerror(errno);
+      return;
+    }
+  }
+  pinned_ = true;
+}
+
+void TcRedirect::Unpin() {
+  for (const char* name : kPinNames) {
+    ::unlink((PinDirectory() + "/" + name).c_str());
+  }
+}
+
+bool TcRedirect::Open() {
+  int* fds[] = {&config_fd_, &routes_fd_, &counters_fd_};
+  for (int i = 0; i < 3; ++i) {
+    std::string path = PinDirectory() + "/" + kPinNames[i];
+    union bpf_attr attr;
+    ::memset(&attr, 0, sizeof(attr));
+    attr.pathname = reinterpret_cast<uint64>(path.c_str());
+    *fds[i] = BpfSyscall(BPF_OBJ_GET, &attr);
+    if (*fds[i] < 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void TcRedirect::SetConfig(const TcRedirectConfig& config) {
+  uint32 key = 0;
+  union bpf_attr attr;
+  ::memset(&attr, 0, sizeof(attr));
+  attr.map_fd = config_fd_;
+  attr.key = reinterpret_cast<uint64>(&key);
+  attr.value = reinterpret_cast<uint64>(&config);
+  attr.flags = BPF_ANY;
+  CHECK(BpfSyscall(BPF_MAP_UPDATE_ELEM, &attr) == 0)
+      << "bpf map update error: " << strerror(errno);
+}
+
+TcRedirectConfig TcRedirect::GetConfig() const {
+  uint32 key = 0;
+  TcRedirectConfig config;
+  union bpf_attr attr;
+  ::memset(&attr, 0, sizeof(attr));
+  attr.map_fd = config_fd_;
+  attr.key = reinterpret_cast<uint64>(&key);
+  attr.value = reinterpret_cast<uint64>(&config);
+  CHECK(BpfSyscall(BPF_MAP_LOOKUP_ELEM, &attr) == 0)
+      << "bpf map lookup error: " << strerror(errno);
+  return config;
+}
+
+static RouteKey MakeRouteKey(uint32 net, uint32 mask) {
+  RouteKey key = {static_cast<uint32>(__builtin_popcount(mask)), net};
+  return key;
+}
+
+void TcRedirect::AddRoute(const RouteTable::Route& route) {
+  RouteKey key = MakeRouteKey(route.net, route.mask);
+  union bpf_attr attr;
+  ::memset(&attr, 0, sizeof(attr));
+  attr.map_fd = routes_fd_;
+  attr.key = reinterpret_cast<uint64>(&key);
+  attr.value = reinterpret_cast<uint64>(&route.client_ip);
+  attr.flags = BPF_ANY;
+  CHECK(BpfSyscall(BPF_MAP_UPDATE_ELEM, &attr) == 0)
+      << "bpf route update error: " << strerror(errno);
+}
+
+bool TcRedirect::DeleteRoute(uint32 net, uint32 mask) {
+  RouteKey key = MakeRouteKey(net, mask);
+  union bpf_attr attr;
+  ::memset(&attr, 0, sizeof(attr));
+  attr.map_fd = routes_fd_;
+  attr.key = reinterpret_cast<uint64>(&key);
+  return BpfSyscall(BPF_MAP_DELETE_ELEM, &attr) == 0;
+}
+
+std::vector<RouteTable::Route> TcRedirect::GetRoutes() const {
+  std::vector<RouteTable::Route> routes;
+  RouteKey current, next;
+  bool first = true;
+  while (true) {
+    union bpf_attr attr;
+    ::memset(&attr, 0, sizeof(attr));
+    attr.map_fd = routes_fd_;
+    // no key starts the iteration
+    attr.key = first ? 0 : reinterpret_cast<uint64>(&current);
+    attr.next_key = reinterpret_cast<uint64>(&next);
+    if (BpfSyscall(BPF_MAP_GET_NEXT_KEY, &attr) != 0) {
+      break;
+    }
+    RouteTable::Route route;
+    route.net = next.net;
+    route.mask = next.prefix_length == 0 ?
+        0 : ::htonl(~0u << (32 - next.prefix_length));
+    ::memset(&attr, 0, sizeof(attr));
+    attr.map_fd = routes_fd_;
+    attr.key = reinterpret_cast<uint64>(&next);
+    attr.value = reinterpret_cast<uint64>(&route.client_ip);
+    if (BpfSyscall(BPF_MAP_LOOKUP_ELEM, &attr) == 0) {
+      routes.push_back(route);
+    }
+    current = next;
+    first = false;
+  }
+  return routes;
+}
+
+TcRedirectCounters TcRedirect::GetCounters(
+    std::vector<TcRedirectCounters>* per_cpu) const {
+  // per cpu values are 8 byte aligned, TcRedirectCounters already is
+  std::vector<TcRedirectCounters> values(PossibleCpus());
+  uint32 key = 0;
+  union bpf_attr attr;
+  ::memset(&attr, 0, sizeof(attr));
+  attr.map_fd = counters_fd_;
+  attr.key = reinterpret_cast<uint64>(&key);
+  attr.value = reinterpret_cast<uint64>(values.data());
+  CHECK(BpfSyscall(BPF_MAP_LOOKUP_ELEM, &attr) == 0)
+      << "bpf map lookup error: " << strerror(errno);
+  TcRedirectCounters total = {0, 0, 0};
+  for (const TcRedirectCounters& value : values) {
+    total.packets += value.packets;
+    total.bytes += value.bytes;
+    total.passed += value.passed;
+  }
+  if (per_cpu != NULL) {
+    per_cpu->swap(values);
+  }
+  return total;
+}
@@ -0,0 +1,74 @@
+#ifndef TCPMANY_EXAMPLE_TC_REDIRECT_H_
+#define TCPMANY_EXAMPLE_TC_REDIRECT_H_
+
+#include <string>
+#include <vector>
+
+#include "base.h"
+#include "noncopyable.h"
+#include "route_table.h"
+
+// Which server the in-kernel program rewrites replies of, the value of the
+// single entry config map. Network order.
+struct TcRedirectConfig {
+  // 0 matches any server address
+  uint32 server_ip;
+  uint16 server_port;
+  uint16 padding;
+};
+
+// One cpu's slot of the per-cpu counter map.
+struct TcRedirectCounters {
+  uint64 packets;
+  uint64 bytes;
+  // ipv4 packets seen that didn't match the config
+  uint64 passed;
+};
+
+// The redirect rewrite done by an eBPF program on tc egress (tcx) of an
+// interface: tcp segments from the server to a fake client address get
+// their source set to that address and their destination to the client
+// host the route table (an lpm trie map) gives for it, with both checksums
+// fixed by the kernel helpers, and then continue on their way. The packet
+// is rewritten in place instead of copied, so the route for the fake
+// addresses has to lead to the client host already.
+//
+// The program stays attached while the object that called Attach lives.
+// The maps are pinned under /sys/fs/bpf/tcpmany/<interface>/ when a bpf
+// filesystem is mounted there, which is how redirectctl finds them.
+class TcRedirect : public NonCopyable {
+ public:
+  explicit TcRedirect(const std::string& interface);
+  ~TcRedirect();
+
+  // loads and attaches the program, CHECK fails on error
+  void Attach(const TcRedirectConfig& config, const RouteTable& routes);
+  // opens the maps pinned by a running redirect, false if there are none
+  bool Open();
+
+  void SetConfig(const TcRedirectConfig& config);
+  TcRedirectConfig GetConfig() const;
+  void AddRoute(const RouteTable::Route& route);
+  // false if there was no route for exactly that network
+  bool DeleteRoute(uint32 net, uint32 mask);
+  std::vector<RouteTable::Route> GetRoutes() const;
+  // sum over all cpus, the per cpu values are stored in |per_cpu| if given
+  TcRedirectCounters GetCounters(
+      std::vector<TcRedirectCounters>* per_cpu = NULL) const;
+
+  std::string PinDirectory() const;
+
+ private:
+  void Pin();
+  void Unpin();
+
+  std::string interface_;
+  int config_fd_;
+  int routes_fd_;
+  int counters_fd_;
+  int prog_fd_;
+  int link_fd_;
+  bool pinned_;
+};
+
+#endif  // TCPMANY_EXAMPLE_TC_REDIRECT_H_
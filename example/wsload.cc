@@ -0,0 +1,213 @@
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "connection.h"
+#include "kernel.h"
+#include "websocket.h"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+
+using tcpmany::InetAddress;
+using tcpmany::Kernel;
+using tcpmany::KernelStats;
+using tcpmany::WebSocketClient;
+using tcpmany::WebSocketGroup;
+using tcpmany::WebSocketOpcode;
+
+typedef std::chrono::steady_clock Clock;
+
+namespace {
+
+std::atomic<uint64> g_opened(0);
+std::atomic<uint64> g_logins(0);
+std::atomic<uint64> g_echoes(0);
+std::atomic<uint64> g_pongs(0);
+std::atomic<uint64> g_closed(0);
+std::atomic<uint64> g_clean_closes(0);
+
+double SecondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+int64 RssBytes() {
+  std::ifstream status("/proc/self/status");
+  string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmRSS:") == 0) {
+      return atoll(line.c_str() + 6) * 1024;
+    }
+  }
+  return 0;
+}
+
+double CpuSeconds() {
+  struct rusage usage;
+  ::getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// waits until |counter| reaches |target| or stops moving for |settle| seconds
+void WaitFor(const std::atomic<uint64>& counter, uint64 target,
+             double settle) {
+  uint64 last = counter;
+  Clock::time_point last_progress = Clock::now();
+  while (counter < target && SecondsSince(last_progress) < settle) {
+    if (counter != last) {
+      last = counter;
+      last_progress = Clock::now();
+    }
+    ::usleep(10 * 1000);
+  }
+}
+
+}  // namespace
+
+// Opens <count> WebSocket clients at <rate> per second against an echo
+// server (fakeserver -m ws). Each logs in with a text message of its own
+// and pings once. Then every <interval_ms> all of them send a heartbeat,
+// <heartbeats> times; it is encoded and masked once for the whole group
+// and echoed back by the server. At the end every client closes and one
+// json object is printed. -s <bytes> sizes the heartbeat, -c and -t are
+// the same as for scaleload.
+int main(int argc, char* argv[]) {
+  tcpmany::KernelOptions options;
+  int heartbeat_size = 16;
+  int opt;
+  while ((opt = ::getopt(argc, argv, "c:s:t:")) != -1) {
+    if (opt == 'c') {
+      options.capture_interface = optarg;
+    } else if (opt == 's') {
+      heartbeat_size = atoi(optarg);
+    } else if (opt == 't') {
+      options.callback_threads = atoi(optarg);
+    } else {
+      return -1;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (argc != 8) {
+    cerr << "usage: " << argv[0] << " [-c capture_interface]"
+         << " [-s heartbeat_size] [-t callback_threads] <ip> <port> <count>"
+         << " <rate> <local_ip> <heartbeats> <interval_ms>" << endl;
+    return -1;
+  }
+  const InetAddress server_addr(argv[1], atoi(argv[2]));
+  const int COUNT = atoi(argv[3]);
+  const double RATE = atof(argv[4]);
+  const uint32 FIRST_IP = ::ntohl(::inet_addr(argv[5]));
+  const int HEARTBEATS = atoi(argv[6]);
+  const int INTERVAL_MS = atoi(argv[7]);
+  const uint16 LOCAL_PORT = 13579;
+
+  WebSocketGroup group(server_addr.ToIpPort(), "/", 1);
+  group.SetOpenCallback([](WebSocketClient& client) {
+    ++g_opened;
+    const intptr_t id = reinterpret_cast<intptr_t>(client.user_data());
+    client.SendText("LOGIN " + std::to_string(id));
+    client.Ping("hello");
+  });
+  group.SetMessageCallback([](WebSocketClient&, WebSocketOpcode opcode,
+                              const char* data, size_t len) {
+    if (opcode == tcpmany::WS_PONG) {
+      ++g_pongs;
+    } else if (len > 0 && data[0] == 'L') {
+      ++g_logins;
+    } else {
+      ++g_echoes;
+    }
+  });
+  group.SetClosedCallback([](WebSocketClient& client) {
+    ++g_closed;
+    if (client.close_code() == 1000) {
+      ++g_clean_closes;
+    }
+  });
+  const string heartbeat =
+      group.Prebuild(tcpmany::WS_TEXT, string(heartbeat_size, 'h'));
+
+  options.servers.push_back(server_addr);
+  tcpmany::IpRange clients_range = {FIRST_IP, FIRST_IP + COUNT - 1};
+  options.client_ranges.push_back(clients_range);
+  Kernel::Start(options);
+  const int64 base_rss = RssBytes();
+  const double base_cpu = CpuSeconds();
+
+  const Clock::time_point start = Clock::now();
+  std::vector<std::unique_ptr<WebSocketClient> > clients(COUNT);
+  for (int i = 0; i < COUNT; ++i) {
+    double due = i / RATE;
+    double now = SecondsSince(start);
+    if (due > now + 0.001) {
+      ::usleep(static_cast<useconds_t>((due - now) * 1e6));
+    }
+    InetAddress client_addr(FIRST_IP + i, LOCAL_PORT);
+    clients[i].reset(new WebSocketClient(
+        Kernel::NewConnection(server_addr, client_addr), &group));
+    clients[i]->set_user_data(reinterpret_cast<void*>(intptr_t(i)));
+    clients[i]->Connect();
+  }
+  const double ramp_seconds = SecondsSince(start);
+  WaitFor(g_opened, COUNT, 3);
+  const uint64 opened = g_opened;
+  WaitFor(g_logins, opened, 3);
+  const int64 rss = RssBytes();
+
+  const std::chrono::milliseconds interval(INTERVAL_MS);
+  const Clock::time_point heartbeat_start = Clock::now();
+  uint64 heartbeats_sent = 0;
+  for (int round = 0; round < HEARTBEATS; ++round) {
+    std::this_thread::sleep_until(heartbeat_start + interval * (round + 1));
+    for (const auto& client : clients) {
+      if (client->state() == WebSocketClient::WS_OPEN) {
+        client->SendPrebuilt(heartbeat);
+        ++heartbeats_sent;
+      }
+    }
+  }
+  WaitFor(g_echoes, heartbeats_sent, 3);
+
+  for (const auto& client : clients) {
+    client->Close();
+  }
+  WaitFor(g_closed, COUNT, 3);
+
+  const KernelStats stats = Kernel::GetStats();
+  const double cpu = CpuSeconds() - base_cpu;
+  cout << "{"
+       << "\"clients_requested\":" << COUNT << ","
+       << "\"ramp_seconds\":" << ramp_seconds << ","
+       << "\"seconds\":" << SecondsSince(start) << ","
+       << "\"opened\":" << opened << ","
+       << "\"login_echoes\":" << g_logins << ","
+       << "\"pongs\":" << g_pongs << ","
+       << "\"heartbeats_sent\":" << heartbeats_sent << ","
+       << "\"heartbeat_echoes\":" << g_echoes << ","
+       << "\"closed\":" << g_closed << ","
+       << "\"clean_closes\":" << g_clean_closes << ","
+       << "\"rss_bytes_per_client\":"
+       << (opened > 0 ? (rss - base_rss) / static_cast<double>(opened) : 0)
+       << ","
+       << "\"cpu_seconds\":" << cpu << ","
+       << "\"packets_received\":" << stats.packets_received << ","
+       << "\"packets_sent\":" << stats.packets_sent << ","
+       << "\"receive_drops\":" << stats.receive_drops
+       << "}" << endl;
+  tcpmany::FlushLogs();
+  ::_exit(0);
+}
@@ -3,6 +3,7 @@
 
 #include <queue>
 #include <mutex>
+#include <chrono>
 #include <condition_variable>
 
 #include "noncopyable.h"
@@ -40,6 +41,18 @@ class BlockingQueue : public NonCopyable {
     return true;
   }
 
+  bool TimedPop(T& data, int timeout_ms) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!condition_.wait_for(lock,
+                             std::chrono::milliseconds(timeout_ms),
+                             [this] { return !queue_.empty(); })) {
+      return false;
+    }
+    data = queue_.front();
+    queue_.pop();
+    return true;
+  }
+
   T const& Front() const {
     std::unique_lock<std::mutex> lock(mutex_);
     return queue_.front();
@@ -76,6 +89,17 @@ class BoundedBlockingQueue : public BlockingQueue<T> {
     this->condition_.notify_one();
   }
 
+  // false instead of waiting when the queue is full
+  bool TryPush(const T& data) {
+    std::unique_lock<std::mutex> lock(this->mutex_);
+    if (this->queue_.size() >= max_count_) {
+      return false;
+    }
+    this->queue_.push(data);
+    this->condition_.notify_one();
+    return true;
+  }
+
   virtual void Pop(T& data) {
     std::unique_lock<std::mutex> lock(this->mutex_);
 
@@ -0,0 +1,337 @@
+#include "bpf_filter.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+
+#include "ebpf.h"
+#include "logging.h"
+
+namespace tcpmany {
+
+// offsets into the ipv4 header
+static const uint32 kIpProtocol = 9;
+static const uint32 kIpFragment = 6;
+static const uint32 kIpSrc = 12;
+static const uint32 kIpDst = 16;
+// offsets into the tcp header, relative to X = ip header length
+static const uint32 kTcpSrcPort = 0;
+// offsets into the ipv6 header, the tcp header follows at a fixed offset
+static const uint32 kIp6NextHeader = 6;
+static const uint32 kIp6Src = 8;
+static const uint32 kIp6Dst = 24;
+static const uint32 kTcp6SrcPort = 40;
+
+BpfFilter::BpfFilter(sa_family_t family) : family_(family) {
+  if (family_ == AF_INET6) {
+    // packet sockets see both families, the version is the high nibble
+    Add(BPF_LD | BPF_B | BPF_ABS, 0);
+    Add(BPF_JMP | BPF_JGE | BPF_K, 0x60, kNext, kDrop);
+    Add(BPF_JMP | BPF_JGT | BPF_K, 0x6f, kDrop, kNext);
+    Add(BPF_LD | BPF_B | BPF_ABS, kIp6NextHeader);
+    Add(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, kNext, kDrop);
+    return;
+  }
+  Add(BPF_LD | BPF_B | BPF_ABS, kIpProtocol);
+  Add(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, kNext, kDrop);
+  // later fragments carry no tcp header
+  Add(BPF_LD | BPF_H | BPF_ABS, kIpFragment);
+  Add(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, kDrop, kNext);
+}
+
+void BpfFilter::Add(uint16 code, uint32 k, int jt, int jf) {
+  Insn insn = {code, k, jt, jf};
+  insns_.push_back(insn);
+}
+
+void BpfFilter::RequireSourcePort(uint16 port) {
+  RequireSourcePorts(std::vector<uint16>(1, port));
+}
+
+void BpfFilter::RequireSourcePorts(const std::vector<uint16>& ports) {
+  const int count = static_cast<int>(ports.size());
+  if (family_ == AF_INET6) {
+    const int end = Size() + 1 + count;
+    Add(BPF_LD | BPF_H | BPF_ABS, kTcp6SrcPort);
+    for (int i = 0; i < count; ++i) {
+      Add(BPF_JMP | BPF_JEQ | BPF_K, ports[i], end,
+          i == count - 1 ? kDrop : kNext);
+    }
+    return;
+  }
+  const int end = Size() + 2 + count;
+  Add(BPF_LDX | BPF_B | BPF_MSH, 0);
+  Add(BPF_LD | BPF_H | BPF_IND, kTcpSrcPort);
+  for (int i = 0; i < count; ++i) {
+    Add(BPF_JMP | BPF_JEQ | BPF_K, ports[i], end,
+        i == count - 1 ? kDrop : kNext);
+  }
+}
+
+void BpfFilter::RequireIpIn(const std::vector<IpRange>& ranges) {
+  CHECK(family_ == AF_INET);
+  // two comparisons per range and address, a miss moves on to the next
+  // range, then to the destination address
+  const int count = static_cast<int>(ranges.size());
+  const int block = 1 + 2 * count;
+  const int end = Size() + 2 * block;
+  for (int offset : {kIpSrc, kIpDst}) {
+    const int miss = offset == kIpDst ? kDrop : Size() + block;
+    Add(BPF_LD | BPF_W | BPF_ABS, offset);
+    for (int i = 0; i < count; ++i) {
+      const int next = i == count - 1 ? miss : Size() + 2;
+      Add(BPF_JMP | BPF_JGE | BPF_K, ranges[i].first, kNext, next);
+      Add(BPF_JMP | BPF_JGT | BPF_K, ranges[i].last, next, end);
+    }
+  }
+}
+
+void BpfFilter::RequireSource(const std::vector<InetAddress>& endpoints) {
+  CHECK(family_ == AF_INET);
+  // five instructions per endpoint, a mismatch moves on to the next one
+  const int kBlock = 5;
+  const int count = static_cast<int>(endpoints.size());
+  const int end = Size() + kBlock * count;
+  for (int i = 0; i < count; ++i) {
+    const struct sockaddr_in& addr = endpoints[i].SockAddr();
+    const int next = i == count - 1 ? kDrop : Size() + kBlock;
+    Add(BPF_LD | BPF_W | BPF_ABS, kIpSrc);
+    Add(BPF_JMP | BPF_JEQ | BPF_K, ::ntohl(addr.sin_addr.s_addr),
+        kNext, next);
+    Add(BPF_LDX | BPF_B | BPF_MSH, 0);
+    Add(BPF_LD | BPF_H | BPF_IND, kTcpSrcPort);
+    Add(BPF_JMP | BPF_JEQ | BPF_K, ::ntohs(addr.sin_port), end, next);
+  }
+}
+
+void BpfFilter::RequireSourceIp(uint32 ip_net) {
+  CHECK(family_ == AF_INET);
+  Add(BPF_LD | BPF_W | BPF_ABS, kIpSrc);
+  Add(BPF_JMP | BPF_JEQ | BPF_K, ::ntohl(ip_net), kNext, kDrop);
+}
+
+void BpfFilter::ExcludeDestinationIp(uint32 ip_net) {
+  CHECK(family_ == AF_INET);
+  Add(BPF_LD | BPF_W | BPF_ABS, kIpDst);
+  Add(BPF_JMP | BPF_JEQ | BPF_K, ::ntohl(ip_net), kDrop, kNext);
+}
+
+void BpfFilter::RequireSourceIp6(const struct in6_addr& ip) {
+  CHECK(family_ == AF_INET6);
+  for (int i = 0; i < 4; ++i) {
+    Add(BPF_LD | BPF_W | BPF_ABS, kIp6Src + 4 * i);
+    Add(BPF_JMP | BPF_JEQ | BPF_K, ::ntohl(ip.s6_addr32[i]), kNext, kDrop);
+  }
+}
+
+// two instructions per word, the first differing word leaves the check
+void BpfFilter::ExcludeDestinationIp6(const struct in6_addr& ip) {
+  CHECK(family_ == AF_INET6);
+  const int end = Size() + 8;
+  for (int i = 0; i < 4; ++i) {
+    Add(BPF_LD | BPF_W | BPF_ABS, kIp6Dst + 4 * i);
+    Add(BPF_JMP | BPF_JEQ | BPF_K, ::ntohl(ip.s6_addr32[i]),
+        i == 3 ? kDrop : kNext, end);
+  }
+}
+
+int BpfFilter::Target(int index, int branch) const {
+  const Insn& insn = insns_[index];
+  const int target = branch == 0 ? insn.jt : insn.jf;
+  if (target == kNext) {
+    return index + 1;
+  } else if (target == kAccept) {
+    return Size();
+  } else if (target == kDrop) {
+    return Size() + 1;
+  }
+  return target;
+}
+
+// Classic jump offsets are 8 bits, a few hundred ranges or endpoints
+// already need more. Such a branch goes to a BPF_JA right behind its
+// jump, which takes a 32 bit offset. Those move the other targets further
+// away, so the layout is repeated until no branch needs another one.
+std::vector<struct sock_filter> BpfFilter::Program() const {
+  // where each instruction ends up, then accept and drop
+  std::vector<int> position(Size() + 2);
+  // per instruction, bit 0 and 1 for a long true and false branch
+  std::vector<uint8> long_jumps(Size(), 0);
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    int next = 0;
+    for (int i = 0; i < Size(); ++i) {
+      position[i] = next;
+      next += 1 + (long_jumps[i] & 1) + (long_jumps[i] >> 1);
+    }
+    position[Size()] = next;
+    position[Size() + 1] = next + 1;
+    for (int i = 0; i < Size(); ++i) {
+      if (BPF_CLASS(insns_[i].code) != BPF_JMP) {
+        continue;
+      }
+      for (int j = 0; j < 2; ++j) {
+        int offset = position[Target(i, j)] - (position[i] + 1);
+        if (offset > 255 && !(long_jumps[i] & (1 << j))) {
+          long_jumps[i] |= 1 << j;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  std::vector<struct sock_filter> program;
+  for (int i = 0; i < Size(); ++i) {
+    const Insn& insn = insns_[i];
+    struct sock_filter filter = {insn.code, 0, 0, insn.k};
+    int far_targets[2];
+    int far_count = 0;
+    if (BPF_CLASS(insn.code) == BPF_JMP) {
+      uint8 offsets[2];
+      for (int j = 0; j < 2; ++j) {
+        int target = position[Target(i, j)];
+        if (long_jumps[i] & (1 << j)) {
+          far_targets[far_count] = target;
+          target = position[i] + 1 + far_count;
+          ++far_count;
+        }
+        int offset = target - (position[i] + 1);
+        CHECK(offset >= 0 && offset <= 255) << "bpf jump out of range";
+        offsets[j] = offset;
+      }
+      filter.jt = offsets[0];
+      filter.jf = offsets[1];
+    }
+    program.push_back(filter);
+    for (int j = 0; j < far_count; ++j) {
+      const uint32 offset = far_targets[j] - (program.size() + 1);
+      struct sock_filter long_jump = BPF_JUMP(BPF_JMP | BPF_JA, offset, 0, 0);
+      program.push_back(long_jump);
+    }
+  }
+  struct sock_filter accept_all = BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+  struct sock_filter drop_all = BPF_STMT(BPF_RET | BPF_K, 0);
+  program.push_back(accept_all);
+  program.push_back(drop_all);
+  return program;
+}
+
+bool BpfFilter::Attach(int fd) const {
+  std::vector<struct sock_filter> program = Program();
+  struct sock_fprog fprog;
+  fprog.len = program.size();
+  fprog.filter = program.data();
+  return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER,
+                    &fprog, sizeof(fprog)) == 0;
+}
+
+// Classic A and X live in r0 and r7, r6 holds the skb as the ld_abs and
+// ld_ind instructions expect. Every classic instruction gets a label so the
+// relative jumps survive the different instruction counts.
+std::vector<struct bpf_insn> BpfFilter::EbpfProgram(int counter_fd) const {
+  std::vector<struct sock_filter> program = Program();
+  EbpfAssembler a;
+  a.MovReg(BPF_REG_6, BPF_REG_1);
+  for (size_t i = 0; i < program.size(); ++i) {
+    const struct sock_filter& insn = program[i];
+    a.Label(std::to_string(i));
+    switch (BPF_CLASS(insn.code)) {
+      case BPF_LD:
+        if (BPF_MODE(insn.code) == BPF_ABS) {
+          a.Emit(BPF_LD | BPF_SIZE(insn.code) | BPF_ABS, 0, 0, 0, insn.k);
+        } else {
+          CHECK(BPF_MODE(insn.code) == BPF_IND);
+          a.Emit(BPF_LD | BPF_SIZE(insn.code) | BPF_IND,
+                 0, BPF_REG_7, 0, insn.k);
+        }
+        break;
+      case BPF_LDX:
+        // X = 4 * (pkt[k] & 0xf), A is left alone
+        CHECK(BPF_MODE(insn.code) == BPF_MSH);
+        a.MovReg(BPF_REG_8, BPF_REG_0);
+        a.Emit(BPF_LD | BPF_B | BPF_ABS, 0, 0, 0, insn.k);
+        a.AluImm(BPF_AND, BPF_REG_0, 0xf);
+        a.AluImm(BPF_LSH, BPF_REG_0, 2);
+        a.MovReg(BPF_REG_7, BPF_REG_0);
+        a.MovReg(BPF_REG_0, BPF_REG_8);
+        break;
+      case BPF_JMP:
+        if (BPF_OP(insn.code) == BPF_JA) {
+          a.Jump(std::to_string(i + 1 + insn.k));
+          break;
+        }
+        CHECK(BPF_SRC(insn.code) == BPF_K);
+        a.Jump32Imm(BPF_OP(insn.code), BPF_REG_0, insn.k,
+                    std::to_string(i + 1 + insn.jt));
+        if (insn.jf != 0) {
+          a.Jump(std::to_string(i + 1 + insn.jf));
+        }
+        break;
+      case BPF_RET:
+        if (insn.k == 0) {
+          a.Jump("drop");
+        } else {
+          a.MovImm(BPF_REG_0, insn.k);
+          a.Exit();
+        }
+        break;
+      default:
+        LOG(FATAL) << "can't translate bpf instruction " << insn.code;
+    }
+  }
+
+  a.Label("drop");
+  a.StoreImm(BPF_W, BPF_REG_10, -4, 0);
+  a.LoadMap(BPF_REG_1, counter_fd);
+  a.MovReg(BPF_REG_2, BPF_REG_10);
+  a.AluImm(BPF_ADD, BPF_REG_2, -4);
+  a.Call(BPF_FUNC_map_lookup_elem);
+  a.JumpImm(BPF_JEQ, BPF_REG_0, 0, "out");
+  a.Load(BPF_DW, BPF_REG_1, BPF_REG_0, 0);
+  a.AluImm(BPF_ADD, BPF_REG_1, 1);
+  a.Store(BPF_DW, BPF_REG_0, 0, BPF_REG_1);
+  a.Label("out");
+  a.MovImm(BPF_REG_0, 0);
+  a.Exit();
+  return a.Program();
+}
+
+int BpfFilter::AttachCounting(int fd) const {
+  int counter_fd = CreateBpfMap(BPF_MAP_TYPE_PERCPU_ARRAY, sizeof(uint32),
+                                sizeof(uint64), 1, "tm_filtered");
+  if (counter_fd < 0) {
+    return -1;
+  }
+  std::string log;
+  int prog_fd = LoadBpfProgram(BPF_PROG_TYPE_SOCKET_FILTER,
+                               EbpfProgram(counter_fd), "tm_filter", &log);
+  if (prog_fd < 0) {
+    int error = errno;
+    VLOG(1) << "socket filter rejected: " << log;
+    ::close(counter_fd);
+    errno = error;
+    return -1;
+  }
+  // the socket keeps the program alive, the map stays with the caller
+  int ret = setsockopt(fd, SOL_SOCKET, SO_ATTACH_BPF,
+                       &prog_fd, sizeof(prog_fd));
+  int error = errno;
+  ::close(prog_fd);
+  if (ret != 0) {
+    ::close(counter_fd);
+    errno = error;
+    return -1;
+  }
+  return counter_fd;
+}
+
+bool BpfFilter::AttachDropAll(int fd) {
+  struct sock_filter drop_all = BPF_STMT(BPF_RET | BPF_K, 0);
+  struct sock_fprog fprog = {1, &drop_all};
+  return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER,
+                    &fprog, sizeof(fprog)) == 0;
+}
+
+}  // namespace tcpmany
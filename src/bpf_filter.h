@@ -0,0 +1,83 @@
+#ifndef TCPMANY_BPF_FILTER_H_
+#define TCPMANY_BPF_FILTER_H_
+
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <vector>
+
+#include "base.h"
+#include "inet_address.h"
+
+namespace tcpmany {
+
+// Builds classic BPF programs for packets that start at the ipv4 header,
+// which is what raw sockets and SOCK_DGRAM packet sockets run their filters
+// on. The program accepts ipv4 tcp packets (first fragments only) for which
+// every added requirement holds; a requirement is a set of alternatives of
+// which one has to match.
+//
+// With AF_INET6 it takes packets that start at the ipv6 header instead,
+// tcp right behind it (no extension headers), and only the port and
+// ipv6 requirements apply.
+class BpfFilter {
+ public:
+  explicit BpfFilter(sa_family_t family = AF_INET);
+
+  // tcp source port equals |port| (host order)
+  void RequireSourcePort(uint16 port);
+  // tcp source port is one of |ports| (host order)
+  void RequireSourcePorts(const std::vector<uint16>& ports);
+  // ip source or ip destination lies in one of |ranges|
+  void RequireIpIn(const std::vector<IpRange>& ranges);
+  // ip source and tcp source port equal those of one of |endpoints|
+  void RequireSource(const std::vector<InetAddress>& endpoints);
+  // ip source equals |ip_net| (network order)
+  void RequireSourceIp(uint32 ip_net);
+  // ip destination is not |ip_net| (network order)
+  void ExcludeDestinationIp(uint32 ip_net);
+  // the same for ipv6
+  void RequireSourceIp6(const struct in6_addr& ip);
+  void ExcludeDestinationIp6(const struct in6_addr& ip);
+
+  std::vector<struct sock_filter> Program() const;
+  // SO_ATTACH_FILTER, returns false with errno set on failure
+  bool Attach(int fd) const;
+  // Attaches the program translated to eBPF (SO_ATTACH_BPF), which also
+  // counts the packets it drops. Returns the fd of the per-cpu counter map,
+  // read it with ReadPerCpuCounter(fd, 0), or -1 with errno set when the
+  // kernel won't take it; Attach still works then.
+  int AttachCounting(int fd) const;
+  // for sockets that are only sent on, so they don't queue a copy of
+  // everything they could receive
+  static bool AttachDropAll(int fd);
+
+ private:
+  // jump targets besides absolute instruction indexes
+  enum {
+    kNext = -1,
+    kAccept = -2,
+    kDrop = -3,
+  };
+  struct Insn {
+    uint16 code;
+    uint32 k;
+    int jt;
+    int jf;
+  };
+
+  void Add(uint16 code, uint32 k, int jt = kNext, int jf = kNext);
+  // instruction index a branch (0 true, 1 false) goes to, Size() for
+  // accept and Size() + 1 for drop
+  int Target(int index, int branch) const;
+  std::vector<struct bpf_insn> EbpfProgram(int counter_fd) const;
+  int Size() const {
+    return static_cast<int>(insns_.size());
+  }
+
+  const sa_family_t family_;
+  std::vector<Insn> insns_;
+};
+
+}  // namespace tcpmany
+
+#endif  // TCPMANY_BPF_FILTER_H_
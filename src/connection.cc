@@ -19,38 +19,170 @@ void DefaultClosedCallback(Connection& conn) {
 
 Connection::Connection(const InetAddress& dst_addr,
                        const InetAddress& src_addr)
+    : Connection(dst_addr, src_addr, ::time(0) + ::clock()) {
+}
+
+Connection::Connection(const InetAddress& dst_addr,
+                       const InetAddress& src_addr,
+                       uint32 seq)
     : connected_callback_(DefaultConnectedCallback),
       message_callback_(DefaultMessageCallback),
       closed_callback_(DefaultClosedCallback),
       dst_addr_(dst_addr),
       src_addr_(src_addr),
       state_(CS_CLOSED),
-      seq_(::time(0) + ::clock()) {
+      seq_(seq),
+      syn_ack_time_(0),
+      last_send_time_(0),
+      syn_send_time_(0) {
 }
 
 Connection::~Connection() {
+  if (state_ == CS_ESTABLISHED) {
+    Kernel::CountEstablished(-1);
+  } else if (state_ == CS_SYN_SENT) {
+    Kernel::CountSynSent(-1);
+  }
   VLOG(3) << "Connection destroy: " << GetSrcAddress().ToIpPort();
 }
 
+// The state is switched before the packet is queued, the answer may be
+// processed by the receive thread before Send returns.
 void Connection::Connect() {
+  if (!SetState(CS_CLOSED, CS_SYN_SENT)) {
+    LOG(WARNING) << "connect of a connection in use: "
+                 << src_addr_.ToIpPort();
+    return;
+  }
   Kernel::Send(SynPacket(seq_++, dst_addr_, src_addr_));
-  state_ = CS_SYN_SENT;
 }
 
 void Connection::Close() {
-  Kernel::Send(FinPacket(seq_++, ack_seq_, dst_addr_, src_addr_));
-  state_ = CS_FIN_WAIT_1;
+  if (state_ == CS_SYN_SENT) {
+    Abort();
+    return;
+  }
+  if (SetState(CS_ESTABLISHED, CS_FIN_WAIT_1)) {
+    Kernel::Send(FinPacket(seq_++, ack_seq_, dst_addr_, src_addr_));
+  }
+}
+
+bool Connection::Abort() {
+  ConnState state = state_;
+  while (state != CS_CLOSED) {
+    if (SetState(state, CS_CLOSED)) {
+      Kernel::Send(RstPacket(seq_, ack_seq_, dst_addr_, src_addr_));
+      return true;
+    }
+    state = state_;
+  }
+  return false;
+}
+
+bool Connection::Send(const std::string& message) {
+  if (!Kernel::MemoryAvailable()) {
+    return false;
+  }
+  const uint32 seq = seq_.fetch_add(message.length());
+  if (message.length() <= kMaxSegmentSize) {
+    Kernel::Send(DataPacket(seq, ack_seq_, dst_addr_, src_addr_, message));
+    return true;
+  }
+  for (size_t offset = 0; offset < message.length();
+       offset += kMaxSegmentSize) {
+    Kernel::Send(DataPacket(seq + offset,
+                            ack_seq_,
+                            dst_addr_,
+                            src_addr_,
+                            message.substr(offset, kMaxSegmentSize)));
+  }
+  return true;
 }
 
-void Connection::Send(const std::string& message) {
-  Kernel::Send(DataPacket(seq_.fetch_add(message.length()),
-                          ack_seq_,
-                          dst_addr_,
-                          src_addr_,
-                          message));
+int64 Connection::ConnectLatency() const {
+  int64 syn_send_time = syn_send_time_;
+  if (syn_send_time == 0 || syn_ack_time_ == 0) {
+    return 0;
+  }
+  return syn_ack_time_ - syn_send_time;
+}
+
+bool Connection::SetState(ConnState from, ConnState to) {
+  if (!state_.compare_exchange_strong(from, to)) {
+    return false;
+  }
+  if (to == CS_ESTABLISHED) {
+    Kernel::CountEstablished(1);
+  } else if (from == CS_ESTABLISHED) {
+    Kernel::CountEstablished(-1);
+  }
+  if (to == CS_SYN_SENT) {
+    Kernel::CountSynSent(1);
+  } else if (from == CS_SYN_SENT) {
+    Kernel::CountSynSent(-1);
+  }
+  return true;
+}
+
+void Connection::Restore(uint32 ack_seq) {
+  ack_seq_ = ack_seq;
+  SetState(CS_CLOSED, CS_ESTABLISHED);
+}
+
+void Connection::OnPacketSent(const Packet& packet) {
+  if (packet.timestamp.software == 0) {
+    return;
+  }
+  last_send_time_ = packet.timestamp.software;
+  if (packet.IsSyn() && !packet.IsAck()) {
+    syn_send_time_ = packet.timestamp.software;
+  }
+}
+
+// Once the Kernel is stopping the callbacks are skipped, what they refer
+// to may be gone already.
+void Connection::NotifyConnected() {
+  if (Kernel::Stopping()) {
+    return;
+  }
+  EventDispatcher* dispatcher = Kernel::Dispatcher();
+  if (dispatcher == NULL) {
+    connected_callback_(*this);
+    return;
+  }
+  dispatcher->Dispatch(this, [this] { connected_callback_(*this); });
+}
+
+// the packet is gone by the time a callback thread gets to the message
+void Connection::NotifyMessage(const char* data, int len) {
+  if (Kernel::Stopping()) {
+    return;
+  }
+  EventDispatcher* dispatcher = Kernel::Dispatcher();
+  if (dispatcher == NULL) {
+    message_callback_(*this, data, len);
+    return;
+  }
+  auto message = std::make_shared<std::string>(data, len);
+  dispatcher->Dispatch(this, [this, message] {
+    message_callback_(*this, message->data(), message->length());
+  }, sizeof(*message) + len);
+}
+
+void Connection::NotifyClosed() {
+  if (Kernel::Stopping()) {
+    return;
+  }
+  EventDispatcher* dispatcher = Kernel::Dispatcher();
+  if (dispatcher == NULL) {
+    closed_callback_(*this);
+    return;
+  }
+  dispatcher->Dispatch(this, [this] { closed_callback_(*this); });
 }
 
 void Connection::ProcessPacket(const Packet& packet) {
+  last_receive_time_ = packet.timestamp;
   int data_len = packet.DataLen();
   VLOG(4) << "data(" << data_len << "):"
           << std::string(packet.Data(), data_len);
@@ -59,14 +191,27 @@ void Connection::ProcessPacket(const Packet& packet) {
   } else {
     ack_seq_.store(packet.GetSeq() + 1);
   }
-  switch (state_) {
+  // a transition that loses to Close or Abort on another thread leaves
+  // the callbacks to theirs
+  const ConnState state = state_;
+  // a reset, with or without ACK, ends the connection in any state and is
+  // not answered
+  if (packet.IsRst()) {
+    if (state != CS_CLOSED && SetState(state, CS_CLOSED)) {
+      NotifyClosed();
+    }
+    return;
+  }
+  switch (state) {
     case CS_CLOSED:
       break;
     case CS_SYN_SENT:
       if (packet.IsSyn() && packet.IsAck()) {
+        syn_ack_time_ = packet.timestamp.software;
         Kernel::Send(AckPacket(seq_, packet, dst_addr_, src_addr_));
-        state_ = CS_ESTABLISHED;
-        connected_callback_(*this);
+        if (SetState(state, CS_ESTABLISHED)) {
+          NotifyConnected();
+        }
       } else {
         CHECK(false);
       }
@@ -78,13 +223,14 @@ void Connection::ProcessPacket(const Packet& packet) {
     case CS_FIN_WAIT_1:
       if (packet.IsAck() && packet.IsFin()) {
         Kernel::Send(AckPacket(seq_, packet, dst_addr_, src_addr_));
-        state_ = CS_CLOSED;
-        closed_callback_(*this);
+        if (SetState(state, CS_CLOSED)) {
+          NotifyClosed();
+        }
       } else if (packet.IsAck()) {
-        state_ = CS_FIN_WAIT_2;
+        SetState(state, CS_FIN_WAIT_2);
       } else if (packet.IsFin()) {
         Kernel::Send(AckPacket(seq_, packet, dst_addr_, src_addr_));
-        state_ = CS_CLOSING;
+        SetState(state, CS_CLOSING);
       } else {
         CHECK(false);
       }
@@ -92,16 +238,19 @@ void Connection::ProcessPacket(const Packet& packet) {
     case CS_FIN_WAIT_2:
       if (packet.IsFin()) {
         Kernel::Send(AckPacket(seq_, packet, dst_addr_, src_addr_));
-        state_ = CS_CLOSED; // CS_TIME_WAIT;
-        closed_callback_(*this);
-      } else {
-        CHECK(false);
+        if (SetState(state, CS_CLOSED)) { // CS_TIME_WAIT;
+          NotifyClosed();
+        }
+      } else if (packet.DataLen() > 0) {
+        // the peer may send until it closes its side too
+        Kernel::Send(AckPacket(seq_, packet, dst_addr_, src_addr_));
       }
       break;
     case CS_CLOSING:
       if (packet.IsAck()) {
-        state_ = CS_CLOSED; // CS_TIME_WAIT;
-        closed_callback_(*this);
+        if (SetState(state, CS_CLOSED)) { // CS_TIME_WAIT;
+          NotifyClosed();
+        }
       } else {
         CHECK(false);
       }
@@ -116,10 +265,10 @@ void Connection::ProcessMessage(const Packet& packet) {
   int data_len = packet.DataLen();
   if (data_len > 0) {
     Kernel::Send(AckPacket(seq_, packet, dst_addr_, src_addr_));
-    message_callback_(*this, packet.Data(), data_len);
+    NotifyMessage(packet.Data(), data_len);
   } else if (packet.IsFin()) {
     Kernel::Send(FinAckPacket(seq_, packet, dst_addr_, src_addr_));
-    state_ = CS_CLOSING;
+    SetState(CS_ESTABLISHED, CS_CLOSING);
   } else if (packet.IsAck()) {
     // TODO clear the resend timer
   } else {
@@ -17,6 +17,11 @@ typedef std::function<void (Connection&)> ConnectedCallback;
 typedef std::function<void (Connection&, const char*, int)> MessageCallback;
 typedef std::function<void (Connection&)> ClosedCallback;
 
+// With KernelOptions::callback_threads the callbacks run on other threads
+// than the receive thread, which may be in the same connection meanwhile.
+// Connect, Close, Abort, Send, IsClosed, the addresses, LastSendTime and
+// ConnectLatency are safe from any thread. The callbacks are to be set
+// before Connect, LastReceiveTime only read on the receive thread.
 class Connection : public NonCopyable {
  public:
   void SetConnectedCallback(const ConnectedCallback& cb) {
@@ -44,15 +49,58 @@ class Connection : public NonCopyable {
     return state_ == CS_CLOSED;
   }
 
+  // Kernel timestamps of the last packet received from the peer, taken when
+  // it reached the raw socket rather than when ReceiveThread got to it.
+  const PacketTimestamp& LastReceiveTime() const {
+    return last_receive_time_;
+  }
+  // Software TX completion time (ns) of the last packet sent to the peer,
+  // only maintained when KernelOptions::tx_timestamps is on.
+  int64 LastSendTime() const {
+    return last_send_time_;
+  }
+  // SYN on the wire to SYN-ACK at the socket, in ns, 0 until both
+  // timestamps are known.
+  int64 ConnectLatency() const;
+
   void Connect();
+  // Sends a FIN when established. Before the handshake is done it aborts
+  // instead, a FIN could not be answered yet; closing or closed it does
+  // nothing.
   void Close();
-  void Send(const std::string& message);
+  // Resets the connection: a RST goes out and it is closed at once,
+  // without the closed callback. False when it was closed already, by this
+  // or another thread; the callback of that close still runs.
+  bool Abort();
+  // A message longer than kMaxSegmentSize goes out in several segments,
+  // all or none: false when refused over KernelOptions::memory_budget,
+  // nothing is sent then. The segments of one message take one range of
+  // sequence numbers, messages sent at once from several threads don't
+  // interleave.
+  bool Send(const std::string& message);
+
+  // payload per packet, under what Packet takes for ipv4 and ipv6
+  static const size_t kMaxSegmentSize = 1400;
 
  private:
   Connection(const InetAddress& dst_addr, const InetAddress& src_addr);
+  // starting at |seq| instead of a fresh initial sequence number, which
+  // costs a clock() syscall
+  Connection(const InetAddress& dst_addr,
+             const InetAddress& src_addr,
+             uint32 seq);
   ~Connection();
   void ProcessPacket(const Packet& packet);
   void ProcessMessage(const Packet& packet);
+  // called by the send thread with the TX completion timestamp
+  void OnPacketSent(const Packet& packet);
+  // takes over a connection from a snapshot, established and having
+  // received everything before |ack_seq|
+  void Restore(uint32 ack_seq);
+  // run the callbacks, inline or on the Kernel's callback threads
+  void NotifyConnected();
+  void NotifyMessage(const char* data, int len);
+  void NotifyClosed();
 
   ConnectedCallback connected_callback_;
   MessageCallback message_callback_;
@@ -68,12 +116,25 @@ class Connection : public NonCopyable {
     CS_FIN_WAIT_2,
     CS_CLOSING,
     CS_TIME_WAIT,
-  } state_;
+  };
+  // Changed by the receive thread and by Close and Abort from any thread,
+  // only through SetState.
+  std::atomic<ConnState> state_;
+  // Moves from |from| to |to| unless another thread changed the state
+  // first, and keeps the kernel's established count in step: the change
+  // and its count happen once. False when it lost.
+  bool SetState(ConnState from, ConnState to);
 
   std::atomic<uint32> seq_;
   std::atomic<uint32> ack_seq_;
 
+  PacketTimestamp last_receive_time_;
+  int64 syn_ack_time_;
+  std::atomic<int64> last_send_time_;
+  std::atomic<int64> syn_send_time_;
+
   friend class Kernel;
+  friend class KernelPeer;
 };
 
 }
@@ -0,0 +1,117 @@
+#include "ebpf.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "logging.h"
+
+namespace tcpmany {
+
+int BpfSyscall(int cmd, union bpf_attr* attr) {
+  return ::syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+int CreateBpfMap(uint32 type,
+                 uint32 key_size,
+                 uint32 value_size,
+                 uint32 max_entries,
+                 const char* name) {
+  union bpf_attr attr;
+  ::memset(&attr, 0, sizeof(attr));
+  attr.map_type = type;
+  attr.key_size = key_size;
+  attr.value_size = value_size;
+  attr.max_entries = max_entries;
+  if (type == BPF_MAP_TYPE_LPM_TRIE) {
+    attr.map_flags = BPF_F_NO_PREALLOC;
+  }
+  ::strncpy(attr.map_name, name, sizeof(attr.map_name) - 1);
+  return BpfSyscall(BPF_MAP_CREATE, &attr);
+}
+
+int LoadBpfProgram(uint32 type,
+                   const std::vector<struct bpf_insn>& program,
+                   const char* name,
+                   std::string* log) {
+  static const char license[] = "GPL";
+  union bpf_attr attr;
+  ::memset(&attr, 0, sizeof(attr));
+  attr.prog_type = type;
+  attr.insns = reinterpret_cast<uint64>(program.data());
+  attr.insn_cnt = program.size();
+  attr.license = reinterpret_cast<uint64>(license);
+  ::strncpy(attr.prog_name, name, sizeof(attr.prog_name) - 1);
+  int fd = BpfSyscall(BPF_PROG_LOAD, &attr);
+  if (fd >= 0 || log == NULL) {
+    return fd;
+  }
+  // load again only to get the verifier's reasons
+  int error = errno;
+  std::vector<char> buffer(64 * 1024);
+  attr.log_buf = reinterpret_cast<uint64>(buffer.data());
+  attr.log_size = buffer.size();
+  attr.log_level = 1;
+  fd = BpfSyscall(BPF_PROG_LOAD, &attr);
+  if (fd >= 0) {
+    return fd;
+  }
+  log->assign(buffer.data());
+  errno = error;
+  return -1;
+}
+
+int PossibleCpus() {
+  FILE* file = ::fopen("/sys/devices/system/cpu/possible", "r");
+  CHECK(file != NULL) << "open cpu possible mask error: " << strerror(errno);
+  int count = 0;
+  int first, last;
+  char separator;
+  while (::fscanf(file, "%d", &first) == 1) {
+    last = first;
+    if (::fscanf(file, "%c", &separator) == 1 && separator == '-') {
+      CHECK(::fscanf(file, "%d%c", &last, &separator) >= 1);
+    }
+    count += last - first + 1;
+  }
+  ::fclose(file);
+  CHECK(count > 0);
+  return count;
+}
+
+uint64 ReadPerCpuCounter(int map_fd, uint32 key) {
+  std::vector<uint64> values(PossibleCpus());
+  union bpf_attr attr;
+  ::memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd;
+  attr.key = reinterpret_cast<uint64>(&key);
+  attr.value = reinterpret_cast<uint64>(values.data());
+  if (BpfSyscall(BPF_MAP_LOOKUP_ELEM, &attr) != 0) {
+    return 0;
+  }
+  uint64 sum = 0;
+  for (uint64 value : values) {
+    sum += value;
+  }
+  return sum;
+}
+
+std::vector<struct bpf_insn> EbpfAssembler::Program() const {
+  std::vector<struct bpf_insn> program = insns_;
+  for (size_t i = 0; i < jumps_.size(); ++i) {
+    size_t from = jumps_[i].first;
+    int target = -1;
+    for (size_t j = 0; j < labels_.size(); ++j) {
+      if (labels_[j].first == jumps_[i].second) {
+        target = labels_[j].second;
+      }
+    }
+    CHECK(target > static_cast<int>(from))
+        << "bad jump target " << jumps_[i].second;
+    program[from].off = target - (from + 1);
+  }
+  return program;
+}
+
+}  // namespace tcpmany
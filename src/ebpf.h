@@ -0,0 +1,111 @@
+#ifndef TCPMANY_EBPF_H_
+#define TCPMANY_EBPF_H_
+
+#include <linux/bpf.h>
+#include <string.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base.h"
+
+namespace tcpmany {
+
+// Thin wrappers over the bpf() syscall, for the few eBPF programs tcpmany
+// assembles itself (no compiler or libbpf needed). All return -1 with errno
+// set on failure.
+int BpfSyscall(int cmd, union bpf_attr* attr);
+int CreateBpfMap(uint32 type,
+                 uint32 key_size,
+                 uint32 value_size,
+                 uint32 max_entries,
+                 const char* name);
+// the verifier output goes to |log| when loading fails
+int LoadBpfProgram(uint32 type,
+                   const std::vector<struct bpf_insn>& program,
+                   const char* name,
+                   std::string* log);
+// slots in per-cpu map values
+int PossibleCpus();
+// sum over all cpus of a per-cpu array of uint64 counters at |key|
+uint64 ReadPerCpuCounter(int map_fd, uint32 key);
+
+// Assembles eBPF instructions with named jump targets, resolved once the
+// whole program is there.
+class EbpfAssembler {
+ public:
+  void Emit(uint8 code, uint8 dst, uint8 src, int16 off, int32 imm) {
+    struct bpf_insn insn;
+    ::memset(&insn, 0, sizeof(insn));
+    insn.code = code;
+    insn.dst_reg = dst;
+    insn.src_reg = src;
+    insn.off = off;
+    insn.imm = imm;
+    insns_.push_back(insn);
+  }
+
+  void MovImm(uint8 dst, int32 imm) {
+    Emit(BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm);
+  }
+  void MovReg(uint8 dst, uint8 src) {
+    Emit(BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0);
+  }
+  void AluImm(uint8 op, uint8 dst, int32 imm) {
+    Emit(BPF_ALU64 | op | BPF_K, dst, 0, 0, imm);
+  }
+  void AluReg(uint8 op, uint8 dst, uint8 src) {
+    Emit(BPF_ALU64 | op | BPF_X, dst, src, 0, 0);
+  }
+  void Load(uint8 size, uint8 dst, uint8 src, int16 off) {
+    Emit(BPF_LDX | size | BPF_MEM, dst, src, off, 0);
+  }
+  void Store(uint8 size, uint8 dst, int16 off, uint8 src) {
+    Emit(BPF_STX | size | BPF_MEM, dst, src, off, 0);
+  }
+  void StoreImm(uint8 size, uint8 dst, int16 off, int32 imm) {
+    Emit(BPF_ST | size | BPF_MEM, dst, 0, off, imm);
+  }
+  void LoadMap(uint8 dst, int map_fd) {
+    Emit(BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, map_fd);
+    Emit(0, 0, 0, 0, 0);
+  }
+  void Call(int32 helper) {
+    Emit(BPF_JMP | BPF_CALL, 0, 0, 0, helper);
+  }
+  void Exit() {
+    Emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+  }
+  void Jump(const std::string& label) {
+    jumps_.push_back(std::make_pair(insns_.size(), label));
+    Emit(BPF_JMP | BPF_JA, 0, 0, 0, 0);
+  }
+  // compares the low 32 bits only, |imm| is not sign extended
+  void Jump32Imm(uint8 op, uint8 dst, uint32 imm, const std::string& label) {
+    jumps_.push_back(std::make_pair(insns_.size(), label));
+    Emit(BPF_JMP32 | op | BPF_K, dst, 0, 0, imm);
+  }
+  void JumpImm(uint8 op, uint8 dst, int32 imm, const std::string& label) {
+    jumps_.push_back(std::make_pair(insns_.size(), label));
+    Emit(BPF_JMP | op | BPF_K, dst, 0, 0, imm);
+  }
+  void JumpReg(uint8 op, uint8 dst, uint8 src, const std::string& label) {
+    jumps_.push_back(std::make_pair(insns_.size(), label));
+    Emit(BPF_JMP | op | BPF_X, dst, src, 0, 0);
+  }
+  void Label(const std::string& label) {
+    labels_.push_back(std::make_pair(label, insns_.size()));
+  }
+
+  // CHECK fails on a jump to a missing label or backwards
+  std::vector<struct bpf_insn> Program() const;
+
+ private:
+  std::vector<struct bpf_insn> insns_;
+  std::vector<std::pair<size_t, std::string>> jumps_;
+  std::vector<std::pair<std::string, size_t>> labels_;
+};
+
+}  // namespace tcpmany
+
+#endif  // TCPMANY_EBPF_H_
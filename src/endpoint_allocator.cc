@@ -0,0 +1,402 @@
+#include "endpoint_allocator.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "logging.h"
+
+namespace tcpmany {
+
+static bool ParsePort(const std::string& text, uint16* port) {
+  char* end = NULL;
+  long value = ::strtol(text.c_str(), &end, 10);
+  if (text.empty() || *end != '\0' || value < 1 || value > 65535) {
+    return false;
+  }
+  *port = static_cast<uint16>(value);
+  return true;
+}
+
+InetAddress SourceRange::Address(uint32 ip, uint16 port) const {
+  if (!ipv6) {
+    return InetAddress(ip, port);
+  }
+  struct in6_addr addr = prefix6;
+  addr.s6_addr32[3] = ::htonl(ip);
+  return InetAddress(addr, port);
+}
+
+// the bits of |addr| past |prefix| cleared
+static struct in6_addr MaskIp6(struct in6_addr addr, int prefix) {
+  for (int i = 0; i < 16; ++i) {
+    int bits = std::min(8, std::max(0, prefix - i * 8));
+    addr.s6_addr[i] &= bits == 0 ? 0 : 0xff << (8 - bits);
+  }
+  return addr;
+}
+
+bool ParseSourceRange(const std::string& spec, SourceRange* range) {
+  std::string ips = spec;
+  std::string rest;
+  range->first_port = 1024;
+  range->last_port = 65535;
+  range->ipv6 = false;
+  ::memset(&range->prefix6, 0, sizeof(range->prefix6));
+  if (!spec.empty() && spec[0] == '[') {
+    size_t close = spec.find(']');
+    if (close == std::string::npos) {
+      return false;
+    }
+    range->ipv6 = true;
+    ips = spec.substr(1, close - 1);
+    rest = spec.substr(close + 1);
+    // the prefix may sit on either side of the bracket
+    if (!rest.empty() && rest[0] == '/') {
+      size_t colon = rest.find(':');
+      ips += rest.substr(0, colon);
+      rest = colon == std::string::npos ? "" : rest.substr(colon);
+    }
+    if (!rest.empty() && rest[0] != ':') {
+      return false;
+    }
+  } else if (std::count(spec.begin(), spec.end(), ':') > 1) {
+    range->ipv6 = true;
+  } else {
+    size_t colon = spec.find(':');
+    if (colon != std::string::npos) {
+      ips = spec.substr(0, colon);
+      rest = spec.substr(colon);
+    }
+  }
+  if (!rest.empty()) {
+    std::string ports = rest.substr(1);
+    size_t dash = ports.find('-');
+    if (dash == std::string::npos) {
+      if (!ParsePort(ports, &range->first_port)) {
+        return false;
+      }
+      range->last_port = range->first_port;
+    } else if (!ParsePort(ports.substr(0, dash), &range->first_port) ||
+               !ParsePort(ports.substr(dash + 1), &range->last_port) ||
+               range->first_port > range->last_port) {
+      return false;
+    }
+  }
+  const int max_prefix = range->ipv6 ? 128 : 32;
+  int prefix = max_prefix;
+  size_t slash = ips.find('/');
+  if (slash != std::string::npos) {
+    char* end = NULL;
+    prefix = ::strtol(ips.c_str() + slash + 1, &end, 10);
+    if (slash + 1 == ips.size() || *end != '\0' || prefix < 0 ||
+        prefix > max_prefix) {
+      return false;
+    }
+    ips.resize(slash);
+  }
+  if (range->ipv6) {
+    struct in6_addr addr6;
+    if (::inet_pton(AF_INET6, ips.c_str(), &addr6) != 1) {
+      return false;
+    }
+    addr6 = MaskIp6(addr6, prefix);
+    const int host_bits = std::min(32, 128 - prefix);
+    uint32 mask = host_bits == 32 ? 0 : ~0u << host_bits;
+    range->ips.first = ::ntohl(addr6.s6_addr32[3]) & mask;
+    range->ips.last = range->ips.first | ~mask;
+    // the subnet-router anycast address, ipv6 has no broadcast
+    if (prefix <= 126) {
+      ++range->ips.first;
+    }
+    addr6.s6_addr32[3] = 0;
+    range->prefix6 = addr6;
+    return true;
+  }
+  struct in_addr addr;
+  if (::inet_pton(AF_INET, ips.c_str(), &addr) != 1) {
+    return false;
+  }
+  uint32 mask = prefix == 0 ? 0 : ~0u << (32 - prefix);
+  range->ips.first = ::ntohl(addr.s_addr) & mask;
+  range->ips.last = range->ips.first | ~mask;
+  // a network's own address and its broadcast address are no clients
+  if (prefix <= 30) {
+    ++range->ips.first;
+    --range->ips.last;
+  }
+  return true;
+}
+
+EndpointAllocator::EndpointAllocator(const std::vector<SourceRange>& ranges,
+                                     std::chrono::milliseconds quarantine)
+    : quarantine_(quarantine),
+      capacity_(0),
+      limit_(0),
+      in_use_(0),
+      ips_in_use_(0) {
+  uint64 ip_count = 0;
+  for (const SourceRange& source : ranges) {
+    CHECK(source.ips.first <= source.ips.last &&
+          source.first_port <= source.last_port);
+    for (const Range& other : ranges_) {
+      CHECK(source.ipv6 != other.source.ipv6 ||
+            (source.ipv6 && ::memcmp(&source.prefix6, &other.source.prefix6,
+                                     sizeof(source.prefix6)) != 0) ||
+            source.ips.last < other.source.ips.first ||
+            source.ips.first > other.source.ips.last ||
+            source.last_port < other.source.first_port ||
+            source.first_port > other.source.last_port)
+          << "overlapping source ranges";
+    }
+    Range range;
+    range.source = source;
+    range.ports = source.last_port - source.first_port + 1;
+    range.first_index = capacity_;
+    range.first_ip_index = ip_count;
+    ranges_.push_back(range);
+    uint64 ips = static_cast<uint64>(source.ips.last) - source.ips.first + 1;
+    capacity_ += ips * range.ports;
+    ip_count += ips;
+  }
+  // as many levels as the whole capacity needs, all empty for now
+  uint64 words = capacity_;
+  do {
+    words = (words + 63) / 64;
+    levels_.push_back(std::vector<uint64>());
+  } while (words > 1);
+}
+
+bool EndpointAllocator::Allocate(InetAddress* addr) {
+  ReleaseExpired();
+  uint64 index;
+  // what Grow adds may all be reserved already
+  while (!FindFree(&index)) {
+    if (limit_ == capacity_) {
+      return false;
+    }
+    Grow(limit_ + 4096);
+  }
+  Take(index);
+  const Range& range = RangeOf(index);
+  uint64 offset = index - range.first_index;
+  *addr = range.source.Address(range.source.ips.first + offset / range.ports,
+                               range.source.first_port + offset % range.ports);
+  return true;
+}
+
+bool EndpointAllocator::Reserve(const InetAddress& addr) {
+  ReleaseExpired();
+  uint64 index;
+  if (!Index(addr, &index)) {
+    return false;
+  }
+  if (index < limit_ + kDenseReserve) {
+    Grow(index + 1);
+  }
+  if (index < limit_
+          ? (levels_[0][index / 64] & (1ull << (index % 64))) == 0
+          : reserved_.count(index) != 0) {
+    return false;
+  }
+  Take(index);
+  return true;
+}
+
+void EndpointAllocator::Free(const InetAddress& addr) {
+  uint64 index;
+  if (!Index(addr, &index)) {
+    return;
+  }
+  const uint64 ip_index = IpIndex(index);
+  uint32& ip_use = IpUse(ip_index);
+  CHECK(ip_use > 0) << "endpoint freed twice";
+  if (--ip_use == 0) {
+    --ips_in_use_;
+    if (ip_index >= ip_use_.size()) {
+      far_ip_use_.erase(ip_index);
+    }
+  }
+  --in_use_;
+  if (quarantine_.count() <= 0) {
+    Release(index);
+    return;
+  }
+  QuarantineEntry entry;
+  entry.until = Clock::now() + quarantine_;
+  entry.index = index;
+  quarantined_.push_back(entry);
+}
+
+bool EndpointAllocator::Contains(const InetAddress& addr) const {
+  uint64 index;
+  return Index(addr, &index);
+}
+
+uint64 EndpointAllocator::MemoryBytes() const {
+  // a hash node is about 32 bytes
+  uint64 bytes = ip_use_.capacity() * sizeof(uint32) +
+                 quarantined_.size() * sizeof(QuarantineEntry) +
+                 (reserved_.size() + far_ip_use_.size()) * 32;
+  for (const auto& level : levels_) {
+    bytes += level.capacity() * sizeof(uint64);
+  }
+  return bytes;
+}
+
+bool EndpointAllocator::Index(const InetAddress& addr, uint64* index) const {
+  const bool ipv6 = addr.IsIpv6();
+  const struct in6_addr& ip6 = addr.SockAddr6().sin6_addr;
+  const uint32 ip = ipv6 ? ::ntohl(ip6.s6_addr32[3]) : addr.IpHost();
+  const uint16 port = addr.PortHost();
+  for (const Range& range : ranges_) {
+    if (range.source.ipv6 != ipv6 ||
+        (ipv6 && ::memcmp(&range.source.prefix6, &ip6, 12) != 0)) {
+      continue;
+    }
+    if (ip >= range.source.ips.first && ip <= range.source.ips.last &&
+        port >= range.source.first_port && port <= range.source.last_port) {
+      *index = range.first_index +
+               static_cast<uint64>(ip - range.source.ips.first) * range.ports +
+               (port - range.source.first_port);
+      return true;
+    }
+  }
+  return false;
+}
+
+const EndpointAllocator::Range& EndpointAllocator::RangeOf(
+    uint64 index) const {
+  size_t i = ranges_.size() - 1;
+  while (index < ranges_[i].first_index) {
+    --i;
+  }
+  return ranges_[i];
+}
+
+uint64 EndpointAllocator::IpIndex(uint64 index) const {
+  const Range& range = RangeOf(index);
+  return range.first_ip_index + (index - range.first_index) / range.ports;
+}
+
+uint32& EndpointAllocator::IpUse(uint64 ip_index) {
+  if (ip_index < ip_use_.size()) {
+    return ip_use_[ip_index];
+  }
+  return far_ip_use_[ip_index];
+}
+
+void EndpointAllocator::Take(uint64 index) {
+  if (index < limit_) {
+    MarkUsed(index);
+  } else {
+    reserved_.insert(index);
+  }
+  ++in_use_;
+  if (IpUse(IpIndex(index))++ == 0) {
+    ++ips_in_use_;
+  }
+}
+
+void EndpointAllocator::Release(uint64 index) {
+  if (index < limit_) {
+    MarkFree(index);
+  } else {
+    reserved_.erase(index);
+  }
+}
+
+void EndpointAllocator::ReleaseExpired() {
+  if (quarantined_.empty()) {
+    return;
+  }
+  Clock::time_point now = Clock::now();
+  while (!quarantined_.empty() && quarantined_.front().until <= now) {
+    Release(quarantined_.front().index);
+    quarantined_.pop_front();
+  }
+}
+
+void EndpointAllocator::Grow(uint64 limit) {
+  limit = std::min(capacity_, limit);
+  while (limit_ < limit) {
+    // a whole word at a time, limit_ stays a multiple of 64 until the end
+    uint64 bits = std::min<uint64>(64, capacity_ - limit_);
+    uint64 index = limit_ / 64;
+    levels_[0].push_back(bits == 64 ? ~0ull : (1ull << bits) - 1);
+    for (size_t level = 1; level < levels_.size(); ++level) {
+      std::vector<uint64>& words = levels_[level];
+      if (words.size() <= index / 64) {
+        words.push_back(0);
+      }
+      uint64& word = words[index / 64];
+      bool was_empty = word == 0;
+      word |= 1ull << (index % 64);
+      if (!was_empty) {
+        break;
+      }
+      index /= 64;
+    }
+    limit_ += bits;
+  }
+  if (limit_ > 0) {
+    ip_use_.resize(IpIndex(limit_ - 1) + 1, 0);
+  }
+  for (auto iter = reserved_.begin(); iter != reserved_.end();) {
+    if (*iter < limit_) {
+      MarkUsed(*iter);
+      iter = reserved_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+  for (auto iter = far_ip_use_.begin(); iter != far_ip_use_.end();) {
+    if (iter->first < ip_use_.size()) {
+      ip_use_[iter->first] += iter->second;
+      iter = far_ip_use_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+}
+
+void EndpointAllocator::MarkFree(uint64 index) {
+  for (std::vector<uint64>& level : levels_) {
+    uint64& word = level[index / 64];
+    bool was_empty = word == 0;
+    word |= 1ull << (index % 64);
+    if (!was_empty) {
+      break;
+    }
+    index /= 64;
+  }
+}
+
+void EndpointAllocator::MarkUsed(uint64 index) {
+  for (std::vector<uint64>& level : levels_) {
+    uint64& word = level[index / 64];
+    word &= ~(1ull << (index % 64));
+    if (word != 0) {
+      break;
+    }
+    index /= 64;
+  }
+}
+
+bool EndpointAllocator::FindFree(uint64* index) const {
+  if (levels_.back().empty()) {
+    return false;
+  }
+  uint64 found = 0;
+  for (size_t level = levels_.size(); level-- > 0;) {
+    uint64 word = levels_[level][found];
+    if (word == 0) {
+      return false;
+    }
+    found = found * 64 + __builtin_ctzll(word);
+  }
+  *index = found;
+  return true;
+}
+
+}  // namespace tcpmany
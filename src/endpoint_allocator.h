@@ -0,0 +1,142 @@
+#ifndef TCPMANY_ENDPOINT_ALLOCATOR_H_
+#define TCPMANY_ENDPOINT_ALLOCATOR_H_
+
+#include <chrono>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "base.h"
+#include "inet_address.h"
+#include "noncopyable.h"
+
+namespace tcpmany {
+
+// Fake client addresses times a range of ports, all in host order and
+// inclusive. The addresses of an ipv6 range are |prefix6| with the last
+// 32 bits replaced by those in |ips|.
+struct SourceRange {
+  IpRange ips;
+  uint16 first_port;
+  uint16 last_port;
+  bool ipv6;
+  struct in6_addr prefix6;
+
+  // |ip| is one of ips
+  InetAddress Address(uint32 ip, uint16 port) const;
+};
+
+// Parses "<ip>[/<prefix>][:<port>[-<port>]]", e.g. "10.64.0.0/16" or
+// "10.64.0.1:2000-2999", with an ipv6 address in brackets when ports
+// follow, e.g. "[fd00:64::]/64:2000-2999". The ports default to
+// 1024-65535. Of a prefix shorter than /96 only the first 2^32 - 1
+// addresses are used, which is 2^48 endpoints.
+bool ParseSourceRange(const std::string& spec, SourceRange* range);
+
+// Hands out source ip:port pairs from a set of SourceRanges, lowest first:
+// every port of an address is used before the next address is touched, so
+// a million connections need a few dozen fake addresses instead of a
+// million. A free endpoint is a set bit in a bitmap with a summary bitmap
+// on top of every 64 words, finding one costs a handful of word scans for
+// any size. The bitmap only reaches as far as the highest endpoint handed
+// out so far, a /10 costs nothing until it is used. An endpoint reserved
+// far past its end is kept in a set until the bitmap gets there, one
+// address deep in a /10 doesn't cost gigabytes of bitmap.
+//
+// A freed endpoint waits |quarantine| before it is handed out again, the
+// server may still hold the old connection in TIME_WAIT. Not thread safe.
+class EndpointAllocator : public NonCopyable {
+ public:
+  EndpointAllocator(const std::vector<SourceRange>& ranges,
+                    std::chrono::milliseconds quarantine);
+
+  // false when every endpoint is in use or in quarantine
+  bool Allocate(InetAddress* addr);
+  // Takes a specific endpoint, false if it is in use or in quarantine. The
+  // bitmap grows up to it when it is at most kDenseReserve endpoints past
+  // the bitmap's end.
+  bool Reserve(const InetAddress& addr);
+  // does nothing for endpoints outside the ranges
+  void Free(const InetAddress& addr);
+  bool Contains(const InetAddress& addr) const;
+
+  uint64 Capacity() const {
+    return capacity_;
+  }
+  uint64 InUse() const {
+    return in_use_;
+  }
+  uint64 Quarantined() const {
+    return quarantined_.size();
+  }
+  // addresses with at least one endpoint in use
+  uint64 IpsInUse() const {
+    return ips_in_use_;
+  }
+  // held by the bitmaps, the per address counts, the quarantine and the
+  // far reservations
+  uint64 MemoryBytes() const;
+
+  // 2MB of bitmap
+  static const uint64 kDenseReserve = 1 << 24;
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Range {
+    SourceRange source;
+    uint64 ports;
+    // of its first endpoint, and of its first address in ip_use_
+    uint64 first_index;
+    uint64 first_ip_index;
+  };
+  struct QuarantineEntry {
+    Clock::time_point until;
+    uint64 index;
+  };
+
+  bool Index(const InetAddress& addr, uint64* index) const;
+  const Range& RangeOf(uint64 index) const;
+  // of the endpoint's address in ip_use_
+  uint64 IpIndex(uint64 index) const;
+  // the endpoints in use of an address, in ip_use_ or far_ip_use_
+  uint32& IpUse(uint64 ip_index);
+  void Take(uint64 index);
+  // back to free, in the bitmap or out of reserved_
+  void Release(uint64 index);
+  // endpoints whose quarantine is over go back to the bitmap
+  void ReleaseExpired();
+
+  // extends the bitmap and ip_use_ to cover endpoints below |limit|, and
+  // moves what reserved_ and far_ip_use_ hold below it there
+  void Grow(uint64 limit);
+  void MarkFree(uint64 index);
+  void MarkUsed(uint64 index);
+  bool FindFree(uint64* index) const;
+
+  std::vector<Range> ranges_;
+  const Clock::duration quarantine_;
+  uint64 capacity_;
+  // endpoints from here on are free and not in the bitmap yet
+  uint64 limit_;
+  uint64 in_use_;
+  uint64 ips_in_use_;
+  // levels_[0] has a bit per endpoint below limit_, set while it is free,
+  // every level above a bit per word of the one below, set while that word
+  // isn't 0. The top level has at most one word.
+  std::vector<std::vector<uint64> > levels_;
+  // endpoints in use per address, for the addresses below limit_
+  std::vector<uint32> ip_use_;
+  // taken endpoints from limit_ on, in use or in quarantine, and the
+  // endpoints in use of the addresses ip_use_ doesn't reach yet
+  std::unordered_set<uint64> reserved_;
+  std::unordered_map<uint64, uint32> far_ip_use_;
+  // in the order they were freed, so also in the order they expire
+  std::deque<QuarantineEntry> quarantined_;
+};
+
+}  // namespace tcpmany
+
+#endif  // TCPMANY_ENDPOINT_ALLOCATOR_H_
@@ -0,0 +1,66 @@
+#include "event_dispatcher.h"
+
+#include "logging.h"
+
+namespace tcpmany {
+
+EventDispatcher::EventDispatcher(int threads, size_t queue_size)
+    : dispatched_(0),
+      waits_(0),
+      queued_bytes_(0) {
+  CHECK(threads > 0 && queue_size > 0);
+  for (int i = 0; i < threads; ++i) {
+    queues_.emplace_back(new TaskQueue(queue_size));
+  }
+  for (int i = 0; i < threads; ++i) {
+    threads_.emplace_back(&EventDispatcher::WorkerThread, this,
+                          queues_[i].get());
+  }
+}
+
+EventDispatcher::~EventDispatcher() {
+  // an empty task tells the thread its queue is done
+  for (auto& queue : queues_) {
+    queue->Push(Entry());
+  }
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+void EventDispatcher::Dispatch(const void* key, const Task& task,
+                               size_t bytes) {
+  // spreads keys that are heap addresses of equally sized objects
+  uint64 hash = reinterpret_cast<uintptr_t>(key) * 0x9e3779b97f4a7c15ull;
+  size_t index = (hash >> 32) % queues_.size();
+  TaskQueue* queue = queues_[index].get();
+  Entry entry = {task, sizeof(Entry) + bytes};
+  queued_bytes_ += entry.bytes;
+  if (!queue->TryPush(entry)) {
+    ++waits_;
+    queue->Push(entry);
+  }
+  ++dispatched_;
+}
+
+uint64 EventDispatcher::Queued() const {
+  uint64 queued = 0;
+  for (const auto& queue : queues_) {
+    queued += queue->Size();
+  }
+  return queued;
+}
+
+void EventDispatcher::WorkerThread(TaskQueue* queue) {
+  Entry entry;
+  while (true) {
+    queue->Pop(entry);
+    if (!entry.task) {
+      break;
+    }
+    entry.task();
+    queued_bytes_ -= entry.bytes;
+  }
+}
+
+}  // namespace tcpmany
@@ -0,0 +1,64 @@
+#ifndef TCPMANY_EVENT_DISPATCHER_H_
+#define TCPMANY_EVENT_DISPATCHER_H_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "base.h"
+#include "blocking_queue.h"
+#include "noncopyable.h"
+
+namespace tcpmany {
+
+// Runs tasks on a fixed pool of threads, each with its own bounded queue.
+// Tasks with the same key always go to the same thread, so they run one at
+// a time and in the order they were dispatched. When a queue is full
+// Dispatch waits for room, which the Waits counter makes visible.
+class EventDispatcher : public NonCopyable {
+ public:
+  typedef std::function<void ()> Task;
+
+  EventDispatcher(int threads, size_t queue_size);
+  // runs whatever is still queued, then joins the threads
+  ~EventDispatcher();
+
+  // |bytes| is what the task holds beyond itself, a copied message for
+  // instance, counted in QueuedBytes until it has run.
+  void Dispatch(const void* key, const Task& task, size_t bytes = 0);
+
+  // tasks waiting in the queues right now
+  uint64 Queued() const;
+  // and the memory they hold
+  uint64 QueuedBytes() const {
+    return queued_bytes_;
+  }
+  uint64 Dispatched() const {
+    return dispatched_;
+  }
+  // times Dispatch found the queue full and had to wait
+  uint64 Waits() const {
+    return waits_;
+  }
+
+ private:
+  struct Entry {
+    Task task;
+    size_t bytes;
+  };
+  typedef BoundedBlockingQueue<Entry> TaskQueue;
+
+  void WorkerThread(TaskQueue* queue);
+
+  std::vector<std::unique_ptr<TaskQueue> > queues_;
+  std::vector<std::thread> threads_;
+  std::atomic<uint64> dispatched_;
+  std::atomic<uint64> waits_;
+  std::atomic<uint64> queued_bytes_;
+};
+
+}  // namespace tcpmany
+
+#endif  // TCPMANY_EVENT_DISPATCHER_H_
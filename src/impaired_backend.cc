@@ -0,0 +1,362 @@
+#include "impaired_backend.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <cmath>
+
+#include "logging.h"
+
+namespace tcpmany {
+
+namespace {
+
+// links entries before the first sweep for idle ones
+const size_t kMinLinksSweepSize = 65536;
+
+bool ParseProbability(const std::string& value, double* result) {
+  char* end = NULL;
+  *result = ::strtod(value.c_str(), &end);
+  return !value.empty() && *end == '\0' && *result >= 0 && *result <= 1;
+}
+
+bool ParseMs(const std::string& value, int* result) {
+  char* end = NULL;
+  long ms = ::strtol(value.c_str(), &end, 10);
+  if (value.empty() || *end != '\0' || ms < 0 || ms > 3600 * 1000) {
+    return false;
+  }
+  *result = static_cast<int>(ms);
+  return true;
+}
+
+bool ParseBandwidth(const std::string& value, uint64* bps) {
+  char* end = NULL;
+  double rate = ::strtod(value.c_str(), &end);
+  if (value.empty() || rate < 0) {
+    return false;
+  }
+  if (*end == 'k' || *end == 'K') {
+    rate *= 1e3;
+    ++end;
+  } else if (*end == 'm' || *end == 'M') {
+    rate *= 1e6;
+    ++end;
+  } else if (*end == 'g' || *end == 'G') {
+    rate *= 1e9;
+    ++end;
+  }
+  *bps = static_cast<uint64>(rate);
+  return *end == '\0';
+}
+
+uint64 Mix(uint64 key) {
+  // The finalizer of MurmurHash3, so that neighbouring addresses spread
+  // over all bits; Endpoint6KeyHash leaves the upper ones to the prefix.
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdull;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ull;
+  return key ^ key >> 33;
+}
+
+}  // namespace
+
+bool ParseImpairmentGroup(const std::string& spec, ImpairmentGroup* group) {
+  *group = ImpairmentGroup();
+  ImpairmentProfile* profile = &group->profile;
+  size_t begin = 0;
+  while (begin < spec.size()) {
+    size_t end = spec.find(',', begin);
+    if (end == std::string::npos) {
+      end = spec.size();
+    }
+    const std::string pair = spec.substr(begin, end - begin);
+    begin = end + 1;
+    const size_t equal = pair.find('=');
+    if (equal == std::string::npos) {
+      return false;
+    }
+    const std::string key = pair.substr(0, equal);
+    const std::string value = pair.substr(equal + 1);
+    bool ok;
+    if (key == "share") {
+      ok = ParseProbability(value, &group->share);
+    } else if (key == "drop") {
+      ok = ParseProbability(value, &profile->drop);
+    } else if (key == "dup") {
+      ok = ParseProbability(value, &profile->duplicate);
+    } else if (key == "reorder") {
+      ok = ParseProbability(value, &profile->reorder);
+    } else if (key == "reorder_ms") {
+      ok = ParseMs(value, &profile->reorder_ms);
+    } else if (key == "delay") {
+      ok = ParseMs(value, &profile->delay_ms);
+    } else if (key == "jitter") {
+      ok = ParseMs(value, &profile->jitter_ms);
+    } else if (key == "dist") {
+      ok = true;
+      if (value == "uniform") {
+        profile->distribution = DELAY_UNIFORM;
+      } else if (value == "normal") {
+        profile->distribution = DELAY_NORMAL;
+      } else if (value == "pareto") {
+        profile->distribution = DELAY_PARETO;
+      } else {
+        ok = false;
+      }
+    } else if (key == "bw") {
+      ok = ParseBandwidth(value, &profile->bandwidth_bps);
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+ImpairedBackend::Direction::Direction(uint64 seed)
+    : links_sweep_size(kMinLinksSweepSize),
+      order(0),
+      // xorshift must not start from 0
+      random(Mix(seed) | 1) {}
+
+ImpairedBackend::ImpairedBackend(const std::shared_ptr<IoBackend>& inner,
+                                 const ImpairmentOptions& options,
+                                 const std::vector<InetAddress>& servers)
+    : inner_(inner),
+      options_(options),
+      tx_(options.seed),
+      rx_(options.seed + 1),
+      drops_(0),
+      duplicates_(0),
+      reorders_(0),
+      pending_(0) {
+  for (const InetAddress& server : servers) {
+    if (server.IsIpv6()) {
+      servers6_.push_back(server.SockAddr6().sin6_addr);
+    } else {
+      servers_.push_back(::htonl(server.IpHost()));
+    }
+  }
+}
+
+int ImpairedBackend::Receive(Packet* packet) {
+  if (!rx_.queue.empty() && rx_.queue.top().due <= Clock::now()) {
+    const PacketPtr& delayed = rx_.queue.top().packet;
+    ::memcpy(packet->Buffer(), delayed->Buffer(), delayed->Size());
+    // it arrives now, the round trip times measured take the delay in
+    struct timespec now;
+    ::clock_gettime(CLOCK_REALTIME, &now);
+    packet->timestamp.software =
+        static_cast<int64>(now.tv_sec) * 1000000000 + now.tv_nsec;
+    packet->timestamp.hardware = 0;
+    rx_.queue.pop();
+    --pending_;
+    return packet->Size();
+  }
+  int len = inner_->Receive(packet);
+  if (len < Packet::HEADER_LEN || !packet->IsTcp()) {
+    return len;
+  }
+  // held back or dropped, like nothing arrived
+  return Impair(&rx_, *packet, ClientOfReceived(*packet)) ? 0 : len;
+}
+
+int ImpairedBackend::Send(const Packet& packet) {
+  if (Impair(&tx_, packet, ClientOfSent(packet))) {
+    // the packet left as far as the Kernel is concerned
+    return packet.Size();
+  }
+  return inner_->Send(packet);
+}
+
+int ImpairedBackend::SendDue() {
+  if (tx_.queue.empty()) {
+    return kMaxWaitMs;
+  }
+  const Clock::time_point now = Clock::now();
+  while (!tx_.queue.empty() && tx_.queue.top().due <= now) {
+    if (inner_->Send(*tx_.queue.top().packet) == -1) {
+      LOG_EVERY_N_SEC(ERROR, 1) << "send error: " << ::strerror(errno);
+    }
+    tx_.queue.pop();
+    --pending_;
+  }
+  if (tx_.queue.empty()) {
+    return kMaxWaitMs;
+  }
+  // rounded up, the packet is not due before
+  int64 wait_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      tx_.queue.top().due - now).count();
+  return static_cast<int>(std::min<int64>((wait_us + 999) / 1000,
+                                          kMaxWaitMs));
+}
+
+ImpairedBackend::Stats ImpairedBackend::GetStats() const {
+  Stats stats;
+  stats.drops = drops_;
+  stats.duplicates = duplicates_;
+  stats.reorders = reorders_;
+  stats.pending = pending_;
+  return stats;
+}
+
+uint64 ImpairedBackend::ClientOfSent(const Packet& packet) const {
+  return Mix(packet.IsIpv6() ? Endpoint6KeyHash()(packet.SrcKey6())
+                             : packet.SrcKey());
+}
+
+uint64 ImpairedBackend::ClientOfReceived(const Packet& packet) const {
+  // the same two forms Kernel::Demux looks up
+  if (FromServer(packet)) {
+    return Mix(packet.IsIpv6() ? Endpoint6KeyHash()(packet.DstKey6())
+                               : packet.DstKey());
+  }
+  return Mix(packet.IsIpv6()
+                 ? Endpoint6KeyHash()(EndpointKey(packet.SrcIp6(),
+                                                  packet.DstPortNet()))
+                 : EndpointKey(packet.SrcIpNet(), packet.DstPortNet()));
+}
+
+bool ImpairedBackend::FromServer(const Packet& packet) const {
+  if (servers_.empty() && servers6_.empty()) {
+    return true;
+  }
+  if (packet.IsIpv6()) {
+    for (const struct in6_addr& server : servers6_) {
+      if (::memcmp(&server, &packet.SrcIp6(), sizeof(server)) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+  return std::find(servers_.begin(), servers_.end(), packet.SrcIpNet()) !=
+         servers_.end();
+}
+
+const ImpairmentProfile* ImpairedBackend::ProfileOf(uint64 client) const {
+  // the upper 53 bits as a fraction in [0, 1)
+  const double point = (client >> 11) * (1.0 / (1ull << 53));
+  double end = 0;
+  for (const ImpairmentGroup& group : options_.groups) {
+    end += group.share;
+    if (point < end) {
+      return &group.profile;
+    }
+  }
+  return NULL;
+}
+
+bool ImpairedBackend::Impair(Direction* dir, const Packet& packet,
+                             uint64 client) {
+  const ImpairmentProfile* profile = ProfileOf(client);
+  if (profile == NULL) {
+    return false;
+  }
+  if (profile->drop > 0 && Random(dir) < profile->drop) {
+    ++drops_;
+    return true;
+  }
+  int copies = 1;
+  if (profile->duplicate > 0 && Random(dir) < profile->duplicate) {
+    copies = 2;
+    ++duplicates_;
+  }
+  Clock::duration delay = Delay(dir, *profile);
+  if (profile->reorder > 0 && Random(dir) < profile->reorder) {
+    delay += std::chrono::milliseconds(profile->reorder_ms);
+    ++reorders_;
+  }
+  if (copies == 1 && delay <= Clock::duration::zero() &&
+      profile->bandwidth_bps == 0) {
+    return false;
+  }
+  const Clock::time_point now = Clock::now();
+  if (profile->bandwidth_bps == 0) {
+    for (int i = 0; i < copies; ++i) {
+      Hold(dir, packet, now + delay);
+    }
+    return true;
+  }
+  // each copy is serialized onto the client's link after what is already
+  // on it, then travels for |delay|
+  const Clock::duration transmit = std::chrono::nanoseconds(
+      static_cast<int64>(packet.Size() * 8 * 1e9 / profile->bandwidth_bps));
+  Clock::time_point& busy = dir->links[client];
+  for (int i = 0; i < copies; ++i) {
+    busy = std::max(busy, now) + transmit;
+    Hold(dir, packet, busy + delay);
+  }
+  if (dir->links.size() >= dir->links_sweep_size) {
+    SweepLinks(dir, now);
+  }
+  return true;
+}
+
+ImpairedBackend::Clock::duration ImpairedBackend::Delay(
+    Direction* dir, const ImpairmentProfile& profile) {
+  double ms = profile.delay_ms;
+  if (profile.jitter_ms > 0) {
+    switch (profile.distribution) {
+      case DELAY_UNIFORM:
+        ms += (2 * Random(dir) - 1) * profile.jitter_ms;
+        break;
+      case DELAY_NORMAL:
+        // Box-Muller
+        ms += profile.jitter_ms *
+              std::sqrt(-2 * std::log(1 - Random(dir))) *
+              std::cos(2 * M_PI * Random(dir));
+        break;
+      case DELAY_PARETO:
+        // shape 2, the part above delay_ms averages jitter_ms, capped at
+        // 100 times that
+        ms += profile.jitter_ms *
+              std::min(1 / std::sqrt(1 - Random(dir)) - 1, 100.0);
+        break;
+    }
+  }
+  if (ms <= 0) {
+    return Clock::duration::zero();
+  }
+  return std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double, std::milli>(ms));
+}
+
+void ImpairedBackend::Hold(Direction* dir, const Packet& packet,
+                           Clock::time_point due) {
+  Delayed delayed;
+  delayed.due = due;
+  delayed.order = dir->order++;
+  delayed.packet = std::make_shared<Packet>(packet);
+  dir->queue.push(delayed);
+  ++pending_;
+}
+
+void ImpairedBackend::SweepLinks(Direction* dir, Clock::time_point now) {
+  for (auto iter = dir->links.begin(); iter != dir->links.end();) {
+    if (iter->second <= now) {
+      iter = dir->links.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+  dir->links_sweep_size =
+      std::max(kMinLinksSweepSize, dir->links.size() * 2);
+}
+
+double ImpairedBackend::Random(Direction* dir) {
+  // xorshift64*
+  dir->random ^= dir->random >> 12;
+  dir->random ^= dir->random << 25;
+  dir->random ^= dir->random >> 27;
+  return ((dir->random * 0x2545f4914f6cdd1dull) >> 11) *
+         (1.0 / (1ull << 53));
+}
+
+}  // namespace tcpmany
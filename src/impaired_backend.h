@@ -0,0 +1,197 @@
+#ifndef TCPMANY_IMPAIRED_BACKEND_H_
+#define TCPMANY_IMPAIRED_BACKEND_H_
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "inet_address.h"
+#include "io_backend.h"
+#include "packet.h"
+
+namespace tcpmany {
+
+enum DelayDistribution {
+  // delay_ms give or take jitter_ms
+  DELAY_UNIFORM,
+  // delay_ms on average with a standard deviation of jitter_ms
+  DELAY_NORMAL,
+  // at least delay_ms plus a heavy tail averaging jitter_ms
+  DELAY_PARETO,
+};
+
+// What happens to the packets of a client, in each direction on its own.
+struct ImpairmentProfile {
+  // probabilities, per packet
+  double drop;
+  double duplicate;
+  // a reordered packet is held back reorder_ms longer than the rest
+  double reorder;
+  int reorder_ms;
+  int delay_ms;
+  int jitter_ms;
+  DelayDistribution distribution;
+  // bits per second a client's link carries in each direction, 0 for no
+  // limit. Packets wait for their turn, none is dropped for it.
+  uint64 bandwidth_bps;
+
+  ImpairmentProfile()
+      : drop(0),
+        duplicate(0),
+        reorder(0),
+        reorder_ms(10),
+        delay_ms(0),
+        jitter_ms(0),
+        distribution(DELAY_UNIFORM),
+        bandwidth_bps(0) {}
+};
+
+struct ImpairmentGroup {
+  // the fraction of the clients in the group, picked by a hash of their
+  // address and port
+  double share;
+  ImpairmentProfile profile;
+
+  ImpairmentGroup() : share(1) {}
+};
+
+struct ImpairmentOptions {
+  // Each client falls into the first group its hash lands in, the groups
+  // taking up their shares one after the other. Clients past the sum of
+  // the shares go unimpaired.
+  std::vector<ImpairmentGroup> groups;
+  uint64 seed;
+
+  ImpairmentOptions() : seed(1) {}
+};
+
+// Parses comma separated key=value pairs, e.g.
+// "share=0.1,drop=0.01,delay=50,jitter=10,dist=normal,bw=2m". The keys are
+// share, drop, dup, reorder and reorder_ms, delay and jitter in ms, dist
+// (uniform, normal or pareto) and bw in bits per second, with k, m or g.
+// Left out keys keep their defaults.
+bool ParseImpairmentGroup(const std::string& spec, ImpairmentGroup* group);
+
+// Puts a lossy, slow network between the Kernel and another backend: drops,
+// duplicates, delays and reorders packets and caps the bandwidth of each
+// client, sent and received packets alike. The Kernel wraps its backend
+// in one when KernelOptions::impairment has groups, and costs nothing more
+// without.
+//
+// Held back packets wait in a queue per direction, ordered by when they
+// are due, which only the thread of that direction touches: the send
+// thread sends them between the packets it takes from its queue (see
+// SendDue), the receive thread hands them over before reading more. A
+// received packet can come late by up to the inner backend's receive
+// timeout, 100ms for the default backends, when nothing else arrives to
+// wake the receive thread up. What is still held back at Stop is dropped.
+//
+// Connection never retransmits and acks whatever segment arrived last, so
+// this is no lossy client as a real stack would be: a lost or reordered
+// server segment is acked over and the server never sends it again, a
+// lost client segment leaves a gap the server waits on for good, and a
+// lost SYN or SYN-ACK leaves the connection in SYN_SENT, counted by
+// KernelStats::syn_sent. Delay, jitter and bandwidth are what it models
+// faithfully; drops, duplicates and reordering only exercise the server's
+// handling of them.
+class ImpairedBackend : public IoBackend {
+ public:
+  struct Stats {
+    uint64 drops;
+    uint64 duplicates;
+    uint64 reorders;
+    // held back, not yet sent or received
+    uint64 pending;
+  };
+
+  // |servers| tell received packets in the capture form (from a server,
+  // to the client) from those a redirect turned around (from the client's
+  // address, to its port); without servers all are taken as captured.
+  ImpairedBackend(const std::shared_ptr<IoBackend>& inner,
+                  const ImpairmentOptions& options,
+                  const std::vector<InetAddress>& servers);
+
+  virtual int Receive(Packet* packet);
+  virtual int Send(const Packet& packet);
+  virtual bool EnableTxTimestamps() {
+    return inner_->EnableTxTimestamps();
+  }
+  virtual int ReadTxTimestamp(Packet* packet) {
+    return inner_->ReadTxTimestamp(packet);
+  }
+  virtual uint64 Drops() const {
+    return inner_->Drops();
+  }
+  virtual uint64 Filtered() const {
+    return inner_->Filtered();
+  }
+
+  // Sends the held back packets that are due, from the send thread.
+  // Returns the ms until the next one is, at most kMaxWaitMs.
+  int SendDue();
+
+  Stats GetStats() const;
+
+  static const int kMaxWaitMs = 100;
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Delayed {
+    Clock::time_point due;
+    // keeps packets due at the same time in order
+    uint64 order;
+    PacketPtr packet;
+
+    bool operator>(const Delayed& other) const {
+      return due != other.due ? due > other.due : order > other.order;
+    }
+  };
+
+  // the state of one direction, only touched by its thread
+  struct Direction {
+    std::priority_queue<Delayed, std::vector<Delayed>,
+                        std::greater<Delayed> > queue;
+    // until when a client's link is busy, with the bandwidth capped
+    std::unordered_map<uint64, Clock::time_point> links;
+    size_t links_sweep_size;
+    uint64 order;
+    uint64 random;
+
+    explicit Direction(uint64 seed);
+  };
+
+  // the hash of the client a packet belongs to
+  uint64 ClientOfSent(const Packet& packet) const;
+  uint64 ClientOfReceived(const Packet& packet) const;
+  bool FromServer(const Packet& packet) const;
+  // NULL when the client goes unimpaired
+  const ImpairmentProfile* ProfileOf(uint64 client) const;
+  // Drops |packet| or holds it back, a duplicate too, and returns true,
+  // or returns false when it goes through as it is, right now.
+  bool Impair(Direction* dir, const Packet& packet, uint64 client);
+  Clock::duration Delay(Direction* dir, const ImpairmentProfile& profile);
+  void Hold(Direction* dir, const Packet& packet, Clock::time_point due);
+  void SweepLinks(Direction* dir, Clock::time_point now);
+  // uniform in [0, 1)
+  static double Random(Direction* dir);
+
+  const std::shared_ptr<IoBackend> inner_;
+  const ImpairmentOptions options_;
+  std::vector<uint32> servers_;
+  std::vector<struct in6_addr> servers6_;
+  Direction tx_;
+  Direction rx_;
+  std::atomic<uint64> drops_;
+  std::atomic<uint64> duplicates_;
+  std::atomic<uint64> reorders_;
+  std::atomic<uint64> pending_;
+};
+
+}  // namespace tcpmany
+
+#endif  // TCPMANY_IMPAIRED_BACKEND_H_
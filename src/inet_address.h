@@ -3,6 +3,7 @@
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <string.h>
 #include <string>
 #include <sstream>
 
@@ -10,50 +11,163 @@
 #include "logging.h"
 
 namespace tcpmany {
+
+// An inclusive range of ipv4 addresses, host order.
+struct IpRange {
+  uint32 first;
+  uint32 last;
+};
+
+// Identifies an ip:port in the connection table, both in network order.
+inline uint64 EndpointKey(uint32 ip_net, uint16 port_net) {
+  return static_cast<uint64>(ip_net) << 16 | port_net;
+}
+
+// The same for ipv6, which doesn't fit in 64 bits.
+struct Endpoint6Key {
+  uint64 ip[2];
+  uint16 port_net;
+
+  bool operator==(const Endpoint6Key& other) const {
+    return ip[0] == other.ip[0] && ip[1] == other.ip[1] &&
+           port_net == other.port_net;
+  }
+};
+
+struct Endpoint6KeyHash {
+  size_t operator()(const Endpoint6Key& key) const {
+    // fake clients share the prefix and differ in the last bits, which
+    // std::hash<uint64> would pass through unmixed
+    uint64 hash = key.ip[0] * 0x9e3779b97f4a7c15ull ^ key.ip[1];
+    hash = (hash ^ key.port_net) * 0xff51afd7ed558ccdull;
+    return hash ^ (hash >> 32);
+  }
+};
+
+inline Endpoint6Key EndpointKey(const struct in6_addr& ip, uint16 port_net) {
+  Endpoint6Key key;
+  ::memcpy(key.ip, &ip, sizeof(key.ip));
+  key.port_net = port_net;
+  return key;
+}
+
+// An ipv4 or ipv6 ip:port. The string forms are "a.b.c.d:port" and
+// "[ipv6]:port".
 class InetAddress {
  public:
   InetAddress() = delete;
   ~InetAddress() = default;
 
   InetAddress(const std::string& ip_port) {
-    size_t sep_pos = ip_port.find(':');
+    size_t sep_pos = ip_port.rfind(':');
     CHECK(sep_pos != std::string::npos);
-    addr_.sin_family = AF_INET;
     std::string ip_str = ip_port.substr(0, sep_pos);
-    std::string port_str = ip_port.substr(sep_pos+1, ip_port.length());
-    addr_.sin_port = ::htons(std::stoi(port_str));
-    CHECK(::inet_pton(AF_INET, ip_str.c_str(), &addr_.sin_addr) != 0)
-        << "convert ip failed";
+    if (ip_str.size() >= 2 && ip_str[0] == '[' &&
+        ip_str[ip_str.size() - 1] == ']') {
+      ip_str = ip_str.substr(1, ip_str.size() - 2);
+    }
+    Init(ip_str, std::stoi(ip_port.substr(sep_pos + 1)));
+  }
+  InetAddress(const struct sockaddr_in& addr) {
+    addr_.v4 = addr;
   }
-  InetAddress(const struct sockaddr_in& addr) : addr_(addr) {}
+  InetAddress(const struct sockaddr_in6& addr) {
+    addr_.v6 = addr;
+  }
+  // the family follows from |ip|
   InetAddress(const std::string& ip, uint16 port) {
-    addr_.sin_family = AF_INET;
-    addr_.sin_port = ::htons(port);
-    CHECK(::inet_pton(AF_INET, ip.c_str(), &addr_.sin_addr) != 0)
-        << "convert ip failed";
+    Init(ip, port);
   }
   InetAddress(uint32 ip_host, uint16 port_host) {
-    addr_.sin_family = AF_INET;
-    addr_.sin_port = ::htons(port_host);
-    addr_.sin_addr.s_addr = ::htonl(ip_host);
+    ::memset(&addr_, 0, sizeof(addr_));
+    addr_.v4.sin_family = AF_INET;
+    addr_.v4.sin_port = ::htons(port_host);
+    addr_.v4.sin_addr.s_addr = ::htonl(ip_host);
+  }
+  InetAddress(const struct in6_addr& ip, uint16 port_host) {
+    ::memset(&addr_, 0, sizeof(addr_));
+    addr_.v6.sin6_family = AF_INET6;
+    addr_.v6.sin6_port = ::htons(port_host);
+    addr_.v6.sin6_addr = ip;
   }
 
   std::string ToIpPort() const {
     std::ostringstream stream;
-    char buf[32] = {0};
-    ::inet_ntop(AF_INET, &addr_.sin_addr, buf,
-        static_cast<socklen_t>(sizeof(buf)));
-    uint16 port = ::ntohs(addr_.sin_port);
-    stream << buf << ':' << port;
+    char buf[INET6_ADDRSTRLEN] = {0};
+    if (IsIpv6()) {
+      ::inet_ntop(AF_INET6, &addr_.v6.sin6_addr, buf,
+          static_cast<socklen_t>(sizeof(buf)));
+      stream << '[' << buf << ']';
+    } else {
+      ::inet_ntop(AF_INET, &addr_.v4.sin_addr, buf,
+          static_cast<socklen_t>(sizeof(buf)));
+      stream << buf;
+    }
+    stream << ':' << PortHost();
     return stream.str();
   }
 
+  sa_family_t family() const {
+    return addr_.v4.sin_family;
+  }
+  bool IsIpv6() const {
+    return family() == AF_INET6;
+  }
+  // ipv4 only
   const struct sockaddr_in& SockAddr() const {
-    return addr_;
+    return addr_.v4;
+  }
+  // ipv6 only
+  const struct sockaddr_in6& SockAddr6() const {
+    return addr_.v6;
+  }
+  // either family, for the socket calls
+  const struct sockaddr* SockAddrPtr() const {
+    return reinterpret_cast<const struct sockaddr*>(&addr_);
+  }
+  socklen_t SockAddrLen() const {
+    return IsIpv6() ? sizeof(addr_.v6) : sizeof(addr_.v4);
+  }
+  // ipv4 only
+  uint32 IpHost() const {
+    return ::ntohl(addr_.v4.sin_addr.s_addr);
+  }
+  // the port sits in the same place for both families
+  uint16 PortHost() const {
+    return ::ntohs(addr_.v4.sin_port);
+  }
+  uint16 PortNet() const {
+    return addr_.v4.sin_port;
+  }
+  // ipv4 only
+  uint64 Key() const {
+    return EndpointKey(addr_.v4.sin_addr.s_addr, addr_.v4.sin_port);
+  }
+  // ipv6 only
+  Endpoint6Key Key6() const {
+    return EndpointKey(addr_.v6.sin6_addr, addr_.v6.sin6_port);
   }
 
  private:
-  struct sockaddr_in addr_;
+  void Init(const std::string& ip, uint16 port) {
+    ::memset(&addr_, 0, sizeof(addr_));
+    if (ip.find(':') != std::string::npos) {
+      addr_.v6.sin6_family = AF_INET6;
+      addr_.v6.sin6_port = ::htons(port);
+      CHECK(::inet_pton(AF_INET6, ip.c_str(), &addr_.v6.sin6_addr) == 1)
+          << "convert ip failed";
+      return;
+    }
+    addr_.v4.sin_family = AF_INET;
+    addr_.v4.sin_port = ::htons(port);
+    CHECK(::inet_pton(AF_INET, ip.c_str(), &addr_.v4.sin_addr) != 0)
+        << "convert ip failed";
+  }
+
+  union {
+    struct sockaddr_in v4;
+    struct sockaddr_in6 v6;
+  } addr_;
 };
 }
 #endif  // TCPMANY_INET_ADDRES_H_
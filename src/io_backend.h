@@ -0,0 +1,50 @@
+#ifndef TCPMANY_IO_BACKEND_H_
+#define TCPMANY_IO_BACKEND_H_
+
+#include "base.h"
+#include "noncopyable.h"
+
+namespace tcpmany {
+
+struct Packet;
+
+// Where the kernel threads get ip packets from and hand them to. Receive is
+// only called from the receive thread, Send and ReadTxTimestamp only from
+// the send thread.
+class IoBackend : public NonCopyable {
+ public:
+  virtual ~IoBackend() {}
+
+  // Fills |packet| (and packet->timestamp when known) with the next ip
+  // packet. Returns its length, 0 when nothing arrived in time so the caller
+  // can check for stop, or -1 on error with errno set.
+  virtual int Receive(Packet* packet) = 0;
+
+  // Returns the number of bytes sent or -1 on error with errno set.
+  virtual int Send(const Packet& packet) = 0;
+
+  // Asks for TX completion timestamps, returns false if not supported.
+  virtual bool EnableTxTimestamps() {
+    return false;
+  }
+
+  // Fills the ip/tcp header and timestamp of one sent packet whose TX
+  // completion has been reported. Returns 0 when none is pending.
+  virtual int ReadTxTimestamp(Packet* packet) {
+    return 0;
+  }
+
+  // Packets the host dropped before Receive could read them.
+  virtual uint64 Drops() const {
+    return 0;
+  }
+
+  // Packets a filter kept from Receive because they aren't for tcpmany.
+  virtual uint64 Filtered() const {
+    return 0;
+  }
+};
+
+}  // namespace tcpmany
+
+#endif  // TCPMANY_IO_BACKEND_H_
@@ -3,13 +3,16 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/socket.h>
-#include <linux/if_ether.h>
+#include <algorithm>
+#include <chrono>
 #include <functional>
 #include <string>
 
 #include "packet.h"
 #include "connection.h"
+#include "packet_ring_backend.h"
+#include "raw_socket_backend.h"
+#include "snapshot.h"
 
 using std::string;
 
@@ -26,15 +29,44 @@ static bool IsLastPacket(PacketPtr& packet) {
   return !::memcmp(packet->Buffer(), LAST_PACKET_DATA, sizeof(LAST_PACKET_DATA));
 }
 
+// close packets Stop queues at a time
+static const size_t kTeardownBatch = 4096;
+
+// what malloc adds to every block, roughly
+static const uint64 kHeapOverhead = 16;
+// a packet from make_shared, with its control block, and its queue slot
+static const uint64 kQueuedPacketBytes =
+    sizeof(Packet) + 2 * sizeof(void*) + kHeapOverhead + sizeof(PacketPtr);
+
+// A node holds the entry, the next pointer and, for some hashes, the hash
+// itself; the buckets are a pointer each.
+template <typename Map>
+static uint64 TableBytes(const Map& map) {
+  return map.size() * (sizeof(typename Map::value_type) +
+                       2 * sizeof(void*) + kHeapOverhead) +
+         map.bucket_count() * sizeof(void*);
+}
+
+// a connection and its share of the table
+static uint64 ConnectionBytes() {
+  return sizeof(Connection) + kHeapOverhead +
+         sizeof(ConnectionMap::value_type) + 3 * sizeof(void*) +
+         kHeapOverhead;
+}
+
 Kernel::Kernel()
-    : sockfd_(-1),
+    : impaired_(NULL),
+      has_pending_releases_(false),
       receive_stop_state_(SS_STOPED),
+      packets_received_(0),
+      packets_sent_(0),
+      packets_unmatched_(0),
+      established_(0),
+      syn_sent_(0),
+      memory_base_(0),
+      memory_refused_connections_(0),
+      memory_refused_sends_(0),
       stoped_(false) {
-  sockfd_ = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
-  CHECK(sockfd_ >= 0) << "socket error: " << strerror(errno);
-  int flag = 1;
-  CHECK(setsockopt(sockfd_, IPPROTO_IP, IP_HDRINCL, &flag, sizeof(flag)) >= 0)
-      << "setsockopt error: " << strerror(errno);
 }
 
 Kernel::~Kernel() {
@@ -44,73 +76,159 @@ Kernel::~Kernel() {
 
 void Kernel::DoStop() {
   if (!stoped_.exchange(true)) {
-    for (auto& iter : connections_) {
-      if (iter.second->IsClosed()) {
-        DoRelease(*(iter.second));
-        continue;
-      }
-      iter.second->SetClosedCallback([](Connection& conn) {
-          LOG(INFO) << "Connection Closed: " << conn.GetSrcAddress().ToIpPort();
-          Kernel::Release(conn);
-      });
-      iter.second->Close(); 
-    }
-    while (!connections_.empty()) {
-      ::sleep(1);
-      LOG(INFO) << "waiting for all connection closing";
-    }
-    LOG(INFO) << "all connection closed";
+    Teardown();
 
     receive_stop_state_ = SS_STOPING;
     if (receive_thread_.joinable()) {
       receive_thread_.join();
     }
+    DeletePendingReleases();
+    // draining runs the queued callbacks, which may release connections in
+    // turn; without a dispatcher those are deleted inline
+    dispatcher_.reset();
+    DeletePendingReleases();
+    DeleteConnections();
 
     packets_.Push(LastPacket());
     if (send_thread_.joinable()) {
       send_thread_.join();
     }
 
-    ::close(sockfd_);
+    // after both threads, it writes out what they recorded last
+    recorder_.reset();
+    impaired_ = NULL;
+    backend_.reset();
   }
 }
 
+// The close packets go out in batches, the next one once the send queue
+// has drained to a batch and the rate allows it, so millions of them
+// neither pile up in memory nor hit the peers at once. Nothing is freed
+// here, the receive thread may still be in any connection.
+void Kernel::Teardown() {
+  typedef std::chrono::steady_clock Clock;
+  const TeardownOptions& teardown = options_.teardown;
+  const Clock::time_point start = Clock::now();
+  const Clock::time_point deadline =
+      start + std::chrono::milliseconds(teardown.deadline_ms);
+  std::vector<Connection*> open;
+  {
+    std::unique_lock<std::mutex> lock(conn_mutex_);
+    open.reserve(connections_.size() + connections6_.size());
+    for (const auto& iter : connections_) {
+      if (!iter.second->IsClosed()) {
+        open.push_back(iter.second);
+      }
+    }
+    for (const auto& iter : connections6_) {
+      if (!iter.second->IsClosed()) {
+        open.push_back(iter.second);
+      }
+    }
+  }
+  if (open.empty()) {
+    return;
+  }
+
+  size_t sent = 0;
+  if (teardown.mode != TEARDOWN_FORGET) {
+    for (; sent < open.size(); ++sent) {
+      if (sent % kTeardownBatch == 0 && sent > 0) {
+        while (packets_.Size() > kTeardownBatch &&
+               Clock::now() < deadline) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (teardown.rate > 0) {
+          std::this_thread::sleep_until(std::min(deadline,
+              start + std::chrono::microseconds(
+                  static_cast<int64>(sent * 1e6 / teardown.rate))));
+        }
+        if (Clock::now() >= deadline) {
+          break;
+        }
+      }
+      // The receive thread may be in the same connection, Close and
+      // Abort only change its state through Connection::SetState.
+      Connection* conn = open[sent];
+      if (teardown.mode == TEARDOWN_RST ||
+          conn->state_ == Connection::CS_SYN_SENT) {
+        // a FIN before the handshake is done would never be answered
+        conn->Abort();
+      } else {
+        // does nothing to those closing already
+        conn->Close();
+      }
+    }
+  }
+  // the ones the deadline came before, and in FIN mode those not done
+  const size_t total = open.size();
+  size_t forgotten = total - sent;
+  if (teardown.mode == TEARDOWN_FIN) {
+    open.resize(sent);
+    while (!open.empty() && Clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      open.erase(std::remove_if(open.begin(), open.end(),
+                                [](Connection* conn) {
+                                  return conn->IsClosed();
+                                }),
+                 open.end());
+    }
+    forgotten += open.size();
+  }
+  LOG(INFO) << "teardown of " << total << " open connections: " << sent
+            << (teardown.mode == TEARDOWN_RST ? " RSTs" : " FINs")
+            << " sent, " << forgotten << " forgotten after "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   Clock::now() - start).count() << "ms";
+}
+
 void Kernel::ReceiveThread() {
+  PacketRecorder::Buffer* record =
+      recorder_ ? recorder_->NewBuffer() : NULL;
   receive_stop_state_ = SS_RUNNING;
   while (receive_stop_state_ == SS_RUNNING) {
+    if (has_pending_releases_) {
+      DeletePendingReleases();
+    }
     auto packet = std::make_shared<Packet>();
-    int len = recvfrom(sockfd_,
-                       packet->Buffer(),
-                       Packet::MAX_SIZE,
-                       0,
-                       NULL,
-                       NULL);
+    int len = backend_->Receive(packet.get());
     if (len < 0) {
-      LOG(ERROR) << "recvfrom error: " << strerror(errno);
+      LOG_EVERY_N_SEC(ERROR, 1) << "receive error: " << strerror(errno);
+      continue;
+    }
+    if (len == 0) {
       continue;
     }
-    if (len < Packet::HEADER_LEN) {
-      LOG(INFO) << "recvfrom length(" << len << ") is too small";
+    ++packets_received_;
+    if (len < (packet->IsIpv6() ? Packet::HEADER6_LEN : Packet::HEADER_LEN)) {
+      LOG_EVERY_N_SEC(INFO, 1) << "recvfrom length(" << len
+                                << ") is too small";
+      continue;
+    }
+    // Size() and DataLen() go by the payload length
+    if (packet->IsIpv6() &&
+        sizeof(struct ip6_hdr) + ::ntohs(packet->pkt6.ip6.ip6_plen) >
+            static_cast<size_t>(len)) {
+      LOG_EVERY_N_SEC(INFO, 1) << "ipv6 payload length("
+                                << ::ntohs(packet->pkt6.ip6.ip6_plen)
+                                << ") exceeds recvfrom length(" << len << ")";
       continue;
     }
     VLOG(4) << "receive packet: " << *packet;
     if (!packet->IsTcp()) {
-      LOG(INFO) << "invalid tcp packet";
+      LOG_EVERY_N_SEC(INFO, 1) << "invalid tcp packet";
       continue;
     }
-    string dst_ip_port = packet->DstIpPortString();
-    Connection* conn = FindConnection(dst_ip_port);
-    if (conn == nullptr) {
-      // process the fake ip address
-      string src_ip_port = packet->SrcIpPortString();
-      string fake_addr = src_ip_port.substr(0, src_ip_port.find(':'));
-      string dst_port = dst_ip_port.substr(dst_ip_port.find(':') + 1,
-                                           dst_ip_port.length());
-      fake_addr += ':';
-      fake_addr += dst_port;
-      conn = FindConnection(fake_addr);
+    Connection* conn = Demux(*packet);
+    if (record != NULL) {
+      // a redirected reply has the fake client in its source, only the
+      // connection knows; one for no connection goes by its destination
+      recorder_->Record(record, *packet,
+                        conn != nullptr ? conn->GetSrcAddress()
+                                        : packet->DstAddress());
     }
     if (conn == nullptr) {
+      ++packets_unmatched_;
       VLOG(4) << "no connection match the packet";
       continue;
     } else {
@@ -122,70 +240,500 @@ void Kernel::ReceiveThread() {
 }
 
 void Kernel::SendThread() {
+  PacketRecorder::Buffer* record =
+      recorder_ ? recorder_->NewBuffer() : NULL;
   while (true) {
     PacketPtr packet;
-    packets_.Pop(packet);
+    if (impaired_ == NULL) {
+      packets_.Pop(packet);
+    } else if (!packets_.TimedPop(packet, impaired_->SendDue())) {
+      continue;
+    }
     if (IsLastPacket(packet)) {
       break;
     }
-    CHECK(sockfd_ != -1);
-    struct sockaddr_in dst_addr = packet->DstSockAddr();
-    int ret = sendto(sockfd_,
-                     packet->Buffer(),
-                     packet->Size(),
-                     0,
-                     (struct sockaddr*)&dst_addr,
-                     sizeof(struct sockaddr));
-    if (ret == -1) {
-      LOG(ERROR) << "sendto error: " << ::strerror(errno);
+    if (backend_->Send(*packet) == -1) {
+      LOG_EVERY_N_SEC(ERROR, 1) << "send error: " << ::strerror(errno);
+    } else {
+      ++packets_sent_;
+      if (record != NULL) {
+        recorder_->Record(record, *packet, packet->SrcAddress());
+      }
+    }
+    if (options_.tx_timestamps) {
+      ReadTxTimestamps();
     }
   }
   LOG(INFO) << "send thread exited";
 }
 
+void Kernel::ReadTxTimestamps() {
+  // the kernel reports completions asynchronously, so this picks up
+  // whatever has been queued so far without blocking the send path
+  Packet packet;
+  while (backend_->ReadTxTimestamp(&packet) > 0) {
+    std::unique_lock<std::mutex> lock(conn_mutex_);
+    Connection* conn = NULL;
+    if (packet.IsIpv6()) {
+      auto iter = connections6_.find(packet.SrcKey6());
+      conn = iter != connections6_.end() ? iter->second : NULL;
+    } else {
+      auto iter = connections_.find(packet.SrcKey());
+      conn = iter != connections_.end() ? iter->second : NULL;
+    }
+    if (conn != NULL) {
+      conn->OnPacketSent(packet);
+    }
+  }
+}
+
 void Kernel::DoSend(std::shared_ptr<Packet> packet) {
   packet->CalculateChecksum();
   packets_.Push(packet);
 }
 
-void Kernel::DoStart() {
+void Kernel::DoStart(const KernelOptions& options) {
   CHECK(!send_thread_.joinable());
   CHECK(!receive_thread_.joinable());
+  // again after a Stop
+  stoped_ = false;
+  options_ = options;
+  if (options_.client_ranges.empty()) {
+    for (const SourceRange& range : options_.source_ranges) {
+      if (!range.ipv6) {
+        options_.client_ranges.push_back(range.ips);
+      }
+    }
+  }
+  sa_family_t family = AF_INET;
+  if (!options_.servers.empty()) {
+    family = options_.servers[0].family();
+  } else if (!options_.source_ranges.empty() &&
+             options_.source_ranges[0].ipv6) {
+    family = AF_INET6;
+  }
+  backend_ = options_.backend;
+  if (!backend_ && !options_.capture_interface.empty()) {
+    CHECK(family == AF_INET) << "capture_interface takes ipv4 servers only";
+    backend_ = std::make_shared<PacketRingBackend>(
+        options_.capture_interface, options_.servers);
+  }
+  if (!backend_ && options_.servers.empty()) {
+    backend_ = std::make_shared<RawSocketBackend>(family);
+  }
+  if (!backend_) {
+    backend_ = std::make_shared<RawSocketBackend>(
+        options_.servers, options_.client_ranges);
+  }
+  impaired_ = NULL;
+  if (!options_.impairment.groups.empty()) {
+    auto impaired = std::make_shared<ImpairedBackend>(
+        backend_, options_.impairment, options_.servers);
+    impaired_ = impaired.get();
+    backend_ = impaired;
+  }
+  if (options_.tx_timestamps) {
+    options_.tx_timestamps = backend_->EnableTxTimestamps();
+  }
+  if (!options_.source_ranges.empty()) {
+    std::unique_lock<std::mutex> lock(conn_mutex_);
+    sources_.reset(new EndpointAllocator(
+        options_.source_ranges,
+        std::chrono::milliseconds(options_.source_quarantine_ms)));
+  }
+  if (options_.callback_threads > 0) {
+    dispatcher_.reset(new EventDispatcher(options_.callback_threads,
+                                          options_.callback_queue_size));
+  }
+  if (!options_.record.path.empty()) {
+    recorder_.reset(new PacketRecorder(options_.record));
+  }
   send_thread_ = std::thread(&Kernel::SendThread, this);
   receive_thread_ = std::thread(&Kernel::ReceiveThread, this);
 }
 
+KernelStats Kernel::DoGetStats() {
+  KernelStats stats;
+  stats.packets_received = packets_received_;
+  stats.packets_sent = packets_sent_;
+  stats.packets_unmatched = packets_unmatched_;
+  stats.receive_drops = backend_ ? backend_->Drops() : 0;
+  stats.packets_filtered = backend_ ? backend_->Filtered() : 0;
+  {
+    std::unique_lock<std::mutex> lock(conn_mutex_);
+    stats.connections = connections_.size() + connections6_.size();
+    stats.sources_in_use = sources_ ? sources_->InUse() : 0;
+    stats.source_ips_in_use = sources_ ? sources_->IpsInUse() : 0;
+    stats.sources_quarantined = sources_ ? sources_->Quarantined() : 0;
+    AccountMemoryLocked(&stats);
+  }
+  int64 established = established_;
+  stats.established = established > 0 ? established : 0;
+  int64 syn_sent = syn_sent_;
+  stats.syn_sent = syn_sent > 0 ? syn_sent : 0;
+  stats.callbacks_dispatched = dispatcher_ ? dispatcher_->Dispatched() : 0;
+  stats.callbacks_queued = dispatcher_ ? dispatcher_->Queued() : 0;
+  stats.callback_queue_waits = dispatcher_ ? dispatcher_->Waits() : 0;
+  stats.packets_recorded = 0;
+  stats.record_drops = 0;
+  if (recorder_) {
+    PacketRecorder::Stats record = recorder_->GetStats();
+    stats.packets_recorded = record.packets;
+    stats.record_drops = record.drops;
+  }
+  ImpairedBackend::Stats impaired = {0, 0, 0, 0};
+  if (impaired_ != NULL) {
+    impaired = impaired_->GetStats();
+  }
+  stats.impaired_drops = impaired.drops;
+  stats.impaired_duplicates = impaired.duplicates;
+  stats.impaired_reorders = impaired.reorders;
+  stats.impaired_pending = impaired.pending;
+  stats.memory_refused_connections = memory_refused_connections_;
+  stats.memory_refused_sends = memory_refused_sends_;
+  return stats;
+}
+
+bool Kernel::DoSaveRecording() {
+  return recorder_ && recorder_->Save();
+}
+
 Connection* Kernel::DoNewConnection(const InetAddress& dst_addr,
                                     const InetAddress& src_addr) {
-  std::string ip_port = src_addr.ToIpPort();
+  CHECK(dst_addr.family() == src_addr.family())
+      << "mixed address families: " << src_addr.ToIpPort() << " to "
+      << dst_addr.ToIpPort();
+  std::unique_lock<std::mutex> lock(conn_mutex_);
+  if (!AdmitConnectionLocked()) {
+    return nullptr;
+  }
   // TODO consider throw an exception instead
-  CHECK(FindConnection(ip_port) == nullptr)
-      << "the src_addr is already in use: " << ip_port;
+  CHECK(!HasConnection(src_addr))
+      << "the src_addr is already in use: " << src_addr.ToIpPort();
+  if (sources_ && sources_->Contains(src_addr)) {
+    CHECK(sources_->Reserve(src_addr))
+        << "the src_addr is in quarantine: " << src_addr.ToIpPort();
+  }
   Connection* conn = new Connection(dst_addr, src_addr);
-  InsertConnection(ip_port, conn);
+  AddConnection(conn);
   return conn;
 }
 
-Connection* Kernel::FindConnection(const std::string& ip_port) {
+Connection* Kernel::DoNewConnection(const InetAddress& dst_addr) {
+  std::unique_lock<std::mutex> lock(conn_mutex_);
+  CHECK(sources_) << "no KernelOptions::source_ranges";
+  InetAddress src_addr(0u, 0);
+  if (!AdmitConnectionLocked() || !sources_->Allocate(&src_addr)) {
+    return nullptr;
+  }
+  CHECK(src_addr.family() == dst_addr.family())
+      << "source_ranges of another family than " << dst_addr.ToIpPort();
+  Connection* conn = new Connection(dst_addr, src_addr);
+  AddConnection(conn);
+  return conn;
+}
+
+bool Kernel::DoMemoryAvailable() {
+  const uint64 budget = options_.memory_budget;
+  if (budget == 0 ||
+      memory_base_ + packets_.Size() * kQueuedPacketBytes < budget) {
+    return true;
+  }
+  // connections may have gone and events run since, account anew
+  std::unique_lock<std::mutex> lock(conn_mutex_);
+  KernelStats stats;
+  if (AccountMemoryLocked(&stats) < budget) {
+    return true;
+  }
+  ++memory_refused_sends_;
+  LOG_EVERY_N_SEC(WARNING, 1) << "memory budget of " << budget
+                              << " bytes reached, message refused";
+  return false;
+}
+
+uint64 Kernel::AccountMemoryLocked(KernelStats* stats) {
+  const uint64 connections = connections_.size() + connections6_.size();
+  stats->memory_connections =
+      connections * (sizeof(Connection) + kHeapOverhead);
+  stats->memory_tables = TableBytes(connections_) + TableBytes(connections6_);
+  stats->memory_callbacks = dispatcher_ ? dispatcher_->QueuedBytes() : 0;
+  stats->memory_sources = sources_ ? sources_->MemoryBytes() : 0;
+  stats->memory_recorder = recorder_ ? recorder_->MemoryBytes() : 0;
+  const uint64 queued = packets_.Size() * kQueuedPacketBytes;
+  stats->memory_packets = queued;
+  if (impaired_ != NULL) {
+    stats->memory_packets +=
+        impaired_->GetStats().pending * kQueuedPacketBytes;
+  }
+  stats->memory_total = stats->memory_connections + stats->memory_tables +
+                        stats->memory_packets + stats->memory_callbacks +
+                        stats->memory_sources + stats->memory_recorder;
+  memory_base_ = stats->memory_total - queued;
+  stats->memory_per_connection =
+      connections > 0 ? stats->memory_total / connections : 0;
+  return stats->memory_total;
+}
+
+uint64 Kernel::ConnectionRoomLocked() {
+  const uint64 budget = options_.memory_budget;
+  if (budget == 0) {
+    return ~0ull;
+  }
+  KernelStats stats;
+  const uint64 total = AccountMemoryLocked(&stats);
+  return total < budget ? (budget - total) / ConnectionBytes() : 0;
+}
+
+bool Kernel::AdmitConnectionLocked() {
+  if (ConnectionRoomLocked() > 0) {
+    return true;
+  }
+  ++memory_refused_connections_;
+  LOG_EVERY_N_SEC(WARNING, 1) << "memory budget of "
+                              << options_.memory_budget
+                              << " bytes reached, connection refused";
+  return false;
+}
+
+int64 Kernel::DoSaveSnapshot(const std::string& path) {
+  SnapshotFile snapshot;
+  uint64 count = 0;
+  {
+    std::unique_lock<std::mutex> lock(conn_mutex_);
+    for (const auto& iter : connections_) {
+      if (iter.second->state_ == Connection::CS_ESTABLISHED) {
+        ++count;
+      }
+    }
+    if (!connections6_.empty()) {
+      LOG(WARNING) << connections6_.size() << " ipv6 connections left out "
+                   << "of " << path << ", snapshots are ipv4 only";
+    }
+    if (!snapshot.Create(path, count)) {
+      return -1;
+    }
+    SnapshotRecord* record = snapshot.records();
+    for (const auto& iter : connections_) {
+      const Connection* conn = iter.second;
+      if (conn->state_ != Connection::CS_ESTABLISHED) {
+        continue;
+      }
+      const struct sockaddr_in& src = conn->GetSrcAddress().SockAddr();
+      const struct sockaddr_in& dst = conn->GetDstAddress().SockAddr();
+      record->src_ip = src.sin_addr.s_addr;
+      record->dst_ip = dst.sin_addr.s_addr;
+      record->src_port = src.sin_port;
+      record->dst_port = dst.sin_port;
+      record->seq = conn->seq_;
+      record->ack_seq = conn->ack_seq_;
+      record->reserved = 0;
+      ++record;
+    }
+  }
+  if (!snapshot.Commit()) {
+    return -1;
+  }
+  return count;
+}
+
+// The source addresses are claimed first, in restoring_, the connections
+// are handed to |restored| outside the lock, it may well call into the
+// Kernel, and only then go into the table.
+int64 Kernel::DoRestoreSnapshot(const std::string& path,
+                                const RestoredCallback& restored) {
+  CHECK(receive_thread_.joinable()) << "Kernel not started";
+  SnapshotFile snapshot;
+  if (!snapshot.Open(path)) {
+    return -1;
+  }
+  std::vector<const SnapshotRecord*> records;
+  records.reserve(snapshot.count());
+  uint64 room;
+  {
+    std::unique_lock<std::mutex> lock(conn_mutex_);
+    room = ConnectionRoomLocked();
+    for (uint64 i = 0; i < snapshot.count() && records.size() < room;
+         ++i) {
+      const SnapshotRecord* record = &snapshot.records()[i];
+      InetAddress src(::ntohl(record->src_ip), ::ntohs(record->src_port));
+      // duplicates within the snapshot are taken by the first one
+      if (HasConnection(src) ||
+          (sources_ && sources_->Contains(src) && !sources_->Reserve(src))) {
+        continue;
+      }
+      restoring_.insert(src.Key());
+      records.push_back(record);
+    }
+  }
+  if (records.size() == room && room < snapshot.count()) {
+    memory_refused_connections_ += snapshot.count() - room;
+    LOG(WARNING) << "memory budget reached, only " << room << " of "
+                 << snapshot.count() << " connections of " << path
+                 << " restored";
+  } else if (records.size() < snapshot.count()) {
+    LOG(WARNING) << snapshot.count() - records.size() << " connections of "
+                 << path << " skipped, their source address is taken";
+  }
+  std::vector<Connection*> conns;
+  conns.reserve(records.size());
+  for (const SnapshotRecord* record : records) {
+    struct sockaddr_in src = {};
+    src.sin_family = AF_INET;
+    src.sin_addr.s_addr = record->src_ip;
+    src.sin_port = record->src_port;
+    struct sockaddr_in dst = src;
+    dst.sin_addr.s_addr = record->dst_ip;
+    dst.sin_port = record->dst_port;
+    Connection* conn =
+        new Connection(InetAddress(dst), InetAddress(src), record->seq);
+    conn->Restore(record->ack_seq);
+    if (restored) {
+      restored(*conn);
+    }
+    conns.push_back(conn);
+  }
   std::unique_lock<std::mutex> lock(conn_mutex_);
-  auto iter = connections_.find(ip_port);
+  connections_.reserve(connections_.size() + conns.size());
+  int64 count = 0;
+  for (Connection* conn : conns) {
+    const InetAddress& src = conn->GetSrcAddress();
+    restoring_.erase(src.Key());
+    // overwriting the slot would leak the one in it
+    if (HasConnection(src)) {
+      LOG(WARNING) << "restored connection dropped, its source address "
+                   << src.ToIpPort() << " was taken meanwhile";
+      delete conn;
+      continue;
+    }
+    AddConnection(conn);
+    ++count;
+  }
+  return count;
+}
+
+Connection* Kernel::FindConnection(uint64 key) {
+  std::unique_lock<std::mutex> lock(conn_mutex_);
+  auto iter = connections_.find(key);
   if (iter == connections_.end()) {
     return nullptr;
   }
   return iter->second;
 }
 
-void Kernel::InsertConnection(const std::string& addr, Connection* conn) {
+Connection* Kernel::FindConnection(const Endpoint6Key& key) {
+  std::unique_lock<std::mutex> lock(conn_mutex_);
+  auto iter = connections6_.find(key);
+  if (iter == connections6_.end()) {
+    return nullptr;
+  }
+  return iter->second;
+}
+
+// A reply routed straight back is addressed to the fake client. One that
+// went through a redirect has the fake client address moved to the
+// source, the destination port is still the fake client's.
+Connection* Kernel::Demux(const Packet& packet) {
+  if (packet.IsIpv6()) {
+    Connection* conn = FindConnection(packet.DstKey6());
+    if (conn == nullptr) {
+      conn = FindConnection(
+          EndpointKey(packet.SrcIp6(), packet.DstPortNet()));
+    }
+    return conn;
+  }
+  Connection* conn = FindConnection(packet.DstKey());
+  if (conn == nullptr) {
+    conn = FindConnection(
+        EndpointKey(packet.SrcIpNet(), packet.DstPortNet()));
+  }
+  return conn;
+}
+
+void Kernel::InsertConnection(uint64 key, Connection* conn) {
   std::unique_lock<std::mutex> lock(conn_mutex_);
-  connections_[addr] = conn;
+  connections_[key] = conn;
+}
+
+bool Kernel::HasConnection(const InetAddress& src_addr) const {
+  if (src_addr.IsIpv6()) {
+    return connections6_.count(src_addr.Key6()) != 0;
+  }
+  return connections_.count(src_addr.Key()) != 0 ||
+         restoring_.count(src_addr.Key()) != 0;
+}
+
+void Kernel::AddConnection(Connection* conn) {
+  const InetAddress& src_addr = conn->GetSrcAddress();
+  if (src_addr.IsIpv6()) {
+    connections6_[src_addr.Key6()] = conn;
+  } else {
+    connections_[src_addr.Key()] = conn;
+  }
+}
+
+void Kernel::RemoveConnection(const InetAddress& src_addr) {
+  if (src_addr.IsIpv6()) {
+    connections6_.erase(src_addr.Key6());
+  } else {
+    connections_.erase(src_addr.Key());
+  }
 }
 
 void Kernel::DoRelease(Connection& conn) {
   std::unique_lock<std::mutex> lock(conn_mutex_);
   CHECK(conn.IsClosed());
-  std::string address = conn.GetSrcAddress().ToIpPort();
-  connections_.erase(address);
-  delete &conn;
+  const InetAddress& address = conn.GetSrcAddress();
+  RemoveConnection(address);
+  if (sources_) {
+    sources_->Free(address);
+  }
+  // Only the receive thread itself, when it runs the callbacks, knows it
+  // holds no pointer to the connection any more.
+  if (dispatcher_ || std::this_thread::get_id() != receive_thread_.get_id()) {
+    pending_releases_.push_back(&conn);
+    has_pending_releases_ = true;
+  } else {
+    delete &conn;
+  }
+}
+
+// Called with every thread stopped. The tables are swapped out in one go
+// and the connections deleted without taking the lock each time.
+void Kernel::DeleteConnections() {
+  ConnectionMap conns;
+  Connection6Map conns6;
+  {
+    std::unique_lock<std::mutex> lock(conn_mutex_);
+    conns.swap(connections_);
+    conns6.swap(connections6_);
+    sources_.reset();
+  }
+  for (const auto& iter : conns) {
+    delete iter.second;
+  }
+  for (const auto& iter : conns6) {
+    delete iter.second;
+  }
+}
+
+// Once out of connections_ the receive thread won't find a connection
+// again, so the delete queued now runs after every event it queued for it.
+// Without callback threads it is between packets here and deletes them
+// at once.
+void Kernel::DeletePendingReleases() {
+  std::vector<Connection*> releases;
+  {
+    std::unique_lock<std::mutex> lock(conn_mutex_);
+    releases.swap(pending_releases_);
+    has_pending_releases_ = false;
+  }
+  for (Connection* conn : releases) {
+    if (dispatcher_) {
+      dispatcher_->Dispatch(conn, [conn] { delete conn; });
+    } else {
+      delete conn;
+    }
+  }
 }
 
 }
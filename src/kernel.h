@@ -1,8 +1,11 @@
 #ifndef TCPMANY_KERNEL_H_
 #define TCPMANY_KERNEL_H_
 
+#include <functional>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <thread>
 #include <memory>
 #include <atomic>
@@ -12,61 +15,307 @@
 #include "singleton.h"
 #include "noncopyable.h"
 #include "blocking_queue.h"
+#include "endpoint_allocator.h"
+#include "event_dispatcher.h"
+#include "impaired_backend.h"
 #include "inet_address.h"
+#include "io_backend.h"
+#include "packet_recorder.h"
 
 namespace tcpmany {
 
 struct Packet;
 class Connection;
-typedef std::unordered_map<std::string, Connection*> ConnectionMap;
+// keyed by the EndpointKey of the connection's source address
+typedef std::unordered_map<uint64, Connection*> ConnectionMap;
+typedef std::unordered_map<Endpoint6Key, Connection*, Endpoint6KeyHash>
+    Connection6Map;
+typedef std::function<void (Connection&)> RestoredCallback;
+
+// How Kernel::Stop ends the connections still open.
+enum TeardownMode {
+  // a FIN each, then it waits for the peers to finish the close
+  TEARDOWN_FIN,
+  // a RST each, nothing to wait for
+  TEARDOWN_RST,
+  // nothing is sent, the peers find out by their own timeouts
+  TEARDOWN_FORGET,
+};
+
+struct TeardownOptions {
+  TeardownMode mode;
+  // FINs or RSTs per second, 0 for as fast as the send thread takes them
+  uint32 rate;
+  // Stop sends and waits no longer than this, connections not closed by
+  // then are forgotten
+  int deadline_ms;
+
+  TeardownOptions()
+      : mode(TEARDOWN_FIN),
+        rate(0),
+        deadline_ms(10 * 1000) {}
+};
+
+struct KernelOptions {
+  // Ask the backend for TX completion timestamps. Costs one extra
+  // recvmsg(MSG_ERRQUEUE) per sent packet, so it is off by default.
+  bool tx_timestamps;
+  // Where packets go to and come from. When empty, a PacketRingBackend on
+  // capture_interface if that is set, a RawSocketBackend otherwise. The
+  // default backends take one address family, that of |servers|, or of
+  // |source_ranges| without servers, ipv4 without either.
+  std::shared_ptr<IoBackend> backend;
+  // Capture the replies of |servers| on this interface instead of having
+  // a redirect send them back, see PacketRingBackend.
+  std::string capture_interface;
+  // When set, the default backends only receive the packets of these
+  // servers, and, if |client_ranges| is set too, only those of the fake
+  // client addresses in it. The rest stays in the host kernel.
+  std::vector<InetAddress> servers;
+  std::vector<IpRange> client_ranges;
+  // When above 0, the connected, message and closed callbacks run on this
+  // many threads instead of the receive thread, which then only does the
+  // protocol processing. A connection's callbacks always run on the same
+  // thread, in order. Each thread queues up to callback_queue_size events,
+  // the receive thread waits when that is full.
+  int callback_threads;
+  size_t callback_queue_size;
+  // Where Kernel::NewConnection(dst_addr) takes source addresses from, see
+  // EndpointAllocator. A closed connection's address is reused after
+  // source_quarantine_ms at the earliest. The ipv4 ones are also the
+  // default client_ranges.
+  std::vector<SourceRange> source_ranges;
+  int source_quarantine_ms;
+  // With record.path set, the packets sent and received are recorded into
+  // that pcap file, see PacketRecorder.
+  RecorderOptions record;
+  // how Stop closes the connections still open
+  TeardownOptions teardown;
+  // With groups, packets of the clients in them are dropped, duplicated,
+  // delayed and reordered on their way to and from the backend, see
+  // ImpairedBackend.
+  ImpairmentOptions impairment;
+  // When above 0, the bytes of KernelStats::memory_total the kernel may
+  // reach. Past it NewConnection returns NULL, RestoreSnapshot restores
+  // fewer connections and Connection::Send refuses messages, so a ramp
+  // stops short instead of the process being killed halfway.
+  uint64 memory_budget;
+
+  KernelOptions()
+      : tx_timestamps(false),
+        callback_threads(0),
+        callback_queue_size(4096),
+        source_quarantine_ms(60 * 1000),
+        memory_budget(0) {}
+};
+
+// Snapshot of the kernel counters, all totals since Start except
+// connections and established.
+struct KernelStats {
+  uint64 packets_received;
+  uint64 packets_sent;
+  // tcp packets that matched no connection
+  uint64 packets_unmatched;
+  // dropped by the host before the backend could read them
+  uint64 receive_drops;
+  // kept from the backend by its filter, not meant for any connection
+  uint64 packets_filtered;
+  // entries in the connection table
+  uint64 connections;
+  // connections currently in the established state
+  uint64 established;
+  // Connections currently waiting for their SYN-ACK. Nothing retransmits
+  // a lost SYN or SYN-ACK, so under impairment the ones that never get
+  // out of it pile up here.
+  uint64 syn_sent;
+  // with callback_threads: events handed to them (the delete of a released
+  // connection counts as one), events still waiting, and how often the
+  // receive thread had to wait for room in a queue
+  uint64 callbacks_dispatched;
+  uint64 callbacks_queued;
+  uint64 callback_queue_waits;
+  // with source_ranges: endpoints held by connections, distinct addresses
+  // among them, and endpoints waiting out their quarantine
+  uint64 sources_in_use;
+  uint64 source_ips_in_use;
+  uint64 sources_quarantined;
+  // with record.path: packets recorded, and those dropped because the
+  // recorder fell behind
+  uint64 packets_recorded;
+  uint64 record_drops;
+  // with impairment: packets dropped and duplicated, those held back longer
+  // to reorder them, and those held back right now
+  uint64 impaired_drops;
+  uint64 impaired_duplicates;
+  uint64 impaired_reorders;
+  uint64 impaired_pending;
+  // What the kernel holds in memory, in bytes, estimated from the counts
+  // and sizes of what it keeps rather than asked from the allocator: the
+  // connections with their callbacks (but what those capture beyond the
+  // storage of std::function), the connection tables, packets waiting to
+  // be sent or held back by the impairment, callback events still queued
+  // with their messages, the source address bitmaps and quarantine, and
+  // the recorder's buffers. Per connection is the total over connections.
+  uint64 memory_connections;
+  uint64 memory_tables;
+  uint64 memory_packets;
+  uint64 memory_callbacks;
+  uint64 memory_sources;
+  uint64 memory_recorder;
+  uint64 memory_total;
+  uint64 memory_per_connection;
+  // with memory_budget: connections not created or restored, and messages
+  // Connection::Send refused, because the total had reached it
+  uint64 memory_refused_connections;
+  uint64 memory_refused_sends;
+};
 
 class Kernel : public NonCopyable {
  public:
   friend class Singleton<Kernel>;
 
-  static void Start() {
-    Singleton<Kernel>::Instance().DoStart();
+  static void Start(const KernelOptions& options = KernelOptions()) {
+    Singleton<Kernel>::Instance().DoStart(options);
   }
+  // Closes the connections still open as KernelOptions::teardown says,
+  // without running their callbacks any more, stops the threads and
+  // deletes every connection. Any Connection pointer is stale afterwards,
+  // Start may be called again.
   static void Stop() {
     Singleton<Kernel>::Instance().DoStop();
   }
 
-  // Kernel will take ownership of the connection
+  // Kernel will take ownership of the connection. NULL when it would not
+  // fit into KernelOptions::memory_budget.
   static Connection* NewConnection(const InetAddress& dst_addr,
                                    const InetAddress& src_addr) {
     return Singleton<Kernel>::Instance().DoNewConnection(dst_addr, src_addr);
   }
+  // with a source address from KernelOptions::source_ranges, NULL when
+  // they are used up or over the memory budget
+  static Connection* NewConnection(const InetAddress& dst_addr) {
+    return Singleton<Kernel>::Instance().DoNewConnection(dst_addr);
+  }
   static void Send(std::shared_ptr<Packet> packet) {
     Singleton<Kernel>::Instance().DoSend(packet);
   }
   static void Release(Connection& conn) {
     Singleton<Kernel>::Instance().DoRelease(conn);
   }
+  static KernelStats GetStats() {
+    return Singleton<Kernel>::Instance().DoGetStats();
+  }
+  // Writes out what has been recorded, in ring mode the last
+  // record.ring_seconds. False without a recording or on errors.
+  static bool SaveRecording() {
+    return Singleton<Kernel>::Instance().DoSaveRecording();
+  }
+
+  // Writes the established connections to |path|, see SnapshotFile, and
+  // returns how many, -1 on errors. Data still in flight is not part of
+  // it, so take it while the connections are quiet. ipv4 only, ipv6
+  // connections are left out.
+  static int64 SaveSnapshot(const std::string& path) {
+    return Singleton<Kernel>::Instance().DoSaveSnapshot(path);
+  }
+  // Recreates the connections of a snapshot as established, without a
+  // handshake, so a restarted client carries on where the old one stopped.
+  // |restored| gets each one before the receive thread can, to set its
+  // callbacks. Connections whose source address is taken are skipped.
+  // Returns how many were restored, -1 on errors. Needs a started Kernel.
+  static int64 RestoreSnapshot(const std::string& path,
+                               const RestoredCallback& restored) {
+    return Singleton<Kernel>::Instance().DoRestoreSnapshot(path, restored);
+  }
 
  private:
   Kernel();
   ~Kernel();
-  void DoStart();
+  void DoStart(const KernelOptions& options);
   void DoStop();
   Connection* DoNewConnection(const InetAddress& dst_addr,
                               const InetAddress& src_addr);
+  Connection* DoNewConnection(const InetAddress& dst_addr);
   void DoSend(std::shared_ptr<Packet> packet);
+  KernelStats DoGetStats();
+  bool DoSaveRecording();
+  int64 DoSaveSnapshot(const std::string& path);
+  int64 DoRestoreSnapshot(const std::string& path,
+                          const RestoredCallback& restored);
+  static void CountEstablished(int delta) {
+    Singleton<Kernel>::Instance().established_ += delta;
+  }
+  static void CountSynSent(int delta) {
+    Singleton<Kernel>::Instance().syn_sent_ += delta;
+  }
+  // where Connection hands its callbacks, NULL when they run inline
+  static EventDispatcher* Dispatcher() {
+    return Singleton<Kernel>::Instance().dispatcher_.get();
+  }
+  // Stop has begun, callbacks are no longer run
+  static bool Stopping() {
+    return Singleton<Kernel>::Instance().stoped_;
+  }
+  // for Connection::Send, false when the memory budget is reached
+  static bool MemoryAvailable() {
+    return Singleton<Kernel>::Instance().DoMemoryAvailable();
+  }
+  bool DoMemoryAvailable();
+  // Fills in the memory fields of |stats| but the refused counts and
+  // returns memory_total, with conn_mutex_ held.
+  uint64 AccountMemoryLocked(KernelStats* stats);
+  // how many more connections fit into the memory budget, with
+  // conn_mutex_ held
+  uint64 ConnectionRoomLocked();
+  // false, counted and logged, when not even one does
+  bool AdmitConnectionLocked();
+  void DeletePendingReleases();
+  // the connection closing part of DoStop
+  void Teardown();
+  // deletes what is left in the tables, once no thread can reach it
+  void DeleteConnections();
 
   void ReceiveThread();
   void SendThread();
-  Connection* FindConnection(const std::string& address);
-  void InsertConnection(const std::string& addr, Connection* conn);
+  void ReadTxTimestamps();
+  Connection* FindConnection(uint64 key);
+  Connection* FindConnection(const Endpoint6Key& key);
+  // the connection a received packet is for, NULL if none
+  Connection* Demux(const Packet& packet);
+  void InsertConnection(uint64 key, Connection* conn);
+  // by source address, those a restore has claimed too, with conn_mutex_
+  // held
+  bool HasConnection(const InetAddress& src_addr) const;
+  void AddConnection(Connection* conn);
+  void RemoveConnection(const InetAddress& src_addr);
 
   // must close it before remove
   void DoRelease(Connection& conn);
 
   ConnectionMap connections_;
+  Connection6Map connections6_;
+  // the source keys of the connections a RestoreSnapshot has yet to add
+  std::unordered_set<uint64> restoring_;
+  // guards connections_, connections6_, restoring_ and sources_
   std::mutex conn_mutex_;
+  std::unique_ptr<EndpointAllocator> sources_;
 
   std::thread receive_thread_;
   std::thread send_thread_;
-  int sockfd_;
+  std::shared_ptr<IoBackend> backend_;
+  // backend_ when impairing, NULL otherwise
+  ImpairedBackend* impaired_;
+  // NULL when not recording
+  std::unique_ptr<PacketRecorder> recorder_;
+  KernelOptions options_;
   BlockingQueue<std::shared_ptr<Packet>> packets_;
+  std::unique_ptr<EventDispatcher> dispatcher_;
+  // Connections released off the receive thread (from a callback thread,
+  // a session timer, any other) while it may still be processing a packet
+  // for them. The receive thread deletes them, through the dispatcher
+  // after their last queued event when there is one.
+  std::vector<Connection*> pending_releases_;
+  std::atomic<bool> has_pending_releases_;
 
   enum StopStatus {
     SS_STOPED,
@@ -74,9 +323,22 @@ class Kernel : public NonCopyable {
     SS_STOPING,
   };
   StopStatus receive_stop_state_;
+
+  std::atomic<uint64> packets_received_;
+  std::atomic<uint64> packets_sent_;
+  std::atomic<uint64> packets_unmatched_;
+  std::atomic<int64> established_;
+  std::atomic<int64> syn_sent_;
+  // memory_total less the send queue when last accounted, for the quick
+  // check of Connection::Send
+  std::atomic<uint64> memory_base_;
+  std::atomic<uint64> memory_refused_connections_;
+  std::atomic<uint64> memory_refused_sends_;
+
   std::atomic<bool> stoped_;
 
   friend class Connection;
+  friend class KernelPeer;
 };
 
 }
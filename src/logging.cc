@@ -0,0 +1,278 @@
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace tcpmany {
+
+static int InitialVerboseLevel() {
+  const char* level = ::getenv("TCPMANY_V");
+  return level != NULL ? ::atoi(level) : 0;
+}
+
+std::atomic<int> g_log_level(LOG_INFO);
+std::atomic<int> g_verbose_level(InitialVerboseLevel());
+
+namespace {
+
+// Where one thread's lines wait for the writer: a ring of bytes with a
+// single producer, the owning thread, and a single consumer, whoever holds
+// AsyncLogger::mutex_. A line goes in whole or not at all.
+class LogBuffer {
+ public:
+  static const size_t kCapacity = 1 << 20;
+
+  LogBuffer() : data_(new char[kCapacity]), head_(0), tail_(0) {}
+
+  // false if the line doesn't fit, *half_full tells when to wake the writer
+  bool Push(const char* line, size_t len, bool* half_full) {
+    uint64 tail = tail_.load(std::memory_order_relaxed);
+    uint64 head = head_.load(std::memory_order_acquire);
+    if (tail - head + len > kCapacity) {
+      return false;
+    }
+    size_t offset = tail & (kCapacity - 1);
+    size_t first = std::min(len, kCapacity - offset);
+    ::memcpy(data_.get() + offset, line, first);
+    ::memcpy(data_.get(), line + first, len - first);
+    tail_.store(tail + len, std::memory_order_release);
+    *half_full = tail + len - head > kCapacity / 2;
+    return true;
+  }
+
+  void Drain(std::string* out) {
+    uint64 head = head_.load(std::memory_order_relaxed);
+    uint64 tail = tail_.load(std::memory_order_acquire);
+    while (head != tail) {
+      size_t offset = head & (kCapacity - 1);
+      size_t len = std::min<uint64>(tail - head, kCapacity - offset);
+      out->append(data_.get() + offset, len);
+      head += len;
+    }
+    head_.store(head, std::memory_order_release);
+  }
+
+ private:
+  // not value initialized, pages are only touched once lines reach them
+  std::unique_ptr<char[]> data_;
+  std::atomic<uint64> head_;
+  std::atomic<uint64> tail_;
+};
+
+// Owns the buffers of all threads and the thread that writes them to
+// stderr every 50ms, or sooner when one fills up. Never destroyed: threads
+// and atexit handlers may still log while the process goes down, so at
+// exit it only flushes and switches to writing synchronously.
+class AsyncLogger {
+ public:
+  static AsyncLogger& Instance() {
+    static AsyncLogger* logger = new AsyncLogger();
+    return *logger;
+  }
+
+  void Append(const char* line, size_t len, int level) {
+    if (!synchronous_.load(std::memory_order_acquire)) {
+      LogBuffer* buffer = ThreadBuffer();
+      bool half_full = false;
+      if (buffer->Push(line, len, &half_full)) {
+        if (half_full) {
+          wakeup_.notify_one();
+        }
+        return;
+      }
+      // the writer can't keep up: drop chatter, but not what matters
+      if (level < LOG_WARNING) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    WriteLocked();
+    ::fwrite(line, 1, len, stderr);
+  }
+
+  void Flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    WriteLocked();
+    ::fflush(stderr);
+  }
+
+ private:
+  AsyncLogger() : synchronous_(false), dropped_(0) {
+    ::atexit(&AsyncLogger::AtExit);
+    std::thread(&AsyncLogger::WriterThread, this).detach();
+  }
+
+  static void AtExit() {
+    AsyncLogger& logger = Instance();
+    logger.synchronous_.store(true, std::memory_order_release);
+    logger.Flush();
+  }
+
+  LogBuffer* ThreadBuffer() {
+    // the logger keeps its reference until the last line is written
+    thread_local std::shared_ptr<LogBuffer> buffer;
+    if (!buffer) {
+      buffer = std::make_shared<LogBuffer>();
+      std::unique_lock<std::mutex> lock(mutex_);
+      buffers_.push_back(buffer);
+    }
+    return buffer.get();
+  }
+
+  void WriterThread() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      wakeup_.wait_for(lock, std::chrono::milliseconds(50));
+      WriteLocked();
+    }
+  }
+
+  // drains every buffer into stderr and forgets those of exited threads
+  void WriteLocked() {
+    pending_.clear();
+    for (size_t i = 0; i < buffers_.size();) {
+      buffers_[i]->Drain(&pending_);
+      if (buffers_[i].use_count() == 1) {
+        buffers_[i] = buffers_.back();
+        buffers_.pop_back();
+      } else {
+        ++i;
+      }
+    }
+    uint64 dropped = dropped_.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0) {
+      pending_ += "logging fell behind, dropped " +
+                  std::to_string(dropped) + " lines\n";
+    }
+    if (!pending_.empty()) {
+      ::fwrite(pending_.data(), 1, pending_.size(), stderr);
+    }
+  }
+
+  std::atomic<bool> synchronous_;
+  std::atomic<uint64> dropped_;
+  // guards buffers_ and pending_, and serializes the writes to stderr
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::vector<std::shared_ptr<LogBuffer> > buffers_;
+  std::string pending_;
+};
+
+// "YYYYMMDD:HHMMSS" only changes once a second, the thread id never
+struct ThreadPrefix {
+  ThreadPrefix() : second(-1), tid(::syscall(SYS_gettid)) {}
+
+  void Format(const struct timespec& now) {
+    if (now.tv_sec == second) {
+      return;
+    }
+    second = now.tv_sec;
+    struct tm tm;
+    ::localtime_r(&now.tv_sec, &tm);
+    snprintf(text, sizeof(text), "%04d%02d%02d:%02d%02d%02d",
+             (1900 + tm.tm_year) % 10000,
+             (tm.tm_mon + 1) % 100,
+             tm.tm_mday % 100,
+             tm.tm_hour % 100,
+             tm.tm_min % 100,
+             tm.tm_sec % 100);
+  }
+
+  time_t second;
+  long tid;
+  char text[24];
+};
+
+thread_local ThreadPrefix t_prefix;
+thread_local LogStream t_stream;
+
+int64 MonotonicNanoseconds() {
+  struct timespec ts;
+  ::clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return static_cast<int64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+}  // namespace
+
+void FlushLogs() {
+  AsyncLogger::Instance().Flush();
+}
+
+LogStream::LogStream() : std::ostream(this), busy(false), size_(0) {
+  Reset();
+}
+
+void LogStream::Reset() {
+  setp(buf_, buf_ + kMaxLine - 1);
+  clear();
+  size_ = 0;
+}
+
+void LogStream::Finish() {
+  // the put area ends one byte short of buf_, a full line keeps its newline
+  size_t len = pptr() - pbase();
+  buf_[len] = '\n';
+  size_ = len + 1;
+}
+
+LogMessage::LogMessage(const char* file,
+                       int line,
+                       const char* level_str,
+                       int level)
+    : stream_(&t_stream), owned_(false), level_(level) {
+  if (stream_->busy) {
+    stream_ = new LogStream();
+    owned_ = true;
+  }
+  stream_->busy = true;
+  struct timespec now;
+  ::clock_gettime(CLOCK_REALTIME, &now);
+  t_prefix.Format(now);
+  char micros[16];
+  snprintf(micros, sizeof(micros), ".%06ld", now.tv_nsec / 1000 % 1000000);
+  *stream_ << t_prefix.tid << ':'
+           << t_prefix.text << micros << ':'
+           << level_str << ':'
+           << file << ':'
+           << line << "| ";
+}
+
+LogMessage::~LogMessage() {
+  stream_->Finish();
+  AsyncLogger::Instance().Append(stream_->data(), stream_->size(), level_);
+  stream_->Reset();
+  stream_->busy = false;
+  if (owned_) {
+    delete stream_;
+  }
+  if (level_ == LOG_FATAL) {
+    FlushLogs();
+    ::abort();
+  }
+}
+
+uint64 LogRateLimiter::Allow(double seconds) {
+  int64 now = MonotonicNanoseconds();
+  int64 next = next_.load(std::memory_order_relaxed);
+  if (now < next ||
+      !next_.compare_exchange_strong(
+          next, now + static_cast<int64>(seconds * 1e9),
+          std::memory_order_relaxed)) {
+    suppressed_.fetch_add(1, std::memory_order_relaxed);
+    return 0;
+  }
+  return 1 + suppressed_.exchange(0, std::memory_order_relaxed);
+}
+
+}  // namespace tcpmany
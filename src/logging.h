@@ -1,21 +1,32 @@
 #ifndef TCPMANY_LOGGING_H_
 #define TCPMANY_LOGGING_H_
 
-#include <time.h>
-#include <stdio.h>
-#include <sstream>
-#include <thread>
+#include <atomic>
+#include <ostream>
+#include <streambuf>
 
-#define LOG_LEVEL tcpmany::LOG_INFO
-#define LOG_VERBOSE_LEVEL 3
+#include "base.h"
 
+// FATAL always gets through, whatever SetLogLevel says, so that a failed
+// CHECK aborts; for the other severities the first test folds away.
 #define LOG(severity) \
-  if (LOG_LEVEL <= tcpmany::LOG_##severity) \
-    tcpmany::SimpleLogger(__FILE__, __LINE__, #severity, \
+  if (tcpmany::LOG_##severity == tcpmany::LOG_FATAL || \
+      tcpmany::LogLevel() <= tcpmany::LOG_##severity) \
+    tcpmany::LogMessage(__FILE__, __LINE__, #severity, \
         tcpmany::LOG_##severity).Stream()
 
+// verbose logging, off unless SetVerboseLevel (or the TCPMANY_V environment
+// variable) raised the level to at least v
 #define VLOG(v) \
-  if (LOG_VERBOSE_LEVEL >= v) LOG(INFO)
+  if (tcpmany::VerboseLevel() >= (v)) LOG(INFO)
+
+// At most one message every |seconds| from this statement, the next one
+// that gets through says how many were suppressed in between.
+#define LOG_EVERY_N_SEC(severity, seconds) \
+  if (uint64 tcpmany_log_allowed = \
+          [] { static tcpmany::LogRateLimiter limiter; return &limiter; }() \
+              ->Allow(seconds)) \
+    LOG(severity) << tcpmany::LogSuppressed(tcpmany_log_allowed - 1)
 
 #define CHECK(condition) \
   if (!(condition)) \
@@ -29,39 +40,103 @@ const int LOG_ERROR = 2;
 const int LOG_ERROR_REPORT = 3;
 const int LOG_FATAL = 4;
 
-class SimpleLogger {
+extern std::atomic<int> g_log_level;
+extern std::atomic<int> g_verbose_level;
+
+// Both can be changed at any time from any thread, the macros above only
+// pay for a relaxed load when a message is filtered out.
+inline int LogLevel() {
+  return g_log_level.load(std::memory_order_relaxed);
+}
+inline void SetLogLevel(int level) {
+  g_log_level.store(level, std::memory_order_relaxed);
+}
+inline int VerboseLevel() {
+  return g_verbose_level.load(std::memory_order_relaxed);
+}
+inline void SetVerboseLevel(int level) {
+  g_verbose_level.store(level, std::memory_order_relaxed);
+}
+
+// Writes out everything logged so far. Lines are otherwise written by a
+// background thread, so call this before leaving with _exit.
+void FlushLogs();
+
+class LogStream;
+
+// Formats one line into a per-thread buffer and hands it to the background
+// writer when destroyed, so the logging thread never waits for stderr. A
+// FATAL message flushes everything and aborts.
+class LogMessage {
  public:
-  SimpleLogger(const char* file, int line, const char* level_str, int level)
-      : level_(level) {
-    time_t t = ::time(nullptr);
-    struct tm* tm = ::localtime(&t);
-    char time_buf[20] = {0};
-    snprintf(time_buf, sizeof(time_buf), "%d%02d%02d:%02d%02d%02d",
-        1900 + tm->tm_year,
-        tm->tm_mon,
-        tm->tm_mday,
-        tm->tm_hour,
-        tm->tm_min,
-        tm->tm_sec);
-    stream_ << std::this_thread::get_id() << ':'
-            << time_buf << ':'
-            << level_str << ':'
-            << file << ':'
-            << line << "| ";
+  LogMessage(const char* file, int line, const char* level_str, int level);
+  ~LogMessage();
+  std::ostream& Stream();
+
+ private:
+  // the thread's reusable stream, or an own one when a message is logged
+  // while formatting another
+  LogStream* stream_;
+  bool owned_;
+  int level_;
+};
+
+// A fixed size line buffer, whatever doesn't fit is cut off.
+class LogStream : private std::streambuf, public std::ostream {
+ public:
+  static const int kMaxLine = 4096;
+
+  LogStream();
+  void Reset();
+  // ends the line, data() and size() then cover it with its newline
+  void Finish();
+  const char* data() const {
+    return buf_;
   }
-  ~SimpleLogger() {
-    stream_ << '\n';
-    ::fwrite(stream_.str().c_str(), 1, stream_.str().length(), stderr);
-    if (level_ == LOG_FATAL) {
-      ::fflush(stderr);
-      ::abort();
-    }
+  size_t size() const {
+    return size_;
   }
-  std::ostream& Stream() { return stream_; }
+
+  // set while a message is being formatted into the stream
+  bool busy;
 
  private:
-  std::ostringstream stream_;
-  int level_;
+  virtual std::streambuf::int_type overflow(std::streambuf::int_type c) {
+    return std::streambuf::traits_type::not_eof(c);
+  }
+
+  char buf_[kMaxLine];
+  size_t size_;
+};
+
+inline std::ostream& LogMessage::Stream() {
+  return *stream_;
+}
+
+class LogRateLimiter {
+ public:
+  LogRateLimiter() : next_(0), suppressed_(0) {}
+  // 0 when the message has to be suppressed, otherwise one more than the
+  // number suppressed since the last one that got through
+  uint64 Allow(double seconds);
+
+ private:
+  std::atomic<int64> next_;
+  std::atomic<uint64> suppressed_;
+};
+
+struct LogSuppressed {
+  explicit LogSuppressed(uint64 n) : count(n) {}
+  uint64 count;
 };
+
+inline std::ostream& operator<<(std::ostream& os, const LogSuppressed& s) {
+  if (s.count > 0) {
+    os << "(" << s.count << " similar suppressed) ";
+  }
+  return os;
 }
+
+}  // namespace tcpmany
+
 #endif  // TCPMANY_LOGGING_H_
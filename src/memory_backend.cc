@@ -0,0 +1,115 @@
+#include "memory_backend.h"
+
+#include <string.h>
+#include <string>
+
+namespace tcpmany {
+
+static const uint32 kServerIsn = 1000000;
+static const int kReceiveTimeoutMs = 100;
+
+MemoryBackend::MemoryBackend(bool echo) : echo_(echo) {
+  ::memset(&stats_, 0, sizeof(stats_));
+}
+
+PacketPtr MemoryBackend::Reply(const Packet& request,
+                               uint32 seq,
+                               uint32 ack_seq) {
+  auto reply = std::make_shared<Packet>(request.Family());
+  reply->ExchangeAddress(request);
+  reply->SetSeq(seq);
+  reply->SetAck();
+  reply->SetAckSeq(ack_seq);
+  return reply;
+}
+
+MemoryBackend::Peer* MemoryBackend::FindPeer(const Packet& packet,
+                                             bool create) {
+  if (packet.IsIpv6()) {
+    if (create) {
+      return &peers6_[packet.SrcKey6()];
+    }
+    auto iter = peers6_.find(packet.SrcKey6());
+    return iter == peers6_.end() ? NULL : &iter->second;
+  }
+  if (create) {
+    return &peers_[packet.SrcKey()];
+  }
+  auto iter = peers_.find(packet.SrcKey());
+  return iter == peers_.end() ? NULL : &iter->second;
+}
+
+void MemoryBackend::ErasePeer(const Packet& packet) {
+  if (packet.IsIpv6()) {
+    peers6_.erase(packet.SrcKey6());
+  } else {
+    peers_.erase(packet.SrcKey());
+  }
+}
+
+int MemoryBackend::Receive(Packet* packet) {
+  PacketPtr reply;
+  if (!replies_.TimedPop(reply, kReceiveTimeoutMs)) {
+    return 0;
+  }
+  int len = reply->Size();
+  ::memcpy(packet->Buffer(), reply->Buffer(), len);
+  return len;
+}
+
+int MemoryBackend::Send(const Packet& packet) {
+  int len = packet.Size();
+  PacketPtr reply;
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (packet.IsSyn() && !packet.IsAck()) {
+    Peer& peer = *FindPeer(packet, true);
+    peer.seq = kServerIsn;
+    peer.established = false;
+    peer.fin_sent = false;
+    reply = Reply(packet, peer.seq++, packet.GetSeq() + 1);
+    reply->SetSyn();
+    ++stats_.accepted;
+  } else {
+    Peer* found = FindPeer(packet, false);
+    if (found == NULL) {
+      return len;
+    }
+    Peer& peer = *found;
+    int data_len = packet.DataLen();
+    if (packet.IsRst()) {
+      ErasePeer(packet);
+      ++stats_.closed;
+    } else if (data_len > 0) {
+      stats_.bytes_received += data_len;
+      reply = Reply(packet, peer.seq, packet.GetSeq() + data_len);
+      if (echo_) {
+        reply->SetPsh();
+        reply->SetData(std::string(packet.Data(), data_len));
+        peer.seq += data_len;
+      }
+    } else if (packet.IsFin()) {
+      // ack the FIN and close our side in the same segment
+      reply = Reply(packet, peer.seq++, packet.GetSeq() + 1);
+      reply->SetFin();
+      peer.fin_sent = true;
+    } else if (peer.fin_sent) {
+      ErasePeer(packet);
+      ++stats_.closed;
+    } else if (!peer.established) {
+      peer.established = true;
+      ++stats_.established;
+    }
+  }
+  lock.unlock();
+  if (reply) {
+    replies_.Push(reply);
+  }
+  return len;
+}
+
+MemoryBackend::Stats MemoryBackend::GetStats() const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+}  // namespace tcpmany
@@ -0,0 +1,60 @@
+#ifndef TCPMANY_MEMORY_BACKEND_H_
+#define TCPMANY_MEMORY_BACKEND_H_
+
+#include <unordered_map>
+#include <mutex>
+
+#include "blocking_queue.h"
+#include "io_backend.h"
+#include "packet.h"
+
+namespace tcpmany {
+
+// Stands in for the network and a minimal tcp server inside the process.
+// Every packet the kernel sends is answered right away: SYN with SYN-ACK,
+// data with an ACK (carrying the same data back when |echo| is set) and
+// FIN with FIN-ACK, a RST forgets the client. Needs no privileges and runs
+// at memory speed, so the user space stack can be measured apart from the
+// NIC. Takes both ipv4 and ipv6.
+class MemoryBackend : public IoBackend {
+ public:
+  struct Stats {
+    uint64 accepted;
+    uint64 established;
+    uint64 closed;
+    uint64 bytes_received;
+  };
+
+  explicit MemoryBackend(bool echo = true);
+  virtual ~MemoryBackend() {}
+
+  virtual int Receive(Packet* packet);
+  virtual int Send(const Packet& packet);
+
+  Stats GetStats() const;
+
+ private:
+  // what the simulated server remembers about one client
+  struct Peer {
+    uint32 seq;
+    bool established;
+    bool fin_sent;
+  };
+
+  static PacketPtr Reply(const Packet& request, uint32 seq, uint32 ack_seq);
+  // the peer that sent |packet|, with mutex_ held; NULL if unknown and not
+  // |create|
+  Peer* FindPeer(const Packet& packet, bool create);
+  void ErasePeer(const Packet& packet);
+
+  const bool echo_;
+  std::unordered_map<uint64, Peer> peers_;
+  std::unordered_map<Endpoint6Key, Peer, Endpoint6KeyHash> peers6_;
+  mutable std::mutex mutex_;
+  Stats stats_;
+  BlockingQueue<PacketPtr> replies_;
+};
+
+}  // namespace tcpmany
+
+#endif  // TCPMANY_MEMORY_BACKEND_H_
@@ -4,6 +4,7 @@
 #include <linux/if_ether.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/ip6.h>
 #include <netinet/tcp.h>
 #include <string.h>
 #include <errno.h>
@@ -21,9 +22,24 @@ namespace tcpmany {
 struct Packet;
 typedef std::shared_ptr<Packet> PacketPtr;
 
+// Times reported by the kernel through SO_TIMESTAMPING, in nanoseconds.
+// software is CLOCK_REALTIME, hardware is the NIC clock; 0 means the kernel
+// did not report that kind of timestamp for the packet.
+struct PacketTimestamp {
+  int64 software;
+  int64 hardware;
+
+  PacketTimestamp() : software(0), hardware(0) {}
+};
+
+// An ipv4 or ipv6 tcp packet, without ip options or ipv6 extension
+// headers. pkt and pkt6 are the two layouts of raw, the version in the
+// first byte says which one holds; Tcp() works for both.
 struct Packet {
   static const uint32 MAX_SIZE = ETH_FRAME_LEN;
   static const uint16 HEADER_LEN = sizeof(struct iphdr) + sizeof(struct tcphdr);
+  static const uint16 HEADER6_LEN =
+      sizeof(struct ip6_hdr) + sizeof(struct tcphdr);
 
   union {
     unsigned char raw[MAX_SIZE];
@@ -32,78 +48,139 @@ struct Packet {
       struct tcphdr tcp;
       unsigned char data[MAX_SIZE - HEADER_LEN];
     } pkt;
+    struct {
+      struct ip6_hdr ip6;
+      struct tcphdr tcp;
+      unsigned char data[MAX_SIZE - HEADER6_LEN];
+    } pkt6;
   };
+  // filled by the receive path, not part of the wire data
+  PacketTimestamp timestamp;
 
-  Packet() {
+  explicit Packet(sa_family_t family = AF_INET) {
     ::memset(raw, 0, sizeof(raw));
-    pkt.ip.version = IPVERSION;
-    pkt.ip.ihl = sizeof(pkt.ip) / 4;
-    pkt.ip.tos = 0x04;
-    pkt.ip.tot_len = ::htons(HEADER_LEN);
-    pkt.ip.id = 11111;  // TODO
-    pkt.ip.frag_off = 0;
-    pkt.ip.ttl = IPDEFTTL;
-    pkt.ip.protocol = IPPROTO_TCP;
-
-    pkt.tcp.doff = sizeof(struct tcphdr) / 4;
-    pkt.tcp.window = ::htons(4096);
-    pkt.tcp.urg_ptr = 0;
+    if (family == AF_INET6) {
+      pkt6.ip6.ip6_flow = ::htonl(6 << 28);
+      pkt6.ip6.ip6_plen = ::htons(sizeof(struct tcphdr));
+      pkt6.ip6.ip6_nxt = IPPROTO_TCP;
+      pkt6.ip6.ip6_hlim = IPDEFTTL;
+    } else {
+      pkt.ip.version = IPVERSION;
+      pkt.ip.ihl = sizeof(pkt.ip) / 4;
+      pkt.ip.tos = 0x04;
+      pkt.ip.tot_len = ::htons(HEADER_LEN);
+      pkt.ip.id = 11111;  // TODO
+      pkt.ip.frag_off = 0;
+      pkt.ip.ttl = IPDEFTTL;
+      pkt.ip.protocol = IPPROTO_TCP;
+    }
+    Tcp().doff = sizeof(struct tcphdr) / 4;
+    Tcp().window = ::htons(4096);
+    Tcp().urg_ptr = 0;
   }
 
-  bool IsTcp() const { return pkt.ip.protocol == IPPROTO_TCP; }
-  void SetSyn() { pkt.tcp.syn = 1; }
-  bool IsSyn() const { return pkt.tcp.syn == 1; }
-  void SetAck() { pkt.tcp.ack = 1; }
-  bool IsAck() const { return pkt.tcp.ack == 1; }
-  void SetFin() { pkt.tcp.fin = 1; }
-  bool IsFin() const { return pkt.tcp.fin == 1; }
-  void SetPsh() { pkt.tcp.psh = 1; }
-  bool IsPsh() const { return pkt.tcp.psh == 1; }
-  void SetSeq(uint32 n) { pkt.tcp.seq = ::htonl(n); }
-  uint32 GetSeq() const { return ::ntohl(pkt.tcp.seq); }
-  void SetAckSeq(uint32 n) { pkt.tcp.ack_seq = ::htonl(n); }
-  uint32 GetAckSeq() const { return ::ntohl(pkt.tcp.ack_seq); }
+  bool IsIpv6() const { return (raw[0] >> 4) == 6; }
+  sa_family_t Family() const { return IsIpv6() ? AF_INET6 : AF_INET; }
+  struct tcphdr& Tcp() { return IsIpv6() ? pkt6.tcp : pkt.tcp; }
+  const struct tcphdr& Tcp() const { return IsIpv6() ? pkt6.tcp : pkt.tcp; }
 
+  bool IsTcp() const {
+    return IsIpv6() ? pkt6.ip6.ip6_nxt == IPPROTO_TCP
+                    : pkt.ip.protocol == IPPROTO_TCP;
+  }
+  void SetSyn() { Tcp().syn = 1; }
+  bool IsSyn() const { return Tcp().syn == 1; }
+  void SetAck() { Tcp().ack = 1; }
+  bool IsAck() const { return Tcp().ack == 1; }
+  void SetFin() { Tcp().fin = 1; }
+  bool IsFin() const { return Tcp().fin == 1; }
+  void SetRst() { Tcp().rst = 1; }
+  bool IsRst() const { return Tcp().rst == 1; }
+  void SetPsh() { Tcp().psh = 1; }
+  bool IsPsh() const { return Tcp().psh == 1; }
+  void SetSeq(uint32 n) { Tcp().seq = ::htonl(n); }
+  uint32 GetSeq() const { return ::ntohl(Tcp().seq); }
+  void SetAckSeq(uint32 n) { Tcp().ack_seq = ::htonl(n); }
+  uint32 GetAckSeq() const { return ::ntohl(Tcp().ack_seq); }
+
+  // of the packet's own family
   void SetSrcAddress(const InetAddress& addr) {
-    pkt.ip.saddr = addr.SockAddr().sin_addr.s_addr;
-    pkt.tcp.source = addr.SockAddr().sin_port;
+    if (IsIpv6()) {
+      pkt6.ip6.ip6_src = addr.SockAddr6().sin6_addr;
+    } else {
+      pkt.ip.saddr = addr.SockAddr().sin_addr.s_addr;
+    }
+    Tcp().source = addr.PortNet();
   }
   void SetDstAddress(const InetAddress& addr) {
-    pkt.ip.daddr = addr.SockAddr().sin_addr.s_addr;
-    pkt.tcp.dest = addr.SockAddr().sin_port;
+    if (IsIpv6()) {
+      pkt6.ip6.ip6_dst = addr.SockAddr6().sin6_addr;
+    } else {
+      pkt.ip.daddr = addr.SockAddr().sin_addr.s_addr;
+    }
+    Tcp().dest = addr.PortNet();
   }
   void SetAddress(const InetAddress& dst, const InetAddress& src) {
     SetDstAddress(dst);
     SetSrcAddress(src);
   }
+  InetAddress SrcAddress() const {
+    if (IsIpv6()) {
+      return InetAddress(pkt6.ip6.ip6_src, SrcPort());
+    }
+    return InetAddress(::ntohl(pkt.ip.saddr), SrcPort());
+  }
+  InetAddress DstAddress() const {
+    if (IsIpv6()) {
+      return InetAddress(pkt6.ip6.ip6_dst, DstPort());
+    }
+    return InetAddress(::ntohl(pkt.ip.daddr), DstPort());
+  }
   std::string SrcIpPortString() const {
-    char buf[32] = {0};
-    snprintf(buf, sizeof(buf), "%s:%d",
-        inet_ntoa({s_addr: pkt.ip.saddr}), ntohs(pkt.tcp.source));
-    return buf;
+    return SrcAddress().ToIpPort();
   }
   std::string DstIpPortString() const {
-    char buf[32] = {0};
-    snprintf(buf, sizeof(buf), "%s:%d",
-        inet_ntoa({s_addr: pkt.ip.daddr}), ntohs(pkt.tcp.dest));
-    return buf;
+    return DstAddress().ToIpPort();
+  }
+  // ipv4 only
+  uint64 SrcKey() const {
+    return EndpointKey(pkt.ip.saddr, pkt.tcp.source);
+  }
+  uint64 DstKey() const {
+    return EndpointKey(pkt.ip.daddr, pkt.tcp.dest);
   }
   struct sockaddr_in DstSockAddr() const {
     return {sin_family: AF_INET,
             sin_port: pkt.tcp.dest,
             sin_addr: {s_addr: pkt.ip.daddr}};
   }
+  // ipv6 only
+  Endpoint6Key SrcKey6() const {
+    return EndpointKey(pkt6.ip6.ip6_src, pkt6.tcp.source);
+  }
+  Endpoint6Key DstKey6() const {
+    return EndpointKey(pkt6.ip6.ip6_dst, pkt6.tcp.dest);
+  }
+  // The port is left 0: raw ipv6 sockets take it for the protocol and
+  // refuse anything else.
+  struct sockaddr_in6 DstSockAddr6() const {
+    struct sockaddr_in6 addr;
+    ::memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = pkt6.ip6.ip6_dst;
+    return addr;
+  }
   uint16 SrcPort() const {
-    return ::ntohs(pkt.tcp.source);
+    return ::ntohs(Tcp().source);
   }
   uint16 DstPort() const {
-    return ::ntohs(pkt.tcp.dest);
+    return ::ntohs(Tcp().dest);
   }
   uint16 SrcPortNet() const {
-    return pkt.tcp.source;
+    return Tcp().source;
   }
   uint16 DstPortNet() const {
-    return pkt.tcp.dest;
+    return Tcp().dest;
   }
   uint32 SrcIpNet() const {
     return pkt.ip.saddr;
@@ -117,93 +194,190 @@ struct Packet {
   void SetDstIpNet(uint32 ip) {
     pkt.ip.daddr = ip;
   }
+  const struct in6_addr& SrcIp6() const {
+    return pkt6.ip6.ip6_src;
+  }
+  const struct in6_addr& DstIp6() const {
+    return pkt6.ip6.ip6_dst;
+  }
   void SetSrcPortNet(uint16 port) {
-    pkt.tcp.source = port;
+    Tcp().source = port;
   }
   void SetDstPortNet(uint16 port) {
-    pkt.tcp.dest = port;
+    Tcp().dest = port;
   }
 
   unsigned char* Buffer() {
     return raw;
   }
   const char* Data() const {
-    return reinterpret_cast<const char*>(&pkt.tcp) + pkt.tcp.doff * 4;
+    return reinterpret_cast<const char*>(&Tcp()) + Tcp().doff * 4;
   }
   int DataLen() const {
+    if (IsIpv6()) {
+      return ::ntohs(pkt6.ip6.ip6_plen) - pkt6.tcp.doff * 4;
+    }
     return ::ntohs(pkt.ip.tot_len) - sizeof(struct iphdr) - pkt.tcp.doff * 4;
   }
   void SetData(const std::string& data) {
+    if (IsIpv6()) {
+      CHECK(data.size() <= sizeof(pkt6.data));
+      ::memcpy(pkt6.data, data.c_str(), data.length());
+      pkt6.ip6.ip6_plen =
+          ::htons(::ntohs(pkt6.ip6.ip6_plen) + data.length());
+      return;
+    }
     CHECK(data.size() <= sizeof(pkt.data));
     ::memcpy(pkt.data, data.c_str(), data.length());
-    pkt.ip.tot_len += ::htons(data.length());
+    pkt.ip.tot_len = ::htons(::ntohs(pkt.ip.tot_len) + data.length());
   }
 
   size_t Size() const {
+    if (IsIpv6()) {
+      return sizeof(struct ip6_hdr) + ::ntohs(pkt6.ip6.ip6_plen);
+    }
     return ::ntohs(pkt.ip.tot_len);
   }
 
+  // both packets of the same family
   void ExchangeAddress(const Packet& p) {
-    pkt.ip.saddr = p.pkt.ip.daddr;
-    pkt.ip.daddr = p.pkt.ip.saddr;
-    pkt.tcp.source = p.pkt.tcp.dest;
-    pkt.tcp.dest = p.pkt.tcp.source;
+    if (IsIpv6()) {
+      pkt6.ip6.ip6_src = p.pkt6.ip6.ip6_dst;
+      pkt6.ip6.ip6_dst = p.pkt6.ip6.ip6_src;
+    } else {
+      pkt.ip.saddr = p.pkt.ip.daddr;
+      pkt.ip.daddr = p.pkt.ip.saddr;
+    }
+    Tcp().source = p.Tcp().dest;
+    Tcp().dest = p.Tcp().source;
   }
 
-  static uint16 Checksum(const void* data, int len) {
-    CHECK(len % 2 == 0);
-    const uint16* p = static_cast<const uint16*>(data);
-    int sum = 0;
-    for (int i = 0; i < len; i+=2) {
-      sum += *p++;
+  // Ones' complement sum of data in network order 16-bit words, added to
+  // sum and not yet folded. An odd trailing byte is padded with zero.
+  static uint32 ChecksumAdd(uint32 sum, const void* data, int len) {
+    const uint8* p = static_cast<const uint8*>(data);
+    for (; len > 1; len -= 2, p += 2) {
+      uint16 word;
+      ::memcpy(&word, p, sizeof(word));
+      sum += word;
+    }
+    if (len == 1) {
+      uint16 word = 0;
+      ::memcpy(&word, p, 1);
+      sum += word;
     }
+    return sum;
+  }
+
+  static uint16 ChecksumFold(uint32 sum) {
     while (sum >> 16) {
       sum = (sum & 0xffff) + (sum >> 16);
     }
-    CHECK(sum <= 0xffff);
     return ~sum;
   }
 
+  static uint16 Checksum(const void* data, int len) {
+    return ChecksumFold(ChecksumAdd(0, data, len));
+  }
+
+  // Updates check for a 32-bit field of the summed data changing from
+  // old_value to new_value, eqn. 3 of RFC 1624: HC' = ~(~HC + ~m + m').
+  static uint16 ChecksumReplace(uint16 check,
+                                uint32 old_value,
+                                uint32 new_value) {
+    uint32 sum = static_cast<uint16>(~check);
+    sum += static_cast<uint16>(~old_value) +
+           static_cast<uint16>(~old_value >> 16);
+    sum += (new_value & 0xffff) + (new_value >> 16);
+    return ChecksumFold(sum);
+  }
+
+  // Full recompute of both checksums over the IP header and the whole
+  // TCP segment, options and payload included. ipv6 has no header
+  // checksum, its pseudo header takes the 128-bit addresses.
   void CalculateChecksum() {
+    if (IsIpv6()) {
+      const int tcp_len = ::ntohs(pkt6.ip6.ip6_plen);
+      pkt6.tcp.check = 0;
+      uint32 sum = ChecksumAdd(0, &pkt6.ip6.ip6_src, 32);
+      sum += ::htons(tcp_len);
+      sum += ::htons(IPPROTO_TCP);
+      pkt6.tcp.check = ChecksumFold(ChecksumAdd(sum, &pkt6.tcp, tcp_len));
+      return;
+    }
+    const int ip_header_len = pkt.ip.ihl * 4;
+    const int tcp_len = ::ntohs(pkt.ip.tot_len) - ip_header_len;
     pkt.ip.check = 0;
-    pkt.ip.check = Checksum(raw, sizeof(struct iphdr)-8);
+    pkt.ip.check = Checksum(raw, ip_header_len);
 
-    pkt.tcp.check = 0;
-    // TODO deal with data length
-    int data_len = DataLen();
-    int padding_data_len = (data_len & 1) ? data_len+1 : data_len;
+    struct tcphdr* tcp = reinterpret_cast<struct tcphdr*>(raw + ip_header_len);
+    tcp->check = 0;
+    uint32 sum = ChecksumAdd(0, &pkt.ip.saddr, 8);
+    sum += ::htons(IPPROTO_TCP);
+    sum += ::htons(tcp_len);
+    tcp->check = ChecksumFold(ChecksumAdd(sum, tcp, tcp_len));
+  }
+
+  // Rewrites the IP addresses of a packet whose checksums are already
+  // valid, adjusting both checksums for the changed words only instead of
+  // re-summing the segment.
+  void RewriteAddressNet(uint32 src_ip, uint32 dst_ip) {
+    struct tcphdr* tcp =
+        reinterpret_cast<struct tcphdr*>(raw + pkt.ip.ihl * 4);
+    uint16 ip_check = pkt.ip.check;
+    uint16 tcp_check = tcp->check;
+    ip_check = ChecksumReplace(ip_check, pkt.ip.saddr, src_ip);
+    ip_check = ChecksumReplace(ip_check, pkt.ip.daddr, dst_ip);
+    tcp_check = ChecksumReplace(tcp_check, pkt.ip.saddr, src_ip);
+    tcp_check = ChecksumReplace(tcp_check, pkt.ip.daddr, dst_ip);
+    pkt.ip.saddr = src_ip;
+    pkt.ip.daddr = dst_ip;
+    pkt.ip.check = ip_check;
+    tcp->check = tcp_check;
+  }
 
-    struct PseudoHeader {
-      uint8 allways_zero;
-      uint8 protocol;
-      uint16 tcp_len;
-    };
-    struct PseudoHeader* pseudo =
-        reinterpret_cast<struct PseudoHeader*>(
-            raw + HEADER_LEN + padding_data_len);
-    pseudo->allways_zero = 0;
-    pseudo->protocol = IPPROTO_TCP;
-    pseudo->tcp_len = ::htons(sizeof(struct tcphdr) + data_len);
-    pkt.tcp.check = Checksum(&pkt.ip.saddr,
-                             sizeof(struct tcphdr) + 12 + padding_data_len);
+  // The same for ipv6, where only the tcp checksum covers the addresses.
+  void RewriteAddress6(const struct in6_addr& src_ip,
+                       const struct in6_addr& dst_ip) {
+    uint16 check = pkt6.tcp.check;
+    const struct in6_addr* olds[2] = {&pkt6.ip6.ip6_src, &pkt6.ip6.ip6_dst};
+    const struct in6_addr* news[2] = {&src_ip, &dst_ip};
+    for (int i = 0; i < 2; ++i) {
+      for (int word = 0; word < 4; ++word) {
+        check = ChecksumReplace(check, olds[i]->s6_addr32[word],
+                                news[i]->s6_addr32[word]);
+      }
+    }
+    pkt6.ip6.ip6_src = src_ip;
+    pkt6.ip6.ip6_dst = dst_ip;
+    pkt6.tcp.check = check;
   }
 };
 
 inline std::ostream& operator<<(std::ostream& os, const Packet& packet) {
   const iphdr& ip = packet.pkt.ip;
-  const tcphdr& tcp = packet.pkt.tcp;
-  os << "ip:{version:" << ip.version << ","
-     << "ihl:" << ip.ihl << ","
-     << "tos:" << (int)ip.tos << ","
-     << "tot_len:" << ::ntohs(ip.tot_len) << ","
-     << "id:" << ip.id << ","
-     << "frag_off:" << ip.frag_off << ","
-     << "ttl:" << (int)ip.ttl << ","
-     << "protocol:" << (int)ip.protocol << ","
-     << "check:" << ip.check << "},"
-     << "saddr:" << ::inet_ntoa({s_addr: ip.saddr}) << ","
-     << "daddr:" << ::inet_ntoa({s_addr: ip.daddr}) << ",tcp:{"
-     << "source:" << ::ntohs(tcp.source) << ","
+  const tcphdr& tcp = packet.Tcp();
+  if (packet.IsIpv6()) {
+    const ip6_hdr& ip6 = packet.pkt6.ip6;
+    os << "ip6:{plen:" << ::ntohs(ip6.ip6_plen) << ","
+       << "nxt:" << (int)ip6.ip6_nxt << ","
+       << "hlim:" << (int)ip6.ip6_hlim << "},"
+       << "saddr:" << packet.SrcAddress().ToIpPort() << ","
+       << "daddr:" << packet.DstAddress().ToIpPort() << ",tcp:{";
+  } else {
+    os << "ip:{version:" << ip.version << ","
+       << "ihl:" << ip.ihl << ","
+       << "tos:" << (int)ip.tos << ","
+       << "tot_len:" << ::ntohs(ip.tot_len) << ","
+       << "id:" << ip.id << ","
+       << "frag_off:" << ip.frag_off << ","
+       << "ttl:" << (int)ip.ttl << ","
+       << "protocol:" << (int)ip.protocol << ","
+       << "check:" << ip.check << "},"
+       << "saddr:" << ::inet_ntoa({s_addr: ip.saddr}) << ","
+       << "daddr:" << ::inet_ntoa({s_addr: ip.daddr}) << ",tcp:{";
+  }
+  os << "source:" << ::ntohs(tcp.source) << ","
      << "dest:" << ::ntohs(tcp.dest) << ","
      << "seq:" << ::ntohl(tcp.seq) << ","
      << "ack_seq:" << ::ntohl(tcp.ack_seq) << ","
@@ -225,7 +399,7 @@ inline std::ostream& operator<<(std::ostream& os, const Packet& packet) {
 inline PacketPtr SynPacket(uint32 seq,
                            const InetAddress& dst,
                            const InetAddress& src) {
-  auto packet = std::make_shared<Packet>();
+  auto packet = std::make_shared<Packet>(dst.family());
   packet->SetAddress(dst, src);
   packet->SetSyn();
   packet->SetSeq(seq);
@@ -236,7 +410,7 @@ inline PacketPtr FinPacket(uint32 seq,
                            uint32 ack_seq,
                            const InetAddress& dst,
                            const InetAddress& src) {
-  auto packet = std::make_shared<Packet>();
+  auto packet = std::make_shared<Packet>(dst.family());
   packet->SetAddress(dst, src);
   packet->SetFin();
   packet->SetSeq(seq);
@@ -245,11 +419,24 @@ inline PacketPtr FinPacket(uint32 seq,
   return packet;
 }
 
+inline PacketPtr RstPacket(uint32 seq,
+                           uint32 ack_seq,
+                           const InetAddress& dst,
+                           const InetAddress& src) {
+  auto packet = std::make_shared<Packet>(dst.family());
+  packet->SetAddress(dst, src);
+  packet->SetRst();
+  packet->SetSeq(seq);
+  packet->SetAck();
+  packet->SetAckSeq(ack_seq);
+  return packet;
+}
+
 inline PacketPtr AckPacket(uint32 seq,
                            const Packet& rp,
                            const InetAddress& dst,
                            const InetAddress& src) {
-  auto sp = std::make_shared<Packet>();
+  auto sp = std::make_shared<Packet>(dst.family());
   sp->SetAddress(dst, src);
   sp->SetAck();
   int data_len = rp.DataLen();
@@ -266,7 +453,7 @@ inline PacketPtr FinAckPacket(uint32 seq,
                               const Packet& rp,
                               const InetAddress& dst,
                               const InetAddress& src) {
-  auto sp = std::make_shared<Packet>();
+  auto sp = std::make_shared<Packet>(dst.family());
   sp->SetAddress(dst, src);
   sp->SetFin();
   sp->SetAck();
@@ -280,7 +467,7 @@ inline PacketPtr DataPacket(uint32 seq,
                             const InetAddress& dst,
                             const InetAddress& src,
                             const std::string& message) {
-  auto sp = std::make_shared<Packet>();
+  auto sp = std::make_shared<Packet>(dst.family());
   sp->SetAddress(dst, src);
   sp->SetPsh();
   sp->SetSeq(seq);
@@ -0,0 +1,407 @@
+#include "packet_recorder.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+
+#include "logging.h"
+#include "packet.h"
+
+namespace tcpmany {
+
+namespace {
+
+// pcap with nanosecond timestamps, packets starting at the ip header
+const uint32 PCAP_MAGIC_NANOSECONDS = 0xa1b23c4d;
+const uint32 LINKTYPE_RAW = 101;
+
+struct PcapHeader {
+  uint32 magic;
+  uint16 version_major;
+  uint16 version_minor;
+  int32 thiszone;
+  uint32 sigfigs;
+  uint32 snaplen;
+  uint32 network;
+};
+
+struct RecordHeader {
+  uint32 ts_sec;
+  uint32 ts_nsec;
+  uint32 incl_len;
+  uint32 orig_len;
+};
+
+size_t RoundUpToPowerOfTwo(size_t size) {
+  size_t rounded = 1;
+  while (rounded < size) {
+    rounded <<= 1;
+  }
+  return rounded;
+}
+
+bool Matches(const InetAddress& wanted, const InetAddress& client) {
+  if (wanted.IsIpv6() != client.IsIpv6() ||
+      (wanted.PortHost() != 0 && wanted.PortHost() != client.PortHost())) {
+    return false;
+  }
+  if (wanted.IsIpv6()) {
+    return ::memcmp(&wanted.SockAddr6().sin6_addr,
+                    &client.SockAddr6().sin6_addr,
+                    sizeof(struct in6_addr)) == 0;
+  }
+  return wanted.IpHost() == client.IpHost();
+}
+
+}  // namespace
+
+class PacketRecorder::Buffer {
+ public:
+  explicit Buffer(size_t capacity)
+      : capacity_(RoundUpToPowerOfTwo(capacity)),
+        data_(new char[capacity_]),
+        head_(0),
+        tail_(0),
+        packets_(0),
+        drops_(0) {}
+
+  // false if the record doesn't fit, *half_full tells when to wake the
+  // writer
+  bool Push(const RecordHeader& header, const void* data,
+            bool* half_full) {
+    const size_t len = sizeof(header) + header.incl_len;
+    uint64 tail = tail_.load(std::memory_order_relaxed);
+    uint64 head = head_.load(std::memory_order_acquire);
+    if (tail - head + len > capacity_) {
+      drops_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    Copy(tail, &header, sizeof(header));
+    Copy(tail + sizeof(header), data, header.incl_len);
+    tail_.store(tail + len, std::memory_order_release);
+    packets_.fetch_add(1, std::memory_order_relaxed);
+    *half_full = tail + len - head > capacity_ / 2;
+    return true;
+  }
+
+  void Drain(std::string* out) {
+    uint64 head = head_.load(std::memory_order_relaxed);
+    uint64 tail = tail_.load(std::memory_order_acquire);
+    while (head != tail) {
+      size_t offset = head & (capacity_ - 1);
+      size_t len = std::min<uint64>(tail - head, capacity_ - offset);
+      out->append(data_.get() + offset, len);
+      head += len;
+    }
+    head_.store(head, std::memory_order_release);
+  }
+
+  uint64 packets() const {
+    return packets_.load(std::memory_order_relaxed);
+  }
+  uint64 drops() const {
+    return drops_.load(std::memory_order_relaxed);
+  }
+  size_t capacity() const {
+    return capacity_;
+  }
+
+ private:
+  void Copy(uint64 at, const void* data, size_t len) {
+    size_t offset = at & (capacity_ - 1);
+    size_t first = std::min(len, capacity_ - offset);
+    ::memcpy(data_.get() + offset, data, first);
+    ::memcpy(data_.get(), static_cast<const char*>(data) + first,
+             len - first);
+  }
+
+  const size_t capacity_;
+  // not value initialized, pages are only touched once records reach them
+  std::unique_ptr<char[]> data_;
+  std::atomic<uint64> head_;
+  std::atomic<uint64> tail_;
+  std::atomic<uint64> packets_;
+  std::atomic<uint64> drops_;
+};
+
+// Appends through a window of the file mapped into memory. The file is
+// extended to exactly what has been written before every append, so it
+// is a complete pcap at any moment, even if the process dies.
+class PacketRecorder::File {
+ public:
+  File() : fd_(-1), window_(NULL), window_offset_(0), used_(0) {}
+  ~File() {
+    Close();
+  }
+
+  bool Open(const std::string& path) {
+    path_ = path;
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+      LOG(ERROR) << "open " << path << " error: " << ::strerror(errno);
+      return false;
+    }
+    PcapHeader header;
+    header.magic = PCAP_MAGIC_NANOSECONDS;
+    header.version_major = 2;
+    header.version_minor = 4;
+    header.thiszone = 0;
+    header.sigfigs = 0;
+    header.snaplen = Packet::MAX_SIZE;
+    header.network = LINKTYPE_RAW;
+    return Append(reinterpret_cast<const char*>(&header), sizeof(header));
+  }
+
+  bool Append(const char* data, size_t len) {
+    if (::ftruncate(fd_, size() + len) != 0) {
+      LOG(ERROR) << "extend " << path_ << " error: " << ::strerror(errno);
+      return false;
+    }
+    while (len > 0) {
+      if ((window_ == NULL || used_ == kWindowSize) && !NextWindow()) {
+        return false;
+      }
+      size_t n = std::min(len, kWindowSize - used_);
+      ::memcpy(window_ + used_, data, n);
+      used_ += n;
+      data += n;
+      len -= n;
+    }
+    return true;
+  }
+
+  void Close() {
+    if (window_ != NULL) {
+      ::munmap(window_, kWindowSize);
+      window_ = NULL;
+    }
+    if (fd_ >= 0) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  uint64 size() const {
+    return window_offset_ + used_;
+  }
+
+ private:
+  static const size_t kWindowSize = 16 << 20;
+
+  // the window may reach past the end of the file, only what Append
+  // extended the file to is ever touched
+  bool NextWindow() {
+    uint64 offset = 0;
+    if (window_ != NULL) {
+      offset = window_offset_ + kWindowSize;
+      ::munmap(window_, kWindowSize);
+      window_ = NULL;
+    }
+    void* window = ::mmap(NULL, kWindowSize, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd_, offset);
+    if (window == MAP_FAILED) {
+      LOG(ERROR) << "map " << path_ << " error: " << ::strerror(errno);
+      return false;
+    }
+    window_ = static_cast<char*>(window);
+    window_offset_ = offset;
+    used_ = 0;
+    return true;
+  }
+
+  std::string path_;
+  int fd_;
+  char* window_;
+  uint64 window_offset_;
+  size_t used_;
+};
+
+PacketRecorder::PacketRecorder(const RecorderOptions& options)
+    : options_(options),
+      stop_(false),
+      file_(new File()),
+      ring_bytes_(0),
+      bytes_written_(0),
+      memory_bytes_(0) {
+  CHECK(file_->Open(options_.path)) << "can't record to " << options_.path;
+  thread_ = std::thread(&PacketRecorder::WriterThread, this);
+}
+
+PacketRecorder::~PacketRecorder() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wakeup_.notify_one();
+  thread_.join();
+  Save();
+  Stats stats = GetStats();
+  LOG(INFO) << "recorded " << stats.packets << " packets to "
+            << options_.path << ", dropped " << stats.drops;
+}
+
+PacketRecorder::Buffer* PacketRecorder::NewBuffer() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  buffers_.emplace_back(new Buffer(options_.buffer_size));
+  drained_.resize(buffers_.size());
+  UpdateMemoryLocked();
+  return buffers_.back().get();
+}
+
+void PacketRecorder::Record(Buffer* buffer, const Packet& packet,
+                            const InetAddress& client) {
+  if (!Wanted(client)) {
+    return;
+  }
+  const uint32 max_size = Packet::MAX_SIZE;
+  const uint32 size = std::min<uint32>(packet.Size(), max_size);
+  uint32 len = size;
+  if (options_.headers_only) {
+    len = std::min<uint32>(size - packet.DataLen(), size);
+  }
+  struct timespec now;
+  ::clock_gettime(CLOCK_REALTIME, &now);
+  RecordHeader header;
+  header.ts_sec = now.tv_sec;
+  header.ts_nsec = now.tv_nsec;
+  header.incl_len = len;
+  header.orig_len = size;
+  bool half_full = false;
+  if (buffer->Push(header, packet.raw, &half_full) && half_full) {
+    wakeup_.notify_one();
+  }
+}
+
+bool PacketRecorder::Wanted(const InetAddress& client) const {
+  if (options_.sample <= 1 && options_.connections.empty()) {
+    return true;
+  }
+  if (options_.sample > 1) {
+    uint64 hash = client.IsIpv6() ? Endpoint6KeyHash()(client.Key6())
+                                  : client.Key() * 0x9e3779b97f4a7c15ull;
+    if ((hash >> 32) % options_.sample != 0) {
+      return false;
+    }
+  }
+  if (options_.connections.empty()) {
+    return true;
+  }
+  for (const InetAddress& wanted : options_.connections) {
+    if (Matches(wanted, client)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool PacketRecorder::Save() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  DrainLocked();
+  return options_.ring_seconds > 0 ? WriteRingLocked() : file_ != NULL;
+}
+
+PacketRecorder::Stats PacketRecorder::GetStats() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  Stats stats;
+  ::memset(&stats, 0, sizeof(stats));
+  for (const auto& buffer : buffers_) {
+    stats.packets += buffer->packets();
+    stats.drops += buffer->drops();
+  }
+  stats.bytes_written = bytes_written_;
+  return stats;
+}
+
+void PacketRecorder::UpdateMemoryLocked() {
+  uint64 bytes = ring_bytes_ + merged_.capacity();
+  for (size_t i = 0; i < buffers_.size(); ++i) {
+    bytes += buffers_[i]->capacity() + drained_[i].capacity();
+  }
+  memory_bytes_ = bytes;
+}
+
+void PacketRecorder::WriterThread() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    wakeup_.wait_for(lock, std::chrono::milliseconds(50));
+    DrainLocked();
+  }
+}
+
+void PacketRecorder::DrainLocked() {
+  for (size_t i = 0; i < buffers_.size(); ++i) {
+    drained_[i].clear();
+    buffers_[i]->Drain(&drained_[i]);
+  }
+  // every buffer is in time order on its own, merge them
+  merged_.clear();
+  std::vector<size_t> offsets(drained_.size(), 0);
+  while (true) {
+    int next = -1;
+    RecordHeader next_header;
+    for (size_t i = 0; i < drained_.size(); ++i) {
+      if (offsets[i] == drained_[i].size()) {
+        continue;
+      }
+      RecordHeader header;
+      ::memcpy(&header, drained_[i].data() + offsets[i], sizeof(header));
+      if (next < 0 || header.ts_sec < next_header.ts_sec ||
+          (header.ts_sec == next_header.ts_sec &&
+           header.ts_nsec < next_header.ts_nsec)) {
+        next = i;
+        next_header = header;
+      }
+    }
+    if (next < 0) {
+      break;
+    }
+    const size_t len = sizeof(next_header) + next_header.incl_len;
+    merged_.append(drained_[next], offsets[next], len);
+    offsets[next] += len;
+  }
+  if (merged_.empty()) {
+    return;
+  }
+
+  if (options_.ring_seconds > 0) {
+    const Clock::time_point now = Clock::now();
+    ring_.push_back(Chunk());
+    ring_.back().time = now;
+    ring_.back().data.swap(merged_);
+    ring_bytes_ += ring_.back().data.capacity();
+    while (now - ring_.front().time >
+           std::chrono::seconds(options_.ring_seconds)) {
+      ring_bytes_ -= ring_.front().data.capacity();
+      ring_.pop_front();
+    }
+    UpdateMemoryLocked();
+    return;
+  }
+  if (file_ == NULL) {
+    return;
+  }
+  if (file_->Append(merged_.data(), merged_.size())) {
+    bytes_written_ += merged_.size();
+  } else {
+    // the file stays whole up to here, stop recording into it
+    file_.reset();
+  }
+}
+
+bool PacketRecorder::WriteRingLocked() {
+  file_.reset(new File());
+  bool ok = file_->Open(options_.path);
+  uint64 bytes = 0;
+  for (auto iter = ring_.begin(); ok && iter != ring_.end(); ++iter) {
+    ok = file_->Append(iter->data.data(), iter->data.size());
+    bytes += iter->data.size();
+  }
+  bytes_written_ = ok ? bytes : 0;
+  return ok;
+}
+
+}  // namespace tcpmany
@@ -0,0 +1,125 @@
+#ifndef TCPMANY_PACKET_RECORDER_H_
+#define TCPMANY_PACKET_RECORDER_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base.h"
+#include "inet_address.h"
+#include "noncopyable.h"
+
+namespace tcpmany {
+
+struct Packet;
+
+struct RecorderOptions {
+  // the pcap file, nothing is recorded while empty
+  std::string path;
+  // only the ip and tcp headers, tcp options included
+  bool headers_only;
+  // Only the packets of one in |sample| connections, picked by a hash of
+  // the client endpoint, so every recorded connection is complete.
+  uint32 sample;
+  // When not empty, only the connections with these client endpoints, a
+  // port of 0 takes every port of the address.
+  std::vector<InetAddress> connections;
+  // When above 0, only the last ring_seconds of packets are kept, in
+  // memory, and written to |path| by Save or when the recorder goes away.
+  // Otherwise every packet is streamed to the file as it comes.
+  int ring_seconds;
+  // Per recording thread. When the writer falls this far behind, packets
+  // are dropped rather than waited for.
+  size_t buffer_size;
+
+  RecorderOptions()
+      : headers_only(false),
+        sample(1),
+        ring_seconds(0),
+        buffer_size(8 << 20) {}
+};
+
+// Records packets into a pcap file (LINKTYPE_RAW, nanosecond timestamps)
+// for a run too fast to have tcpdump next to it. Each recording thread
+// copies its packets into a buffer of its own, lock free, and a background
+// thread merges the buffers in time order every 50ms and writes them out
+// through a memory mapping. Recording never waits: a full buffer drops
+// the packet and counts it.
+class PacketRecorder : public NonCopyable {
+ public:
+  // where one thread's packets wait for the writer
+  class Buffer;
+
+  struct Stats {
+    uint64 packets;
+    uint64 drops;
+    uint64 bytes_written;
+  };
+
+  // CHECKs that |options.path| can be created
+  explicit PacketRecorder(const RecorderOptions& options);
+  // writes out what is still buffered, and in ring mode the ring
+  ~PacketRecorder();
+
+  // A buffer for the calling thread, the only one to record into it.
+  // Owned by the recorder.
+  Buffer* NewBuffer();
+
+  // |client| is the fake client endpoint of the connection |packet|
+  // belongs to, what |sample| and |connections| go by. A reply that came
+  // through a redirect doesn't carry it as one of its endpoints.
+  void Record(Buffer* buffer, const Packet& packet,
+              const InetAddress& client);
+
+  // Writes everything recorded so far, in ring mode the packets of the
+  // last ring_seconds replace the file. False on errors, logged.
+  bool Save();
+
+  Stats GetStats();
+  // held by the buffers and the ring, without taking the mutex
+  uint64 MemoryBytes() const {
+    return memory_bytes_;
+  }
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  // the packets written at one drain, in ring mode
+  struct Chunk {
+    Clock::time_point time;
+    std::string data;
+  };
+
+  bool Wanted(const InetAddress& client) const;
+  void WriterThread();
+  // moves the buffered packets to the file or the ring, with mutex_ held
+  void DrainLocked();
+  bool WriteRingLocked();
+  void UpdateMemoryLocked();
+
+  const RecorderOptions options_;
+  // guards everything below but the buffers' insides
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  bool stop_;
+  std::vector<std::unique_ptr<Buffer> > buffers_;
+  std::vector<std::string> drained_;
+  std::string merged_;
+  class File;
+  std::unique_ptr<File> file_;
+  std::deque<Chunk> ring_;
+  uint64 ring_bytes_;
+  uint64 bytes_written_;
+  std::atomic<uint64> memory_bytes_;
+  std::thread thread_;
+};
+
+}  // namespace tcpmany
+
+#endif  // TCPMANY_PACKET_RECORDER_H_
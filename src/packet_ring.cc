@@ -0,0 +1,132 @@
+#include "packet_ring.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_ether.h>
+#include <arpa/inet.h>
+
+#include "logging.h"
+
+namespace tcpmany {
+
+// frames are never larger than an ethernet frame once the link header is
+// stripped, a smaller frame size only matters for the block layout
+static const uint32 kFrameSize = 2048;
+
+PacketRing::PacketRing(const std::string& interface,
+                       const BpfFilter& filter,
+                       bool promiscuous,
+                       uint32 block_size,
+                       uint32 block_count,
+                       uint32 block_timeout_ms)
+    : fd_(-1),
+      ring_(NULL),
+      block_size_(block_size),
+      block_count_(block_count),
+      current_block_(0) {
+  // ETH_P_ALL, outgoing packets are only handed to "all" taps
+  fd_ = socket(AF_PACKET, SOCK_DGRAM, ::htons(ETH_P_ALL));
+  CHECK(fd_ >= 0) << "socket error: " << strerror(errno);
+  CHECK(filter.Attach(fd_)) << "attach filter error: " << strerror(errno);
+  int version = TPACKET_V3;
+  CHECK(setsockopt(fd_, SOL_PACKET, PACKET_VERSION,
+                   &version, sizeof(version)) == 0)
+      << "PACKET_VERSION error: " << strerror(errno);
+
+  struct tpacket_req3 req;
+  ::memset(&req, 0, sizeof(req));
+  req.tp_block_size = block_size_;
+  req.tp_block_nr = block_count_;
+  req.tp_frame_size = kFrameSize;
+  req.tp_frame_nr = block_size_ / kFrameSize * block_count_;
+  req.tp_retire_blk_tov = block_timeout_ms;
+  CHECK(setsockopt(fd_, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == 0)
+      << "PACKET_RX_RING error: " << strerror(errno);
+  void* ring = ::mmap(NULL, block_size_ * block_count_,
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED,
+                      fd_, 0);
+  if (ring == MAP_FAILED) {
+    // MAP_LOCKED fails under a low RLIMIT_MEMLOCK, the ring still works
+    ring = ::mmap(NULL, block_size_ * block_count_,
+                  PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  }
+  CHECK(ring != MAP_FAILED) << "mmap error: " << strerror(errno);
+  ring_ = static_cast<uint8*>(ring);
+
+  int ifindex = ::if_nametoindex(interface.c_str());
+  CHECK(ifindex > 0) << "unknown interface: " << interface;
+  struct sockaddr_ll addr;
+  ::memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = ::htons(ETH_P_ALL);
+  addr.sll_ifindex = ifindex;
+  CHECK(bind(fd_, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+      << "bind error: " << strerror(errno);
+
+  if (promiscuous) {
+    struct packet_mreq mreq;
+    ::memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(fd_, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                   &mreq, sizeof(mreq)) != 0) {
+      LOG(WARNING) << "promiscuous mode failed: " << strerror(errno);
+    }
+  }
+}
+
+PacketRing::~PacketRing() {
+  if (ring_ != NULL) {
+    ::munmap(ring_, block_size_ * block_count_);
+  }
+  ::close(fd_);
+}
+
+struct tpacket_block_desc* PacketRing::NextBlock(int timeout_ms) {
+  struct tpacket_block_desc* block =
+      reinterpret_cast<struct tpacket_block_desc*>(
+          ring_ + current_block_ * block_size_);
+  if (!(block->hdr.bh1.block_status & TP_STATUS_USER)) {
+    struct pollfd pfd;
+    pfd.fd = fd_;
+    pfd.events = POLLIN | POLLERR;
+    pfd.revents = 0;
+    ::poll(&pfd, 1, timeout_ms);
+    if (!(block->hdr.bh1.block_status & TP_STATUS_USER)) {
+      return NULL;
+    }
+  }
+  __sync_synchronize();
+  return block;
+}
+
+void PacketRing::ReleaseBlock(struct tpacket_block_desc* block) {
+  __sync_synchronize();
+  block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+  current_block_ = (current_block_ + 1) % block_count_;
+}
+
+void PacketRing::JoinFanout(uint16 group_id, int mode) {
+  int fanout = group_id | (mode << 16);
+  CHECK(setsockopt(fd_, SOL_PACKET, PACKET_FANOUT,
+                   &fanout, sizeof(fanout)) == 0)
+      << "PACKET_FANOUT error: " << strerror(errno);
+}
+
+PacketRing::Stats PacketRing::GetStats() {
+  struct tpacket_stats_v3 kernel_stats;
+  socklen_t len = sizeof(kernel_stats);
+  Stats stats = {0, 0};
+  if (getsockopt(fd_, SOL_PACKET, PACKET_STATISTICS,
+                 &kernel_stats, &len) == 0) {
+    stats.packets = kernel_stats.tp_packets;
+    stats.drops = kernel_stats.tp_drops;
+  }
+  return stats;
+}
+
+}  // namespace tcpmany
@@ -0,0 +1,77 @@
+#ifndef TCPMANY_PACKET_RING_H_
+#define TCPMANY_PACKET_RING_H_
+
+#include <linux/if_packet.h>
+#include <string>
+
+#include "base.h"
+#include "bpf_filter.h"
+#include "noncopyable.h"
+
+namespace tcpmany {
+
+// A TPACKET_V3 receive ring on an AF_PACKET/SOCK_DGRAM socket bound to one
+// interface. The kernel fills whole blocks of frames in memory shared with
+// us and hands them over a block at a time, so capturing costs neither a
+// syscall nor a copy per packet. Frames start at the network header.
+class PacketRing : public NonCopyable {
+ public:
+  struct Stats {
+    uint64 packets;
+    uint64 drops;
+  };
+
+  // |filter| is attached before the socket is bound, so nothing it rejects
+  // ever lands in the ring. |block_timeout_ms| bounds how long a partly
+  // filled block is held back.
+  PacketRing(const std::string& interface,
+             const BpfFilter& filter,
+             bool promiscuous,
+             uint32 block_size = 1 << 22,
+             uint32 block_count = 64,
+             uint32 block_timeout_ms = 10);
+  ~PacketRing();
+
+  int fd() const {
+    return fd_;
+  }
+
+  // Waits up to |timeout_ms| for the next filled block, NULL on timeout.
+  // The block belongs to us until ReleaseBlock.
+  struct tpacket_block_desc* NextBlock(int timeout_ms);
+  void ReleaseBlock(struct tpacket_block_desc* block);
+
+  // Calls function(data, length, header) for every frame of |block|, data
+  // pointing at the ip header and length being what was captured.
+  template <typename Function>
+  static void ForEachFrame(struct tpacket_block_desc* block,
+                           Function function) {
+    uint32 count = block->hdr.bh1.num_pkts;
+    uint8* frame = reinterpret_cast<uint8*>(block) +
+                   block->hdr.bh1.offset_to_first_pkt;
+    for (uint32 i = 0; i < count; ++i) {
+      struct tpacket3_hdr* header =
+          reinterpret_cast<struct tpacket3_hdr*>(frame);
+      function(frame + header->tp_net, header->tp_snaplen, header);
+      frame += header->tp_next_offset;
+    }
+  }
+
+  // Shares the interface with the other sockets of fanout group |group_id|.
+  // PACKET_FANOUT_HASH keeps every flow on one socket.
+  void JoinFanout(uint16 group_id, int mode = PACKET_FANOUT_HASH);
+
+  // counters since the last call, the kernel resets them on read
+  Stats GetStats();
+
+ private:
+  int fd_;
+  uint8* ring_;
+  uint32 block_size_;
+  uint32 block_count_;
+  uint32 current_block_;
+};
+
+}  // namespace tcpmany
+
+#endif  // TCPMANY_PACKET_RING_H_
@@ -0,0 +1,89 @@
+#include "packet_ring_backend.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "bpf_filter.h"
+#include "logging.h"
+#include "packet.h"
+
+namespace tcpmany {
+
+static BpfFilter ServerFilter(const std::vector<InetAddress>& servers) {
+  CHECK(!servers.empty()) << "capturing needs the server addresses";
+  BpfFilter filter;
+  filter.RequireSource(servers);
+  return filter;
+}
+
+// A 1ms block timeout: at low rates every reply would otherwise wait for
+// its block to retire and show up in the measured latency.
+PacketRingBackend::PacketRingBackend(const std::string& interface,
+                                     const std::vector<InetAddress>& servers)
+    : ring_(interface, ServerFilter(servers), false, 1 << 22, 16, 1),
+      sockfd_(-1),
+      block_(NULL),
+      frame_(NULL),
+      frames_left_(0),
+      drops_(0) {
+  sockfd_ = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+  CHECK(sockfd_ >= 0) << "socket error: " << strerror(errno);
+  int flag = 1;
+  CHECK(setsockopt(sockfd_, IPPROTO_IP, IP_HDRINCL, &flag, sizeof(flag)) >= 0)
+      << "setsockopt error: " << strerror(errno);
+  CHECK(BpfFilter::AttachDropAll(sockfd_))
+      << "setsockopt error: " << strerror(errno);
+}
+
+PacketRingBackend::~PacketRingBackend() {
+  if (block_ != NULL) {
+    ring_.ReleaseBlock(block_);
+  }
+  ::close(sockfd_);
+}
+
+int PacketRingBackend::Receive(Packet* packet) {
+  if (block_ == NULL) {
+    // same wake up interval as the raw socket's SO_RCVTIMEO
+    block_ = ring_.NextBlock(100);
+    if (block_ == NULL) {
+      return 0;
+    }
+    frame_ = reinterpret_cast<uint8*>(block_) +
+             block_->hdr.bh1.offset_to_first_pkt;
+    frames_left_ = block_->hdr.bh1.num_pkts;
+  }
+  int len = 0;
+  if (frames_left_ > 0) {
+    struct tpacket3_hdr* header =
+        reinterpret_cast<struct tpacket3_hdr*>(frame_);
+    len = header->tp_snaplen;
+    if (len > static_cast<int>(Packet::MAX_SIZE)) {
+      len = Packet::MAX_SIZE;
+    }
+    ::memcpy(packet->Buffer(), frame_ + header->tp_net, len);
+    packet->timestamp.software =
+        static_cast<int64>(header->tp_sec) * 1000000000 + header->tp_nsec;
+    frame_ += header->tp_next_offset;
+    --frames_left_;
+  }
+  if (frames_left_ == 0) {
+    ring_.ReleaseBlock(block_);
+    block_ = NULL;
+    drops_ += ring_.GetStats().drops;
+  }
+  return len;
+}
+
+int PacketRingBackend::Send(const Packet& packet) {
+  struct sockaddr_in dst_addr = packet.DstSockAddr();
+  return sendto(sockfd_,
+                packet.raw,
+                packet.Size(),
+                0,
+                (struct sockaddr*)&dst_addr,
+                sizeof(struct sockaddr));
+}
+
+}  // namespace tcpmany
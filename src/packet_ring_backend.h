@@ -0,0 +1,44 @@
+#ifndef TCPMANY_PACKET_RING_BACKEND_H_
+#define TCPMANY_PACKET_RING_BACKEND_H_
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "inet_address.h"
+#include "io_backend.h"
+#include "packet_ring.h"
+
+namespace tcpmany {
+
+// For when the servers route the fake client addresses straight to this
+// host, no redirect in between: the replies are taken off |interface| with
+// a PacketRing before the host's ip stack (which would drop them, they are
+// not addressed to it) sees them, and keep their fake destination address
+// for the demultiplexing. Only packets from |servers| are captured. Sending
+// goes through a raw socket like RawSocketBackend. Needs root.
+class PacketRingBackend : public IoBackend {
+ public:
+  PacketRingBackend(const std::string& interface,
+                    const std::vector<InetAddress>& servers);
+  virtual ~PacketRingBackend();
+
+  virtual int Receive(Packet* packet);
+  virtual int Send(const Packet& packet);
+  virtual uint64 Drops() const {
+    return drops_;
+  }
+
+ private:
+  PacketRing ring_;
+  int sockfd_;
+  // the block being read, NULL when it has to wait for the next one
+  struct tpacket_block_desc* block_;
+  uint8* frame_;
+  uint32 frames_left_;
+  std::atomic<uint64> drops_;
+};
+
+}  // namespace tcpmany
+
+#endif  // TCPMANY_PACKET_RING_BACKEND_H_
@@ -0,0 +1,248 @@
+#include "pcap_replay_backend.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <thread>
+
+#include "logging.h"
+#include "packet.h"
+
+namespace tcpmany {
+
+namespace {
+
+const uint32 PCAP_MAGIC = 0xa1b2c3d4;
+const uint32 PCAP_MAGIC_NANOSECONDS = 0xa1b23c4d;
+const uint32 PCAPNG_MAGIC = 0x0a0d0d0a;
+const size_t PCAP_HEADER_LEN = 24;
+const size_t RECORD_HEADER_LEN = 16;
+
+const uint32 LINKTYPE_NULL = 0;
+const uint32 LINKTYPE_ETHERNET = 1;
+const uint32 LINKTYPE_RAW = 101;
+const uint32 LINKTYPE_LINUX_SLL = 113;
+const uint32 LINKTYPE_IPV4 = 228;
+const uint32 LINKTYPE_IPV6 = 229;
+const uint32 LINKTYPE_LINUX_SLL2 = 276;
+
+const uint16 ETHERTYPE_IPV4 = 0x0800;
+const uint16 ETHERTYPE_IPV6 = 0x86dd;
+const uint16 ETHERTYPE_VLAN = 0x8100;
+
+// same wake up interval as the raw socket's SO_RCVTIMEO
+const int kReceiveTimeoutMs = 100;
+
+uint16 ReadU16Net(const uint8* data) {
+  return static_cast<uint16>(data[0] << 8 | data[1]);
+}
+
+}  // namespace
+
+PcapReplayBackend::PcapReplayBackend(const std::string& path,
+                                     const ReplayOptions& options)
+    : options_(options),
+      data_(NULL),
+      size_(0),
+      swapped_(false),
+      nanoseconds_(false),
+      linktype_(0),
+      offset_(PCAP_HEADER_LEN),
+      loop_(0),
+      first_packet_ns_(-1),
+      playing_(false),
+      done_(false),
+      replayed_(0),
+      filtered_(0) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  CHECK(fd >= 0) << "open " << path << " error: " << ::strerror(errno);
+  struct stat st;
+  CHECK(::fstat(fd, &st) == 0) << "stat " << path << " error: "
+                               << ::strerror(errno);
+  CHECK(static_cast<size_t>(st.st_size) >= PCAP_HEADER_LEN)
+      << path << " is no pcap file";
+  size_ = st.st_size;
+  void* data = ::mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  CHECK(data != MAP_FAILED) << "map " << path << " error: "
+                            << ::strerror(errno);
+  ::madvise(data, size_, MADV_SEQUENTIAL);
+  data_ = static_cast<const uint8*>(data);
+
+  uint32 magic;
+  ::memcpy(&magic, data_, sizeof(magic));
+  CHECK(magic != PCAPNG_MAGIC)
+      << path << " is pcapng, convert it with editcap -F pcap";
+  swapped_ = magic == __builtin_bswap32(PCAP_MAGIC) ||
+             magic == __builtin_bswap32(PCAP_MAGIC_NANOSECONDS);
+  magic = Swap(magic);
+  CHECK(magic == PCAP_MAGIC || magic == PCAP_MAGIC_NANOSECONDS)
+      << path << " is no pcap file";
+  nanoseconds_ = magic == PCAP_MAGIC_NANOSECONDS;
+  ::memcpy(&linktype_, data_ + 20, sizeof(linktype_));
+  // the upper bits hold the FCS length and flags
+  linktype_ = Swap(linktype_) & 0xffff;
+  CHECK(linktype_ == LINKTYPE_NULL || linktype_ == LINKTYPE_ETHERNET ||
+        linktype_ == LINKTYPE_RAW || linktype_ == LINKTYPE_LINUX_SLL ||
+        linktype_ == LINKTYPE_IPV4 || linktype_ == LINKTYPE_IPV6 ||
+        linktype_ == LINKTYPE_LINUX_SLL2)
+      << path << " has unsupported linktype " << linktype_;
+}
+
+PcapReplayBackend::~PcapReplayBackend() {
+  ::munmap(const_cast<uint8*>(data_), size_);
+}
+
+void PcapReplayBackend::Play() {
+  playing_ = true;
+}
+
+int PcapReplayBackend::Receive(Packet* packet) {
+  if (!playing_ || done_) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(
+        playing_ ? kReceiveTimeoutMs : 1));
+    return 0;
+  }
+  while (true) {
+    if (offset_ + RECORD_HEADER_LEN > size_) {
+      // a truncated last record ends the loop like the end of the file
+      if (++loop_ >= options_.loops) {
+        done_ = true;
+        return 0;
+      }
+      offset_ = PCAP_HEADER_LEN;
+      first_packet_ns_ = -1;
+    }
+    uint32 header[4];
+    ::memcpy(header, data_ + offset_, sizeof(header));
+    const uint32 incl_len = Swap(header[2]);
+    const uint32 orig_len = Swap(header[3]);
+    if (offset_ + RECORD_HEADER_LEN + incl_len > size_) {
+      offset_ = size_;
+      continue;
+    }
+    const uint8* record = data_ + offset_ + RECORD_HEADER_LEN;
+    const int network = NetworkOffset(record, incl_len);
+    if (network < 0 || !Wanted(record + network, incl_len - network)) {
+      offset_ += RECORD_HEADER_LEN + incl_len;
+      ++filtered_;
+      continue;
+    }
+
+    const int64 packet_ns =
+        static_cast<int64>(Swap(header[0])) * 1000000000 +
+        Swap(header[1]) * (nanoseconds_ ? 1 : 1000);
+    if (options_.speed > 0) {
+      const Clock::time_point now = Clock::now();
+      if (first_packet_ns_ < 0) {
+        first_packet_ns_ = packet_ns;
+        loop_start_ = now;
+      }
+      const Clock::time_point due = loop_start_ +
+          std::chrono::nanoseconds(static_cast<int64>(
+              (packet_ns - first_packet_ns_) / options_.speed));
+      if (due > now + std::chrono::milliseconds(kReceiveTimeoutMs)) {
+        // let the receive thread check for stop in between
+        std::this_thread::sleep_for(
+            std::chrono::milliseconds(kReceiveTimeoutMs));
+        return 0;
+      }
+      if (due > now) {
+        std::this_thread::sleep_until(due);
+      }
+    }
+
+    const uint32 len = incl_len - network;
+    const uint32 orig = orig_len > static_cast<uint32>(network)
+                            ? orig_len - network : 0;
+    const uint32 max_size = Packet::MAX_SIZE;
+    const uint32 size = std::min(std::max(len, orig), max_size);
+    const uint32 copied = std::min(len, size);
+    ::memcpy(packet->Buffer(), record + network, copied);
+    ::memset(packet->Buffer() + copied, 0, size - copied);
+    packet->timestamp.software = packet_ns;
+    offset_ += RECORD_HEADER_LEN + incl_len;
+    ++replayed_;
+    return size;
+  }
+}
+
+int PcapReplayBackend::Send(const Packet& packet) {
+  return packet.Size();
+}
+
+int PcapReplayBackend::NetworkOffset(const uint8* data, uint32 len) const {
+  int offset = 0;
+  uint16 ethertype = 0;
+  switch (linktype_) {
+    case LINKTYPE_RAW:
+    case LINKTYPE_IPV4:
+    case LINKTYPE_IPV6:
+      return 0;
+    case LINKTYPE_NULL:
+      // the family is in the byte order of the capturing host, the ip
+      // version is checked later anyway
+      return len >= 4 ? 4 : -1;
+    case LINKTYPE_ETHERNET:
+      if (len < 14) {
+        return -1;
+      }
+      offset = 14;
+      ethertype = ReadU16Net(data + 12);
+      if (ethertype == ETHERTYPE_VLAN && len >= 18) {
+        offset = 18;
+        ethertype = ReadU16Net(data + 16);
+      }
+      break;
+    case LINKTYPE_LINUX_SLL:
+      if (len < 16) {
+        return -1;
+      }
+      offset = 16;
+      ethertype = ReadU16Net(data + 14);
+      break;
+    case LINKTYPE_LINUX_SLL2:
+      if (len < 20) {
+        return -1;
+      }
+      offset = 20;
+      ethertype = ReadU16Net(data);
+      break;
+  }
+  return ethertype == ETHERTYPE_IPV4 || ethertype == ETHERTYPE_IPV6
+             ? offset : -1;
+}
+
+bool PcapReplayBackend::Wanted(const uint8* ip, uint32 len) const {
+  uint32 tcp;
+  if (len >= Packet::HEADER_LEN && ip[0] >> 4 == 4) {
+    // ipv4, the protocol
+    if (ip[9] != IPPROTO_TCP) {
+      return false;
+    }
+    tcp = (ip[0] & 0x0f) * 4;
+  } else if (len >= Packet::HEADER6_LEN && ip[0] >> 4 == 6) {
+    // ipv6, the next header
+    if (ip[6] != IPPROTO_TCP) {
+      return false;
+    }
+    tcp = sizeof(struct ip6_hdr);
+  } else {
+    return false;
+  }
+  if (tcp + 2 > len) {
+    return false;
+  }
+  if (options_.server_ports.empty()) {
+    return true;
+  }
+  const uint16 port = ReadU16Net(ip + tcp);
+  return std::find(options_.server_ports.begin(), options_.server_ports.end(),
+                   port) != options_.server_ports.end();
+}
+
+}  // namespace tcpmany
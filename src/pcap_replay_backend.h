@@ -0,0 +1,90 @@
+#ifndef TCPMANY_PCAP_REPLAY_BACKEND_H_
+#define TCPMANY_PCAP_REPLAY_BACKEND_H_
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "io_backend.h"
+
+namespace tcpmany {
+
+struct ReplayOptions {
+  // 0 hands the packets over as fast as the receive thread takes them,
+  // otherwise at their recorded pace sped up by this factor
+  double speed;
+  // times through the file
+  int loops;
+  // When not empty, only tcp packets from these ports, those of the
+  // servers, are replayed. The address is not compared, a redirect has
+  // replaced it.
+  std::vector<uint16> server_ports;
+
+  ReplayOptions() : speed(0), loops(1) {}
+};
+
+// Feeds the packets of a pcap file into the receive path instead of a
+// network, to measure the demultiplexing and the connection state machine
+// alone: no root, no NIC, the same packets every run. The file is mapped
+// and read in place. Sent packets go nowhere.
+//
+// Takes pcap (not pcapng) in either byte order with micro or nanosecond
+// timestamps, linktype raw ip, ethernet, linux cooked (v1 and v2) or
+// loopback. Packets recorded without their payload get zeros in its
+// place. Nothing is handed over before Play, so connections can be set up
+// first.
+class PcapReplayBackend : public IoBackend {
+ public:
+  // CHECKs that |path| is a pcap file it can read
+  PcapReplayBackend(const std::string& path, const ReplayOptions& options);
+  virtual ~PcapReplayBackend();
+
+  virtual int Receive(Packet* packet);
+  virtual int Send(const Packet& packet);
+  // packets skipped: not ip, not tcp, or not from server_ports
+  virtual uint64 Filtered() const {
+    return filtered_;
+  }
+
+  void Play();
+  // every loop has been handed to the receive thread
+  bool Done() const {
+    return done_;
+  }
+  uint64 Replayed() const {
+    return replayed_;
+  }
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  // where the ip packet starts in a record of |len| bytes, -1 if it
+  // carries no ip
+  int NetworkOffset(const uint8* data, uint32 len) const;
+  bool Wanted(const uint8* ip, uint32 len) const;
+  uint32 Swap(uint32 value) const {
+    return swapped_ ? __builtin_bswap32(value) : value;
+  }
+
+  const ReplayOptions options_;
+  const uint8* data_;
+  size_t size_;
+  bool swapped_;
+  bool nanoseconds_;
+  uint32 linktype_;
+  // the next record
+  size_t offset_;
+  int loop_;
+  // when the current loop started, and the time of its first packet
+  Clock::time_point loop_start_;
+  int64 first_packet_ns_;
+  std::atomic<bool> playing_;
+  std::atomic<bool> done_;
+  std::atomic<uint64> replayed_;
+  std::atomic<uint64> filtered_;
+};
+
+}  // namespace tcpmany
+
+#endif  // TCPMANY_PCAP_REPLAY_BACKEND_H_
@@ -0,0 +1,285 @@
+#include "raw_socket_backend.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <linux/if_ether.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <algorithm>
+
+#include "bpf_filter.h"
+#include "ebpf.h"
+#include "logging.h"
+#include "packet.h"
+
+// since linux 4.5, older headers lack it
+#ifndef IPV6_HDRINCL
+#define IPV6_HDRINCL 36
+#endif
+
+namespace tcpmany {
+
+static int64 ToNanoseconds(const struct timespec& ts) {
+  return static_cast<int64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Picks the timestamps and, when |drops| is given, the socket's drop
+// counter (SO_RXQ_OVFL) out of the control messages, and when |dst| is
+// given, the ipv6 destination address (IPV6_PKTINFO).
+static void ReadControl(struct msghdr* msg,
+                        PacketTimestamp* timestamp,
+                        std::atomic<uint64>* drops,
+                        struct in6_addr* dst = NULL) {
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
+       cmsg != NULL;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO &&
+        dst != NULL) {
+      struct in6_pktinfo info;
+      ::memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+      *dst = info.ipi6_addr;
+      continue;
+    }
+    if (cmsg->cmsg_level != SOL_SOCKET) {
+      continue;
+    }
+    if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+      struct scm_timestamping ts;
+      ::memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      timestamp->software = ToNanoseconds(ts.ts[0]);
+      timestamp->hardware = ToNanoseconds(ts.ts[2]);
+    } else if (cmsg->cmsg_type == SO_RXQ_OVFL && drops != NULL) {
+      uint32 count;
+      ::memcpy(&count, CMSG_DATA(cmsg), sizeof(count));
+      *drops = count;
+    }
+  }
+}
+
+// The copy looped back on the error queue starts at the link layer header
+// (ethernet on loopback and veth), the receive path gets the ip header.
+static int IpHeaderOffset(const unsigned char* buf, int len, int version) {
+  const int header_len =
+      version == 6 ? Packet::HEADER6_LEN : Packet::HEADER_LEN;
+  const uint16 ether_type = version == 6 ? ETH_P_IPV6 : ETH_P_IP;
+  if (len >= header_len && (buf[0] >> 4) == version) {
+    return 0;
+  }
+  if (len >= ETH_HLEN + header_len &&
+      buf[12] == (ether_type >> 8) && buf[13] == (ether_type & 0xff)) {
+    return ETH_HLEN;
+  }
+  return -1;
+}
+
+RawSocketBackend::RawSocketBackend(sa_family_t family)
+    : family_(family),
+      sockfd_(-1),
+      filter_counter_fd_(-1),
+      drops_(0),
+      timestamp_flags_(SOF_TIMESTAMPING_RX_SOFTWARE |
+                       SOF_TIMESTAMPING_RX_HARDWARE |
+                       SOF_TIMESTAMPING_SOFTWARE |
+                       SOF_TIMESTAMPING_RAW_HARDWARE) {
+  Init();
+}
+
+RawSocketBackend::RawSocketBackend(const std::vector<InetAddress>& servers,
+                                   const std::vector<IpRange>& client_ranges)
+    : RawSocketBackend(servers.empty() ? AF_INET : servers[0].family()) {
+  for (const InetAddress& server : servers) {
+    CHECK(server.family() == family_)
+        << "servers of both address families: " << server.ToIpPort();
+  }
+  if (servers.empty() || family_ == AF_INET6) {
+    return;
+  }
+  // redirect replaces the server address, only the port is left of it
+  std::vector<uint16> ports;
+  for (const InetAddress& server : servers) {
+    uint16 port = ::ntohs(server.SockAddr().sin_port);
+    if (std::find(ports.begin(), ports.end(), port) == ports.end()) {
+      ports.push_back(port);
+    }
+  }
+  BpfFilter filter;
+  filter.RequireSourcePorts(ports);
+  if (!client_ranges.empty()) {
+    filter.RequireIpIn(client_ranges);
+  }
+  filter_counter_fd_ = filter.AttachCounting(sockfd_);
+  if (filter_counter_fd_ < 0) {
+    LOG(WARNING) << "eBPF socket filter not supported, dropped packets "
+                 << "won't be counted: " << strerror(errno);
+    CHECK(filter.Attach(sockfd_)) << "setsockopt error: " << strerror(errno);
+  }
+}
+
+void RawSocketBackend::Init() {
+  sockfd_ = socket(family_, SOCK_RAW, IPPROTO_TCP);
+  CHECK(sockfd_ >= 0) << "socket error: " << strerror(errno);
+  int flag = 1;
+  if (family_ == AF_INET6) {
+    CHECK(setsockopt(sockfd_, IPPROTO_IPV6, IPV6_HDRINCL,
+                     &flag, sizeof(flag)) >= 0)
+        << "setsockopt error: " << strerror(errno);
+    CHECK(setsockopt(sockfd_, IPPROTO_IPV6, IPV6_RECVPKTINFO,
+                     &flag, sizeof(flag)) >= 0)
+        << "setsockopt error: " << strerror(errno);
+  } else {
+    CHECK(setsockopt(sockfd_, IPPROTO_IP, IP_HDRINCL,
+                     &flag, sizeof(flag)) >= 0)
+        << "setsockopt error: " << strerror(errno);
+  }
+  // wake up now and then so the receive thread notices a stop request
+  struct timeval timeout = {0, 100 * 1000};
+  CHECK(setsockopt(sockfd_, SOL_SOCKET, SO_RCVTIMEO,
+                   &timeout, sizeof(timeout)) >= 0)
+      << "setsockopt error: " << strerror(errno);
+  if (setsockopt(sockfd_, SOL_SOCKET, SO_TIMESTAMPING,
+                 &timestamp_flags_, sizeof(timestamp_flags_)) < 0) {
+    LOG(WARNING) << "SO_TIMESTAMPING not supported: " << strerror(errno);
+    timestamp_flags_ = 0;
+  }
+  if (setsockopt(sockfd_, SOL_SOCKET, SO_RXQ_OVFL, &flag, sizeof(flag)) < 0) {
+    LOG(WARNING) << "SO_RXQ_OVFL not supported: " << strerror(errno);
+  }
+}
+
+RawSocketBackend::~RawSocketBackend() {
+  ::close(sockfd_);
+  if (filter_counter_fd_ >= 0) {
+    ::close(filter_counter_fd_);
+  }
+}
+
+uint64 RawSocketBackend::Filtered() const {
+  return filter_counter_fd_ < 0 ?
+      0 : ReadPerCpuCounter(filter_counter_fd_, 0);
+}
+
+int RawSocketBackend::Receive(Packet* packet) {
+  if (family_ == AF_INET6) {
+    return Receive6(packet);
+  }
+  struct iovec iov = {packet->Buffer(), Packet::MAX_SIZE};
+  char control[256];
+  struct msghdr msg;
+  ::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  int len = recvmsg(sockfd_, &msg, 0);
+  if (len < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      return 0;
+    }
+    return -1;
+  }
+  ReadControl(&msg, &packet->timestamp, &drops_);
+  return len;
+}
+
+int RawSocketBackend::Receive6(Packet* packet) {
+  const size_t header_len = sizeof(struct ip6_hdr);
+  struct iovec iov = {packet->Buffer() + header_len,
+                      Packet::MAX_SIZE - header_len};
+  struct sockaddr_in6 src;
+  char control[256];
+  struct msghdr msg;
+  ::memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &src;
+  msg.msg_namelen = sizeof(src);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  int len = recvmsg(sockfd_, &msg, 0);
+  if (len < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      return 0;
+    }
+    return -1;
+  }
+  struct ip6_hdr* ip6 = &packet->pkt6.ip6;
+  ::memset(ip6, 0, header_len);
+  ReadControl(&msg, &packet->timestamp, &drops_, &ip6->ip6_dst);
+  ip6->ip6_flow = ::htonl(6 << 28);
+  ip6->ip6_plen = ::htons(len);
+  ip6->ip6_nxt = IPPROTO_TCP;
+  ip6->ip6_hlim = IPDEFTTL;
+  ip6->ip6_src = src.sin6_addr;
+  return header_len + len;
+}
+
+int RawSocketBackend::Send(const Packet& packet) {
+  if (family_ == AF_INET6) {
+    struct sockaddr_in6 dst_addr = packet.DstSockAddr6();
+    return sendto(sockfd_,
+                  packet.raw,
+                  packet.Size(),
+                  0,
+                  (struct sockaddr*)&dst_addr,
+                  sizeof(dst_addr));
+  }
+  struct sockaddr_in dst_addr = packet.DstSockAddr();
+  return sendto(sockfd_,
+                packet.raw,
+                packet.Size(),
+                0,
+                (struct sockaddr*)&dst_addr,
+                sizeof(struct sockaddr));
+}
+
+bool RawSocketBackend::EnableTxTimestamps() {
+  if (timestamp_flags_ == 0) {
+    return false;
+  }
+  int flags = timestamp_flags_ |
+              SOF_TIMESTAMPING_TX_SOFTWARE |
+              SOF_TIMESTAMPING_TX_HARDWARE;
+  if (setsockopt(sockfd_, SOL_SOCKET, SO_TIMESTAMPING,
+                 &flags, sizeof(flags)) < 0) {
+    LOG(WARNING) << "TX timestamps not supported: " << strerror(errno);
+    return false;
+  }
+  timestamp_flags_ = flags;
+  return true;
+}
+
+int RawSocketBackend::ReadTxTimestamp(Packet* packet) {
+  const int version = family_ == AF_INET6 ? 6 : IPVERSION;
+  const int header_len =
+      version == 6 ? Packet::HEADER6_LEN : Packet::HEADER_LEN;
+  unsigned char buf[ETH_HLEN + Packet::HEADER6_LEN];
+  char control[256];
+  while (true) {
+    struct iovec iov = {buf, sizeof(buf)};
+    struct msghdr msg;
+    ::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    int len = recvmsg(sockfd_, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+    if (len < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOG_EVERY_N_SEC(ERROR, 1) << "recvmsg errqueue error: "
+                                  << strerror(errno);
+      }
+      return 0;
+    }
+    int offset = IpHeaderOffset(buf, len, version);
+    if (offset < 0) {
+      continue;
+    }
+    ::memcpy(packet->Buffer(), buf + offset, header_len);
+    ReadControl(&msg, &packet->timestamp, NULL);
+    return header_len;
+  }
+}
+
+}  // namespace tcpmany
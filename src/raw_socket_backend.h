@@ -0,0 +1,58 @@
+#ifndef TCPMANY_RAW_SOCKET_BACKEND_H_
+#define TCPMANY_RAW_SOCKET_BACKEND_H_
+
+#include <atomic>
+#include <vector>
+
+#include "inet_address.h"
+#include "io_backend.h"
+
+namespace tcpmany {
+
+// The default backend: one SOCK_RAW socket with IP_HDRINCL, which sees
+// every tcp packet of its address family delivered to the host. Needs root.
+//
+// Given |servers|, a socket filter keeps everything else (ssh, the
+// redirect's own traffic, ...) in the kernel: only packets from one of the
+// server ports are received, and when |client_ranges| is set, only those
+// with a fake client address as source (rewritten by redirect) or
+// destination (routed straight here). The filter counts what it drops
+// where the kernel takes eBPF socket filters.
+//
+// An AF_INET6 socket takes IPV6_HDRINCL for sending, but receives the tcp
+// segment alone; Receive puts the ipv6 header back together from the
+// source address and IPV6_PKTINFO. It gets no filter, the classic BPF
+// programs are written against the ipv4 header.
+class RawSocketBackend : public IoBackend {
+ public:
+  explicit RawSocketBackend(sa_family_t family = AF_INET);
+  // of the family of |servers|
+  RawSocketBackend(const std::vector<InetAddress>& servers,
+                   const std::vector<IpRange>& client_ranges);
+  virtual ~RawSocketBackend();
+
+  virtual int Receive(Packet* packet);
+  virtual int Send(const Packet& packet);
+  virtual bool EnableTxTimestamps();
+  virtual int ReadTxTimestamp(Packet* packet);
+  virtual uint64 Drops() const {
+    return drops_;
+  }
+  virtual uint64 Filtered() const;
+
+ private:
+  void Init();
+  int Receive6(Packet* packet);
+
+  const sa_family_t family_;
+  int sockfd_;
+  // per-cpu drop counter of the socket filter, -1 if there is none
+  int filter_counter_fd_;
+  // receive queue overflows as last reported by SO_RXQ_OVFL
+  std::atomic<uint64> drops_;
+  int timestamp_flags_;
+};
+
+}  // namespace tcpmany
+
+#endif  // TCPMANY_RAW_SOCKET_BACKEND_H_
@@ -0,0 +1,427 @@
+#include "session.h"
+
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "kernel.h"
+#include "logging.h"
+
+namespace tcpmany {
+
+namespace {
+
+std::atomic<uint64> g_running(0);
+std::atomic<uint64> g_frame_bytes(0);
+std::atomic<uint64> g_large_frames(0);
+std::atomic<uint64> g_sleeping(0);
+
+// Hands out frames from per size class free lists, refilled a slab at a
+// time. Frames are recycled within their class, the memory never goes back
+// to the system: a load generator keeps the same number of sessions alive
+// for most of its run.
+class FramePool {
+ public:
+  static const size_t kGranularity = 64;
+  static const size_t kMaxFrame = 4096;
+  static const size_t kSlabBytes = 64 * 1024;
+
+  static FramePool& Instance() {
+    // never destroyed, sessions may still finish while the process exits
+    static FramePool* pool = new FramePool();
+    return *pool;
+  }
+
+  void* Allocate(size_t size) {
+    if (size > kMaxFrame) {
+      ++g_large_frames;
+      return ::operator new(size);
+    }
+    SizeClass& size_class = classes_[Index(size)];
+    std::unique_lock<std::mutex> lock(size_class.mutex);
+    if (size_class.free == NULL) {
+      Refill(&size_class, (Index(size) + 1) * kGranularity);
+    }
+    FreeFrame* frame = size_class.free;
+    size_class.free = frame->next;
+    return frame;
+  }
+
+  void Free(void* frame, size_t size) {
+    if (size > kMaxFrame) {
+      --g_large_frames;
+      ::operator delete(frame);
+      return;
+    }
+    SizeClass& size_class = classes_[Index(size)];
+    std::unique_lock<std::mutex> lock(size_class.mutex);
+    FreeFrame* free_frame = static_cast<FreeFrame*>(frame);
+    free_frame->next = size_class.free;
+    size_class.free = free_frame;
+  }
+
+ private:
+  struct FreeFrame {
+    FreeFrame* next;
+  };
+  struct SizeClass {
+    SizeClass() : free(NULL) {}
+    std::mutex mutex;
+    FreeFrame* free;
+  };
+
+  static size_t Index(size_t size) {
+    return (size + kGranularity - 1) / kGranularity - 1;
+  }
+
+  void Refill(SizeClass* size_class, size_t frame_size) {
+    size_t count = std::max<size_t>(1, kSlabBytes / frame_size);
+    char* slab = static_cast<char*>(::operator new(count * frame_size));
+    g_frame_bytes += count * frame_size;
+    for (size_t i = 0; i < count; ++i) {
+      FreeFrame* frame = reinterpret_cast<FreeFrame*>(slab + i * frame_size);
+      frame->next = size_class->free;
+      size_class->free = frame;
+    }
+  }
+
+  SizeClass classes_[kMaxFrame / kGranularity];
+};
+
+// Resumes sleeping sessions when their time has come and runs the
+// deadlines of Connect and Read, on its own thread. One heap entry per
+// sleeper or deadline, a deadline stays until its time even when the wait
+// ended before. Started with the first timer and never stopped.
+class SessionTimer {
+ public:
+  static SessionTimer& Instance() {
+    static SessionTimer* timer = new SessionTimer();
+    return *timer;
+  }
+
+  void Add(std::chrono::steady_clock::time_point when,
+           std::coroutine_handle<> handle) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++g_sleeping;
+    Push(Timer{when, handle, nullptr});
+  }
+
+  void AddDeadline(std::chrono::steady_clock::time_point when,
+                   std::function<void()> expire) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    Push(Timer{when, nullptr, std::move(expire)});
+  }
+
+ private:
+  // a session to resume, or else a deadline to run
+  struct Timer {
+    std::chrono::steady_clock::time_point when;
+    std::coroutine_handle<> handle;
+    std::function<void()> expire;
+
+    bool operator>(const Timer& other) const {
+      return when > other.when;
+    }
+  };
+
+  SessionTimer() {
+    std::thread(&SessionTimer::TimerThread, this).detach();
+  }
+
+  // with mutex_ held
+  void Push(Timer timer) {
+    bool earliest = timers_.empty() || timer.when < timers_.top().when;
+    timers_.push(std::move(timer));
+    if (earliest) {
+      wakeup_.notify_one();
+    }
+  }
+
+  void TimerThread() {
+    std::vector<Timer> due;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      if (timers_.empty()) {
+        wakeup_.wait(lock);
+        continue;
+      }
+      std::chrono::steady_clock::time_point now =
+          std::chrono::steady_clock::now();
+      if (timers_.top().when > now) {
+        // a copy, the heap changes while the lock is released
+        std::chrono::steady_clock::time_point next = timers_.top().when;
+        wakeup_.wait_until(lock, next);
+        continue;
+      }
+      while (!timers_.empty() && timers_.top().when <= now) {
+        if (timers_.top().handle) {
+          --g_sleeping;
+        }
+        due.push_back(timers_.top());
+        timers_.pop();
+      }
+      // a resumed session may sleep again and needs the lock for that
+      lock.unlock();
+      for (Timer& timer : due) {
+        if (timer.handle) {
+          timer.handle.resume();
+        } else {
+          timer.expire();
+        }
+      }
+      due.clear();
+      lock.lock();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer> >
+      timers_;
+};
+
+}  // namespace
+
+SessionStats GetSessionStats() {
+  SessionStats stats;
+  stats.running = g_running;
+  stats.frame_bytes = g_frame_bytes;
+  stats.large_frames = g_large_frames;
+  stats.sleeping = g_sleeping;
+  return stats;
+}
+
+Session::promise_type::promise_type() {
+  ++g_running;
+}
+
+Session::promise_type::~promise_type() {
+  --g_running;
+}
+
+void* Session::promise_type::operator new(size_t size) {
+  return FramePool::Instance().Allocate(size);
+}
+
+void Session::promise_type::operator delete(void* frame, size_t size) {
+  FramePool::Instance().Free(frame, size);
+}
+
+void Session::promise_type::unhandled_exception() {
+  try {
+    throw;
+  } catch (const std::exception& e) {
+    LOG(FATAL) << "session threw: " << e.what();
+  } catch (...) {
+    LOG(FATAL) << "session threw";
+  }
+}
+
+void SleepAwaiter::await_suspend(std::coroutine_handle<> handle) {
+  SessionTimer::Instance().Add(std::chrono::steady_clock::now() + duration_,
+                               handle);
+}
+
+AsyncConnection::AsyncConnection(Connection* conn)
+    : conn_(conn),
+      state_(std::make_shared<State>()) {
+  std::shared_ptr<State> state = state_;
+  conn_->SetConnectedCallback([state](Connection&) {
+    OnConnected(state);
+  });
+  conn_->SetMessageCallback([state](Connection&, const char* data, int len) {
+    OnMessage(state, data, len);
+  });
+  conn_->SetClosedCallback([state](Connection& c) {
+    OnClosed(state, c);
+  });
+}
+
+// Releasing needs a closed connection. One that is closing, or closed with
+// the callback still on its way, is left to OnClosed. Before the handshake
+// is done it is aborted, which has no callback to wait for.
+AsyncConnection::~AsyncConnection() {
+  bool release = false;
+  {
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    if (state_->closed || !state_->connecting) {
+      release = true;
+    } else if (!state_->established && conn_->Abort()) {
+      state_->closed = true;
+      release = true;
+    } else {
+      state_->detached = true;
+      if (!conn_->IsClosed()) {
+        conn_->Close();
+      }
+    }
+  }
+  if (release) {
+    Kernel::Release(*conn_);
+  }
+}
+
+// Connect goes out before the waiter is registered, an answer that beats
+// it is seen here and the session doesn't suspend at all.
+bool AsyncConnection::ConnectAwaiter::await_suspend(
+    std::coroutine_handle<> handle) {
+  State* state = conn_->state_.get();
+  {
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->connecting = true;
+  }
+  conn_->conn_->Connect();
+  std::unique_lock<std::mutex> lock(state->mutex);
+  if (state->established || state->closed) {
+    return false;
+  }
+  conn_->Wait(handle, true, timeout_);
+  return true;
+}
+
+bool AsyncConnection::ConnectAwaiter::await_resume() const {
+  std::unique_lock<std::mutex> lock(conn_->state_->mutex);
+  return conn_->state_->established && !conn_->state_->closed;
+}
+
+bool AsyncConnection::ReadAwaiter::await_suspend(
+    std::coroutine_handle<> handle) {
+  State* state = conn_->state_.get();
+  std::unique_lock<std::mutex> lock(state->mutex);
+  if (state->buffer.size() >= size_ || state->closed) {
+    return false;
+  }
+  state->wanted = size_;
+  conn_->Wait(handle, false, timeout_);
+  return true;
+}
+
+std::string AsyncConnection::ReadAwaiter::await_resume() {
+  State* state = conn_->state_.get();
+  std::unique_lock<std::mutex> lock(state->mutex);
+  size_t size = std::min(size_, state->buffer.size());
+  std::string data = state->buffer.substr(0, size);
+  state->buffer.erase(0, size);
+  return data;
+}
+
+AsyncConnection::SendAwaiter AsyncConnection::Send(
+    const std::string& message) {
+  return SendAwaiter(conn_->Send(message));
+}
+
+// Connection::Close aborts before the handshake is done, then nothing
+// calls OnClosed.
+void AsyncConnection::Close() {
+  std::unique_lock<std::mutex> lock(state_->mutex);
+  if (state_->closed || !state_->connecting) {
+    return;
+  }
+  if (!state_->established) {
+    if (conn_->Abort()) {
+      state_->closed = true;
+    }
+  } else if (!conn_->IsClosed()) {
+    conn_->Close();
+  }
+}
+
+bool AsyncConnection::Closed() const {
+  std::unique_lock<std::mutex> lock(state_->mutex);
+  return state_->closed;
+}
+
+void AsyncConnection::Wait(std::coroutine_handle<> handle,
+                           bool connect,
+                           std::chrono::steady_clock::duration timeout) {
+  State* state = state_.get();
+  state->waiter = handle;
+  state->wait_connect = connect;
+  uint64 wait_id = ++state->wait_id;
+  if (timeout == kNoTimeout) {
+    return;
+  }
+  std::shared_ptr<State> shared = state_;
+  Connection* conn = conn_;
+  SessionTimer::Instance().AddDeadline(
+      std::chrono::steady_clock::now() + timeout,
+      [shared, wait_id, conn] { OnDeadline(shared, wait_id, conn); });
+}
+
+// A Connect that timed out aborts the connection; when the abort loses to
+// a close on the receive thread, OnClosed still comes and sets closed.
+void AsyncConnection::OnDeadline(std::shared_ptr<State> state,
+                                 uint64 wait_id,
+                                 Connection* conn) {
+  std::coroutine_handle<> waiter;
+  {
+    std::unique_lock<std::mutex> lock(state->mutex);
+    if (!state->waiter || state->wait_id != wait_id) {
+      return;
+    }
+    std::swap(waiter, state->waiter);
+    if (state->wait_connect && conn->Abort()) {
+      state->closed = true;
+    }
+  }
+  waiter.resume();
+}
+
+void AsyncConnection::OnConnected(std::shared_ptr<State> state) {
+  std::coroutine_handle<> waiter;
+  {
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->established = true;
+    if (state->waiter && state->wait_connect) {
+      std::swap(waiter, state->waiter);
+    }
+  }
+  if (waiter) {
+    waiter.resume();
+  }
+}
+
+void AsyncConnection::OnMessage(std::shared_ptr<State> state,
+                                const char* data,
+                                int len) {
+  std::coroutine_handle<> waiter;
+  {
+    std::unique_lock<std::mutex> lock(state->mutex);
+    if (state->detached) {
+      return;
+    }
+    state->buffer.append(data, len);
+    if (state->waiter && !state->wait_connect &&
+        state->buffer.size() >= state->wanted) {
+      std::swap(waiter, state->waiter);
+    }
+  }
+  if (waiter) {
+    waiter.resume();
+  }
+}
+
+void AsyncConnection::OnClosed(std::shared_ptr<State> state,
+                               Connection& conn) {
+  std::coroutine_handle<> waiter;
+  {
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->closed = true;
+    if (!state->detached) {
+      std::swap(waiter, state->waiter);
+    }
+  }
+  if (waiter) {
+    waiter.resume();
+  } else if (state->detached) {
+    Kernel::Release(conn);
+  }
+}
+
+}  // namespace tcpmany
@@ -0,0 +1,250 @@
+#ifndef TCPMANY_SESSION_H_
+#define TCPMANY_SESSION_H_
+
+// C++20 coroutines on top of Connection, for scripting what each client
+// does without a hand written state machine:
+//
+//   Session Login(Connection* c, int id) {
+//     AsyncConnection conn(c);
+//     if (!co_await conn.Connect(std::chrono::seconds(3))) co_return;
+//     co_await conn.Send("LOGIN " + std::to_string(id) + "\n");
+//     std::string reply = co_await conn.Read(6, std::chrono::seconds(5));
+//     while (!conn.Closed()) {
+//       co_await Sleep(std::chrono::seconds(30));
+//       co_await conn.Send("PING\n");
+//     }
+//   }
+//
+// A session starts running when called and frees itself when it returns.
+// It is resumed from wherever the event it waits for happens: the Kernel's
+// receive thread (or callback thread, see KernelOptions::callback_threads)
+// for Connect and Read, the session timer thread for Sleep and for a
+// Connect or Read whose timeout ran out. Only one of them resumes a
+// session at a time, so its body needs no locking, but anything slow in it
+// holds up that thread for every other session.
+//
+// Frames come from a pool of fixed size classes and are recycled, a
+// million sleeping sessions cost their frame and one timer entry each.
+// Needs C++20, the rest of tcpmany builds as C++11.
+
+#include <chrono>
+#include <coroutine>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "base.h"
+#include "connection.h"
+
+namespace tcpmany {
+
+struct SessionStats {
+  // sessions started and not yet returned
+  uint64 running;
+  // frame memory taken from the system, in use or waiting for reuse
+  uint64 frame_bytes;
+  // frames too large for the pool, allocated one by one
+  uint64 large_frames;
+  // sessions waiting in Sleep
+  uint64 sleeping;
+};
+
+SessionStats GetSessionStats();
+
+// Return type of a session coroutine. There is nothing to hold on to, the
+// frame destroys itself at the end.
+class Session {
+ public:
+  struct promise_type {
+    Session get_return_object() {
+      return Session();
+    }
+    std::suspend_never initial_suspend() noexcept {
+      return std::suspend_never();
+    }
+    std::suspend_never final_suspend() noexcept {
+      return std::suspend_never();
+    }
+    void return_void() {}
+    void unhandled_exception();
+
+    promise_type();
+    ~promise_type();
+    static void* operator new(size_t size);
+    static void operator delete(void* frame, size_t size);
+  };
+};
+
+// co_await Sleep(duration) resumes the session on the timer thread.
+class SleepAwaiter {
+ public:
+  explicit SleepAwaiter(std::chrono::steady_clock::duration duration)
+      : duration_(duration) {}
+  bool await_ready() const {
+    return duration_.count() <= 0;
+  }
+  void await_suspend(std::coroutine_handle<> handle);
+  void await_resume() const {}
+
+ private:
+  std::chrono::steady_clock::duration duration_;
+};
+
+template <typename Rep, typename Period>
+SleepAwaiter Sleep(std::chrono::duration<Rep, Period> duration) {
+  return SleepAwaiter(
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          duration));
+}
+
+// Owns a Connection for a session: takes over its callbacks, buffers what
+// arrives until the session reads it, and hands it back to the Kernel when
+// destroyed, closing it first if it is still open.
+class AsyncConnection : public NonCopyable {
+ public:
+  explicit AsyncConnection(Connection* conn);
+  ~AsyncConnection();
+
+  // no deadline for Connect and Read
+  static constexpr std::chrono::steady_clock::duration kNoTimeout =
+      std::chrono::steady_clock::duration::max();
+
+  // true once established, false if the connection closed instead. The
+  // SYN is not retransmitted: with a timeout, a connection still not
+  // established when it runs out is aborted and the result is false.
+  class ConnectAwaiter {
+   public:
+    ConnectAwaiter(AsyncConnection* conn,
+                   std::chrono::steady_clock::duration timeout)
+        : conn_(conn), timeout_(timeout) {}
+    bool await_ready() const {
+      return false;
+    }
+    bool await_suspend(std::coroutine_handle<> handle);
+    bool await_resume() const;
+
+   private:
+    AsyncConnection* conn_;
+    std::chrono::steady_clock::duration timeout_;
+  };
+
+  // exactly |size| bytes, fewer only when the connection closed first or
+  // the timeout ran out; the connection stays open then
+  class ReadAwaiter {
+   public:
+    ReadAwaiter(AsyncConnection* conn,
+                size_t size,
+                std::chrono::steady_clock::duration timeout)
+        : conn_(conn), size_(size), timeout_(timeout) {}
+    bool await_ready() const {
+      return false;
+    }
+    bool await_suspend(std::coroutine_handle<> handle);
+    std::string await_resume();
+
+   private:
+    AsyncConnection* conn_;
+    size_t size_;
+    std::chrono::steady_clock::duration timeout_;
+  };
+
+  // Sending only queues the packets, there is no window to wait for yet,
+  // so this never suspends. It is an awaitable to keep scripts uniform and
+  // leave room for flow control. Resumes with false when the message was
+  // refused over KernelOptions::memory_budget, see Connection::Send.
+  class SendAwaiter {
+   public:
+    explicit SendAwaiter(bool sent) : sent_(sent) {}
+    bool await_ready() const {
+      return true;
+    }
+    void await_suspend(std::coroutine_handle<>) {}
+    bool await_resume() const {
+      return sent_;
+    }
+
+   private:
+    bool sent_;
+  };
+
+  ConnectAwaiter Connect() {
+    return ConnectAwaiter(this, kNoTimeout);
+  }
+  template <typename Rep, typename Period>
+  ConnectAwaiter Connect(std::chrono::duration<Rep, Period> timeout) {
+    return ConnectAwaiter(
+        this,
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            timeout));
+  }
+  ReadAwaiter Read(size_t size) {
+    return ReadAwaiter(this, size, kNoTimeout);
+  }
+  template <typename Rep, typename Period>
+  ReadAwaiter Read(size_t size, std::chrono::duration<Rep, Period> timeout) {
+    return ReadAwaiter(
+        this,
+        size,
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            timeout));
+  }
+  SendAwaiter Send(const std::string& message);
+  void Close();
+  bool Closed() const;
+
+  Connection* connection() const {
+    return conn_;
+  }
+
+ private:
+  // Shared with the connection callbacks, which may run on the receive
+  // thread while the session runs elsewhere.
+  struct State {
+    State()
+        : connecting(false),
+          established(false),
+          closed(false),
+          detached(false),
+          wait_connect(false),
+          wanted(0),
+          wait_id(0) {}
+
+    std::mutex mutex;
+    bool connecting;
+    bool established;
+    bool closed;
+    // the session is gone, the connection is released once closed
+    bool detached;
+    std::string buffer;
+    // the suspended session and what it waits for
+    std::coroutine_handle<> waiter;
+    bool wait_connect;
+    size_t wanted;
+    // counts the waits, a deadline only ends the one it was set for
+    uint64 wait_id;
+  };
+
+  // by value: Kernel::Release from inside a resumed session destroys the
+  // callback that holds the other reference
+  static void OnConnected(std::shared_ptr<State> state);
+  static void OnMessage(std::shared_ptr<State> state,
+                        const char* data,
+                        int len);
+  static void OnClosed(std::shared_ptr<State> state, Connection& conn);
+  // on the session timer thread, |conn| is alive while the wait lasts
+  static void OnDeadline(std::shared_ptr<State> state,
+                         uint64 wait_id,
+                         Connection* conn);
+  // Registers the suspended session, and its deadline unless |timeout| is
+  // kNoTimeout. Called with the state locked.
+  void Wait(std::coroutine_handle<> handle,
+            bool connect,
+            std::chrono::steady_clock::duration timeout);
+
+  Connection* conn_;
+  std::shared_ptr<State> state_;
+};
+
+}  // namespace tcpmany
+
+#endif  // TCPMANY_SESSION_H_
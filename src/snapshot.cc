@@ -0,0 +1,128 @@
+#include "snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "logging.h"
+
+namespace tcpmany {
+
+static const char SNAPSHOT_MAGIC[8] = {'T', 'C', 'P', 'M', 'S', 'N', 'A', 'P'};
+static const uint32 SNAPSHOT_VERSION = 1;
+
+SnapshotFile::SnapshotFile()
+    : data_(NULL),
+      size_(0),
+      records_(NULL),
+      count_(0) {
+}
+
+SnapshotFile::~SnapshotFile() {
+  Unmap();
+  if (!temp_path_.empty()) {
+    ::unlink(temp_path_.c_str());
+  }
+}
+
+bool SnapshotFile::Create(const std::string& path, uint64 count) {
+  Unmap();
+  path_ = path;
+  temp_path_ = path + ".tmp";
+  int fd = ::open(temp_path_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    LOG(ERROR) << "open " << temp_path_ << " error: " << ::strerror(errno);
+    temp_path_.clear();
+    return false;
+  }
+  size_t size = sizeof(Header) + count * sizeof(SnapshotRecord);
+  void* data = MAP_FAILED;
+  if (::ftruncate(fd, size) == 0) {
+    data = ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (data == MAP_FAILED) {
+    LOG(ERROR) << "map " << temp_path_ << " error: " << ::strerror(errno);
+    ::close(fd);
+    return false;
+  }
+  ::close(fd);
+  data_ = data;
+  size_ = size;
+  Header* header = static_cast<Header*>(data_);
+  ::memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+  header->version = SNAPSHOT_VERSION;
+  header->record_size = sizeof(SnapshotRecord);
+  header->count = count;
+  records_ = reinterpret_cast<SnapshotRecord*>(header + 1);
+  count_ = count;
+  return true;
+}
+
+// The records only have to outlive this process, not the host, so they
+// stay in the page cache without an fsync.
+bool SnapshotFile::Commit() {
+  CHECK(!temp_path_.empty()) << "no snapshot created";
+  Unmap();
+  if (::rename(temp_path_.c_str(), path_.c_str()) != 0) {
+    LOG(ERROR) << "rename " << temp_path_ << " error: " << ::strerror(errno);
+    return false;
+  }
+  temp_path_.clear();
+  return true;
+}
+
+bool SnapshotFile::Open(const std::string& path) {
+  Unmap();
+  path_ = path;
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(ERROR) << "open " << path << " error: " << ::strerror(errno);
+    return false;
+  }
+  struct stat st;
+  if (::fstat(fd, &st) != 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(Header)) {
+    LOG(ERROR) << path << " is no snapshot";
+    ::close(fd);
+    return false;
+  }
+  // private and writable, so records() works the same for both modes
+  void* data = ::mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    LOG(ERROR) << "map " << path << " error: " << ::strerror(errno);
+    return false;
+  }
+  data_ = data;
+  size_ = st.st_size;
+  const Header* header = static_cast<const Header*>(data_);
+  if (::memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != SNAPSHOT_VERSION ||
+      header->record_size != sizeof(SnapshotRecord) ||
+      header->count > (size_ - sizeof(Header)) / sizeof(SnapshotRecord)) {
+    LOG(ERROR) << path << " is no snapshot of this version or truncated";
+    Unmap();
+    return false;
+  }
+  records_ = reinterpret_cast<SnapshotRecord*>(
+      static_cast<char*>(data_) + sizeof(Header));
+  count_ = header->count;
+  return true;
+}
+
+void SnapshotFile::Unmap() {
+  if (data_ != NULL) {
+    ::munmap(data_, size_);
+  }
+  data_ = NULL;
+  size_ = 0;
+  records_ = NULL;
+  count_ = 0;
+}
+
+}  // namespace tcpmany
@@ -0,0 +1,67 @@
+#ifndef TCPMANY_SNAPSHOT_H_
+#define TCPMANY_SNAPSHOT_H_
+
+#include <string>
+
+#include "base.h"
+#include "noncopyable.h"
+
+namespace tcpmany {
+
+// One established connection as it is stored, addresses in network order
+// so they go straight back into an InetAddress.
+struct SnapshotRecord {
+  uint32 src_ip;
+  uint32 dst_ip;
+  uint16 src_port;
+  uint16 dst_port;
+  uint32 seq;
+  uint32 ack_seq;
+  uint32 reserved;
+};
+
+// A file holding a header and an array of SnapshotRecords, mapped into
+// memory for both writing and reading: saving is filling the array,
+// restoring is walking it. The layout is that of the machine writing it,
+// a snapshot is meant to be restored on the same host.
+class SnapshotFile : public NonCopyable {
+ public:
+  SnapshotFile();
+  // unmaps, and removes a created file that was not committed
+  ~SnapshotFile();
+
+  // Maps a new file next to |path| with room for |count| records, it only
+  // replaces |path| on Commit. Both log and return false on errors.
+  bool Create(const std::string& path, uint64 count);
+  bool Commit();
+  // false, with a log message, if it is no snapshot or a truncated one
+  bool Open(const std::string& path);
+
+  SnapshotRecord* records() {
+    return records_;
+  }
+  uint64 count() const {
+    return count_;
+  }
+
+ private:
+  struct Header {
+    char magic[8];
+    uint32 version;
+    uint32 record_size;
+    uint64 count;
+  };
+
+  void Unmap();
+
+  std::string path_;
+  std::string temp_path_;
+  void* data_;
+  size_t size_;
+  SnapshotRecord* records_;
+  uint64 count_;
+};
+
+}  // namespace tcpmany
+
+#endif  // TCPMANY_SNAPSHOT_H_
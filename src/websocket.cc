@@ -0,0 +1,481 @@
+#include "websocket.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include "logging.h"
+
+namespace tcpmany {
+
+namespace {
+
+const char WEBSOCKET_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+// a response longer than this is no upgrade
+const size_t kMaxResponseSize = 8192;
+
+const uint8 FIN = 0x80;
+const uint8 MASKED = 0x80;
+
+uint32 Rotate(uint32 value, int bits) {
+  return value << bits | value >> (32 - bits);
+}
+
+// SHA-1 of |data|, for the handshake only
+void Sha1(const std::string& data, uint8 digest[20]) {
+  uint32 h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+  std::string message = data;
+  message.push_back(static_cast<char>(0x80));
+  while (message.size() % 64 != 56) {
+    message.push_back(0);
+  }
+  const uint64 bits = static_cast<uint64>(data.size()) * 8;
+  for (int i = 7; i >= 0; --i) {
+    message.push_back(static_cast<char>(bits >> (i * 8)));
+  }
+  const uint8* block = reinterpret_cast<const uint8*>(message.data());
+  for (size_t offset = 0; offset < message.size(); offset += 64) {
+    uint32 w[80];
+    for (int i = 0; i < 16; ++i) {
+      const uint8* p = block + offset + i * 4;
+      w[i] = static_cast<uint32>(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    }
+    for (int i = 16; i < 80; ++i) {
+      w[i] = Rotate(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    uint32 a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; ++i) {
+      uint32 f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5a827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8f1bbcdc;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
+      }
+      uint32 temp = Rotate(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = Rotate(b, 30);
+      b = a;
+      a = temp;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+  for (int i = 0; i < 20; ++i) {
+    digest[i] = static_cast<uint8>(h[i / 4] >> (24 - i % 4 * 8));
+  }
+}
+
+std::string Base64(const uint8* data, size_t len) {
+  static const char kAlphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  for (size_t i = 0; i < len; i += 3) {
+    uint32 group = data[i] << 16;
+    if (i + 1 < len) {
+      group |= data[i + 1] << 8;
+    }
+    if (i + 2 < len) {
+      group |= data[i + 2];
+    }
+    out.push_back(kAlphabet[group >> 18 & 0x3f]);
+    out.push_back(kAlphabet[group >> 12 & 0x3f]);
+    out.push_back(i + 1 < len ? kAlphabet[group >> 6 & 0x3f] : '=');
+    out.push_back(i + 2 < len ? kAlphabet[group & 0x3f] : '=');
+  }
+  return out;
+}
+
+uint32 NextRandom(uint32* state) {
+  // xorshift32, the keys only have to differ between groups
+  uint32 x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+// the value of header |name| (lower case) in |response|, trimmed
+std::string HeaderValue(const std::string& response, const char* name) {
+  const size_t name_len = ::strlen(name);
+  size_t line = response.find("\r\n");
+  while (line != std::string::npos && line + 2 < response.size()) {
+    const size_t start = line + 2;
+    const size_t end = response.find("\r\n", start);
+    if (end == std::string::npos) {
+      break;
+    }
+    if (end - start > name_len && response[start + name_len] == ':' &&
+        ::strncasecmp(response.data() + start, name, name_len) == 0) {
+      size_t first = start + name_len + 1;
+      size_t last = end;
+      while (first < last && (response[first] == ' ' ||
+                              response[first] == '\t')) {
+        ++first;
+      }
+      while (last > first && (response[last - 1] == ' ' ||
+                              response[last - 1] == '\t')) {
+        --last;
+      }
+      return response.substr(first, last - first);
+    }
+    line = end;
+  }
+  return std::string();
+}
+
+}  // namespace
+
+void MaskWebSocketPayload(char* data, size_t len, const uint8 key[4]) {
+  typedef uint8 Block __attribute__((vector_size(16)));
+  Block mask;
+  for (int i = 0; i < 16; ++i) {
+    mask[i] = key[i % 4];
+  }
+  size_t i = 0;
+  for (; i + sizeof(Block) <= len; i += sizeof(Block)) {
+    Block block;
+    ::memcpy(&block, data + i, sizeof(block));
+    block ^= mask;
+    ::memcpy(data + i, &block, sizeof(block));
+  }
+  for (; i < len; ++i) {
+    data[i] ^= key[i % 4];
+  }
+}
+
+void EncodeWebSocketFrame(WebSocketOpcode opcode, const char* data,
+                          size_t len, const uint8* key, std::string* out) {
+  const uint8 mask_bit = key != NULL ? MASKED : 0;
+  out->push_back(static_cast<char>(FIN | opcode));
+  if (len < 126) {
+    out->push_back(static_cast<char>(mask_bit | len));
+  } else if (len <= 0xffff) {
+    out->push_back(static_cast<char>(mask_bit | 126));
+    out->push_back(static_cast<char>(len >> 8));
+    out->push_back(static_cast<char>(len));
+  } else {
+    out->push_back(static_cast<char>(mask_bit | 127));
+    for (int i = 7; i >= 0; --i) {
+      out->push_back(static_cast<char>(static_cast<uint64>(len) >> (i * 8)));
+    }
+  }
+  if (key != NULL) {
+    out->append(reinterpret_cast<const char*>(key), 4);
+  }
+  const size_t payload = out->size();
+  out->append(data, len);
+  if (key != NULL) {
+    MaskWebSocketPayload(&(*out)[payload], len, key);
+  }
+}
+
+std::string WebSocketAccept(const std::string& key) {
+  uint8 digest[20];
+  Sha1(key + WEBSOCKET_GUID, digest);
+  return Base64(digest, sizeof(digest));
+}
+
+WebSocketGroup::WebSocketGroup(const std::string& host,
+                               const std::string& path,
+                               uint32 seed)
+    : host_(host) {
+  uint32 state = seed * 2654435761u | 1;
+  uint8 nonce[16];
+  for (size_t i = 0; i < sizeof(nonce); ++i) {
+    nonce[i] = static_cast<uint8>(NextRandom(&state) >> 24);
+  }
+  key_ = Base64(nonce, sizeof(nonce));
+  accept_ = WebSocketAccept(key_);
+  for (size_t i = 0; i < sizeof(mask_key_); ++i) {
+    mask_key_[i] = static_cast<uint8>(NextRandom(&state) >> 24);
+  }
+  request_ = Request(path);
+}
+
+std::string WebSocketGroup::Prebuild(WebSocketOpcode opcode,
+                                     const std::string& payload) const {
+  std::string frame;
+  EncodeWebSocketFrame(opcode, payload.data(), payload.size(), mask_key_,
+                       &frame);
+  return frame;
+}
+
+std::string WebSocketGroup::Request(const std::string& path) const {
+  return "GET " + path + " HTTP/1.1\r\n"
+         "Host: " + host_ + "\r\n"
+         "Upgrade: websocket\r\n"
+         "Connection: Upgrade\r\n"
+         "Sec-WebSocket-Key: " + key_ + "\r\n"
+         "Sec-WebSocket-Version: 13\r\n"
+         "\r\n";
+}
+
+WebSocketClient::WebSocketClient(Connection* conn,
+                                 const WebSocketGroup* group)
+    : conn_(conn),
+      group_(group),
+      user_data_(NULL),
+      payload_left_(0),
+      header_len_(0),
+      header_need_(2),
+      response_done_(false),
+      failed_(false),
+      state_(WS_CONNECTING),
+      close_code_(1006) {
+  conn_->SetConnectedCallback([this](Connection& c) { OnConnected(c); });
+  conn_->SetMessageCallback([this](Connection& c, const char* data, int len) {
+    OnMessage(c, data, len);
+  });
+  conn_->SetClosedCallback([this](Connection& c) { OnClosed(c); });
+}
+
+void WebSocketClient::Connect() {
+  conn_->Connect();
+}
+
+void WebSocketClient::Connect(const std::string& path) {
+  buffer_ = group_->Request(path);
+  conn_->Connect();
+}
+
+bool WebSocketClient::SendText(const std::string& text) {
+  return Send(WS_TEXT, text.data(), text.size());
+}
+
+bool WebSocketClient::SendBinary(const std::string& data) {
+  return Send(WS_BINARY, data.data(), data.size());
+}
+
+bool WebSocketClient::SendPrebuilt(const std::string& frame) {
+  return state_ == WS_OPEN && conn_->Send(frame);
+}
+
+bool WebSocketClient::Ping(const std::string& payload) {
+  return Send(WS_PING, payload.data(),
+              std::min<size_t>(payload.size(), 125));
+}
+
+void WebSocketClient::Close(uint16 code) {
+  if (state_ == WS_CONNECTING) {
+    conn_->Close();
+    return;
+  }
+  if (state_ != WS_OPEN) {
+    return;
+  }
+  const char payload[2] = {static_cast<char>(code >> 8),
+                           static_cast<char>(code)};
+  Send(WS_CLOSE, payload, sizeof(payload));
+  state_ = WS_CLOSING;
+}
+
+void WebSocketClient::OnConnected(Connection& conn) {
+  if (buffer_.empty()) {
+    conn.Send(group_->request_);
+  } else {
+    conn.Send(buffer_);
+    // keeps the capacity for the response
+    buffer_.clear();
+  }
+}
+
+void WebSocketClient::OnMessage(Connection& conn, const char* data,
+                                int len) {
+  if (failed_) {
+    return;
+  }
+  size_t offset = 0;
+  const size_t size = len;
+  if (!response_done_) {
+    offset = ParseResponse(data, size);
+  }
+  while (offset < size && response_done_ && !failed_) {
+    if (header_len_ < header_need_) {
+      offset += ParseHeader(data + offset, size - offset);
+    } else {
+      offset += ParsePayload(data + offset, size - offset);
+    }
+  }
+}
+
+void WebSocketClient::OnClosed(Connection& conn) {
+  state_ = WS_CLOSED;
+  if (group_->closed_callback_) {
+    group_->closed_callback_(*this);
+  }
+}
+
+size_t WebSocketClient::ParseResponse(const char* data, size_t len) {
+  const size_t searched = buffer_.size() >= 3 ? buffer_.size() - 3 : 0;
+  buffer_.append(data, len);
+  const size_t end = buffer_.find("\r\n\r\n", searched);
+  if (end == std::string::npos) {
+    if (buffer_.size() > kMaxResponseSize) {
+      buffer_.clear();
+      failed_ = true;
+      close_code_ = 1002;
+      conn_->Close();
+    }
+    return len;
+  }
+  const size_t header_size = end + 4;
+  const size_t used = len - (buffer_.size() - header_size);
+  buffer_.resize(header_size);
+  response_done_ = true;
+  const bool accepted = CheckResponse(buffer_);
+  buffer_.clear();
+  if (!accepted) {
+    failed_ = true;
+    close_code_ = 1002;
+    conn_->Close();
+    return len;
+  }
+  state_ = WS_OPEN;
+  if (group_->open_callback_) {
+    group_->open_callback_(*this);
+  }
+  return used;
+}
+
+bool WebSocketClient::CheckResponse(const std::string& response) const {
+  if (response.compare(0, 12, "HTTP/1.1 101") != 0) {
+    VLOG(1) << conn_->GetSrcAddress().ToIpPort() << " upgrade refused: "
+            << response.substr(0, response.find("\r\n"));
+    return false;
+  }
+  if (HeaderValue(response, "sec-websocket-accept") != group_->accept_) {
+    VLOG(1) << conn_->GetSrcAddress().ToIpPort()
+            << " wrong Sec-WebSocket-Accept";
+    return false;
+  }
+  return true;
+}
+
+size_t WebSocketClient::ParseHeader(const char* data, size_t len) {
+  const size_t used = std::min<size_t>(len, header_need_ - header_len_);
+  ::memcpy(header_ + header_len_, data, used);
+  header_len_ += used;
+  if (header_len_ == 2) {
+    if (header_[1] & MASKED) {
+      // servers must not mask
+      Fail(1002);
+      return used;
+    }
+    const uint8 len7 = header_[1] & 0x7f;
+    header_need_ = 2 + (len7 == 126 ? 2 : len7 == 127 ? 8 : 0);
+  }
+  if (header_len_ < header_need_) {
+    return used;
+  }
+
+  const uint8 opcode = header_[0] & 0x0f;
+  uint64 payload_len = header_[1] & 0x7f;
+  if (payload_len >= 126) {
+    payload_len = 0;
+    for (int i = 2; i < header_need_; ++i) {
+      payload_len = payload_len << 8 | header_[i];
+    }
+  }
+  if (opcode >= WS_CLOSE && (!(header_[0] & FIN) || payload_len > 125)) {
+    Fail(1002);
+    return used;
+  }
+  if (payload_len > kMaxFrameSize) {
+    Fail(1009);
+    return used;
+  }
+  payload_left_ = payload_len;
+  if (payload_len == 0) {
+    header_len_ = 0;
+    header_need_ = 2;
+    OnFrame(opcode, NULL, 0);
+  }
+  return used;
+}
+
+size_t WebSocketClient::ParsePayload(const char* data, size_t len) {
+  const size_t used = std::min<uint64>(len, payload_left_);
+  payload_left_ -= used;
+  const uint8 opcode = header_[0] & 0x0f;
+  if (payload_left_ > 0) {
+    buffer_.append(data, used);
+    return used;
+  }
+  header_len_ = 0;
+  header_need_ = 2;
+  if (buffer_.empty()) {
+    OnFrame(opcode, data, used);
+  } else {
+    buffer_.append(data, used);
+    OnFrame(opcode, buffer_.data(), buffer_.size());
+    buffer_.clear();
+  }
+  return used;
+}
+
+void WebSocketClient::OnFrame(uint8 opcode, const char* data, size_t len) {
+  switch (opcode) {
+    case WS_PING:
+      if (state_ == WS_OPEN) {
+        Send(WS_PONG, data, len);
+      }
+      return;
+    case WS_CLOSE:
+      close_code_ = len >= 2
+          ? static_cast<uint16>(static_cast<uint8>(data[0]) << 8 |
+                                static_cast<uint8>(data[1]))
+          : 1005;
+      if (state_ == WS_OPEN) {
+        // echo the code, the server closes the connection then
+        Send(WS_CLOSE, data, std::min<size_t>(len, 2));
+        state_ = WS_CLOSING;
+      }
+      return;
+    case WS_CONTINUATION:
+    case WS_TEXT:
+    case WS_BINARY:
+    case WS_PONG:
+      if (group_->message_callback_) {
+        group_->message_callback_(*this, static_cast<WebSocketOpcode>(opcode),
+                                  data, len);
+      }
+      return;
+    default:
+      Fail(1002);
+  }
+}
+
+bool WebSocketClient::Send(WebSocketOpcode opcode, const char* data,
+                           size_t len) {
+  if (state_ != WS_OPEN) {
+    return false;
+  }
+  std::string frame;
+  EncodeWebSocketFrame(opcode, data, len, group_->mask_key_, &frame);
+  // segmented by Connection::Send, the whole frame or nothing
+  return conn_->Send(frame);
+}
+
+void WebSocketClient::Fail(uint16 code) {
+  failed_ = true;
+  const char payload[2] = {static_cast<char>(code >> 8),
+                           static_cast<char>(code)};
+  Send(WS_CLOSE, payload, sizeof(payload));
+  state_ = WS_CLOSING;
+  close_code_ = code;
+  conn_->Close();
+}
+
+}  // namespace tcpmany
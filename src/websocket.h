@@ -0,0 +1,196 @@
+#ifndef TCPMANY_WEBSOCKET_H_
+#define TCPMANY_WEBSOCKET_H_
+
+// A WebSocket (RFC 6455) client on top of Connection, cheap enough to run
+// one for each of a million fake clients:
+//
+//   WebSocketGroup group("example.com", "/chat", seed);
+//   group.SetMessageCallback(OnMessage);
+//   const std::string heartbeat = group.Prebuild(WS_TEXT, "{\"op\":1}");
+//   ...
+//   WebSocketClient* client = new WebSocketClient(conn, &group);
+//   client->Connect();
+//   ...
+//   client->SendPrebuilt(heartbeat);
+//
+// What clients have in common lives in their WebSocketGroup: the upgrade
+// request, its key and the accept value expected back, the callbacks and
+// the masking key. Frames the clients of a group all send, heartbeats
+// above all, can be encoded and masked once with Prebuild and then sent
+// as they are.
+//
+// Frames are parsed in place out of the segments Connection hands over. A
+// frame is only copied when it spans segments, into a buffer that keeps
+// its capacity for the next one. Pings are answered with a pong and a
+// close frame with a close frame of the same code, the server then closes
+// the connection.
+
+#include <atomic>
+#include <functional>
+#include <string>
+
+#include "base.h"
+#include "connection.h"
+#include "noncopyable.h"
+
+namespace tcpmany {
+
+enum WebSocketOpcode {
+  WS_CONTINUATION = 0x0,
+  WS_TEXT = 0x1,
+  WS_BINARY = 0x2,
+  WS_CLOSE = 0x8,
+  WS_PING = 0x9,
+  WS_PONG = 0xa,
+};
+
+class WebSocketClient;
+// the upgrade has been accepted
+typedef std::function<void (WebSocketClient&)> WebSocketOpenCallback;
+// A data frame or a pong, with its payload. Fragmented messages come as
+// their frames, the later ones with WS_CONTINUATION.
+typedef std::function<void (WebSocketClient&, WebSocketOpcode, const char*,
+                            size_t)> WebSocketMessageCallback;
+// the connection is closed, see WebSocketClient::close_code
+typedef std::function<void (WebSocketClient&)> WebSocketClosedCallback;
+
+// XORs |len| bytes of |data| with the 4 byte |key|, the first byte with
+// key[0]. Works on 16 bytes at a time, which the compiler turns into one
+// vector instruction each.
+void MaskWebSocketPayload(char* data, size_t len, const uint8 key[4]);
+
+// Appends a frame to |out|, masked with |key| unless it is NULL (the
+// server side).
+void EncodeWebSocketFrame(WebSocketOpcode opcode, const char* data,
+                          size_t len, const uint8* key, std::string* out);
+
+// the Sec-WebSocket-Accept a server answers Sec-WebSocket-Key |key| with
+std::string WebSocketAccept(const std::string& key);
+
+class WebSocketGroup : public NonCopyable {
+ public:
+  // |seed| picks the handshake key and the masking key of the group.
+  WebSocketGroup(const std::string& host, const std::string& path,
+                 uint32 seed);
+
+  void SetOpenCallback(const WebSocketOpenCallback& cb) {
+    open_callback_ = cb;
+  }
+  void SetMessageCallback(const WebSocketMessageCallback& cb) {
+    message_callback_ = cb;
+  }
+  void SetClosedCallback(const WebSocketClosedCallback& cb) {
+    closed_callback_ = cb;
+  }
+
+  // A frame ready for WebSocketClient::SendPrebuilt, encoded and masked
+  // once for every client of the group.
+  std::string Prebuild(WebSocketOpcode opcode,
+                       const std::string& payload) const;
+
+ private:
+  friend class WebSocketClient;
+
+  std::string Request(const std::string& path) const;
+
+  const std::string host_;
+  std::string key_;
+  std::string request_;
+  // expected Sec-WebSocket-Accept
+  std::string accept_;
+  uint8 mask_key_[4];
+  WebSocketOpenCallback open_callback_;
+  WebSocketMessageCallback message_callback_;
+  WebSocketClosedCallback closed_callback_;
+};
+
+// One client, driven from its Connection's callbacks, which it takes over.
+// The group has to outlive it. The Connection stays the caller's: release
+// it (Kernel::Release) and delete the client in the closed callback or
+// after it ran.
+class WebSocketClient : public NonCopyable {
+ public:
+  enum State {
+    WS_CONNECTING,
+    WS_OPEN,
+    // a close frame has been sent
+    WS_CLOSING,
+    WS_CLOSED,
+  };
+
+  WebSocketClient(Connection* conn, const WebSocketGroup* group);
+
+  // Connects and sends the upgrade request once established, for the
+  // group's path or |path|, a per client query string for instance.
+  void Connect();
+  void Connect(const std::string& path);
+
+  // False when not open, or refused over KernelOptions::memory_budget:
+  // a frame is sent whole or not at all, see Connection::Send, from any
+  // thread.
+  bool SendText(const std::string& text);
+  bool SendBinary(const std::string& data);
+  // a frame from the group's Prebuild
+  bool SendPrebuilt(const std::string& frame);
+  bool Ping(const std::string& payload = std::string());
+  void Close(uint16 code = 1000);
+
+  State state() const {
+    return state_;
+  }
+  // From the server's close frame, or the one sent when the server broke
+  // the protocol. 1005 for a close frame without one, 1006 when the
+  // connection closed without any.
+  uint16 close_code() const {
+    return close_code_;
+  }
+  Connection* connection() const {
+    return conn_;
+  }
+  void* user_data() const {
+    return user_data_;
+  }
+  void set_user_data(void* data) {
+    user_data_ = data;
+  }
+
+  // the largest frame taken, bigger ones close with 1009
+  static const uint64 kMaxFrameSize = 16 << 20;
+
+ private:
+  void OnConnected(Connection& conn);
+  void OnMessage(Connection& conn, const char* data, int len);
+  void OnClosed(Connection& conn);
+  // how much of |data| belongs to the http response, which ends in it
+  // once response_done_ is set
+  size_t ParseResponse(const char* data, size_t len);
+  bool CheckResponse(const std::string& response) const;
+  // each takes what it can of |data| and returns how much that was
+  size_t ParseHeader(const char* data, size_t len);
+  size_t ParsePayload(const char* data, size_t len);
+  void OnFrame(uint8 opcode, const char* data, size_t len);
+  bool Send(WebSocketOpcode opcode, const char* data, size_t len);
+  void Fail(uint16 code);
+
+  Connection* const conn_;
+  const WebSocketGroup* const group_;
+  void* user_data_;
+  // A request of the client's own until it is sent, then the http
+  // response or a frame spanning segments.
+  std::string buffer_;
+  uint64 payload_left_;
+  // the frame header being parsed, at most 14 bytes
+  uint8 header_[14];
+  uint8 header_len_;
+  uint8 header_need_;
+  bool response_done_;
+  // the protocol was broken, the rest is ignored
+  bool failed_;
+  // SendPrebuilt may come from another thread than the callbacks
+  std::atomic<State> state_;
+  uint16 close_code_;
+};
+
+}  // namespace tcpmany
+
+#endif  // TCPMANY_WEBSOCKET_H_
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "endpoint_allocator.h"
+
+using tcpmany::EndpointAllocator;
+using tcpmany::InetAddress;
+using tcpmany::SourceRange;
+
+namespace {
+
+int Check(bool ok, const char* test, const char* what) {
+  if (ok) {
+    return 0;
+  }
+  ::fprintf(stderr, "EndpointAllocator %s: %s\n", test, what);
+  return 1;
+}
+
+std::vector<SourceRange> Ranges(const std::string& spec) {
+  SourceRange range;
+  tcpmany::ParseSourceRange(spec, &range);
+  return std::vector<SourceRange>(1, range);
+}
+
+// the endpoint at |index|, with the default ports 1024-65535
+InetAddress At(uint32 first_ip, uint64 index) {
+  return InetAddress(static_cast<uint32>(first_ip + index / 64512),
+                     static_cast<uint16>(1024 + index % 64512));
+}
+
+bool Allocated(EndpointAllocator* allocator, const std::string& expected) {
+  InetAddress addr(0u, 0);
+  return allocator->Allocate(&addr) && addr.ToIpPort() == expected;
+}
+
+int TestAllocate() {
+  const char* test = "Allocate";
+  int failures = 0;
+  // two addresses of two ports each
+  EndpointAllocator allocator(Ranges("10.64.0.0/30:2000-2001"),
+                              std::chrono::milliseconds(0));
+  failures += Check(allocator.Capacity() == 4, test, "capacity");
+  failures += Check(Allocated(&allocator, "10.64.0.1:2000") &&
+                        Allocated(&allocator, "10.64.0.1:2001") &&
+                        Allocated(&allocator, "10.64.0.2:2000"),
+                    test, "not every port of an address first");
+  failures += Check(allocator.InUse() == 3 && allocator.IpsInUse() == 2, test,
+                    "in use counts");
+  failures += Check(Allocated(&allocator, "10.64.0.2:2001"), test, "last");
+  InetAddress addr(0u, 0);
+  failures += Check(!allocator.Allocate(&addr), test, "more than capacity");
+  return failures;
+}
+
+int TestFree() {
+  const char* test = "Free";
+  int failures = 0;
+  EndpointAllocator allocator(Ranges("10.64.0.0/30:2000-2001"),
+                              std::chrono::milliseconds(0));
+  for (int i = 0; i < 4; ++i) {
+    InetAddress addr(0u, 0);
+    allocator.Allocate(&addr);
+  }
+  allocator.Free(InetAddress("10.64.0.1", 2001));
+  allocator.Free(InetAddress("10.64.0.2", 2000));
+  // outside the ranges, ignored
+  allocator.Free(InetAddress("10.65.0.1", 2000));
+  failures += Check(allocator.InUse() == 2 && allocator.IpsInUse() == 2, test,
+                    "in use counts");
+  failures += Check(Allocated(&allocator, "10.64.0.1:2001") &&
+                        Allocated(&allocator, "10.64.0.2:2000"),
+                    test, "freed endpoints not handed out lowest first");
+  return failures;
+}
+
+int TestQuarantine() {
+  const char* test = "quarantine";
+  int failures = 0;
+  EndpointAllocator allocator(Ranges("10.64.0.1:2000-2001"),
+                              std::chrono::milliseconds(50));
+  InetAddress addr(0u, 0);
+  allocator.Allocate(&addr);
+  allocator.Free(addr);
+  failures += Check(allocator.Quarantined() == 1 && allocator.InUse() == 0,
+                    test, "counts");
+  failures += Check(Allocated(&allocator, "10.64.0.1:2001"), test,
+                    "handed out in quarantine");
+  failures += Check(!allocator.Allocate(&addr), test,
+                    "handed out in quarantine, the range used up");
+  failures += Check(!allocator.Reserve(InetAddress("10.64.0.1", 2000)), test,
+                    "reserved in quarantine");
+  ::usleep(60 * 1000);
+  failures += Check(Allocated(&allocator, "10.64.0.1:2000"), test,
+                    "not back after it");
+  failures += Check(allocator.Quarantined() == 0, test, "still counted");
+  return failures;
+}
+
+int TestReserve() {
+  const char* test = "Reserve";
+  int failures = 0;
+  EndpointAllocator allocator(Ranges("10.64.0.0/30:2000-2001"),
+                              std::chrono::milliseconds(0));
+  const InetAddress second("10.64.0.1", 2001);
+  failures += Check(allocator.Reserve(second), test, "a free endpoint");
+  failures += Check(!allocator.Reserve(second), test, "twice");
+  failures += Check(!allocator.Reserve(InetAddress("10.65.0.1", 2000)), test,
+                    "outside the ranges");
+  failures += Check(Allocated(&allocator, "10.64.0.1:2000") &&
+                        Allocated(&allocator, "10.64.0.2:2000"),
+                    test, "handed out after it was reserved");
+  allocator.Free(second);
+  failures += Check(allocator.Reserve(second), test, "after Free");
+  return failures;
+}
+
+// Far past the bitmap's end a reservation goes to a set, and moves into
+// the bitmap once the bitmap gets there.
+int TestReserveFar() {
+  const char* test = "Reserve far";
+  int failures = 0;
+  EndpointAllocator allocator(Ranges("10.0.0.0/8"),
+                              std::chrono::milliseconds(0));
+  const uint32 first_ip = InetAddress("10.0.0.1", 0).IpHost();
+  const uint64 kDense = EndpointAllocator::kDenseReserve;
+
+  // the last endpoint of a /8, 1.1e12 bits of bitmap if grown up to
+  const InetAddress last = At(first_ip, allocator.Capacity() - 1);
+  failures += Check(allocator.Reserve(last), test, "the last endpoint");
+  failures += Check(allocator.MemoryBytes() < 4096, test,
+                    "the bitmap grew up to it");
+  failures += Check(!allocator.Reserve(last), test, "twice");
+  failures += Check(allocator.InUse() == 1 && allocator.IpsInUse() == 1, test,
+                    "in use counts");
+  allocator.Free(last);
+  failures += Check(allocator.InUse() == 0 && allocator.IpsInUse() == 0, test,
+                    "in use counts after Free");
+  failures += Check(allocator.Reserve(last), test, "after Free");
+
+  const InetAddress far = At(first_ip, 2 * kDense);
+  failures += Check(allocator.Reserve(far), test, "beyond kDenseReserve");
+  // the bitmap grows past |far|, which has to stay taken
+  failures += Check(allocator.Reserve(At(first_ip, kDense - 1)) &&
+                        allocator.Reserve(At(first_ip, 2 * kDense + 1)),
+                    test, "within kDenseReserve");
+  failures += Check(!allocator.Reserve(far), test, "lost growing past it");
+  failures += Check(allocator.InUse() == 4, test, "in use count");
+  allocator.Free(far);
+  failures += Check(allocator.Reserve(far), test, "after Free, grown");
+  failures += Check(Allocated(&allocator, "10.0.0.1:1024"), test,
+                    "Allocate after the reservations");
+  return failures;
+}
+
+}  // namespace
+
+int EndpointAllocatorUnittest() {
+  return TestAllocate() + TestFree() + TestQuarantine() + TestReserve() +
+         TestReserveFar();
+}
@@ -0,0 +1,18 @@
+#include <stdio.h>
+
+int EndpointAllocatorUnittest();
+int PacketUnittest();
+int PacketRecorderUnittest();
+int WebSocketUnittest();
+
+// Runs every test, the exit status is the number of failures.
+int main() {
+  int failures = PacketUnittest();
+  failures += PacketRecorderUnittest();
+  failures += EndpointAllocatorUnittest();
+  failures += WebSocketUnittest();
+  if (failures == 0) {
+    ::printf("all tests passed\n");
+  }
+  return failures;
+}
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <memory>
+#include <string>
+
+#include "blocking_queue.h"
+#include "connection.h"
+#include "io_backend.h"
+#include "kernel.h"
+#include "packet.h"
+
+using tcpmany::InetAddress;
+using tcpmany::Kernel;
+using tcpmany::Packet;
+using tcpmany::PacketPtr;
+
+namespace {
+
+const InetAddress kServer("10.0.0.1", 5223);
+// where a redirect sends the replies for every fake client
+const InetAddress kClientHost("192.168.0.9", 0);
+
+// Answers each SYN with a SYN-ACK, to even client ports the way a capture
+// sees it (from the server to the fake client), to odd ones the way a
+// redirect turns it around (from the fake client's address to the client
+// host, at the fake client's port).
+class SynAckBackend : public tcpmany::IoBackend {
+ public:
+  virtual int Receive(Packet* packet) {
+    PacketPtr reply;
+    if (!replies_.TimedPop(reply, 100)) {
+      return 0;
+    }
+    *packet = *reply;
+    return packet->Size();
+  }
+
+  virtual int Send(const Packet& packet) {
+    if (!packet.Tcp().syn) {
+      return packet.Size();
+    }
+    auto reply = std::make_shared<Packet>();
+    reply->ExchangeAddress(packet);
+    reply->SetSyn();
+    reply->SetAck();
+    reply->SetSeq(1000);
+    reply->SetAckSeq(packet.GetSeq() + 1);
+    if (packet.SrcPort() % 2 == 1) {
+      reply->SetSrcIpNet(packet.SrcIpNet());
+      reply->SetDstIpNet(kClientHost.SockAddr().sin_addr.s_addr);
+    }
+    replies_.Push(reply);
+    return packet.Size();
+  }
+
+ private:
+  tcpmany::BlockingQueue<PacketPtr> replies_;
+};
+
+}  // namespace
+
+// Records two of four connections, one in each reply form: the SYN, the
+// SYN-ACK and the ACK of both and nothing of the others.
+int PacketRecorderUnittest() {
+  const std::string path =
+      "/tmp/tcpmany_recorder_unittest." + std::to_string(::getpid());
+  const InetAddress clients[] = {
+      InetAddress("10.64.0.1", 2000), InetAddress("10.64.0.1", 2001),
+      InetAddress("10.64.0.2", 2000), InetAddress("10.64.0.2", 2001)};
+  tcpmany::KernelOptions options;
+  options.backend = std::make_shared<SynAckBackend>();
+  options.record.path = path;
+  options.record.connections.push_back(clients[0]);
+  options.record.connections.push_back(clients[1]);
+  options.teardown.mode = tcpmany::TEARDOWN_FORGET;
+  Kernel::Start(options);
+  for (const InetAddress& client : clients) {
+    Kernel::NewConnection(kServer, client)->Connect();
+  }
+  tcpmany::KernelStats stats;
+  for (int wait_ms = 0; wait_ms < 2000; wait_ms += 10) {
+    stats = Kernel::GetStats();
+    if (stats.established == 4 && stats.packets_sent == 8 &&
+        stats.packets_recorded >= 6) {
+      break;
+    }
+    ::usleep(10 * 1000);
+  }
+  ::usleep(50 * 1000);
+  stats = Kernel::GetStats();
+  Kernel::Stop();
+  ::unlink(path.c_str());
+  if (stats.established != 4 || stats.packets_recorded != 6) {
+    ::fprintf(stderr,
+              "PacketRecorder: %lu of 4 established, %lu recorded packets "
+              "instead of 6\n",
+              static_cast<unsigned long>(stats.established),
+              static_cast<unsigned long>(stats.packets_recorded));
+    return 1;
+  }
+  return 0;
+}
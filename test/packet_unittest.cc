@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#include "packet.h"
+
+using tcpmany::InetAddress;
+using tcpmany::Packet;
+
+namespace {
+
+const InetAddress kServer("10.0.0.1", 5223);
+const InetAddress kClient("10.1.0.1", 13579);
+const InetAddress kServer6("fd00::1", 5223);
+const InetAddress kClient6("fd01::1:1", 13579);
+
+const int kDataLens[] = {0, 1, 2, 63, 64, 511, 1400};
+// timestamp options, as the redirect sees them on most segments
+const uint8 kOptions[12] = {1, 1, 8, 10, 0, 1, 2, 3, 4, 5, 6, 7};
+
+uint32 Next(uint32* random) {
+  *random = *random * 1103515245 + 12345;
+  return *random;
+}
+
+// A checksummed segment from |src| to |dst| with |data_len| bytes of
+// payload, after 12 bytes of options when |options| is set.
+Packet MakePacket(const InetAddress& dst, const InetAddress& src,
+                  bool options, int data_len) {
+  Packet packet(dst.family());
+  packet.SetAddress(dst, src);
+  packet.SetAck();
+  packet.SetSeq(0x12345678);
+  packet.SetAckSeq(0x9abcdef0);
+  // past the tcp header, in raw so the compiler doesn't take the writes
+  // for overflows of the header struct
+  uint8* data = packet.raw + (packet.IsIpv6() ? Packet::HEADER6_LEN
+                                              : Packet::HEADER_LEN);
+  int options_len = 0;
+  if (options) {
+    options_len = sizeof(kOptions);
+    packet.Tcp().doff = (sizeof(struct tcphdr) + options_len) / 4;
+    ::memcpy(data, kOptions, options_len);
+    data += options_len;
+  }
+  for (int i = 0; i < data_len; ++i) {
+    data[i] = static_cast<uint8>(i * 7 + 3);
+  }
+  const int tcp_len = sizeof(struct tcphdr) + options_len + data_len;
+  if (packet.IsIpv6()) {
+    packet.pkt6.ip6.ip6_plen = ::htons(tcp_len);
+  } else {
+    packet.pkt.ip.tot_len = ::htons(sizeof(struct iphdr) + tcp_len);
+  }
+  packet.CalculateChecksum();
+  return packet;
+}
+
+bool Same(const Packet& rewritten, const Packet& expected, const char* what,
+          bool options, int data_len) {
+  if (rewritten.Size() == expected.Size() &&
+      ::memcmp(rewritten.raw, expected.raw, expected.Size()) == 0) {
+    return true;
+  }
+  ::fprintf(stderr,
+            "%s: options=%d data_len=%d: incremental checksum differs "
+            "from full recompute\n",
+            what, options, data_len);
+  return false;
+}
+
+int TestRewriteAddressNet() {
+  int failures = 0;
+  uint32 random = 1;
+  for (int options = 0; options < 2; ++options) {
+    for (int data_len : kDataLens) {
+      for (int round = 0; round < 64; ++round) {
+        Packet packet = MakePacket(kServer, kClient, options, data_len);
+        const uint32 src = Next(&random);
+        const uint32 dst = Next(&random);
+        Packet expected = packet;
+        expected.SetSrcIpNet(src);
+        expected.SetDstIpNet(dst);
+        expected.CalculateChecksum();
+        packet.RewriteAddressNet(src, dst);
+        if (!Same(packet, expected, "RewriteAddressNet", options, data_len)) {
+          ++failures;
+          break;
+        }
+      }
+    }
+  }
+  return failures;
+}
+
+int TestRewriteAddress6() {
+  int failures = 0;
+  uint32 random = 1;
+  for (int options = 0; options < 2; ++options) {
+    for (int data_len : kDataLens) {
+      for (int round = 0; round < 64; ++round) {
+        Packet packet = MakePacket(kServer6, kClient6, options, data_len);
+        struct in6_addr src = packet.SrcIp6();
+        struct in6_addr dst = packet.DstIp6();
+        // the redirect changes the host part, now and then the prefix
+        for (int word = round % 2 == 0 ? 2 : 0; word < 4; ++word) {
+          src.s6_addr32[word] = Next(&random);
+          dst.s6_addr32[word] = Next(&random);
+        }
+        Packet expected = packet;
+        expected.pkt6.ip6.ip6_src = src;
+        expected.pkt6.ip6.ip6_dst = dst;
+        expected.CalculateChecksum();
+        packet.RewriteAddress6(src, dst);
+        if (!Same(packet, expected, "RewriteAddress6", options, data_len)) {
+          ++failures;
+          break;
+        }
+      }
+    }
+  }
+  return failures;
+}
+
+// every payload length up to a full segment, where the length field
+// carries into its high byte too
+int TestSetData() {
+  int failures = 0;
+  for (const InetAddress* server : {&kServer, &kServer6}) {
+    const InetAddress& client = server == &kServer ? kClient : kClient6;
+    for (size_t len = 0; len <= 1400; ++len) {
+      tcpmany::PacketPtr packet = tcpmany::DataPacket(
+          1, 1, *server, client, std::string(len, 'x'));
+      if (packet->DataLen() != static_cast<int>(len)) {
+        ::fprintf(stderr, "SetData: %s data_len=%zu comes out as %d\n",
+                  server->ToIpPort().c_str(), len, packet->DataLen());
+        ++failures;
+        break;
+      }
+    }
+  }
+  return failures;
+}
+
+}  // namespace
+
+int PacketUnittest() {
+  return TestRewriteAddressNet() + TestRewriteAddress6() + TestSetData();
+}
@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "blocking_queue.h"
+#include "connection.h"
+#include "io_backend.h"
+#include "kernel.h"
+#include "packet.h"
+#include "websocket.h"
+
+using tcpmany::InetAddress;
+using tcpmany::Kernel;
+using tcpmany::Packet;
+using tcpmany::PacketPtr;
+using tcpmany::WebSocketClient;
+using tcpmany::WebSocketOpcode;
+
+namespace {
+
+const InetAddress kServer("10.0.0.1", 8080);
+const InetAddress kClient("10.64.0.1", 2000);
+// the most payload a segment from the server carries
+const size_t kSegmentSize = 1000;
+
+int Check(bool ok, const char* test, const char* what) {
+  if (ok) {
+    return 0;
+  }
+  ::fprintf(stderr, "WebSocket %s: %s\n", test, what);
+  return 1;
+}
+
+std::string Pattern(size_t len) {
+  std::string data(len, 0);
+  for (size_t i = 0; i < len; ++i) {
+    data[i] = static_cast<char>(i * 7 + 3);
+  }
+  return data;
+}
+
+// Every length up to three blocks and then some, from every alignment,
+// against masking a byte at a time.
+int TestMask() {
+  const char* test = "MaskWebSocketPayload";
+  const uint8 key[4] = {0x37, 0xfa, 0x21, 0x3d};
+  int failures = 0;
+  for (size_t len = 0; len <= 53; ++len) {
+    for (size_t start = 0; start < 4; ++start) {
+      char data[64];
+      char expected[64];
+      ::memcpy(data, Pattern(sizeof(data)).data(), sizeof(data));
+      ::memcpy(expected, data, sizeof(data));
+      for (size_t i = 0; i < len; ++i) {
+        expected[start + i] ^= key[i % 4];
+      }
+      tcpmany::MaskWebSocketPayload(data + start, len, key);
+      if (::memcmp(data, expected, sizeof(data)) != 0) {
+        ::fprintf(stderr, "WebSocket %s: length %zu at %zu\n", test, len,
+                  start);
+        ++failures;
+      }
+    }
+  }
+  return failures;
+}
+
+// RFC 6455 section 1.3
+int TestAccept() {
+  return Check(tcpmany::WebSocketAccept("dGhlIHNhbXBsZSBub25jZQ==") ==
+                   "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=",
+               "WebSocketAccept", "RFC 6455 example");
+}
+
+// The three length forms at their edges, unmasked and masked.
+int TestEncode() {
+  const char* test = "EncodeWebSocketFrame";
+  const uint8 key[4] = {1, 2, 3, 4};
+  const size_t lens[] = {0, 125, 126, 0xffff, 0x10000};
+  int failures = 0;
+  for (size_t len : lens) {
+    const std::string payload = Pattern(len);
+    const size_t header = len < 126 ? 2 : len <= 0xffff ? 4 : 10;
+    for (const uint8* mask : {static_cast<const uint8*>(NULL), key}) {
+      std::string frame;
+      tcpmany::EncodeWebSocketFrame(tcpmany::WS_BINARY, payload.data(), len,
+                                    mask, &frame);
+      const size_t key_len = mask != NULL ? 4 : 0;
+      bool ok = frame.size() == header + key_len + len &&
+                static_cast<uint8>(frame[0]) == (0x80 | tcpmany::WS_BINARY) &&
+                (static_cast<uint8>(frame[1]) & 0x80) == (mask ? 0x80 : 0);
+      uint64 encoded = static_cast<uint8>(frame[1]) & 0x7f;
+      if (ok && header > 2) {
+        ok = encoded == (header == 4 ? 126u : 127u);
+        encoded = 0;
+        for (size_t i = 2; i < header; ++i) {
+          encoded = encoded << 8 | static_cast<uint8>(frame[i]);
+        }
+      }
+      ok = ok && encoded == len;
+      if (ok) {
+        std::string body = frame.substr(header + key_len);
+        if (mask != NULL) {
+          ok = frame.compare(header, 4,
+                             reinterpret_cast<const char*>(key), 4) == 0;
+          tcpmany::MaskWebSocketPayload(&body[0], body.size(), key);
+        }
+        ok = ok && body == payload;
+      }
+      if (!ok) {
+        ::fprintf(stderr, "WebSocket %s: length %zu%s\n", test, len,
+                  mask != NULL ? " masked" : "");
+        ++failures;
+      }
+    }
+  }
+  return failures;
+}
+
+// Plays the server: answers the SYN, then the upgrade request with the 101
+// response followed by |frames|, cut at each offset of |cuts| into frames
+// and into segments of at most kSegmentSize. What the client sends after
+// the request is kept.
+class ServerBackend : public tcpmany::IoBackend {
+ public:
+  ServerBackend(const std::string& frames, const std::vector<size_t>& cuts)
+      : frames_(frames), cuts_(cuts), answered_(false) {}
+
+  virtual int Receive(Packet* packet) {
+    PacketPtr reply;
+    if (!replies_.TimedPop(reply, 100)) {
+      return 0;
+    }
+    *packet = *reply;
+    return packet->Size();
+  }
+
+  // on the send thread only
+  virtual int Send(const Packet& packet) {
+    const InetAddress client = packet.SrcAddress();
+    if (packet.Tcp().syn) {
+      auto reply = std::make_shared<Packet>();
+      reply->ExchangeAddress(packet);
+      reply->SetSyn();
+      reply->SetAck();
+      reply->SetSeq(1000);
+      reply->SetAckSeq(packet.GetSeq() + 1);
+      replies_.Push(reply);
+    } else if (packet.DataLen() > 0 && answered_) {
+      client_data_.append(packet.Data(), packet.DataLen());
+    } else if (packet.DataLen() > 0) {
+      answered_ = true;
+      const std::string request(packet.Data(), packet.DataLen());
+      const std::string response = Response(request) + frames_;
+      std::vector<size_t> ends;
+      for (size_t cut : cuts_) {
+        ends.push_back(response.size() - frames_.size() + cut);
+      }
+      ends.push_back(response.size());
+      const uint32 ack_seq = packet.GetSeq() + packet.DataLen();
+      size_t offset = 0;
+      for (size_t end : ends) {
+        while (offset < end) {
+          const size_t len = std::min(end - offset, kSegmentSize);
+          replies_.Push(tcpmany::DataPacket(1001 + offset, ack_seq, client,
+                                            packet.DstAddress(),
+                                            response.substr(offset, len)));
+          offset += len;
+        }
+      }
+    }
+    return packet.Size();
+  }
+
+  // read once the Kernel is stopped
+  const std::string& client_data() const {
+    return client_data_;
+  }
+
+ private:
+  static std::string Response(const std::string& request) {
+    const char kKey[] = "Sec-WebSocket-Key: ";
+    const size_t start = request.find(kKey) + sizeof(kKey) - 1;
+    const std::string key =
+        request.substr(start, request.find("\r\n", start) - start);
+    return "HTTP/1.1 101 Switching Protocols\r\n"
+           "Upgrade: websocket\r\n"
+           "Connection: Upgrade\r\n"
+           "Sec-WebSocket-Accept: " + tcpmany::WebSocketAccept(key) + "\r\n"
+           "\r\n";
+  }
+
+  const std::string frames_;
+  const std::vector<size_t> cuts_;
+  bool answered_;
+  std::string client_data_;
+  tcpmany::BlockingQueue<PacketPtr> replies_;
+};
+
+std::string Frame(WebSocketOpcode opcode, const std::string& payload) {
+  std::string frame;
+  tcpmany::EncodeWebSocketFrame(opcode, payload.data(), payload.size(), NULL,
+                                &frame);
+  return frame;
+}
+
+// The client's frame at |offset| of |data|, unmasked, and its size.
+bool ClientFrame(const std::string& data, size_t offset, uint8* opcode,
+                 std::string* payload, size_t* size) {
+  if (data.size() < offset + 6) {
+    return false;
+  }
+  const uint8 len = static_cast<uint8>(data[offset + 1]) & 0x7f;
+  if (len >= 126 || data.size() < offset + 6 + len) {
+    return false;
+  }
+  *opcode = static_cast<uint8>(data[offset]) & 0x0f;
+  *payload = data.substr(offset + 6, len);
+  tcpmany::MaskWebSocketPayload(
+      &(*payload)[0], len,
+      reinterpret_cast<const uint8*>(data.data() + offset + 2));
+  *size = 6 + len;
+  return true;
+}
+
+// A client against a server whose frames arrive cut everywhere it hurts:
+// the response and the first header byte in one segment, the rest of
+// that header with the frame, a ping and part of the next header in the
+// next, each length form, payloads across segments and a close frame
+// behind the end of a 64k one.
+int TestParser() {
+  const char* test = "parser";
+  const std::string text = "hello";
+  const std::string medium = Pattern(300);
+  const std::string large = Pattern(70000);
+  const std::string close_payload("\x03\xe9", 2);
+  const std::string frames = Frame(tcpmany::WS_TEXT, text) +
+                             Frame(tcpmany::WS_PING, "p") +
+                             Frame(tcpmany::WS_BINARY, medium) +
+                             Frame(tcpmany::WS_BINARY, large) +
+                             Frame(tcpmany::WS_CLOSE, close_payload);
+  // the 300 byte frame starts at 10, the 70000 byte one at 314
+  const std::vector<size_t> cuts = {1, 13, 164, 319};
+  auto backend = std::make_shared<ServerBackend>(frames, cuts);
+  tcpmany::KernelOptions options;
+  options.backend = backend;
+  options.teardown.mode = tcpmany::TEARDOWN_FORGET;
+  Kernel::Start(options);
+
+  std::mutex mutex;
+  std::vector<std::pair<WebSocketOpcode, std::string> > received;
+  tcpmany::WebSocketGroup group("example.com", "/", 1);
+  group.SetMessageCallback([&](WebSocketClient&, WebSocketOpcode opcode,
+                               const char* data, size_t len) {
+    std::unique_lock<std::mutex> lock(mutex);
+    received.push_back(std::make_pair(opcode, std::string(data, len)));
+  });
+  WebSocketClient client(Kernel::NewConnection(kServer, kClient), &group);
+  client.Connect();
+  for (int wait_ms = 0; wait_ms < 2000; wait_ms += 10) {
+    if (client.state() == WebSocketClient::WS_CLOSING) {
+      break;
+    }
+    ::usleep(10 * 1000);
+  }
+  // lets the echoed close frame go out
+  ::usleep(50 * 1000);
+  Kernel::Stop();
+
+  int failures = Check(client.state() == WebSocketClient::WS_CLOSING, test,
+                       "no close frame");
+  failures += Check(client.close_code() == 1001, test, "close code");
+  failures += Check(received.size() == 3, test, "number of frames");
+  if (received.size() == 3) {
+    failures += Check(received[0].first == tcpmany::WS_TEXT &&
+                          received[0].second == text,
+                      test, "text frame");
+    failures += Check(received[1].first == tcpmany::WS_BINARY &&
+                          received[1].second == medium,
+                      test, "16 bit length frame");
+    failures += Check(received[2].first == tcpmany::WS_BINARY &&
+                          received[2].second == large,
+                      test, "64 bit length frame");
+  }
+  // a pong for the ping, then the close frame echoed
+  const std::string& sent = backend->client_data();
+  uint8 opcode = 0;
+  std::string payload;
+  size_t size = 0;
+  bool ok = ClientFrame(sent, 0, &opcode, &payload, &size) &&
+            opcode == tcpmany::WS_PONG && payload == "p";
+  failures += Check(ok, test, "pong");
+  ok = ok && ClientFrame(sent, size, &opcode, &payload, &size) &&
+       opcode == tcpmany::WS_CLOSE && payload == close_payload;
+  failures += Check(ok, test, "close frame echo");
+  return failures;
+}
+
+}  // namespace
+
+int WebSocketUnittest() {
+  int failures = TestMask();
+  failures += TestAccept();
+  failures += TestEncode();
+  failures += TestParser();
+  return failures;
+}